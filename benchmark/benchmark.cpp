@@ -0,0 +1,318 @@
+#include <QtCore>
+
+#include <qts3.h>
+#include <qts3metrics_p.h>
+#include "s3testserver.h"
+
+#include <ctime>
+#include <thread>
+#include <vector>
+
+#ifdef USE_QPM_NS
+using namespace com::github::msorvig::s3;
+#endif
+
+// Benchmarks for the threading model: the blocking API with 1 to N caller
+// threads against the in-process S3TestServer, and the mechanisms it is
+// built on in isolation. Results are printed as one row per thread count,
+// as aligned columns or CSV, for plotting scaling curves.
+
+// Prints rows as aligned columns or as CSV.
+class Table
+{
+public:
+    Table(QTextStream *out, bool csv, const QStringList &columns) : m_out(out), m_csv(csv)
+    {
+        row(columns);
+    }
+
+    void row(const QStringList &values)
+    {
+        if (m_csv) {
+            *m_out << values.join(QLatin1Char(',')) << "\n";
+        } else {
+            for (const QString &value : values)
+                *m_out << value.rightJustified(14);
+            *m_out << "\n";
+        }
+        m_out->flush();
+    }
+
+private:
+    QTextStream *m_out;
+    bool m_csv;
+};
+
+static QString number(double value)
+{
+    return QString::number(value, 'f', 1);
+}
+
+// Returns the process CPU time in seconds, for all threads.
+static double cpuTime()
+{
+    return double(std::clock()) / CLOCKS_PER_SEC;
+}
+
+static qint64 percentile(const QVector<qint64> &sorted, double fraction)
+{
+    if (sorted.isEmpty())
+        return 0;
+    return sorted.at(qMin(sorted.count() - 1, int(sorted.count() * fraction)));
+}
+
+static const QByteArray bucket = "benchmark-bucket";
+
+static QString objectKey(int index)
+{
+    return QStringLiteral("object-") + QString::number(index);
+}
+
+// Runs threadCount caller threads which get() their own object in a loop
+// for durationMsecs. Measures throughput, latency, CPU time per request
+// (including the in-process test server), and contention for the network
+// access manager mutex.
+static void benchmarkBlockingApi(QtS3 *s3, int threadCount, int durationMsecs, Table *table)
+{
+    QtS3MetricsRegistry *metrics = QtS3MetricsRegistry::instance();
+    metrics->reset();
+    QVector<QVector<qint64>> latencies(threadCount);
+    QAtomicInt errors;
+
+    const double cpuStart = cpuTime();
+    QElapsedTimer clock;
+    clock.start();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; ++i) {
+        threads.emplace_back([s3, i, durationMsecs, &clock, &latencies, &errors]() {
+            const QString key = objectKey(i);
+            while (clock.elapsed() < durationMsecs) {
+                QElapsedTimer timer;
+                timer.start();
+                if (!s3->get(bucket, key).isSuccess())
+                    errors.ref();
+                latencies[i].append(timer.nsecsElapsed() / 1000);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    const double elapsed = clock.nsecsElapsed() / 1e9;
+    const double cpu = cpuTime() - cpuStart;
+
+    QVector<qint64> all;
+    for (const QVector<qint64> &threadLatencies : latencies)
+        all += threadLatencies;
+    std::sort(all.begin(), all.end());
+    const int requests = qMax(1, all.count());
+    const QtS3MetricsRegistry::Lock lock = QtS3MetricsRegistry::NetworkLock;
+
+    table->row(QStringList() << QString::number(threadCount) << number(all.count() / elapsed)
+                             << number(percentile(all, 0.5) / 1000.0)
+                             << number(percentile(all, 0.99) / 1000.0)
+                             << number(cpu * 1e6 / requests)
+                             << QString::number(metrics->lockContentions(lock))
+                             << number(metrics->lockWaitTime(lock) / 1e6)
+                             << QString::number(errors.load()));
+}
+
+// Target for the BlockingQueuedConnection benchmark. ThreadsafeBlocking-
+// NetworkAccesManager makes the same call to its network thread for each
+// request.
+class HopTarget : public QObject
+{
+    Q_OBJECT
+public slots:
+    int echo(int value) { return value; }
+};
+
+// Measures BlockingQueuedConnection calls from threadCount threads to one
+// target thread: the thread hop in sendCustomRequest() without the network.
+static void benchmarkThreadHop(int threadCount, int durationMsecs, Table *table)
+{
+    QThread targetThread;
+    HopTarget target;
+    target.moveToThread(&targetThread);
+    targetThread.start();
+
+    QAtomicInteger<qint64> calls;
+    const double cpuStart = cpuTime();
+    QElapsedTimer clock;
+    clock.start();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; ++i) {
+        threads.emplace_back([i, durationMsecs, &clock, &target, &calls]() {
+            while (clock.elapsed() < durationMsecs) {
+                int result = 0;
+                QMetaObject::invokeMethod(&target, "echo", Qt::BlockingQueuedConnection,
+                                          Q_RETURN_ARG(int, result), Q_ARG(int, i));
+                calls.fetchAndAddRelaxed(1);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    const double elapsed = clock.nsecsElapsed() / 1e9;
+    const double cpu = cpuTime() - cpuStart;
+    targetThread.quit();
+    targetThread.wait();
+
+    const qint64 count = qMax(qint64(1), calls.load());
+    table->row(QStringList() << QString::number(threadCount) << number(count / elapsed)
+                             << number(elapsed * threadCount * 1e6 / count)
+                             << number(cpu * 1e6 / count));
+}
+
+// Measures the completion wakeup in ThreadsafeBlockingNetworkAccesManager:
+// threadCount threads wait for "requests" which a completer thread finishes
+// one at a time. With wakeAll (the current design) every completion wakes
+// every waiting thread; the targeted variant wakes only the waiting thread.
+static void benchmarkWakeFanOut(int threadCount, int durationMsecs, bool wakeAll, Table *table)
+{
+    QMutex mutex;
+    QWaitCondition completed;                      // shared, for wakeAll
+    QVector<QWaitCondition *> threadCompleted;     // per thread, for targeted wakeups
+    QWaitCondition requested;
+    QQueue<int> pending;
+    QVector<bool> done(threadCount);
+    bool stop = false;
+    qint64 completions = 0;
+    qint64 wakeups = 0;
+    for (int i = 0; i < threadCount; ++i)
+        threadCompleted.append(new QWaitCondition);
+
+    const double cpuStart = cpuTime();
+    QElapsedTimer clock;
+    clock.start();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; ++i) {
+        threads.emplace_back([&, i]() {
+            QMutexLocker lock(&mutex);
+            while (!stop) {
+                done[i] = false;
+                pending.enqueue(i);
+                requested.wakeOne();
+                while (!done[i] && !stop) {
+                    (wakeAll ? &completed : threadCompleted.at(i))->wait(&mutex);
+                    ++wakeups;
+                }
+            }
+        });
+    }
+    std::thread completer([&]() {
+        QMutexLocker lock(&mutex);
+        while (clock.elapsed() < durationMsecs) {
+            while (pending.isEmpty())
+                requested.wait(&mutex);
+            const int i = pending.dequeue();
+            done[i] = true;
+            ++completions;
+            if (wakeAll)
+                completed.wakeAll();
+            else
+                threadCompleted.at(i)->wakeOne();
+            // Let the woken threads run, as the network thread does
+            // between replies.
+            lock.unlock();
+            lock.relock();
+        }
+        stop = true;
+        completed.wakeAll();
+        for (QWaitCondition *condition : threadCompleted)
+            condition->wakeAll();
+    });
+    completer.join();
+    for (std::thread &thread : threads)
+        thread.join();
+    const double elapsed = clock.nsecsElapsed() / 1e9;
+    const double cpu = cpuTime() - cpuStart;
+    qDeleteAll(threadCompleted);
+
+    completions = qMax(qint64(1), completions);
+    table->row(QStringList() << QString::number(threadCount) << number(completions / elapsed)
+                             << number(double(wakeups) / completions)
+                             << number(cpu * 1e6 / completions));
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Measures how the QtS3 threading model scales with the number of caller threads.");
+    parser.addHelpOption();
+    QCommandLineOption maxThreadsOption("max-threads", "Largest thread count.", "count", "512");
+    QCommandLineOption durationOption("duration", "Duration per measurement.", "msecs", "1000");
+    QCommandLineOption objectSizeOption("object-size", "Object size in bytes.", "bytes", "1024");
+    QCommandLineOption networkRequestsOption(
+        "network-requests", "Maximum concurrent network requests.", "count", "6");
+    QCommandLineOption noAdaptiveOption("no-adaptive", "Disable the adaptive concurrency limit.");
+    QCommandLineOption transportOption(
+        "transport", "Transport for the blocking API: qnam, threadlocal, epoll or loopback.",
+        "name", "qnam");
+    QCommandLineOption csvOption("csv", "Print CSV.");
+    parser.addOption(maxThreadsOption);
+    parser.addOption(durationOption);
+    parser.addOption(objectSizeOption);
+    parser.addOption(networkRequestsOption);
+    parser.addOption(noAdaptiveOption);
+    parser.addOption(transportOption);
+    parser.addOption(csvOption);
+    parser.process(app);
+
+    const int maxThreads = parser.value(maxThreadsOption).toInt();
+    const int duration = parser.value(durationOption).toInt();
+    const bool csv = parser.isSet(csvOption);
+    QList<int> threadCounts;
+    for (int threadCount = 1; threadCount <= maxThreads; threadCount *= 2)
+        threadCounts.append(threadCount);
+
+    S3TestServer server;
+    const QByteArray content(parser.value(objectSizeOption).toInt(), 'x');
+    for (int i = 0; i < maxThreads; ++i)
+        server.putObject(bucket, objectKey(i).toUtf8(), content);
+
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    s3.setMaxNetworkRequests(parser.value(networkRequestsOption).toInt());
+    s3.setAdaptiveConcurrency(!parser.isSet(noAdaptiveOption));
+    const QString transport = parser.value(transportOption);
+    if (transport == "threadlocal") {
+        s3.setTransport(QtS3::ThreadLocalTransport);
+    } else if (transport == "epoll") {
+        s3.setTransport(QtS3::EpollTransport);
+    } else if (transport == "loopback") {
+        // The loopback transport has its own object store
+        s3.setTransport(QtS3::LoopbackTransport);
+        for (int i = 0; i < maxThreads; ++i)
+            s3.put(bucket, objectKey(i), content);
+    }
+
+    QTextStream out(stdout);
+    out << "# Blocking API: get() of " << content.size() << " byte objects with the " << transport
+        << " transport, CPU includes the test server\n";
+    Table apiTable(&out, csv, QStringList() << "threads" << "requests/s" << "p50 ms" << "p99 ms"
+                                            << "cpu us/req" << "lock waits" << "lock wait ms"
+                                            << "errors");
+    for (int threadCount : threadCounts)
+        benchmarkBlockingApi(&s3, threadCount, duration, &apiTable);
+
+    out << "\n# BlockingQueuedConnection hop to one thread\n";
+    Table hopTable(&out, csv, QStringList() << "threads" << "calls/s" << "us/call"
+                                            << "cpu us/call");
+    for (int threadCount : threadCounts)
+        benchmarkThreadHop(threadCount, duration, &hopTable);
+
+    for (bool wakeAll : { true, false }) {
+        out << "\n# Completion wakeups, " << (wakeAll ? "wakeAll (current)" : "targeted") << "\n";
+        Table wakeTable(&out, csv, QStringList() << "threads" << "completions/s"
+                                                 << "wakeups/compl" << "cpu us/compl");
+        for (int threadCount : threadCounts)
+            benchmarkWakeFanOut(threadCount, duration, wakeAll, &wakeTable);
+    }
+
+    return 0;
+}
+
+#include "benchmark.moc"
@@ -0,0 +1,12 @@
+TEMPLATE = app
+
+include ($$PWD/../qts3.pri)
+
+TARGET = qts3benchmark
+CONFIG -= app_bundle
+OBJECTS_DIR = .ob
+MOC_DIR = .moc
+INCLUDEPATH += $$PWD/../test
+
+HEADERS += ../test/s3testserver.h
+SOURCES += benchmark.cpp ../test/s3testserver.cpp
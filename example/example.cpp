@@ -28,7 +28,7 @@ int main(int argc, char **argv)
         qDebug() << "S3 put error" << putReply.anyErrorString();
         
     qDebug() << "Checking object size";
-    QtS3Reply<int> sizeReply = s3.size(bucketName, objectName);
+    QtS3Reply<qint64> sizeReply = s3.size(bucketName, objectName);
     if (!sizeReply.isSuccess())
         qDebug() << "S3 size error:" << sizeReply.anyErrorString();
     else
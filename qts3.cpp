@@ -11,6 +11,11 @@ QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
     as well as functons for querying metadata such as size and object existence.
 
     The API is synchronous (blocking) and thread-safe.
+
+    QtS3 objects are cheap to construct, for example one per credential. All
+    QtS3 objects share one network thread and connection pool, which is
+    started by the first request. The credentials are not accessed until the
+    first request.
 */
 
 /*!
@@ -42,6 +47,334 @@ QtS3::QtS3(std::function<QByteArray()> accessKeyIdProvider,
 }
 
 
+/*!
+    Sets a custom \a endpoint, for example "http://localhost:9000" for a local
+    S3 compatible server. Requests are then sent path-style to the endpoint
+    and signed for \a region, without bucket region lookups.
+
+    Call this function before making requests.
+*/
+void QtS3::setEndpoint(const QUrl &endpoint, const QByteArray &region)
+{
+    d->setEndpoint(endpoint, region);
+}
+
+/*!
+    Sets the maximum number of threads used by batch operations such as
+    getMany(), putMany(), existsMany() and listParallel() to \a threadCount.
+    The limit is shared by all batches on this QtS3 object. The default is 16.
+
+    Batches run some of their requests on the calling thread, and therefore
+    make progress also when the limit is reached.
+*/
+void QtS3::setMaxConcurrency(int threadCount)
+{
+    d->m_threadPool.setMaxThreadCount(qMax(1, threadCount));
+}
+
+/*!
+    Returns the maximum number of threads used by batch operations.
+*/
+int QtS3::maxConcurrency()
+{
+    return d->m_threadPool.maxThreadCount();
+}
+
+/*!
+    Sets the \a transport which sends requests. Call this before making
+    requests with this object. Requests in progress complete on the previous
+    transport, and replies from it remain valid until this object is deleted.
+
+    NetworkAccessManagerTransport (the default) sends requests with a
+    QNetworkAccessManager on a network thread shared by all QtS3 objects,
+    and supports https, the memory budget and bandwidth limits.
+
+    ThreadLocalTransport gives each calling thread its own
+    QNetworkAccessManager, and runs a local event loop on the calling thread
+    while a request is in progress. This avoids the hop to the network
+    thread and lets throughput scale with the number of calling threads.
+    Each thread has its own connection pool. Avoid calling QtS3 from threads
+    whose event loop must not be re-entered.
+
+    EpollTransport sends requests from the calling thread on non-blocking
+    keep-alive connections, without thread hops, and writes payloads without
+    copying them. It is available on Linux, for http endpoints: https
+    requests, and other platforms, use NetworkAccessManagerTransport.
+
+    LoopbackTransport answers requests from an in-memory object store without
+    any network, for measuring the signing and processing overhead on its own.
+
+    All transports share the network request limit and the priority queues.
+*/
+void QtS3::setTransport(Transport transport)
+{
+    switch (transport) {
+    case EpollTransport:
+#ifdef Q_OS_LINUX
+        d->setTransport(new QtS3EpollTransport(d->m_networkAccessManager));
+#else
+        qWarning() << "QtS3: EpollTransport is not supported on this platform";
+        d->setTransport(new QtS3QnamTransport(d->m_networkAccessManager));
+#endif
+        break;
+    case ThreadLocalTransport:
+        d->setTransport(new QtS3ThreadLocalTransport(d->m_networkAccessManager));
+        break;
+    case LoopbackTransport:
+        d->setTransport(new QtS3LoopbackTransport());
+        break;
+    default:
+        d->setTransport(new QtS3QnamTransport(d->m_networkAccessManager));
+        break;
+    }
+}
+
+/*!
+    Sets the maximum number of requests in progress on the network per host
+    to \a maxRequests. Further requests to the host wait in per-priority
+    queues, and are started in weighted-fair order. The default is 6, which
+    is the QNetworkAccessManager connection limit per host; raise it for the
+    EpollTransport.
+
+    The limit is process-wide: requests from all QtS3 objects share the
+    network connections, and are scheduled together. The last call sets the
+    limit for all objects.
+
+    This is also the upper bound for the adaptive concurrency limits of this
+    object, see setAdaptiveConcurrency().
+*/
+void QtS3::setMaxNetworkRequests(int maxRequests)
+{
+    d->m_networkAccessManager->scheduler()->setMaxRequests(maxRequests);
+    d->m_concurrencyLimiter.setLimitRange(1, maxRequests, maxRequests);
+}
+
+/*!
+    Sets the scheduling weight for requests with \a priority to \a weight.
+    When several priorities have queued requests, each is started at a rate
+    proportional to its weight. The defaults are 16 for HighPriority, 4 for
+    NormalPriority and 1 for LowPriority. The weights are process-wide, as
+    for setMaxNetworkRequests().
+*/
+void QtS3::setPriorityWeight(Priority priority, int weight)
+{
+    d->m_networkAccessManager->scheduler()->setWeight(priority, weight);
+}
+
+/*!
+    Limits the number of requests with \a priority in progress on the
+    network to \a maxRequests, which reserves the remaining capacity for
+    other priorities. 0 removes the limit, which is the default. The limit
+    is process-wide, as for setMaxNetworkRequests().
+*/
+void QtS3::setPriorityConcurrencyLimit(Priority priority, int maxRequests)
+{
+    d->m_networkAccessManager->scheduler()->setClassLimit(priority, maxRequests);
+}
+
+/*!
+    Enables or disables adaptive concurrency limits, according to \a enable.
+
+    When enabled (the default), requests are limited per bucket and
+    top-level key prefix. The limit starts at the setMaxNetworkRequests()
+    limit, backs off when S3 responds with 503 SlowDown or latency
+    increases, and recovers while request latency stays flat.
+*/
+void QtS3::setAdaptiveConcurrency(bool enable)
+{
+    d->m_concurrencyLimiter.setEnabled(enable);
+}
+
+/*!
+    Returns the current adaptive concurrency limit for requests to
+    \a bucket under the top-level key prefix of \a prefix.
+*/
+int QtS3::concurrencyLimit(const QByteArray &bucket, const QString &prefix)
+{
+    return int(d->m_concurrencyLimiter.limit(QtS3ConcurrencyLimiter::limitKey(bucket, prefix)));
+}
+
+/*!
+    Sets the number of times a request throttled by S3 (503 SlowDown) is
+    retried to \a retries. Retries back off exponentially, starting at
+    50 ms. The default is 3. Replies for requests which are still throttled
+    have the SlowDownError error.
+*/
+void QtS3::setSlowDownRetries(int retries)
+{
+    d->m_slowDownRetries.store(qMax(0, retries));
+}
+
+/*!
+    Limits the total upload and download bandwidth used by this QtS3 object
+    to \a uploadBytesPerSecond and \a downloadBytesPerSecond. A rate of 0
+    removes the limit, which is the default.
+
+    The limits are token buckets: transfers may burst at full speed for up
+    to \a burstBytes (by default one second of traffic) after being idle.
+    Request content is read from and written to the network at the limited
+    rate; request threads are not put to sleep.
+*/
+void QtS3::setBandwidthLimit(qint64 uploadBytesPerSecond, qint64 downloadBytesPerSecond,
+                             qint64 burstBytes)
+{
+    BandwidthShaper *shaper = d->m_networkAccessManager->bandwidthShaper();
+    shaper->setLimit(BandwidthShaper::Upload, -1, uploadBytesPerSecond, burstBytes);
+    shaper->setLimit(BandwidthShaper::Download, -1, downloadBytesPerSecond, burstBytes);
+}
+
+/*!
+    Limits the upload and download bandwidth used by requests with
+    \a priority to \a uploadBytesPerSecond and \a downloadBytesPerSecond,
+    with bursts of up to \a burstBytes. Requests are subject to both the
+    per-priority and the total limit.
+*/
+void QtS3::setBandwidthLimit(Priority priority, qint64 uploadBytesPerSecond,
+                             qint64 downloadBytesPerSecond, qint64 burstBytes)
+{
+    BandwidthShaper *shaper = d->m_networkAccessManager->bandwidthShaper();
+    shaper->setLimit(BandwidthShaper::Upload, priority, uploadBytesPerSecond, burstBytes);
+    shaper->setLimit(BandwidthShaper::Download, priority, downloadBytesPerSecond, burstBytes);
+}
+
+/*!
+    Limits the memory used by requests in progress to \a bytes: request
+    content, and reply content from when the reply headers arrive. 0
+    removes the limit, which is the default.
+
+    New requests wait while the budget is used up, for up to
+    \a maxWaitMsecs, or indefinitely if -1. Requests which time out fail
+    with MemoryBudgetExceededError; use 0 to fail immediately. A request
+    larger than the budget is started when no other request uses memory.
+*/
+void QtS3::setMemoryBudget(qint64 bytes, int maxWaitMsecs)
+{
+    d->m_networkAccessManager->memoryBudget()->setLimit(bytes, maxWaitMsecs);
+}
+
+/*!
+    Returns the memory in bytes currently used by requests in progress.
+*/
+qint64 QtS3::memoryUsage()
+{
+    return d->m_networkAccessManager->memoryBudget()->usage();
+}
+
+/*!
+    Returns the highest memoryUsage() seen.
+*/
+qint64 QtS3::memoryHighWaterMark()
+{
+    return d->m_networkAccessManager->memoryBudget()->highWaterMark();
+}
+
+/*!
+    Starts recording the operations made with this object to \a fileName,
+    replacing the file. Each get(), put(), headObject(), exists(), size(),
+    remove(), listPage() and list() call is recorded with its bucket, key,
+    content size, start time, latency and result, in a compact binary format
+    which the qts3replay tool plays back. Batch operations record one entry
+    per object.
+
+    Returns false if the file could not be opened.
+*/
+bool QtS3::startRecording(const QString &fileName)
+{
+    return d->m_recorder.start(fileName);
+}
+
+/*!
+    Stops recording and closes the recording file.
+*/
+void QtS3::stopRecording()
+{
+    d->m_recorder.stop();
+}
+
+/*!
+    Sets the in-memory object cache size to \a bytes. get() serves cached
+    objects from memory while they are fresh, and revalidates stale objects
+    with a conditional request which does not download the content if the
+    object is unchanged. The least recently used objects are evicted when the
+    cache is full.
+
+    The default size is 0, which disables the cache.
+*/
+void QtS3::setCacheSize(qint64 bytes)
+{
+    d->m_objectCache.setMaxSize(bytes);
+}
+
+/*!
+    Returns the object cache size.
+*/
+qint64 QtS3::cacheSize()
+{
+    return d->m_objectCache.maxSize();
+}
+
+/*!
+    Enables a persistent object cache in \a directory, with a size limit of
+    \a maxBytes. The disk cache is used on in-memory cache misses, survives
+    restarts and can be shared between processes on the same host. Objects
+    with identical content are stored once. Cache policies apply to both
+    caches.
+
+    Entries are keyed on bucket and object name only, use separate
+    directories for different endpoints. An empty \a directory disables the
+    disk cache, which is the default. clearCaches() does not clear the disk
+    cache.
+*/
+void QtS3::setDiskCache(const QString &directory, qint64 maxBytes)
+{
+    d->m_diskCache.setDirectory(directory, maxBytes);
+}
+
+/*!
+    Returns the disk cache directory, or an empty string if the disk cache
+    is disabled.
+*/
+QString QtS3::diskCacheDirectory()
+{
+    return d->m_diskCache.directory();
+}
+
+/*!
+    Sets the default cache \a policy, used for objects which do not match
+    a bucket or prefix policy.
+*/
+void QtS3::setCachePolicy(const QtS3CachePolicy &policy)
+{
+    d->m_objectCache.setDefaultPolicy(policy);
+}
+
+/*!
+    Sets the cache \a policy for objects in \a bucket with keys starting with
+    \a prefix. An empty prefix matches all objects in the bucket. The policy
+    with the longest matching prefix is used.
+*/
+void QtS3::setCachePolicy(const QByteArray &bucket, const QString &prefix,
+                          const QtS3CachePolicy &policy)
+{
+    d->m_objectCache.setPolicy(bucket, prefix, policy);
+}
+
+/*!
+    Prepares this object for requests to \a buckets, so that the first
+    requests do not pay for cold-start latency: looks up and caches the
+    bucket regions, derives the signing keys for the regions, resolves the
+    endpoint host names, and opens \a connectionsPerEndpoint keep-alive
+    connections to each endpoint. Connections are opened in the background
+    with the default transport; the ThreadLocalTransport opens them for the
+    calling thread only.
+
+    Returns an error if a region lookup or host name lookup fails.
+*/
+QtS3Reply<void> QtS3::warmup(const QList<QByteArray> &buckets, int connectionsPerEndpoint)
+{
+    return QtS3Reply<void>(d->warmup(buckets, connectionsPerEndpoint));
+}
+
 /*!
     Returns the region for the \a bucketName bucket. Example values are
     "us-east-1" and "eu-west-1".
@@ -58,24 +391,98 @@ QtS3Reply<QByteArray> QtS3::location(const QByteArray &bucket)
 QtS3Reply<void> QtS3::put(const QByteArray &bucket, const QString &path,
                           const QByteArray &content, const QStringList &headers)
 {
-    return QtS3Reply<void>(d->put(bucket, path, content, headers));
+    return QtS3Reply<void>(d->record(QtS3RequestRecord::Put, bucket, path, content.size(), [&]() {
+        return d->put(bucket, path, content, headers);
+    }));
 }
 
 /*!
-    Checks if the given \a path in \a bucket exists.
+    Returns the metadata (size, ETag, Last-Modified, content type and user
+    metadata) for the object at \a path in \a bucket, using one HEAD request.
+    If the object does not exist the reply will have the ObjectNotFoundError
+    error set.
+*/
+QtS3Reply<QtS3ObjectMetadata> QtS3::headObject(const QByteArray &bucket, const QString &path)
+{
+    return QtS3Reply<QtS3ObjectMetadata>(d->record(QtS3RequestRecord::Head, bucket, path, -1,
+                                                   [&]() { return d->headObject(bucket, path); }));
+}
+
+/*!
+    Checks if the given \a path in \a bucket exists. Use headObject() if
+    you need more than one metadata value.
 */
 QtS3Reply<bool> QtS3::exists(const QByteArray &bucket, const QString &path)
 {
-    return QtS3Reply<bool>(d->exists(bucket, path));
+    return QtS3Reply<bool>(d->record(QtS3RequestRecord::Exists, bucket, path, -1,
+                                     [&]() { return d->exists(bucket, path); }));
+}
+
+/*!
+    Checks if each of \a paths in \a bucket exists, and returns the results in
+    the same order. Uses up to \a concurrency parallel requests.
+
+    existsMany() chooses the cheaper way to check each group of keys with the
+    same "directory" prefix: sparse keys are checked with one HEAD request
+    each, and dense keys are checked by listing the key range which contains
+    them, where one request covers up to 1000 keys. Listings are bounded, and
+    fall back to HEAD requests for the rest of the group if the keys turn out
+    to be sparse within a large prefix.
+*/
+QtS3Reply<QList<bool>> QtS3::existsMany(const QByteArray &bucket, const QStringList &paths,
+                                        int concurrency)
+{
+    return QtS3Reply<QList<bool>>(d->existsMany(bucket, paths, concurrency));
+}
+
+/*!
+    Caches negative exists() results for \a msecs milliseconds, which answers
+    repeated probes for missing objects without a request. put() and remove()
+    on a key clear its entry. Objects created by other clients may be
+    reported as missing until the entry expires.
+
+    The default is 0, which disables the negative cache.
+*/
+void QtS3::setNegativeCacheTtl(int msecs)
+{
+    d->m_existenceCache.setNegativeTtl(msecs);
+}
+
+/*!
+    Returns the negative cache TTL.
+*/
+int QtS3::negativeCacheTtl()
+{
+    return d->m_existenceCache.negativeTtl();
+}
+
+/*!
+    Lists the objects in \a bucket starting with \a prefix and builds a Bloom
+    filter of the keys. exists() then answers keys with the prefix which are
+    definitely not in the filter without a request, and sends a request for
+    the rest. \a falsePositiveRate is the target rate of missing keys which
+    still require a request.
+
+    The filter is a snapshot: keys put() by this QtS3 object are added to it,
+    but objects created by other clients are reported as missing until the
+    filter is loaded again. Use filters for prefixes which are not written
+    concurrently by others. clearCaches() removes all filters.
+*/
+QtS3Reply<void> QtS3::loadExistenceFilter(const QByteArray &bucket, const QString &prefix,
+                                          double falsePositiveRate)
+{
+    return QtS3Reply<void>(d->loadExistenceFilter(bucket, prefix, falsePositiveRate));
 }
 
 /*!
     Returns the size of the object at \a path in \a bucket. If the object
-    does not exist the reply will have an error condition set.
+    does not exist the reply will have an error condition set. Use
+    headObject() if you need more than one metadata value.
 */
-QtS3Reply<int> QtS3::size(const QByteArray &bucket, const QString &path)
+QtS3Reply<qint64> QtS3::size(const QByteArray &bucket, const QString &path)
 {
-    return QtS3Reply<int>(d->size(bucket, path));
+    return QtS3Reply<qint64>(d->record(QtS3RequestRecord::Size, bucket, path, -1,
+                                       [&]() { return d->size(bucket, path); }));
 }
 
 /*!
@@ -83,7 +490,8 @@ QtS3Reply<int> QtS3::size(const QByteArray &bucket, const QString &path)
 */
 QtS3Reply<QByteArray> QtS3::get(const QByteArray &bucket, const QString &path)
 {
-    return QtS3Reply<QByteArray>(d->get(bucket, path));
+    return QtS3Reply<QByteArray>(d->record(QtS3RequestRecord::Get, bucket, path, -1,
+                                           [&]() { return d->get(bucket, path); }));
 }
 
 /*!
@@ -91,7 +499,306 @@ QtS3Reply<QByteArray> QtS3::get(const QByteArray &bucket, const QString &path)
 */
 QtS3Reply<void> QtS3::remove(const QByteArray &bucket, const QString &path)
 {
-    return QtS3Reply<void>(d->remove(bucket, path));
+    return QtS3Reply<void>(d->record(QtS3RequestRecord::Remove, bucket, path, 0,
+                                     [&]() { return d->remove(bucket, path); }));
+}
+
+/*!
+    Downloads the content for each of \a paths in \a bucket, using up to
+    maxConcurrency() parallel requests. Returns one reply per path, in the
+    same order.
+*/
+QList<QtS3Reply<QByteArray>> QtS3::getMany(const QByteArray &bucket, const QStringList &paths)
+{
+    QVector<QtS3ReplyPrivate *> replies(paths.count());
+    d->getMany(bucket, paths,
+               [&replies](int index, QtS3ReplyPrivate *reply) { replies[index] = reply; });
+
+    QList<QtS3Reply<QByteArray>> result;
+    for (QtS3ReplyPrivate *reply : replies)
+        result.append(QtS3Reply<QByteArray>(reply));
+    return result;
+}
+
+/*!
+    Downloads the content for each of \a paths in \a bucket, using up to
+    maxConcurrency() parallel requests. \a callback is called with the path
+    index and the reply as each download completes. Calls are made from
+    worker threads, one at a time.
+*/
+void QtS3::getMany(const QByteArray &bucket, const QStringList &paths,
+                   std::function<void(int index, QtS3Reply<QByteArray> reply)> callback)
+{
+    d->getMany(bucket, paths, [&callback](int index, QtS3ReplyPrivate *reply) {
+        callback(index, QtS3Reply<QByteArray>(reply));
+    });
+}
+
+/*!
+    Uploads \a objects (path and content pairs) to \a bucket, using up to
+    maxConcurrency() parallel requests. \a headers are used for all objects.
+    Returns one reply per object, in the same order.
+*/
+QList<QtS3Reply<void>> QtS3::putMany(const QByteArray &bucket,
+                                     const QList<QPair<QString, QByteArray>> &objects,
+                                     const QStringList &headers)
+{
+    QVector<QtS3ReplyPrivate *> replies(objects.count());
+    d->putMany(bucket, objects, headers,
+               [&replies](int index, QtS3ReplyPrivate *reply) { replies[index] = reply; });
+
+    QList<QtS3Reply<void>> result;
+    for (QtS3ReplyPrivate *reply : replies)
+        result.append(QtS3Reply<void>(reply));
+    return result;
+}
+
+/*!
+    Uploads \a objects (path and content pairs) to \a bucket, using up to
+    maxConcurrency() parallel requests. \a callback is called with the object
+    index and the reply as each upload completes. Calls are made from worker
+    threads, one at a time. \a headers are used for all objects.
+*/
+void QtS3::putMany(const QByteArray &bucket, const QList<QPair<QString, QByteArray>> &objects,
+                   std::function<void(int index, QtS3Reply<void> reply)> callback,
+                   const QStringList &headers)
+{
+    d->putMany(bucket, objects, headers, [&callback](int index, QtS3ReplyPrivate *reply) {
+        callback(index, QtS3Reply<void>(reply));
+    });
+}
+
+// Async operations run on their own pool: they block a thread each for the
+// duration of the operation, which should not stall batch operations.
+class QtS3AsyncThreadPool : public QThreadPool
+{
+public:
+    QtS3AsyncThreadPool() { setMaxThreadCount(32); }
+};
+Q_GLOBAL_STATIC(QtS3AsyncThreadPool, asyncThreadPool)
+
+template <typename T>
+QtS3AsyncReply<T> *QtS3::runAsync(std::function<T(QtS3 &s3, QtS3AsyncReplyBase *reply)> operation)
+{
+    // The operation holds a copy of this object, which keeps the private
+    // object alive until the operation completes.
+    QtS3 s3 = *this;
+    QtS3AsyncReply<T> *reply = new QtS3AsyncReply<T>;
+    reply->start([s3, reply, operation]() mutable {
+        reply->m_result.reset(new T(operation(s3, reply)));
+    });
+    return reply;
+}
+
+/*!
+    Starts downloading the content for the given \a path in \a bucket, and
+    returns immediately. The returned object emits finished() when the
+    download completes; delete it with deleteLater() after reading the
+    result.
+
+    The async functions are intended for threads which run an event loop,
+    such as the GUI thread, which the blocking functions would stall. The
+    operations run on a shared pool of worker threads, and the signals are
+    delivered to the thread which made the call.
+*/
+QtS3AsyncReply<QtS3Reply<QByteArray>> *QtS3::getAsync(const QByteArray &bucket,
+                                                      const QString &path)
+{
+    return runAsync<QtS3Reply<QByteArray>>(
+        [bucket, path](QtS3 &s3, QtS3AsyncReplyBase *) { return s3.get(bucket, path); });
+}
+
+/*!
+    Starts uploading \a content to \a path in \a bucket, with optional
+    \a headers, and returns immediately. See getAsync().
+*/
+QtS3AsyncReply<QtS3Reply<void>> *QtS3::putAsync(const QByteArray &bucket, const QString &path,
+                                                const QByteArray &content,
+                                                const QStringList &headers)
+{
+    return runAsync<QtS3Reply<void>>([bucket, path, content, headers](QtS3 &s3,
+                                                                      QtS3AsyncReplyBase *) {
+        return s3.put(bucket, path, content, headers);
+    });
+}
+
+/*!
+    Starts checking if an object exists at \a path in \a bucket, and
+    returns immediately. See getAsync().
+*/
+QtS3AsyncReply<QtS3Reply<bool>> *QtS3::existsAsync(const QByteArray &bucket, const QString &path)
+{
+    return runAsync<QtS3Reply<bool>>(
+        [bucket, path](QtS3 &s3, QtS3AsyncReplyBase *) { return s3.exists(bucket, path); });
+}
+
+/*!
+    Starts deleting the object at \a path in \a bucket, and returns
+    immediately. See getAsync().
+*/
+QtS3AsyncReply<QtS3Reply<void>> *QtS3::removeAsync(const QByteArray &bucket, const QString &path)
+{
+    return runAsync<QtS3Reply<void>>(
+        [bucket, path](QtS3 &s3, QtS3AsyncReplyBase *) { return s3.remove(bucket, path); });
+}
+
+/*!
+    Starts downloading the content for each of \a paths in \a bucket, as
+    getMany() does, and returns immediately. The returned object emits
+    progress() as each download completes, and finished() when all have
+    completed. See getAsync().
+*/
+QtS3AsyncReply<QList<QtS3Reply<QByteArray>>> *QtS3::getManyAsync(const QByteArray &bucket,
+                                                                 const QStringList &paths)
+{
+    return runAsync<QList<QtS3Reply<QByteArray>>>(
+        [bucket, paths](QtS3 &s3, QtS3AsyncReplyBase *reply) {
+            QMap<int, QtS3Reply<QByteArray>> replies; // index -> reply
+            s3.getMany(bucket, paths, [&](int index, QtS3Reply<QByteArray> result) {
+                replies.insert(index, result);
+                reply->reportProgress(replies.count(), paths.count());
+            });
+            return replies.values();
+        });
+}
+
+/*!
+    Starts uploading \a objects to \a bucket with \a headers, as putMany()
+    does, and returns immediately. The returned object emits progress() as
+    each upload completes, and finished() when all have completed. See
+    getAsync().
+*/
+QtS3AsyncReply<QList<QtS3Reply<void>>> *
+QtS3::putManyAsync(const QByteArray &bucket, const QList<QPair<QString, QByteArray>> &objects,
+                   const QStringList &headers)
+{
+    return runAsync<QList<QtS3Reply<void>>>(
+        [bucket, objects, headers](QtS3 &s3, QtS3AsyncReplyBase *reply) {
+            QMap<int, QtS3Reply<void>> replies; // index -> reply
+            s3.putMany(bucket, objects,
+                       [&](int index, QtS3Reply<void> result) {
+                           replies.insert(index, result);
+                           reply->reportProgress(replies.count(), objects.count());
+                       },
+                       headers);
+            return replies.values();
+        });
+}
+
+/*!
+    Downloads \a length bytes starting at \a offset of the content for the
+    given \a path in \a bucket.
+*/
+QtS3Reply<QByteArray> QtS3::getRange(const QByteArray &bucket, const QString &path,
+                                     qint64 offset, qint64 length)
+{
+    return QtS3Reply<QByteArray>(d->getRange(bucket, path, offset, length));
+}
+
+/*!
+    Starts a multipart upload to \a path in \a bucket and returns the upload
+    id. \a headers may contain optional request headers for the object.
+
+    Upload the parts with uploadPart(), then call completeMultipartUpload()
+    or abortMultipartUpload(). Incomplete uploads use storage until aborted.
+*/
+QtS3Reply<QByteArray> QtS3::createMultipartUpload(const QByteArray &bucket, const QString &path,
+                                                  const QStringList &headers)
+{
+    return QtS3Reply<QByteArray>(d->createMultipartUpload(bucket, path, headers));
+}
+
+/*!
+    Uploads \a content as part \a partNumber (starting at 1) of the multipart
+    upload \a uploadId, and returns the part ETag. All parts except the last
+    must be at least 5MB.
+*/
+QtS3Reply<QByteArray> QtS3::uploadPart(const QByteArray &bucket, const QString &path,
+                                       const QByteArray &uploadId, int partNumber,
+                                       const QByteArray &content)
+{
+    return QtS3Reply<QByteArray>(d->uploadPart(bucket, path, uploadId, partNumber, content));
+}
+
+/*!
+    Completes the multipart upload \a uploadId. \a partETags contains the
+    ETags returned by uploadPart(), in part number order.
+*/
+QtS3Reply<void> QtS3::completeMultipartUpload(const QByteArray &bucket, const QString &path,
+                                              const QByteArray &uploadId,
+                                              const QList<QByteArray> &partETags)
+{
+    return QtS3Reply<void>(d->completeMultipartUpload(bucket, path, uploadId, partETags));
+}
+
+/*!
+    Aborts the multipart upload \a uploadId and deletes the uploaded parts.
+*/
+QtS3Reply<void> QtS3::abortMultipartUpload(const QByteArray &bucket, const QString &path,
+                                           const QByteArray &uploadId)
+{
+    return QtS3Reply<void>(d->abortMultipartUpload(bucket, path, uploadId));
+}
+
+/*!
+    Lists one page (up to 1000 objects) of the objects in \a bucket whose keys
+    start with \a prefix.
+
+    If \a delimiter is set then keys containing the delimiter after the prefix
+    are rolled up and returned as common prefixes instead. \a startAfter
+    starts the listing after the given key. Pass the nextContinuationToken
+    from a truncated page as \a continuationToken to get the next page.
+*/
+QtS3Reply<QtS3ListPage> QtS3::listPage(const QByteArray &bucket, const QString &prefix,
+                                       const QString &delimiter, const QString &startAfter,
+                                       const QString &continuationToken)
+{
+    auto request = [&]() {
+        return d->listPage(bucket, prefix, delimiter, startAfter, continuationToken);
+    };
+    return QtS3Reply<QtS3ListPage>(
+        d->record(QtS3RequestRecord::ListPage, bucket, prefix, -1, request));
+}
+
+/*!
+    Lists all objects in \a bucket whose keys start with \a prefix. The
+    listing is paginated and requires one request per 1000 objects.
+*/
+QtS3Reply<QList<QtS3ObjectInfo>> QtS3::list(const QByteArray &bucket, const QString &prefix)
+{
+    return QtS3Reply<QList<QtS3ObjectInfo>>(d->record(QtS3RequestRecord::List, bucket, prefix, 0,
+                                                      [&]() { return d->list(bucket, prefix); }));
+}
+
+/*!
+    Lists all objects in \a bucket whose keys start with \a prefix, using up
+    to \a concurrency parallel listings.
+
+    The key space is split into ranges, either at the common prefixes found
+    by a "/"-delimited listing or at fixed StartAfter split points, and the
+    ranges are listed concurrently. The objects are returned in key order.
+
+    Note that QtS3 uses one network connection pool, and the number of
+    concurrent connections per bucket is limited by QNetworkAccessManager.
+*/
+QtS3Reply<QList<QtS3ObjectInfo>> QtS3::listParallel(const QByteArray &bucket,
+                                                     const QString &prefix, int concurrency)
+{
+    return QtS3Reply<QList<QtS3ObjectInfo>>(d->listParallel(bucket, prefix, concurrency));
+}
+
+/*!
+    Lists all objects in \a bucket whose keys start with \a prefix, using up
+    to \a concurrency parallel listings. Objects are handed to \a callback as
+    they arrive, in no particular order.
+
+    The callback is called on the listing worker threads, one call at a time.
+*/
+QtS3Reply<void> QtS3::listParallel(const QByteArray &bucket, const QString &prefix,
+                                   std::function<void(const QList<QtS3ObjectInfo> &)> callback,
+                                   int concurrency)
+{
+    return QtS3Reply<void>(d->listParallel(bucket, prefix, callback, concurrency));
 }
 
 /*!
@@ -119,6 +826,109 @@ QByteArray QtS3::secretAccessKey()
     return d->secretAccessKey();
 }
 
+static thread_local QtS3::Priority currentThreadPriority = QtS3::NormalPriority;
+
+/*!
+    \class QtS3PriorityScope
+
+    Sets the priority for QtS3 requests made on the current thread for the
+    lifetime of the scope object, for example:
+
+        QtS3PriorityScope background(QtS3::LowPriority);
+        s3.putMany(bucket, objects);
+
+    Batch operations apply the priority to their worker threads as well.
+*/
+QtS3PriorityScope::QtS3PriorityScope(QtS3::Priority priority)
+    : m_previous(currentThreadPriority)
+{
+    currentThreadPriority = priority;
+}
+
+QtS3PriorityScope::~QtS3PriorityScope()
+{
+    currentThreadPriority = m_previous;
+}
+
+/*!
+    Returns the request priority for the current thread. The default is
+    NormalPriority.
+*/
+QtS3::Priority QtS3PriorityScope::currentPriority()
+{
+    return currentThreadPriority;
+}
+
+/*!
+    \class QtS3Metrics
+
+    Aggregated metrics for all QtS3 objects in the process: request counts by
+    HTTP verb and status code, latency histograms by operation and bucket,
+    bytes sent and received, signing key rotations, bucket region cache hits
+    and misses, pending requests, and time spent waiting for internal locks.
+*/
+
+/*!
+    Returns the metrics in the Prometheus text exposition format, suitable
+    for serving from a /metrics endpoint.
+*/
+QByteArray QtS3Metrics::prometheusText()
+{
+    return QtS3MetricsRegistry::instance()->formatPrometheus();
+}
+
+/*!
+    Resets all counters and histograms. The pending requests gauge is not
+    reset.
+*/
+void QtS3Metrics::reset()
+{
+    QtS3MetricsRegistry::instance()->reset();
+}
+
+/*!
+    \class QtS3Trace
+
+    Records begin and end events for the stages of each QtS3 request: region
+    lookup, signing, queueing, network transfer and reply parsing, as well as
+    contended waits for internal locks. Events are recorded per thread,
+    including the network thread, into fixed-size lock-free ring buffers
+    which keep the most recent events.
+*/
+
+/*!
+    Enables tracing if \a enabled is true. Tracing is disabled by default.
+*/
+void QtS3Trace::setEnabled(bool enabled)
+{
+    QtS3Tracer::instance()->setEnabled(enabled);
+}
+
+/*!
+    Returns whether tracing is enabled.
+*/
+bool QtS3Trace::isEnabled()
+{
+    return QtS3Tracer::instance()->isEnabled();
+}
+
+/*!
+    Returns the recorded events in the Chrome trace-event JSON format, which
+    can be loaded in chrome://tracing or the Perfetto UI.
+*/
+QByteArray QtS3Trace::chromeTraceJson()
+{
+    return QtS3Tracer::instance()->formatChromeTrace();
+}
+
+/*!
+    Discards the events recorded so far.
+*/
+void QtS3Trace::clear()
+{
+    QtS3Tracer::instance()->clear();
+}
+
 QtS3ReplyBase::QtS3ReplyBase(QtS3ReplyPrivate *replyPrivate) : d(replyPrivate) {}
 // error handling
 bool QtS3ReplyBase::isSuccess() { return d->isSuccess(); }
@@ -135,9 +945,114 @@ QString QtS3ReplyBase::anyErrorString() { return d->anyErrorString(); }
 
 QByteArray QtS3ReplyBase::replyData() { return d->bytearrayValue(); }
 
+/*!
+    Returns the time in msecs the request(s) for this reply waited in the
+    priority queues before being sent.
+*/
+qint64 QtS3ReplyBase::queueWaitTime() { return d->m_timing.queueWaitTime / 1000; }
+
+/*!
+    Returns the time spent in each stage of the request(s) for this reply,
+    and the number of bytes sent and received. Replies served from a cache
+    have zero network timings.
+*/
+QtS3ReplyTiming QtS3ReplyBase::timing() { return d->m_timing; }
+
+QtS3AsyncReplyBase::QtS3AsyncReplyBase() : m_finished(false), m_done(false) {}
+
+/*!
+    Destroys the reply. Waits for the operation to complete if it is still
+    in progress.
+*/
+QtS3AsyncReplyBase::~QtS3AsyncReplyBase()
+{
+    QMutexLocker lock(&m_mutex);
+    while (!m_done)
+        m_stateChanged.wait(&m_mutex);
+}
+
+/*!
+    Returns true if the operation has completed and the result is available.
+*/
+bool QtS3AsyncReplyBase::isFinished()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_finished;
+}
+
+/*!
+    Blocks until the operation has completed.
+*/
+void QtS3AsyncReplyBase::waitForFinished()
+{
+    QMutexLocker lock(&m_mutex);
+    while (!m_finished)
+        m_stateChanged.wait(&m_mutex);
+}
+
+void QtS3AsyncReplyBase::start(std::function<void()> operation)
+{
+    class Task : public QRunnable
+    {
+    public:
+        Task(QtS3AsyncReplyBase *reply, std::function<void()> operation)
+            : m_reply(reply), m_operation(operation),
+              m_priority(QtS3PriorityScope::currentPriority())
+        {
+        }
+
+        void run()
+        {
+            {
+                QtS3PriorityScope priority(m_priority);
+                m_operation();
+                m_operation = std::function<void()>(); // release captured state
+            }
+            m_reply->setFinished();
+        }
+
+    private:
+        QtS3AsyncReplyBase *m_reply;
+        std::function<void()> m_operation;
+        QtS3::Priority m_priority; // of the calling thread
+    };
+
+    asyncThreadPool()->start(new Task(this, operation));
+}
+
+void QtS3AsyncReplyBase::reportProgress(int completed, int total)
+{
+    emit progress(completed, total);
+}
+
+// Signals are emitted on the worker thread, and are queued to receivers on
+// other threads.
+void QtS3AsyncReplyBase::setFinished()
+{
+    {
+        QMutexLocker lock(&m_mutex);
+        m_finished = true;
+        m_stateChanged.wakeAll();
+    }
+    emit finished();
+    QMutexLocker lock(&m_mutex);
+    m_done = true;
+    m_stateChanged.wakeAll();
+}
+
 template <> void QtS3Reply<void>::value() {}
 template <> bool QtS3Reply<bool>::value() { return d->boolValue(); }
-template <> int QtS3Reply<int>::value() { return d->intValue(); }
+template <> qint64 QtS3Reply<qint64>::value() { return d->intValue(); }
 template <> QByteArray QtS3Reply<QByteArray>::value() { return d->bytearrayValue(); }
+template <> QtS3ObjectMetadata QtS3Reply<QtS3ObjectMetadata>::value()
+{
+    return d->metadataValue();
+}
+template <> QtS3ListPage QtS3Reply<QtS3ListPage>::value() { return d->listPageValue(); }
+template <> QList<bool> QtS3Reply<QList<bool>>::value() { return d->boolListValue(); }
+template <> QList<QtS3ObjectInfo> QtS3Reply<QList<QtS3ObjectInfo>>::value()
+{
+    return d->listPageValue().objects;
+}
 
 QPM_END_NAMESPACE(com, github, msorvig, s3)
@@ -13,31 +13,232 @@ QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
 class QtS3Private;
 class QtS3;
 class QtS3ReplyPrivate;
+class QtS3TailPrivate;
+class QtS3SyncPrivate;
 template <typename T>
 class QtS3Reply;
+template <typename T>
+class QtS3AsyncReply;
+class QtS3AsyncReplyBase;
+
+class QtS3ObjectInfo
+{
+public:
+    QtS3ObjectInfo() : size(0) {}
+
+    QString key;
+    qint64 size;
+    QByteArray etag;
+    QDateTime lastModified;
+};
+
+class QtS3ObjectMetadata
+{
+public:
+    QtS3ObjectMetadata() : exists(false), size(0) {}
+
+    bool exists;
+    qint64 size;
+    QByteArray etag;
+    QDateTime lastModified;
+    QByteArray contentType;
+    QHash<QByteArray, QByteArray> userMetadata; // x-amz-meta-* headers, without the prefix
+};
+
+class QtS3ListPage
+{
+public:
+    QtS3ListPage() : isTruncated(false) {}
+
+    QList<QtS3ObjectInfo> objects;
+    QStringList commonPrefixes;
+    bool isTruncated;
+    QString nextContinuationToken;
+};
+
+class QtS3CachePolicy
+{
+public:
+    QtS3CachePolicy() : enabled(true), maxAge(60000) {}
+
+    bool enabled;
+    int maxAge; // msecs a cached object is used without revalidation
+};
+
+// Time spent in each stage of a request, in microseconds. Stages which
+// are repeated, for example for retries, are summed.
+class QtS3ReplyTiming
+{
+public:
+    QtS3ReplyTiming()
+        : signingKeyTime(0), regionLookupTime(0), signingTime(0), queueWaitTime(0),
+          timeToFirstByte(0), transferTime(0), bytesSent(0), bytesReceived(0), retryCount(0)
+    {
+    }
+
+    qint64 signingKeyTime;   // deriving or rotating the signing key
+    qint64 regionLookupTime; // looking up the bucket region
+    qint64 signingTime;      // creating and signing the canonical request
+    qint64 queueWaitTime;    // waiting for memory, concurrency limits and priority queues
+    qint64 timeToFirstByte;  // sending the request until the response headers, including
+                             // connection setup and TLS
+    qint64 transferTime;     // response headers until the response completed
+    qint64 bytesSent;
+    qint64 bytesReceived;
+    int retryCount;
+};
 
 class QtS3
 {
 public:
+    enum Priority {
+        HighPriority,   // interactive requests
+        NormalPriority,
+        LowPriority,    // bulk and background requests
+    };
+
+    enum Transport {
+        NetworkAccessManagerTransport,
+        EpollTransport,
+        LoopbackTransport,
+        ThreadLocalTransport,
+    };
+
     QtS3(const QString &accessKeyId, const QString &secretAccessKey);
     QtS3(std::function<QByteArray()> accessKeyIdProvider,
          std::function<QByteArray()> secretAccessKeyProvider);
 
+    void setEndpoint(const QUrl &endpoint, const QByteArray &region = "us-east-1");
+    void setMaxConcurrency(int threadCount);
+    int maxConcurrency();
+    void setTransport(Transport transport);
+    void setMaxNetworkRequests(int maxRequests);
+    void setPriorityWeight(Priority priority, int weight);
+    void setPriorityConcurrencyLimit(Priority priority, int maxRequests);
+    void setAdaptiveConcurrency(bool enable);
+    int concurrencyLimit(const QByteArray &bucket, const QString &prefix = QString());
+    void setSlowDownRetries(int retries);
+    void setBandwidthLimit(qint64 uploadBytesPerSecond, qint64 downloadBytesPerSecond,
+                           qint64 burstBytes = 0);
+    void setBandwidthLimit(Priority priority, qint64 uploadBytesPerSecond,
+                           qint64 downloadBytesPerSecond, qint64 burstBytes = 0);
+    void setMemoryBudget(qint64 bytes, int maxWaitMsecs = -1);
+    qint64 memoryUsage();
+    qint64 memoryHighWaterMark();
+
+    bool startRecording(const QString &fileName);
+    void stopRecording();
+
+    void setCacheSize(qint64 bytes);
+    qint64 cacheSize();
+    void setDiskCache(const QString &directory, qint64 maxBytes);
+    QString diskCacheDirectory();
+    void setCachePolicy(const QtS3CachePolicy &policy);
+    void setCachePolicy(const QByteArray &bucket, const QString &prefix,
+                        const QtS3CachePolicy &policy);
+
+    QtS3Reply<void> warmup(const QList<QByteArray> &buckets, int connectionsPerEndpoint = 2);
     QtS3Reply<QByteArray> location(const QByteArray &bucket);
     QtS3Reply<void> put(const QByteArray &bucket, const QString &path,
                         const QByteArray &content, const QStringList &headers = QStringList());
+    QtS3Reply<QtS3ObjectMetadata> headObject(const QByteArray &bucket, const QString &path);
     QtS3Reply<bool> exists(const QByteArray &bucket, const QString &path);
-    QtS3Reply<int> size(const QByteArray &bucket, const QString &path);
+    QtS3Reply<QList<bool>> existsMany(const QByteArray &bucket, const QStringList &paths,
+                                      int concurrency = 8);
+    void setNegativeCacheTtl(int msecs);
+    int negativeCacheTtl();
+    QtS3Reply<void> loadExistenceFilter(const QByteArray &bucket, const QString &prefix,
+                                        double falsePositiveRate = 0.01);
+    QtS3Reply<qint64> size(const QByteArray &bucket, const QString &path);
     QtS3Reply<QByteArray> get(const QByteArray &bucket, const QString &path);
     QtS3Reply<void> remove(const QByteArray &bucket, const QString &path);
+    QList<QtS3Reply<QByteArray>> getMany(const QByteArray &bucket, const QStringList &paths);
+    void getMany(const QByteArray &bucket, const QStringList &paths,
+                 std::function<void(int index, QtS3Reply<QByteArray> reply)> callback);
+    QList<QtS3Reply<void>> putMany(const QByteArray &bucket,
+                                   const QList<QPair<QString, QByteArray>> &objects,
+                                   const QStringList &headers = QStringList());
+    void putMany(const QByteArray &bucket, const QList<QPair<QString, QByteArray>> &objects,
+                 std::function<void(int index, QtS3Reply<void> reply)> callback,
+                 const QStringList &headers = QStringList());
+    QtS3Reply<QByteArray> getRange(const QByteArray &bucket, const QString &path, qint64 offset,
+                                   qint64 length);
+
+    QtS3Reply<QByteArray> createMultipartUpload(const QByteArray &bucket, const QString &path,
+                                                const QStringList &headers = QStringList());
+    QtS3Reply<QByteArray> uploadPart(const QByteArray &bucket, const QString &path,
+                                     const QByteArray &uploadId, int partNumber,
+                                     const QByteArray &content);
+    QtS3Reply<void> completeMultipartUpload(const QByteArray &bucket, const QString &path,
+                                            const QByteArray &uploadId,
+                                            const QList<QByteArray> &partETags);
+    QtS3Reply<void> abortMultipartUpload(const QByteArray &bucket, const QString &path,
+                                         const QByteArray &uploadId);
+
+    QtS3Reply<QtS3ListPage> listPage(const QByteArray &bucket, const QString &prefix,
+                                     const QString &delimiter = QString(),
+                                     const QString &startAfter = QString(),
+                                     const QString &continuationToken = QString());
+    QtS3Reply<QList<QtS3ObjectInfo>> list(const QByteArray &bucket, const QString &prefix);
+    QtS3Reply<QList<QtS3ObjectInfo>> listParallel(const QByteArray &bucket,
+                                                   const QString &prefix, int concurrency = 8);
+    QtS3Reply<void> listParallel(const QByteArray &bucket, const QString &prefix,
+                                 std::function<void(const QList<QtS3ObjectInfo> &)> callback,
+                                 int concurrency = 8);
+
+    QtS3AsyncReply<QtS3Reply<QByteArray>> *getAsync(const QByteArray &bucket,
+                                                    const QString &path);
+    QtS3AsyncReply<QtS3Reply<void>> *putAsync(const QByteArray &bucket, const QString &path,
+                                              const QByteArray &content,
+                                              const QStringList &headers = QStringList());
+    QtS3AsyncReply<QtS3Reply<bool>> *existsAsync(const QByteArray &bucket, const QString &path);
+    QtS3AsyncReply<QtS3Reply<void>> *removeAsync(const QByteArray &bucket, const QString &path);
+    QtS3AsyncReply<QList<QtS3Reply<QByteArray>>> *getManyAsync(const QByteArray &bucket,
+                                                               const QStringList &paths);
+    QtS3AsyncReply<QList<QtS3Reply<void>>> *
+    putManyAsync(const QByteArray &bucket, const QList<QPair<QString, QByteArray>> &objects,
+                 const QStringList &headers = QStringList());
 
     void clearCaches();
     QByteArray accessKeyId();
     QByteArray secretAccessKey();
 private:
+    friend class QtS3Tail;
+    friend class QtS3Sync;
+    template <typename T>
+    QtS3AsyncReply<T> *runAsync(std::function<T(QtS3 &s3, QtS3AsyncReplyBase *reply)> operation);
     QSharedPointer<QtS3Private> d;
 };
 
+class QtS3PriorityScope
+{
+public:
+    explicit QtS3PriorityScope(QtS3::Priority priority);
+    ~QtS3PriorityScope();
+
+    static QtS3::Priority currentPriority();
+
+private:
+    Q_DISABLE_COPY(QtS3PriorityScope)
+    QtS3::Priority m_previous;
+};
+
+class QtS3Metrics
+{
+public:
+    static QByteArray prometheusText();
+    static void reset();
+};
+
+class QtS3Trace
+{
+public:
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+    static QByteArray chromeTraceJson();
+    static void clear();
+};
+
 class QtS3ReplyBase
 {
 public:
@@ -54,6 +255,9 @@ public:
         InternalReplyInitializationError,
         InternalError,
         UnknownError,
+        FileError,
+        SlowDownError,
+        MemoryBudgetExceededError,
     };
 
     QtS3ReplyBase(QtS3ReplyPrivate *replyPrivate);
@@ -69,8 +273,12 @@ public:
     // verbatim reply as returned by AWS
     QByteArray replyData();
 
+    // metrics
+    qint64 queueWaitTime();
+    QtS3ReplyTiming timing();
+
 protected:
-    QtS3ReplyPrivate *d; // ### should be explicitly shared.
+    QSharedPointer<QtS3ReplyPrivate> d;
 };
 
 template <typename T> class QtS3Reply : public QtS3ReplyBase
@@ -87,6 +295,118 @@ QtS3Reply<T>::QtS3Reply(QtS3ReplyPrivate *replyPrivate)
 
 }
 
+class QtS3AsyncReplyBase : public QObject
+{
+    Q_OBJECT
+public:
+    ~QtS3AsyncReplyBase();
+
+    bool isFinished();
+    void waitForFinished();
+
+signals:
+    void progress(int completed, int total);
+    void finished();
+
+protected:
+    QtS3AsyncReplyBase();
+
+private:
+    friend class QtS3;
+    Q_DISABLE_COPY(QtS3AsyncReplyBase)
+    void start(std::function<void()> operation);
+    void reportProgress(int completed, int total);
+    void setFinished();
+
+    QMutex m_mutex;
+    QWaitCondition m_stateChanged;
+    bool m_finished; // the result is available
+    bool m_done;     // the operation no longer uses this object
+};
+
+template <typename T> class QtS3AsyncReply : public QtS3AsyncReplyBase
+{
+public:
+    T result();
+
+private:
+    friend class QtS3;
+    QtS3AsyncReply() {}
+    QScopedPointer<T> m_result;
+};
+
+template <typename T> T QtS3AsyncReply<T>::result()
+{
+    waitForFinished();
+    return *m_result;
+}
+
+class QtS3Tail
+{
+public:
+    QtS3Tail(const QtS3 &s3, const QByteArray &bucket);
+    ~QtS3Tail();
+
+    void addPrefix(const QString &prefix);
+    QStringList prefixes();
+    void setCallback(
+        std::function<void(const QString &prefix, const QList<QtS3ObjectInfo> &objects)> callback);
+    void setPollInterval(int minimumMsecs, int maximumMsecs);
+    int pollInterval();
+
+    QtS3Reply<QList<QtS3ObjectInfo>> poll();
+    void start();
+    void stop();
+
+    QByteArray saveCheckpoint();
+    bool restoreCheckpoint(const QByteArray &checkpoint);
+
+private:
+    Q_DISABLE_COPY(QtS3Tail)
+    QtS3TailPrivate *d;
+};
+
+class QtS3Sync
+{
+public:
+    class Stats
+    {
+    public:
+        Stats()
+            : filesChecked(0), filesTransferred(0), filesSkipped(0), filesDeleted(0),
+              filesFailed(0), bytesTransferred(0)
+        {
+        }
+
+        int filesChecked;
+        int filesTransferred;
+        int filesSkipped;
+        int filesDeleted;
+        int filesFailed;
+        qint64 bytesTransferred;
+    };
+
+    QtS3Sync(const QtS3 &s3);
+    ~QtS3Sync();
+
+    void setWorkerCount(int count);
+    void setMultipartThreshold(qint64 bytes);
+    void setPartSize(qint64 bytes);
+    void setDeleteExtraneous(bool enable);
+    void setDryRun(bool enable);
+    void setLogCallback(std::function<void(const QString &message)> callback);
+
+    QtS3Reply<void> upload(const QString &localDirectory, const QByteArray &bucket,
+                           const QString &prefix);
+    QtS3Reply<void> download(const QByteArray &bucket, const QString &prefix,
+                             const QString &localDirectory);
+    Stats stats();
+
+private:
+    Q_DISABLE_COPY(QtS3Sync)
+    QtS3SyncPrivate *d;
+};
+
 QPM_END_NAMESPACE(com, github, msorvig, s3)
 
 #endif
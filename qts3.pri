@@ -9,8 +9,26 @@ HEADERS += \
     $$PWD/qts3.h \
     $$PWD/qts3qnam_p.h \
     $$PWD/qts3_p.h \
+    $$PWD/qts3tail_p.h \
+    $$PWD/qts3sync_p.h \
+    $$PWD/qts3cache_p.h \
+    $$PWD/qts3limiter_p.h \
+    $$PWD/qts3metrics_p.h \
+    $$PWD/qts3trace_p.h \
+    $$PWD/qts3recorder_p.h \
+    $$PWD/qts3transport_p.h \
+    $$PWD/qts3epoll_p.h \
     
 SOURCES += \
     $$PWD/qts3.cpp \
     $$PWD/qts3qnam.cpp \
     $$PWD/qts3_p.cpp \
+    $$PWD/qts3tail.cpp \
+    $$PWD/qts3sync.cpp \
+    $$PWD/qts3cache.cpp \
+    $$PWD/qts3limiter.cpp \
+    $$PWD/qts3metrics.cpp \
+    $$PWD/qts3trace.cpp \
+    $$PWD/qts3recorder.cpp \
+    $$PWD/qts3transport.cpp \
+    $$PWD/qts3epoll.cpp \
@@ -44,7 +44,7 @@ QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
 Q_LOGGING_CATEGORY(qts3, "qts3.API")
 Q_LOGGING_CATEGORY(qts3_Internal, "qts3.internal")
 
-QtS3Private::QtS3Private() : m_networkAccessManager(0) {}
+QtS3Private::QtS3Private() : m_networkAccessManager(0), m_transport(0) {}
 
 QtS3Private::QtS3Private(QByteArray accessKeyId, QByteArray secretAccessKey)
 {
@@ -64,8 +64,15 @@ QtS3Private::QtS3Private(std::function<QByteArray()> accessKeyIdProvider,
 
 QtS3Private::~QtS3Private()
 {
-    if (m_networkAccessManager->pendingRequests() > 0)
+    if (m_networkAccessManager && m_networkAccessManager->pendingRequests() > 0)
         qWarning() << "QtS3 object deleted with pending requests in flight";
+
+    // Deletes the transports, which delete their replies: replies which live
+    // on the shared network thread are deleted there with deleteLater(). The
+    // network thread and its QNetworkAccessManager outlive this object.
+    delete m_transport.load();
+    qDeleteAll(m_retiredTransports);
+    delete m_networkAccessManager;
 }
 
 // Returns a date formatted as YYYYMMDD.
@@ -338,8 +345,9 @@ void QtS3Private::signRequest(QNetworkRequest *request, const QByteArray &verb,
     QUrl url = request->url();
     // create authorization header (value)
     QByteArray authHeaderValue
-        = createAuthorizationHeader(headers, verb, url.path().toLatin1(), url.query().toLatin1(),
-                                    payload, accessKeyId, signingKey, dateTime, region, service);
+        = createAuthorizationHeader(headers, verb, url.path(QUrl::FullyEncoded).toLatin1(),
+                                    url.query(QUrl::FullyEncoded).toLatin1(), payload, accessKeyId,
+                                    signingKey, dateTime, region, service);
     // add authorization header to request
     request->setRawHeader("Authorization", authHeaderValue);
 }
@@ -348,8 +356,40 @@ void QtS3Private::signRequest(QNetworkRequest *request, const QByteArray &verb,
 // Stateful non-static functons below
 //
 
+// Initializes the object state. Kept cheap, since applications may create a
+// QtS3 object per credential: the credential providers are not called until
+// the first request, and the network thread is shared and started on first use.
 void QtS3Private::init()
 {
+    m_service = "s3";
+    m_threadPool.setMaxThreadCount(16);
+    m_slowDownRetries.store(3);
+
+    // The current design multiplexes requests from several QtS3 request threads
+    // to one QNetworkAccessManager on a network thread, which is shared by all
+    // QtS3 objects. Requests are admitted by a request scheduler which is also
+    // shared, and limits the requests in progress to the QNetworkAccessManager
+    // connection limit of 6 per host, for all objects together.
+    m_networkAccessManager = new ThreadsafeBlockingNetworkAccesManager();
+    m_transport.store(new QtS3QnamTransport(m_networkAccessManager));
+}
+
+// Replaces the transport. Requests in progress may still be using the
+// previous transport, and replies owned by it may still be in use, so it is
+// kept until this object is deleted. Called on the owner thread.
+void QtS3Private::setTransport(QtS3Transport *transport)
+{
+    QtS3Transport *previous = m_transport.fetchAndStoreOrdered(transport);
+    if (previous)
+        m_retiredTransports.append(previous);
+}
+
+// Warns if the credentials are missing, once, on the first request.
+void QtS3Private::checkCredentials()
+{
+    if (!m_credentialsChecked.testAndSetRelaxed(0, 1))
+        return;
+
     if (m_accessKeyIdProvider().isEmpty()) {
         qWarning() << "access key id not specified";
     }
@@ -357,82 +397,202 @@ void QtS3Private::init()
     if (m_secretAccessKeyProvider().isEmpty()) {
         qWarning() << "secret access key not set";
     }
-
-    m_service = "s3";
-
-    // The current design multiplexes requests from several QtS3 request threads
-    // to one QNetworkAccessManager on a network thread. This limits the number
-    // of concurrent network requests to the QNetworkAccessManager internal limit
-    // (rumored to be 6).
-    m_networkAccessManager = new ThreadsafeBlockingNetworkAccesManager();
 }
 
 void QtS3Private::checkGenerateS3SigningKey(const QByteArray &region)
 {
     QDateTime now = QDateTime::currentDateTimeUtc();
-    m_signingKeysLock.lockForWrite();
-    checkGenerateSigningKey(&m_signingKeys, now, m_secretAccessKeyProvider, region, m_service);
+    lockForWriteTimed(&m_signingKeysLock, QtS3MetricsRegistry::SigningKeysLock);
+    if (checkGenerateSigningKey(&m_signingKeys, now, m_secretAccessKeyProvider, region, m_service))
+        QtS3MetricsRegistry::instance()->addSigningKeyRotation();
     m_signingKeysLock.unlock();
     // std::tuple keyTimeCopy { currents3SigningKey, s3SigningKeyTimeStamp };
     // return keyTimeCopy;
 }
 
-QNetworkRequest *QtS3Private::createSignedRequest(const QByteArray &verb, const QUrl &url,
-                                                  const QHash<QByteArray, QByteArray> &headers,
-                                                  const QByteArray &host, const QByteArray &payload,
-                                                  const QByteArray &region)
+// Creates a request with the standard AWS headers, for sendRequest().
+QNetworkRequest QtS3Private::createRequest(const QUrl &url,
+                                           const QHash<QByteArray, QByteArray> &headers,
+                                           const QByteArray &host)
 {
-    checkGenerateS3SigningKey(region);
-    QDateTime requestTime = QDateTime::currentDateTimeUtc();
+    QNetworkRequest request;
+
+    // request.setAttribute(QNetworkRequest::SynchronousRequestAttribute, true);
+    // request.setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute, true);
 
-    // Create and sign request
-    QNetworkRequest *request = new QNetworkRequest();
+    setRequestAttributes(&request, url, headers, QDateTime::currentDateTimeUtc(), host);
+    return request;
+}
+
+// Signs request at the current time. Called by the transport once the request
+// has been admitted to the network: S3 rejects requests with signatures more
+// than 15 minutes old, and the date should reflect when the request was sent.
+void QtS3Private::signRequestNow(QNetworkRequest *request, const QByteArray &verb,
+                                 const QByteArray &payload, const QByteArray &region,
+                                 QtS3ReplyTiming *timing)
+{
+    checkCredentials();
 
-    // request->setAttribute(QNetworkRequest::SynchronousRequestAttribute, true);
-    // request->setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute, true);
+    QtS3TraceSpan span("sign");
+    QElapsedTimer timer;
+    timer.start();
+    checkGenerateS3SigningKey(region);
+    const qint64 signingKeyTime = timer.nsecsElapsed() / 1000;
+    QDateTime requestTime = QDateTime::currentDateTimeUtc();
 
-    setRequestAttributes(request, url, headers, requestTime, host);
-    m_signingKeysLock.lockForRead();
+    request->setRawHeader("X-Amz-Date", formatDateTime(requestTime));
+    lockForReadTimed(&m_signingKeysLock, QtS3MetricsRegistry::SigningKeysLock);
     QByteArray key = m_signingKeys.value(region).key;
     m_signingKeysLock.unlock();
     signRequest(request, verb, payload, m_accessKeyIdProvider(), key, requestTime, region, m_service);
-    return request;
+
+    if (timing) {
+        timing->signingKeyTime += signingKeyTime;
+        timing->signingTime += timer.nsecsElapsed() / 1000 - signingKeyTime;
+    }
 }
 
 QNetworkReply *QtS3Private::sendRequest(const QByteArray &verb, const QNetworkRequest &request,
-                                        const QByteArray &payload)
+                                        const QByteArray &payload, const QByteArray &region,
+                                        QtS3ReplyTiming *timing)
 {
-
-    QBuffer payloadBuffer(const_cast<QByteArray *>(&payload));
-    if (!payload.isEmpty())
-        payloadBuffer.open(QIODevice::ReadOnly);
-
-    // Send request
-    QNetworkReply *reply = m_networkAccessManager->sendCustomRequest(
-        request, verb, payload.isEmpty() ? nullptr : &payloadBuffer);
-
+    // Send request, at the priority set for this thread. The transport signs
+    // it after any queueing.
+    auto sign = [this, &verb, &payload, &region, timing](QNetworkRequest *request) {
+        signRequestNow(request, verb, payload, region, timing);
+    };
+    QNetworkReply *reply = m_transport.load()->sendRequest(request, verb, payload,
+                                                           QtS3PriorityScope::currentPriority(),
+                                                           sign);
+
+    if (reply) {
+        QtS3MetricsRegistry *metrics = QtS3MetricsRegistry::instance();
+        metrics->addRequest(verb,
+                            reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt());
+        metrics->addBytes(reply->property("qts3BytesSent").toLongLong(),
+                          reply->property("qts3BytesReceived").toLongLong());
+    }
     return reply;
 }
 
 QNetworkReply *QtS3Private::sendS3Request(const QByteArray &bucketName, const QByteArray &verb,
                                           const QString &path, const QByteArray &queryString,
-                                          const QByteArray &content, const QStringList &headers)
+                                          const QByteArray &content, const QStringList &headers,
+                                          QtS3ReplyTiming *timing)
 {
-    const QByteArray host = bucketName + ".s3.amazonaws.com";
-    const QByteArray url = "https://" + host + "/" + path.toLatin1() + "?" + queryString;
+    // Percent encode the key as SigV4 does for S3: UTF-8, with all bytes
+    // except unreserved characters and the '/' separators encoded. The
+    // request is signed with the same encoded path.
+    const QByteArray encodedPath = QUrl::toPercentEncoding(path, "/");
+
+    QByteArray host;
+    QByteArray url;
+    QByteArray region;
+    if (m_endpoint.isValid()) {
+        // S3 compatible servers: path-style requests
+        host = m_endpoint.host().toLatin1();
+        if (m_endpoint.port() != -1)
+            host += ":" + QByteArray::number(m_endpoint.port());
+        url = m_endpoint.scheme().toLatin1() + "://" + host + "/" + bucketName + "/"
+              + encodedPath + "?" + queryString;
+        region = m_endpointRegion;
+    } else {
+        host = bucketName + ".s3.amazonaws.com";
+        url = "https://" + host + "/" + encodedPath + "?" + queryString;
+        lockForReadTimed(&m_bucketRegionsLock, QtS3MetricsRegistry::BucketRegionsLock);
+        region = m_bucketRegions.value(bucketName);
+        m_bucketRegionsLock.unlock();
+    }
 
     QHash<QByteArray, QByteArray> hashHeaders = parseHeaderList(headers);
-    m_bucketRegionsLock.lockForRead();
-    QByteArray region = m_bucketRegions.value(bucketName);
-    m_bucketRegionsLock.unlock();
     if (region.isEmpty()) {
         // internal error
         qDebug() << "No region for" << bucketName;
     }
 
-    QNetworkRequest *request =
-        createSignedRequest(verb, QUrl(url), hashHeaders, host, content, region);
-    return sendRequest(verb, *request, content);
+    // Send the request within the concurrency limit for the bucket and prefix.
+    // Retry throttled (503) requests with exponential backoff and jitter; the
+    // transport signs the request for each attempt, after the waits.
+    QtS3TraceSpan span("request");
+    const QByteArray limitKey = QtS3ConcurrencyLimiter::limitKey(bucketName, path);
+    const QNetworkRequest request = createRequest(QUrl::fromEncoded(url), hashHeaders, host);
+    QElapsedTimer requestTimer;
+    requestTimer.start();
+    for (int attempt = 0;; ++attempt) {
+        qint64 limitWaitTime;
+        {
+            QtS3TraceSpan limitSpan("concurrency limit");
+            limitWaitTime = m_concurrencyLimiter.acquire(limitKey);
+        }
+        QElapsedTimer timer;
+        timer.start();
+        QNetworkReply *reply = sendRequest(verb, request, content, region, timing);
+        if (!reply) {
+            // memory budget exceeded
+            m_concurrencyLimiter.release(limitKey, -1, false);
+            return reply;
+        }
+        const qint64 queueWaitTime = reply->property("qts3QueueWaitTime").toLongLong();
+
+        // Sample the latency for small requests only, where it is not dominated by
+        // the transfer time.
+        const bool throttled =
+            reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 503;
+        const qint64 transferSize = content.size() + reply->bytesAvailable()
+                                    + reply->property("qts3Content").toByteArray().size();
+        const bool sampleLatency = transferSize < 64 * 1024;
+        m_concurrencyLimiter.release(limitKey, sampleLatency ? timer.elapsed() - queueWaitTime : -1,
+                                     throttled);
+        reply->setProperty("qts3QueueWaitTime", queueWaitTime + limitWaitTime);
+
+        if (!throttled || attempt >= m_slowDownRetries.load()) {
+            QtS3MetricsRegistry::instance()->addLatency(
+                operationName(verb, queryString), bucketName, requestTimer.nsecsElapsed() / 1000);
+            return reply;
+        }
+
+        // The throttled attempt counts towards the reply timing.
+        if (timing) {
+            addNetworkTiming(timing, reply);
+            ++timing->retryCount;
+        }
+        reply->deleteLater();
+        const int backoff = 50 << qMin(attempt, 6);
+        QThread::msleep(backoff + QRandomGenerator::global()->bounded(backoff));
+    }
+}
+
+// Returns the S3 API operation name for a request, for metrics.
+QByteArray QtS3Private::operationName(const QByteArray &verb, const QByteArray &queryString)
+{
+    const QList<QByteArray> queryItems = queryString.split('&');
+    auto hasQueryItem = [&queryItems](const QByteArray &name) {
+        for (const QByteArray &item : queryItems) {
+            if (item == name || item.startsWith(name + "="))
+                return true;
+        }
+        return false;
+    };
+
+    if (hasQueryItem("list-type"))
+        return "ListObjectsV2";
+    if (hasQueryItem("partNumber"))
+        return "UploadPart";
+    if (verb == "POST" && hasQueryItem("uploads"))
+        return "CreateMultipartUpload";
+    if (verb == "POST" && hasQueryItem("uploadId"))
+        return "CompleteMultipartUpload";
+    if (verb == "DELETE" && hasQueryItem("uploadId"))
+        return "AbortMultipartUpload";
+    if (verb == "GET")
+        return "GetObject";
+    if (verb == "PUT")
+        return "PutObject";
+    if (verb == "HEAD")
+        return "HeadObject";
+    if (verb == "DELETE")
+        return "DeleteObject";
+    return verb;
 }
 
 QHash<QByteArray, QByteArray> QtS3Private::getErrorComponents(const QByteArray &errorString)
@@ -470,9 +630,258 @@ QByteArray QtS3Private::getCanonicalRequest(const QByteArray &errorString)
     return getErrorComponents(errorString)["CanonicalRequest"];
 }
 
-void QtS3Private::preflight(const QByteArray &bucketName)
+// Creates a ListObjectsV2 query string. The values are percent encoded
+// here since prefixes and continuation tokens may contain query delimiters.
+QByteArray QtS3Private::formatListQuery(const QString &prefix, const QString &delimiter,
+                                        const QString &startAfter,
+                                        const QString &continuationToken)
 {
-    cacheBucketLocation(0, bucketName);
+    QByteArray query = "list-type=2";
+    if (!continuationToken.isEmpty())
+        query += "&continuation-token=" + QUrl::toPercentEncoding(continuationToken);
+    if (!delimiter.isEmpty())
+        query += "&delimiter=" + QUrl::toPercentEncoding(delimiter);
+    if (!prefix.isEmpty())
+        query += "&prefix=" + QUrl::toPercentEncoding(prefix);
+    if (!startAfter.isEmpty())
+        query += "&start-after=" + QUrl::toPercentEncoding(startAfter);
+    return query;
+}
+
+// Creates object metadata from HEAD (or GET) reply headers.
+QtS3ObjectMetadata
+QtS3Private::parseObjectMetadata(const QList<QNetworkReply::RawHeaderPair> &headers)
+{
+    QtS3ObjectMetadata metadata;
+    metadata.exists = true;
+
+    const QByteArray userMetadataPrefix = "x-amz-meta-";
+    foreach (const QNetworkReply::RawHeaderPair &header, headers) {
+        const QByteArray name = header.first.toLower();
+        if (name == "content-length") {
+            metadata.size = header.second.toLongLong();
+        } else if (name == "etag") {
+            metadata.etag = header.second;
+            if (metadata.etag.startsWith('"') && metadata.etag.endsWith('"'))
+                metadata.etag = metadata.etag.mid(1, metadata.etag.length() - 2);
+        } else if (name == "last-modified") {
+            // RFC 1123 date, for example "Wed, 12 Oct 2009 17:50:00 GMT"
+            metadata.lastModified =
+                QLocale::c().toDateTime(QString::fromLatin1(header.second),
+                                        QStringLiteral("ddd, dd MMM yyyy hh:mm:ss 'GMT'"));
+            metadata.lastModified.setTimeSpec(Qt::UTC);
+        } else if (name == "content-type") {
+            metadata.contentType = header.second;
+        } else if (name.startsWith(userMetadataPrefix)) {
+            metadata.userMetadata.insert(name.mid(userMetadataPrefix.length()), header.second);
+        }
+    }
+
+    return metadata;
+}
+
+// Parses a ListObjectsV2 reply (ListBucketResult).
+QtS3ListPage QtS3Private::parseListObjectsV2(const QByteArray &xml)
+{
+    QtS3TraceSpan span("parse");
+    QtS3ListPage page;
+    QtS3ObjectInfo object;
+    bool inContents = false;
+    bool inCommonPrefixes = false;
+
+    QXmlStreamReader reader(xml);
+    while (!reader.atEnd()) {
+        reader.readNext();
+
+        if (reader.isStartElement()) {
+            const QString name = reader.name().toString();
+            if (name == QLatin1String("Contents")) {
+                inContents = true;
+                object = QtS3ObjectInfo();
+            } else if (name == QLatin1String("CommonPrefixes")) {
+                inCommonPrefixes = true;
+            } else if (inContents) {
+                if (name == QLatin1String("Key")) {
+                    object.key = reader.readElementText();
+                } else if (name == QLatin1String("Size")) {
+                    object.size = reader.readElementText().toLongLong();
+                } else if (name == QLatin1String("ETag")) {
+                    object.etag = reader.readElementText().toLatin1();
+                    if (object.etag.startsWith('"') && object.etag.endsWith('"'))
+                        object.etag = object.etag.mid(1, object.etag.length() - 2);
+                } else if (name == QLatin1String("LastModified")) {
+                    object.lastModified =
+                        QDateTime::fromString(reader.readElementText(), Qt::ISODate);
+                }
+            } else if (inCommonPrefixes) {
+                if (name == QLatin1String("Prefix"))
+                    page.commonPrefixes.append(reader.readElementText());
+            } else if (name == QLatin1String("IsTruncated")) {
+                page.isTruncated = (reader.readElementText() == QLatin1String("true"));
+            } else if (name == QLatin1String("NextContinuationToken")) {
+                page.nextContinuationToken = reader.readElementText();
+            }
+        } else if (reader.isEndElement()) {
+            if (reader.name() == QLatin1String("Contents")) {
+                page.objects.append(object);
+                inContents = false;
+            } else if (reader.name() == QLatin1String("CommonPrefixes")) {
+                inCommonPrefixes = false;
+            }
+        }
+    }
+
+    if (reader.hasError()) {
+        qDebug() << "xml err";
+    }
+
+    return page;
+}
+
+// Splits the keys below \a prefix into \a rangeCount adjacent ranges. The split
+// points are the prefix plus one character, spread over the "generally safe"
+// key characters in sort order. Keys outside that set are still covered by
+// the first and last range.
+QList<QtS3Private::ListRange> QtS3Private::splitListRange(const QString &prefix, int rangeCount)
+{
+    static const QString splitCharacters = QStringLiteral(
+        "-./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz");
+    const int count = qBound(1, rangeCount, splitCharacters.count() + 1);
+
+    QList<ListRange> ranges;
+    ListRange range;
+    range.prefix = prefix;
+    for (int i = 1; i < count; ++i) {
+        range.last = prefix + splitCharacters.at(i * splitCharacters.count() / count);
+        ranges.append(range);
+        range.startAfter = range.last;
+    }
+    range.last = QString();
+    ranges.append(range);
+    return ranges;
+}
+
+// Runs task for each index in [0, taskCount) on up to concurrency threads,
+// and waits for all tasks to complete. The threads come from the shared
+// m_threadPool, which bounds the total concurrency of all batches.
+//
+// The calling thread runs tasks too ("caller runs"), and helpers which have
+// not started when the caller runs out of tasks are withdrawn from the pool.
+// Batches therefore complete even if the pool is busy, including batches
+// started from tasks on the pool.
+void QtS3Private::runConcurrently(int taskCount, int concurrency, std::function<void(int)> task)
+{
+    class Batch
+    {
+    public:
+        Batch(std::function<void(int)> task, int taskCount)
+            : task(task), taskCount(taskCount), priority(QtS3PriorityScope::currentPriority()),
+              finishedHelpers(0)
+        {
+        }
+
+        void runTasks()
+        {
+            for (int index = next.fetchAndAddRelaxed(1); index < taskCount;
+                 index = next.fetchAndAddRelaxed(1))
+                task(index);
+        }
+
+        std::function<void(int)> task;
+        const int taskCount;
+        const QtS3::Priority priority; // of the calling thread, applied to the helpers
+        QAtomicInt next;
+        QMutex mutex;
+        QWaitCondition helperFinished;
+        int finishedHelpers;
+    };
+
+    class Helper : public QRunnable
+    {
+    public:
+        Helper(Batch *batch) : m_batch(batch) { setAutoDelete(false); }
+        void run()
+        {
+            QtS3PriorityScope priority(m_batch->priority);
+            m_batch->runTasks();
+            QMutexLocker lock(&m_batch->mutex);
+            ++m_batch->finishedHelpers;
+            m_batch->helperFinished.wakeAll();
+        }
+
+        Batch *m_batch;
+    };
+
+    if (taskCount <= 0)
+        return;
+
+    Batch batch(task, taskCount);
+    QList<Helper *> helpers;
+    const int helperCount = qMin(qMax(1, concurrency), taskCount) - 1;
+    for (int i = 0; i < helperCount; ++i) {
+        helpers.append(new Helper(&batch));
+        m_threadPool.start(helpers.last());
+    }
+
+    batch.runTasks();
+
+    // Withdraw helpers which have not started, and wait for the rest.
+    int startedHelpers = 0;
+    for (Helper *helper : helpers) {
+        if (!m_threadPool.tryTake(helper))
+            ++startedHelpers;
+    }
+    {
+        QMutexLocker lock(&batch.mutex);
+        while (batch.finishedHelpers < startedHelpers)
+            batch.helperFinished.wait(&batch.mutex);
+    }
+    qDeleteAll(helpers);
+}
+
+// Prepares for requests to bucketNames: looks up the bucket regions, derives
+// the signing keys for the regions, resolves the endpoint host names, and
+// opens connectionsPerEndpoint connections to each endpoint.
+QtS3ReplyPrivate *QtS3Private::warmup(const QList<QByteArray> &bucketNames,
+                                      int connectionsPerEndpoint)
+{
+    QtS3ReplyPrivate *s3Reply = new QtS3ReplyPrivate;
+    QSet<QByteArray> regions;
+    QList<QUrl> endpoints;
+    for (const QByteArray &bucketName : bucketNames) {
+        if (!checkBucketName(s3Reply, bucketName) || !cacheBucketLocation(s3Reply, bucketName))
+            return s3Reply;
+
+        QUrl endpoint;
+        if (m_endpoint.isValid()) {
+            regions.insert(m_endpointRegion);
+            endpoint = m_endpoint.adjusted(QUrl::RemovePath | QUrl::RemoveQuery);
+        } else {
+            lockForReadTimed(&m_bucketRegionsLock, QtS3MetricsRegistry::BucketRegionsLock);
+            regions.insert(m_bucketRegions.value(bucketName));
+            m_bucketRegionsLock.unlock();
+            endpoint = QUrl(QString::fromLatin1("https://" + bucketName + ".s3.amazonaws.com"));
+        }
+        if (!endpoints.contains(endpoint))
+            endpoints.append(endpoint);
+    }
+
+    for (const QByteArray &region : regions)
+        checkGenerateS3SigningKey(region);
+
+    for (const QUrl &endpoint : endpoints) {
+        const QHostInfo hostInfo = QHostInfo::fromName(endpoint.host());
+        if (hostInfo.error() != QHostInfo::NoError) {
+            s3Reply->m_s3Error = QtS3ReplyBase::NetworkError;
+            s3Reply->m_s3ErrorString = hostInfo.errorString();
+            return s3Reply;
+        }
+        m_transport.load()->connectToHost(endpoint, connectionsPerEndpoint);
+    }
+
+    s3Reply->m_s3Error = QtS3ReplyBase::NoError;
+    s3Reply->m_s3ErrorString.clear();
+    return s3Reply;
 }
 
 bool QtS3Private::checkBucketName(QtS3ReplyPrivate *s3Reply, const QByteArray &bucketName)
@@ -509,16 +918,25 @@ bool QtS3Private::checkPath(QtS3ReplyPrivate *s3Reply, const QByteArray &path)
 // could be established.
 bool QtS3Private::cacheBucketLocation(QtS3ReplyPrivate *s3Reply, const QByteArray &bucketName)
 {
-    // Check if bucket region is cached.
-    m_bucketRegionsLock.lockForRead();
-    if (m_bucketRegions.contains(bucketName)) {
-        m_bucketRegionsLock.unlock();
+    // All buckets on a custom endpoint use the endpoint region.
+    if (m_endpoint.isValid())
         return true;
-    }
+
+    // Check if bucket region is cached.
+    lockForReadTimed(&m_bucketRegionsLock, QtS3MetricsRegistry::BucketRegionsLock);
+    const bool cached = m_bucketRegions.contains(bucketName);
     m_bucketRegionsLock.unlock();
+    QtS3MetricsRegistry::instance()->addRegionCacheLookup(cached);
+    if (cached)
+        return true;
 
     // Send location request.
+    QtS3TraceSpan span("region lookup");
+    QElapsedTimer timer;
+    timer.start();
     QtS3ReplyPrivate *locationReply = this->location_impl(bucketName);
+    if (s3Reply)
+        s3Reply->m_timing.regionLookupTime += timer.nsecsElapsed() / 1000;
     if (!locationReply->isSuccess()) {
         // propagate error, copy locationReply to s3Reply;
         if (s3Reply) {
@@ -533,7 +951,7 @@ bool QtS3Private::cacheBucketLocation(QtS3ReplyPrivate *s3Reply, const QByteArra
     delete locationReply;
 
     // Check (again) if bucket region is cached.
-    m_bucketRegionsLock.lockForRead();
+    lockForReadTimed(&m_bucketRegionsLock, QtS3MetricsRegistry::BucketRegionsLock);
     if (m_bucketRegions.contains(bucketName)) {
         m_bucketRegionsLock.unlock();
         return true;
@@ -541,7 +959,7 @@ bool QtS3Private::cacheBucketLocation(QtS3ReplyPrivate *s3Reply, const QByteArra
     m_bucketRegionsLock.unlock();
 
     // Update cache with bucket locaton
-    m_bucketRegionsLock.lockForWrite();
+    lockForWriteTimed(&m_bucketRegionsLock, QtS3MetricsRegistry::BucketRegionsLock);
     if (!m_bucketRegions.contains(bucketName))
         m_bucketRegions.insert(bucketName, contents);
     m_bucketRegionsLock.unlock();
@@ -549,9 +967,36 @@ bool QtS3Private::cacheBucketLocation(QtS3ReplyPrivate *s3Reply, const QByteArra
     return true;
 }
 
+// Returns the reply content. Replies for shaped downloads have been read by
+// the network access manager, so use this instead of QNetworkReply::readAll().
+QByteArray QtS3Private::readAll(QNetworkReply *networkReply)
+{
+    return ThreadsafeBlockingNetworkAccesManager::readAll(networkReply);
+}
+
+// Adds the timings and sizes recorded by the transport for networkReply to
+// timing.
+void QtS3Private::addNetworkTiming(QtS3ReplyTiming *timing, QNetworkReply *networkReply)
+{
+    timing->queueWaitTime += networkReply->property("qts3QueueWaitTime").toLongLong() * 1000;
+    timing->timeToFirstByte += networkReply->property("qts3TimeToFirstByte").toLongLong();
+    timing->transferTime += networkReply->property("qts3TransferTime").toLongLong();
+    timing->bytesSent += networkReply->property("qts3BytesSent").toLongLong();
+    timing->bytesReceived += networkReply->property("qts3BytesReceived").toLongLong();
+}
+
 void QtS3Private::processNetworkReplyState(QtS3ReplyPrivate *s3Reply, QNetworkReply *networkReply)
 {
+    QtS3TraceSpan span("parse");
     s3Reply->m_networkReply = networkReply;
+    if (!networkReply) {
+        s3Reply->m_s3Error = QtS3ReplyBase::MemoryBudgetExceededError;
+        s3Reply->m_s3ErrorString = QStringLiteral("Memory budget exceeded");
+        return;
+    }
+
+    // Add the network timings recorded by the network access manager
+    addNetworkTiming(&s3Reply->m_timing, networkReply);
 
     // No error
     if (networkReply->error() == QNetworkReply::NoError) {
@@ -567,7 +1012,7 @@ void QtS3Private::processNetworkReplyState(QtS3ReplyPrivate *s3Reply, QNetworkRe
 
     // Read the reply content, which will typically contain an XML structure
     // describing the error
-    s3Reply->m_byteArrayData = networkReply->readAll();
+    s3Reply->m_byteArrayData = readAll(networkReply);
     if (s3Reply->m_byteArrayData.isEmpty())
         return;
 
@@ -580,6 +1025,8 @@ void QtS3Private::processNetworkReplyState(QtS3ReplyPrivate *s3Reply, QNetworkRe
             s3Reply->m_s3Error = QtS3ReplyBase::BucketNotFoundError;
         } else if (code == "NoSuchKey") {
             s3Reply->m_s3Error = QtS3ReplyBase::ObjectNotFoundError;
+        } else if (code == "SlowDown") {
+            s3Reply->m_s3Error = QtS3ReplyBase::SlowDownError;
         } else {
             s3Reply->m_s3Error = QtS3ReplyBase::GenereicS3Error;
             s3Reply->m_s3ErrorString = code + ": ";
@@ -597,19 +1044,31 @@ QtS3ReplyPrivate *QtS3Private::location_impl(const QByteArray &bucketName)
     if (!checkBucketName(s3Reply, bucketName))
         return s3Reply;
 
+    if (m_endpoint.isValid()) {
+        s3Reply->m_s3Error = QtS3ReplyBase::NoError;
+        s3Reply->m_s3ErrorString.clear();
+        s3Reply->m_byteArrayData = m_endpointRegion;
+        return s3Reply;
+    }
+
     // Special url for discovering the bucket region:
     // https://s3.amazonaws.com/bucket-name?location
     const QByteArray host = "s3.amazonaws.com";
     const QByteArray url = "https://" + host + "/" + bucketName + "?location";
-    QNetworkRequest *request = createSignedRequest(
-        "GET", QUrl(url), QHash<QByteArray, QByteArray>(), host, QByteArray(), "us-east-1");
-    QNetworkReply *networkReply = sendRequest("GET", *request, QByteArray());
+    QElapsedTimer timer;
+    timer.start();
+    const QNetworkRequest request = createRequest(QUrl(url), QHash<QByteArray, QByteArray>(), host);
+    QNetworkReply *networkReply = sendRequest("GET", request, QByteArray(), "us-east-1");
+    if (networkReply) {
+        QtS3MetricsRegistry::instance()->addLatency("GetBucketLocation", bucketName,
+                                                    timer.nsecsElapsed() / 1000);
+    }
 
     processNetworkReplyState(s3Reply, networkReply);
 
     // Extract the location fromt he response xml on success.
     if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
-        s3Reply->m_byteArrayData = networkReply->readAll();
+        s3Reply->m_byteArrayData = readAll(networkReply);
 
         QHash<QByteArray, QByteArray> components = getErrorComponents(s3Reply->bytearrayValue());
         QByteArray location = components.value("LocationConstraint");
@@ -638,13 +1097,83 @@ QtS3ReplyPrivate *QtS3Private::processS3Request(const QByteArray &verb,
     if (!cacheBucketLocation(s3Reply, bucketName))
         return s3Reply;
 
-    QNetworkReply *networkReply = sendS3Request(bucketName, verb, path, query, content, headers);
+    QNetworkReply *networkReply =
+        sendS3Request(bucketName, verb, path, query, content, headers, &s3Reply->m_timing);
 
     processNetworkReplyState(s3Reply, networkReply);
 
     return s3Reply;
 }
 
+// Plans existence checks for keys. Keys are grouped by "directory" (up to
+// the last '/'), and groups with at least minListKeys keys are checked with a
+// listing from the longest common prefix to the last key. The indexes of
+// the keys in sparse groups, which are checked with HEAD requests, are
+// returned in headKeyIndexes.
+QList<QtS3Private::ExistsGroup> QtS3Private::planExistsMany(const QStringList &keys,
+                                                            int minListKeys,
+                                                            QList<int> *headKeyIndexes)
+{
+    QMap<QString, QList<int>> directories; // directory -> key indexes
+    for (int i = 0; i < keys.count(); ++i) {
+        const QString &key = keys.at(i);
+        directories[key.left(key.lastIndexOf(QLatin1Char('/')) + 1)].append(i);
+    }
+
+    QList<ExistsGroup> groups;
+    for (auto it = directories.constBegin(); it != directories.constEnd(); ++it) {
+        const QList<int> &indexes = it.value();
+        if (indexes.count() < minListKeys) {
+            headKeyIndexes->append(indexes);
+            continue;
+        }
+
+        QString prefix = keys.at(indexes.first());
+        QByteArray last;
+        for (int index : indexes) {
+            const QString &key = keys.at(index);
+            int common = 0;
+            while (common < prefix.length() && common < key.length()
+                   && prefix.at(common) == key.at(common))
+                ++common;
+            prefix.truncate(common);
+            last = qMax(last, key.toUtf8()); // S3 key order
+        }
+
+        ExistsGroup group;
+        group.range.prefix = prefix;
+        group.range.last = QString::fromUtf8(last);
+        group.keyIndexes = indexes;
+        groups.append(group);
+    }
+    return groups;
+}
+
+// Parses the UploadId from an InitiateMultipartUploadResult.
+QByteArray QtS3Private::parseUploadId(const QByteArray &xml)
+{
+    return getErrorComponents(xml).value("UploadId");
+}
+
+// Creates the CompleteMultipartUpload request body for parts 1..N.
+QByteArray QtS3Private::formatCompleteMultipartUpload(const QList<QByteArray> &partETags)
+{
+    QByteArray xml = "<CompleteMultipartUpload>";
+    for (int i = 0; i < partETags.count(); ++i) {
+        xml += "<Part><PartNumber>" + QByteArray::number(i + 1) + "</PartNumber><ETag>"
+               + partETags.at(i) + "</ETag></Part>";
+    }
+    xml += "</CompleteMultipartUpload>";
+    return xml;
+}
+
+void QtS3Private::setEndpoint(const QUrl &endpoint, const QByteArray &region)
+{
+    m_endpoint = endpoint;
+    m_endpointRegion = region;
+    clearCaches();
+}
+
 QtS3ReplyPrivate *QtS3Private::location(const QByteArray &bucketName)
 {
     // qCDebug(qts3) << "location" << bucketName;
@@ -656,63 +1185,263 @@ QtS3ReplyPrivate *QtS3Private::put(const QByteArray &bucketName, const QString &
 {
     // qCDebug(qts3) << "put" << bucketName << path << content.count();
 
-    return processS3Request("PUT", bucketName, path.toUtf8(), QByteArray(), content, headers);
+    QtS3ReplyPrivate *s3Reply =
+        processS3Request("PUT", bucketName, path.toUtf8(), QByteArray(), content, headers);
+    invalidateCachedObject(bucketName, path);
+    return s3Reply;
 }
 
-QtS3ReplyPrivate *QtS3Private::exists(const QByteArray &bucketName, const QString &path)
+// Runs request, and records it while recording is active. size is the
+// content size, or -1 to use the reply content or object size.
+QtS3ReplyPrivate *QtS3Private::record(QtS3RequestRecord::Operation operation,
+                                      const QByteArray &bucketName, const QString &key,
+                                      qint64 size, std::function<QtS3ReplyPrivate *()> request)
 {
-    // qCDebug(qts3) << "exists" << bucketName << path;
+    if (!m_recorder.isRecording())
+        return request();
+
+    QtS3RequestRecord requestRecord;
+    requestRecord.operation = operation;
+    requestRecord.bucket = bucketName;
+    requestRecord.key = key.toUtf8();
+    requestRecord.startTime = m_recorder.elapsed();
+    QtS3ReplyPrivate *s3Reply = request();
+    requestRecord.latency = m_recorder.elapsed() - requestRecord.startTime;
+    requestRecord.size =
+        size >= 0 ? size
+                  : qMax(qint64(s3Reply->m_byteArrayData.size()), s3Reply->m_metadata.size);
+    requestRecord.s3Error = s3Reply->m_s3Error;
+    m_recorder.add(requestRecord);
+    return s3Reply;
+}
 
-    QtS3ReplyPrivate *s3Reply = processS3Request("HEAD", bucketName, path.toUtf8(), QByteArray(),
-                                                 QByteArray(), QStringList());
+// Runs request, or waits for an identical in-flight request and returns a
+// copy of its reply. The reply data is implicitly shared between the copies.
+QtS3ReplyPrivate *QtS3Private::coalesce(const QByteArray &verb, const QByteArray &bucketName,
+                                        const QString &path,
+                                        std::function<QtS3ReplyPrivate *()> request)
+{
+    const QByteArray key = verb + " " + QtS3ObjectCache::cacheKey(bucketName, path);
+
+    QtS3TimedMutexLocker lock(&m_inFlightRequestsMutex, QtS3MetricsRegistry::InFlightRequestsLock);
+    QSharedPointer<InFlightRequest> inFlight = m_inFlightRequests.value(key);
+    if (inFlight) {
+        while (!inFlight->finished)
+            m_inFlightRequestFinished.wait(&m_inFlightRequestsMutex);
+        return new QtS3ReplyPrivate(inFlight->reply);
+    }
+    inFlight.reset(new InFlightRequest);
+    m_inFlightRequests.insert(key, inFlight);
+    lock.unlock();
+
+    QtS3ReplyPrivate *s3Reply = request();
+
+    lock.relock();
+    inFlight->reply = *s3Reply;
+    inFlight->finished = true;
+    // Writes detach in-flight requests, see invalidateCachedObject()
+    if (m_inFlightRequests.value(key) == inFlight)
+        m_inFlightRequests.remove(key);
+    m_inFlightRequestFinished.wakeAll();
+    return s3Reply;
+}
+
+QtS3ReplyPrivate *QtS3Private::headObject(const QByteArray &bucketName, const QString &path)
+{
+    // qCDebug(qts3) << "headObject" << bucketName << path;
+
+    return coalesce("HEAD", bucketName, path,
+                    [this, &bucketName, &path]() { return headObject_impl(bucketName, path); });
+}
+
+QtS3ReplyPrivate *QtS3Private::headObject_impl(const QByteArray &bucketName, const QString &path)
+{
+    QtS3ReplyPrivate *s3Reply = new QtS3ReplyPrivate;
 
-    // The HEAD request above does not close properly - AWS closes it on
-    // timeout and we get a RemoteHostClosedError. If we get any headers
-    // then consider the request a success and proceed.
-    if (s3Reply->headerValue("x-amz-request-id").isEmpty()) {
+    if (!checkBucketName(s3Reply, bucketName))
+        return s3Reply;
+    if (!checkPath(s3Reply, path.toUtf8()))
+        return s3Reply;
+    if (!cacheBucketLocation(s3Reply, bucketName))
         return s3Reply;
-    }
 
-    s3Reply->m_s3Error = QtS3ReplyBase::NoError;
-    s3Reply->m_s3ErrorString.clear();
+    QNetworkReply *networkReply =
+        sendS3Request(bucketName, "HEAD", path, QByteArray(), QByteArray(), QStringList(),
+                      &s3Reply->m_timing);
+    processNetworkReplyState(s3Reply, networkReply);
+    if (!networkReply)
+        return s3Reply;
 
-    // Use the presence of "Content-Length" to detect existence.
-    bool ok;
-    s3Reply->headerValue("Content-Length").toInt(&ok);
-    s3Reply->m_intAndBoolData = ok;
-    s3Reply->m_intAndBoolDataValid = true;
+    // HEAD replies have no body with error details, use the HTTP status.
+    const int status = networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (status == 200) {
+        s3Reply->m_s3Error = QtS3ReplyBase::NoError;
+        s3Reply->m_s3ErrorString.clear();
+        s3Reply->m_metadata = parseObjectMetadata(networkReply->rawHeaderPairs());
+    } else if (status == 404) {
+        s3Reply->m_s3Error = QtS3ReplyBase::ObjectNotFoundError;
+        s3Reply->m_s3ErrorString = QStringLiteral("Object Not Found");
+    }
 
     return s3Reply;
 }
 
-QtS3ReplyPrivate *QtS3Private::size(const QByteArray &bucketName, const QString &path)
+QtS3ReplyPrivate *QtS3Private::exists(const QByteArray &bucketName, const QString &path)
 {
-    // qCDebug(qts3) << "size" << bucketName << path;
-
-    QtS3ReplyPrivate *s3Reply = processS3Request("HEAD", bucketName, path.toUtf8(), QByteArray(),
-                                                 QByteArray(), QStringList());
-    // The HEAD request above does not close properly - AWS closes it on
-    // timeout and we get a RemoteHostClosedError. If we get any headers
-    // then consider the request a success and proceed.
-    if (s3Reply->headerValue("x-amz-request-id").isEmpty()) {
+    const QByteArray key = QtS3ObjectCache::cacheKey(bucketName, path);
+    if (m_existenceCache.isKnownMissing(key)) {
+        QtS3ReplyPrivate *s3Reply = new QtS3ReplyPrivate(QtS3ReplyBase::NoError, QString());
+        s3Reply->m_intAndBoolData = false;
+        s3Reply->m_intAndBoolDataValid = true;
         return s3Reply;
     }
 
-    // Use the presence of "Content-Length" to detect existence.
-    if (s3Reply->headerValue("Content-Length").isEmpty()) {
-        s3Reply->m_s3Error = QtS3ReplyBase::ObjectNotFoundError;
-        s3Reply->m_s3ErrorString = QStringLiteral("Object Not Found");
+    QtS3ReplyPrivate *s3Reply = headObject(bucketName, path);
+
+    // A missing object is a successful "does not exist" result.
+    if (s3Reply->m_s3Error == QtS3ReplyBase::ObjectNotFoundError) {
+        s3Reply->m_s3Error = QtS3ReplyBase::NoError;
+        s3Reply->m_s3ErrorString.clear();
+        m_existenceCache.insertMissing(key);
+    }
+
+    if (s3Reply->isSuccess()) {
+        s3Reply->m_intAndBoolData = s3Reply->m_metadata.exists;
+        s3Reply->m_intAndBoolDataValid = true;
+    }
+    return s3Reply;
+}
+
+// Checks if keys exist, choosing between listings and HEAD requests. Dense
+// groups of keys are listed with a page budget of half the group key count,
+// which keeps listing cheaper than HEAD requests. If the budget runs out,
+// or listing fails (for example if ListBucket is not permitted), the rest of
+// the group is checked with HEAD requests.
+QtS3ReplyPrivate *QtS3Private::existsMany(const QByteArray &bucketName, const QStringList &keys,
+                                          int concurrency)
+{
+    QtS3ReplyPrivate *s3Reply = new QtS3ReplyPrivate;
+
+    if (!checkBucketName(s3Reply, bucketName))
         return s3Reply;
+    if (!cacheBucketLocation(s3Reply, bucketName))
+        return s3Reply;
+
+    // Check each distinct key once, and answer known missing keys locally.
+    QStringList uniqueKeys;
+    QHash<QString, int> uniqueIndexes;
+    QStringList checkKeys;
+    QList<int> checkIndexes; // check key index -> unique key index
+    for (const QString &key : keys) {
+        if (uniqueIndexes.contains(key))
+            continue;
+        uniqueIndexes.insert(key, uniqueKeys.count());
+        if (!m_existenceCache.isKnownMissing(QtS3ObjectCache::cacheKey(bucketName, key))) {
+            checkIndexes.append(uniqueKeys.count());
+            checkKeys.append(key);
+        }
+        uniqueKeys.append(key);
+    }
+    QVector<bool> found(checkKeys.count(), false);
+
+    QList<int> headIndexes;
+    const QList<ExistsGroup> groups = planExistsMany(checkKeys, 4, &headIndexes);
+
+    QMutex mutex;
+    runConcurrently(groups.count(), concurrency, [&](int groupIndex) {
+        const ExistsGroup &group = groups.at(groupIndex);
+        const int pageBudget = qMax(1, group.keyIndexes.count() / 2);
+        QSet<QString> listedKeys;
+        QByteArray lastListedKey;
+        int pageCount = 0;
+        bool stopped = false;
+
+        QtS3ReplyPrivate *listReply =
+            listRange(bucketName, group.range, [&](const QList<QtS3ObjectInfo> &objects) {
+                for (const QtS3ObjectInfo &object : objects)
+                    listedKeys.insert(object.key);
+                lastListedKey = objects.last().key.toUtf8();
+                stopped = (++pageCount >= pageBudget);
+                return !stopped;
+            });
+        const bool listed = listReply->isSuccess();
+        delete listReply;
+
+        QMutexLocker lock(&mutex);
+        for (int index : group.keyIndexes) {
+            const QString &key = checkKeys.at(index);
+            if (!listed || (stopped && key.toUtf8() > lastListedKey)) {
+                headIndexes.append(index);
+            } else if (listedKeys.contains(key)) {
+                found[index] = true;
+            } else {
+                m_existenceCache.insertMissing(QtS3ObjectCache::cacheKey(bucketName, key));
+            }
+        }
+    });
+
+    QtS3ReplyPrivate *errorReply = 0;
+    runConcurrently(headIndexes.count(), concurrency, [&](int i) {
+        {
+            QMutexLocker lock(&mutex);
+            if (errorReply)
+                return;
+        }
+        const int index = headIndexes.at(i);
+        QtS3ReplyPrivate *existsReply = exists(bucketName, checkKeys.at(index));
+
+        QMutexLocker lock(&mutex);
+        if (existsReply->isSuccess()) {
+            found[index] = existsReply->boolValue();
+            delete existsReply;
+        } else if (!errorReply) {
+            errorReply = existsReply;
+        } else {
+            delete existsReply;
+        }
+    });
+    if (errorReply) {
+        delete s3Reply;
+        return errorReply;
     }
 
+    QVector<bool> uniqueFound(uniqueKeys.count(), false);
+    for (int i = 0; i < checkIndexes.count(); ++i)
+        uniqueFound[checkIndexes.at(i)] = found.at(i);
+    for (const QString &key : keys)
+        s3Reply->m_boolListData.append(uniqueFound.at(uniqueIndexes.value(key)));
     s3Reply->m_s3Error = QtS3ReplyBase::NoError;
     s3Reply->m_s3ErrorString.clear();
+    return s3Reply;
+}
+
+// Lists the prefix and builds a Bloom filter of the keys, which exists()
+// uses to answer definite misses without a request.
+QtS3ReplyPrivate *QtS3Private::loadExistenceFilter(const QByteArray &bucketName,
+                                                   const QString &prefix, double falsePositiveRate)
+{
+    QtS3ReplyPrivate *s3Reply = listParallel(bucketName, prefix, 8);
+    if (!s3Reply->isSuccess())
+        return s3Reply;
+
+    const QList<QtS3ObjectInfo> objects = s3Reply->m_listPage.objects;
+    QtS3BloomFilter filter(objects.count(), falsePositiveRate);
+    for (const QtS3ObjectInfo &object : objects)
+        filter.insert(QtS3ObjectCache::cacheKey(bucketName, object.key));
+    m_existenceCache.setFilter(QtS3ObjectCache::cacheKey(bucketName, prefix), filter);
+
+    s3Reply->m_listPage = QtS3ListPage();
+    return s3Reply;
+}
 
-    bool ok;
-    int size = s3Reply->headerValue("Content-Length").toInt(&ok);
-    s3Reply->m_intAndBoolData = size;
-    s3Reply->m_intAndBoolDataValid = true;
+QtS3ReplyPrivate *QtS3Private::size(const QByteArray &bucketName, const QString &path)
+{
+    QtS3ReplyPrivate *s3Reply = headObject(bucketName, path);
 
+    if (s3Reply->isSuccess()) {
+        s3Reply->m_intAndBoolData = s3Reply->m_metadata.size;
+        s3Reply->m_intAndBoolDataValid = true;
+    }
     return s3Reply;
 }
 
@@ -720,12 +1449,66 @@ QtS3ReplyPrivate *QtS3Private::get(const QByteArray &bucketName, const QString &
 {
     // qCDebug(qts3) << "get" << bucketName << path;
 
-    QtS3ReplyPrivate *s3Reply = processS3Request("GET", bucketName, path.toUtf8(), QByteArray(),
-                                                 QByteArray(), QStringList());
+    return coalesce("GET", bucketName, path,
+                    [this, &bucketName, &path]() { return get_impl(bucketName, path); });
+}
 
-    // Read content
-    if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
-        s3Reply->m_byteArrayData = s3Reply->m_networkReply->readAll();
+QtS3ReplyPrivate *QtS3Private::get_impl(const QByteArray &bucketName, const QString &path)
+{
+    const bool cacheEnabled = m_objectCache.isEnabled() || m_diskCache.isEnabled();
+    if (!cacheEnabled || !m_objectCache.policy(bucketName, path).enabled) {
+        QtS3ReplyPrivate *s3Reply = processS3Request("GET", bucketName, path.toUtf8(),
+                                                     QByteArray(), QByteArray(), QStringList());
+
+        // Read content
+        if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
+            s3Reply->m_byteArrayData = readAll(s3Reply->m_networkReply);
+        }
+        return s3Reply;
+    }
+
+    // Serve fresh objects from the cache, revalidate stale objects. The
+    // disk cache is checked on memory cache misses.
+    const QByteArray key = QtS3ObjectCache::cacheKey(bucketName, path);
+    QByteArray content;
+    QByteArray etag;
+    qint64 age;
+    QStringList headers;
+    bool cached = m_objectCache.lookup(key, &content, &etag, &age);
+    if (!cached && m_diskCache.lookup(key, &content, &etag, &age)) {
+        m_objectCache.insert(key, content, etag, age);
+        cached = true;
+    }
+    if (cached) {
+        if (age < m_objectCache.policy(bucketName, path).maxAge) {
+            QtS3ReplyPrivate *s3Reply = new QtS3ReplyPrivate(QtS3ReplyBase::NoError, QString());
+            s3Reply->m_byteArrayData = content;
+            return s3Reply;
+        }
+        if (!etag.isEmpty())
+            headers.append(QStringLiteral("If-None-Match:") + QString::fromLatin1(etag));
+    }
+
+    QtS3ReplyPrivate *s3Reply =
+        processS3Request("GET", bucketName, path.toUtf8(), QByteArray(), QByteArray(), headers);
+    const int status = s3Reply->m_networkReply
+        ? s3Reply->m_networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()
+        : 0;
+    if (status == 304 && !headers.isEmpty()) {
+        // Not Modified: the cached content is current.
+        s3Reply->m_s3Error = QtS3ReplyBase::NoError;
+        s3Reply->m_s3ErrorString.clear();
+        s3Reply->m_byteArrayData = content;
+        m_objectCache.revalidated(key);
+        m_diskCache.revalidated(key);
+    } else if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
+        s3Reply->m_byteArrayData = readAll(s3Reply->m_networkReply);
+        const QByteArray replyETag = s3Reply->headerValue("ETag");
+        m_objectCache.insert(key, s3Reply->m_byteArrayData, replyETag);
+        m_diskCache.insert(key, s3Reply->m_byteArrayData, replyETag);
+    } else if (s3Reply->m_s3Error == QtS3ReplyBase::ObjectNotFoundError) {
+        m_objectCache.remove(key);
+        m_diskCache.remove(key);
     }
     return s3Reply;
 }
@@ -734,23 +1517,371 @@ QtS3ReplyPrivate *QtS3Private::remove(const QByteArray &bucketName, const QStrin
 {
     QtS3ReplyPrivate *s3Reply = processS3Request("DELETE", bucketName, path.toUtf8(), QByteArray(),
                                                  QByteArray(), QStringList());
+    invalidateCachedObject(bucketName, path);
 
     // Read content
     if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
-        s3Reply->m_byteArrayData = s3Reply->m_networkReply->readAll();
+        s3Reply->m_byteArrayData = readAll(s3Reply->m_networkReply);
+    }
+    return s3Reply;
+}
+
+// Gets paths on the shared thread pool. callback is called with the path
+// index and reply as each request completes, one call at a time, and takes
+// ownership of the reply.
+void QtS3Private::getMany(const QByteArray &bucketName, const QStringList &paths,
+                          std::function<void(int, QtS3ReplyPrivate *)> callback)
+{
+    QMutex mutex;
+    runConcurrently(paths.count(), m_threadPool.maxThreadCount(), [&](int index) {
+        const QString &path = paths.at(index);
+        QtS3ReplyPrivate *s3Reply = record(QtS3RequestRecord::Get, bucketName, path, -1,
+                                           [&]() { return get(bucketName, path); });
+        QMutexLocker lock(&mutex);
+        callback(index, s3Reply);
+    });
+}
+
+// Puts objects on the shared thread pool, see getMany().
+void QtS3Private::putMany(const QByteArray &bucketName,
+                          const QList<QPair<QString, QByteArray>> &objects,
+                          const QStringList &headers,
+                          std::function<void(int, QtS3ReplyPrivate *)> callback)
+{
+    QMutex mutex;
+    runConcurrently(objects.count(), m_threadPool.maxThreadCount(), [&](int index) {
+        const QPair<QString, QByteArray> &object = objects.at(index);
+        QtS3ReplyPrivate *s3Reply =
+            record(QtS3RequestRecord::Put, bucketName, object.first, object.second.size(),
+                   [&]() { return put(bucketName, object.first, object.second, headers); });
+        QMutexLocker lock(&mutex);
+        callback(index, s3Reply);
+    });
+}
+
+QtS3ReplyPrivate *QtS3Private::getRange(const QByteArray &bucketName, const QString &path,
+                                        qint64 offset, qint64 length)
+{
+    const QString range = QStringLiteral("Range:bytes=%1-%2").arg(offset).arg(offset + length - 1);
+    QtS3ReplyPrivate *s3Reply = processS3Request("GET", bucketName, path.toUtf8(), QByteArray(),
+                                                 QByteArray(), QStringList() << range);
+
+    // Read content
+    if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
+        s3Reply->m_byteArrayData = readAll(s3Reply->m_networkReply);
+    }
+    return s3Reply;
+}
+
+QtS3ReplyPrivate *QtS3Private::createMultipartUpload(const QByteArray &bucketName,
+                                                     const QString &path,
+                                                     const QStringList &headers)
+{
+    QtS3ReplyPrivate *s3Reply =
+        processS3Request("POST", bucketName, path.toUtf8(), "uploads", QByteArray(), headers);
+
+    // Replace the reply XML with the upload id
+    if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
+        s3Reply->m_byteArrayData = parseUploadId(readAll(s3Reply->m_networkReply));
+    }
+    return s3Reply;
+}
+
+QtS3ReplyPrivate *QtS3Private::uploadPart(const QByteArray &bucketName, const QString &path,
+                                          const QByteArray &uploadId, int partNumber,
+                                          const QByteArray &content)
+{
+    const QByteArray query = "partNumber=" + QByteArray::number(partNumber) + "&uploadId="
+                             + QUrl::toPercentEncoding(QString::fromLatin1(uploadId));
+    QtS3ReplyPrivate *s3Reply =
+        processS3Request("PUT", bucketName, path.toUtf8(), query, content, QStringList());
+
+    // The part ETag is needed to complete the upload
+    if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
+        s3Reply->m_byteArrayData = s3Reply->headerValue("ETag");
+    }
+    return s3Reply;
+}
+
+QtS3ReplyPrivate *QtS3Private::completeMultipartUpload(const QByteArray &bucketName,
+                                                       const QString &path,
+                                                       const QByteArray &uploadId,
+                                                       const QList<QByteArray> &partETags)
+{
+    const QByteArray query = "uploadId=" + QUrl::toPercentEncoding(QString::fromLatin1(uploadId));
+    QtS3ReplyPrivate *s3Reply =
+        processS3Request("POST", bucketName, path.toUtf8(), query,
+                         formatCompleteMultipartUpload(partETags), QStringList());
+    invalidateCachedObject(bucketName, path);
+    if (s3Reply->m_s3Error != QtS3ReplyBase::NoError)
+        return s3Reply;
+
+    // CompleteMultipartUpload may fail after sending the 200 OK status, in
+    // which case the reply body contains an error.
+    s3Reply->m_byteArrayData = readAll(s3Reply->m_networkReply);
+    QHash<QByteArray, QByteArray> components = getErrorComponents(s3Reply->m_byteArrayData);
+    if (components.contains("Error")) {
+        s3Reply->m_s3Error = QtS3ReplyBase::GenereicS3Error;
+        s3Reply->m_s3ErrorString = components.value("Code") + ": " + components.value("Message");
+    }
+    return s3Reply;
+}
+
+QtS3ReplyPrivate *QtS3Private::abortMultipartUpload(const QByteArray &bucketName,
+                                                    const QString &path,
+                                                    const QByteArray &uploadId)
+{
+    const QByteArray query = "uploadId=" + QUrl::toPercentEncoding(QString::fromLatin1(uploadId));
+    return processS3Request("DELETE", bucketName, path.toUtf8(), query, QByteArray(),
+                            QStringList());
+}
+
+QtS3ReplyPrivate *QtS3Private::listPage(const QByteArray &bucketName, const QString &prefix,
+                                        const QString &delimiter, const QString &startAfter,
+                                        const QString &continuationToken)
+{
+    QtS3ReplyPrivate *s3Reply = new QtS3ReplyPrivate;
+
+    if (!checkBucketName(s3Reply, bucketName))
+        return s3Reply;
+    if (!cacheBucketLocation(s3Reply, bucketName))
+        return s3Reply;
+
+    // List requests are made on the bucket itself, with an empty object path.
+    const QByteArray query = formatListQuery(prefix, delimiter, startAfter, continuationToken);
+    QNetworkReply *networkReply =
+        sendS3Request(bucketName, "GET", QString(), query, QByteArray(), QStringList(),
+                      &s3Reply->m_timing);
+
+    processNetworkReplyState(s3Reply, networkReply);
+
+    if (s3Reply->m_s3Error == QtS3ReplyBase::NoError) {
+        s3Reply->m_byteArrayData = readAll(networkReply);
+        s3Reply->m_listPage = parseListObjectsV2(s3Reply->m_byteArrayData);
+    }
+
+    return s3Reply;
+}
+
+// Lists the objects in \a range page by page and calls \a callback for each
+// page. Stops when the listing passes the end of the range or when the
+// callback returns false.
+QtS3ReplyPrivate *QtS3Private::listRange(const QByteArray &bucketName, const ListRange &range,
+                                         std::function<bool(const QList<QtS3ObjectInfo> &)> callback)
+{
+    // Compare keys as UTF-8, which is the S3 listing order.
+    const QByteArray last = range.last.toUtf8();
+    QString continuationToken;
+
+    forever {
+        QtS3ReplyPrivate *s3Reply =
+            listPage(bucketName, range.prefix, QString(), range.startAfter, continuationToken);
+        if (!s3Reply->isSuccess())
+            return s3Reply;
+
+        QList<QtS3ObjectInfo> objects = s3Reply->m_listPage.objects;
+        bool done = !s3Reply->m_listPage.isTruncated;
+        if (!last.isEmpty()) {
+            while (!objects.isEmpty() && objects.last().key.toUtf8() > last) {
+                objects.removeLast();
+                done = true;
+            }
+        }
+
+        if (!objects.isEmpty() && !callback(objects))
+            done = true;
+        if (done)
+            return s3Reply;
+
+        continuationToken = s3Reply->m_listPage.nextContinuationToken;
+        delete s3Reply;
+    }
+}
+
+// Lists \a ranges on up to \a concurrency threads. \a callback is called with the
+// range index and the objects for each listed page, one call at a time. The
+// first error stops all listings and is returned.
+QtS3ReplyPrivate *QtS3Private::listRanges(
+    const QByteArray &bucketName, const QList<ListRange> &ranges, int concurrency,
+    std::function<void(int, const QList<QtS3ObjectInfo> &)> callback)
+{
+    QMutex mutex;
+    QtS3ReplyPrivate *errorReply = 0;
+
+    runConcurrently(ranges.count(), concurrency, [&](int index) {
+        {
+            QMutexLocker lock(&mutex);
+            if (errorReply)
+                return;
+        }
+
+        QtS3ReplyPrivate *rangeReply =
+            listRange(bucketName, ranges.at(index), [&](const QList<QtS3ObjectInfo> &objects) {
+                QMutexLocker lock(&mutex);
+                if (errorReply)
+                    return false;
+                callback(index, objects);
+                return true;
+            });
+
+        QMutexLocker lock(&mutex);
+        if (!rangeReply->isSuccess() && !errorReply)
+            errorReply = rangeReply;
+        else
+            delete rangeReply;
+    });
+
+    if (errorReply)
+        return errorReply;
+    return new QtS3ReplyPrivate(QtS3ReplyBase::NoError, QString());
+}
+
+// Finds key ranges below \a prefix that can be listed in parallel. If a
+// "/"-delimited listing fits in one page then each common prefix is split
+// into ranges, and the objects at the prefix level are returned in \a objects.
+// Otherwise the flat key space is split at fixed split points.
+QtS3ReplyPrivate *QtS3Private::discoverListRanges(const QByteArray &bucketName,
+                                                  const QString &prefix, int concurrency,
+                                                  QList<ListRange> *ranges,
+                                                  QList<QtS3ObjectInfo> *objects)
+{
+    // Oversplit to balance ranges of different sizes between the threads.
+    const int rangeCount = qMax(1, concurrency) * 4;
+    QString discoveryPrefix = prefix;
+
+    forever {
+        QtS3ReplyPrivate *s3Reply =
+            listPage(bucketName, discoveryPrefix, QStringLiteral("/"), QString(), QString());
+        if (!s3Reply->isSuccess())
+            return s3Reply;
+        const QtS3ListPage page = s3Reply->m_listPage;
+
+        if (page.isTruncated) {
+            *ranges = splitListRange(discoveryPrefix, rangeCount);
+            return s3Reply;
+        }
+
+        // Descend into a single "directory" to look for more structure.
+        if (page.objects.isEmpty() && page.commonPrefixes.count() == 1) {
+            discoveryPrefix = page.commonPrefixes.first();
+            delete s3Reply;
+            continue;
+        }
+
+        const int splitCount = page.commonPrefixes.isEmpty()
+                                   ? 1
+                                   : qMax(1, rangeCount / page.commonPrefixes.count());
+        foreach (const QString &commonPrefix, page.commonPrefixes)
+            ranges->append(splitListRange(commonPrefix, splitCount));
+        *objects = page.objects;
+        return s3Reply;
+    }
+}
+
+QtS3ReplyPrivate *QtS3Private::list(const QByteArray &bucketName, const QString &prefix)
+{
+    QList<QtS3ObjectInfo> objects;
+    ListRange range;
+    range.prefix = prefix;
+    QtS3ReplyPrivate *s3Reply =
+        listRange(bucketName, range, [&objects](const QList<QtS3ObjectInfo> &page) {
+            objects.append(page);
+            return true;
+        });
+
+    if (s3Reply->isSuccess()) {
+        s3Reply->m_listPage = QtS3ListPage();
+        s3Reply->m_listPage.objects = objects;
     }
     return s3Reply;
 }
 
+QtS3ReplyPrivate *QtS3Private::listParallel(const QByteArray &bucketName, const QString &prefix,
+                                            int concurrency)
+{
+    QList<ListRange> ranges;
+    QList<QtS3ObjectInfo> objects;
+    QtS3ReplyPrivate *s3Reply =
+        discoverListRanges(bucketName, prefix, concurrency, &ranges, &objects);
+    if (!s3Reply->isSuccess())
+        return s3Reply;
+
+    QVector<QList<QtS3ObjectInfo>> rangeObjects(ranges.count());
+    QtS3ReplyPrivate *rangesReply =
+        listRanges(bucketName, ranges, concurrency,
+                   [&rangeObjects](int index, const QList<QtS3ObjectInfo> &page) {
+                       rangeObjects[index].append(page);
+                   });
+    if (!rangesReply->isSuccess()) {
+        delete s3Reply;
+        return rangesReply;
+    }
+    delete rangesReply;
+
+    // Merge. The ranges are disjoint and do not contain the prefix-level
+    // objects, so ordering ranges and objects by their first key orders
+    // the complete listing.
+    QMap<QByteArray, QList<QtS3ObjectInfo>> segments;
+    for (int i = 0; i < ranges.count(); ++i) {
+        const ListRange &range = ranges.at(i);
+        const QString start = range.startAfter.isEmpty() ? range.prefix : range.startAfter;
+        segments[start.toUtf8()].append(rangeObjects.at(i));
+    }
+    foreach (const QtS3ObjectInfo &object, objects)
+        segments[object.key.toUtf8()].append(object);
+
+    s3Reply->m_listPage = QtS3ListPage();
+    for (auto it = segments.constBegin(); it != segments.constEnd(); ++it)
+        s3Reply->m_listPage.objects.append(it.value());
+    return s3Reply;
+}
+
+QtS3ReplyPrivate *
+QtS3Private::listParallel(const QByteArray &bucketName, const QString &prefix,
+                          std::function<void(const QList<QtS3ObjectInfo> &)> callback,
+                          int concurrency)
+{
+    QList<ListRange> ranges;
+    QList<QtS3ObjectInfo> objects;
+    QtS3ReplyPrivate *s3Reply =
+        discoverListRanges(bucketName, prefix, concurrency, &ranges, &objects);
+    if (!s3Reply->isSuccess())
+        return s3Reply;
+    delete s3Reply;
+
+    if (!objects.isEmpty())
+        callback(objects);
+
+    return listRanges(bucketName, ranges, concurrency,
+                      [&callback](int, const QList<QtS3ObjectInfo> &page) { callback(page); });
+}
+
+// Removes an object from the object caches and updates the existence
+// cache after writes, and detaches in-flight reads so that later reads
+// send a new request.
+void QtS3Private::invalidateCachedObject(const QByteArray &bucketName, const QString &path)
+{
+    const QByteArray key = QtS3ObjectCache::cacheKey(bucketName, path);
+    m_objectCache.remove(key);
+    m_diskCache.remove(key);
+    m_existenceCache.invalidate(key);
+
+    QtS3TimedMutexLocker lock(&m_inFlightRequestsMutex, QtS3MetricsRegistry::InFlightRequestsLock);
+    m_inFlightRequests.remove("GET " + key);
+    m_inFlightRequests.remove("HEAD " + key);
+}
+
 void QtS3Private::clearCaches()
 {
-    m_signingKeysLock.lockForWrite();
+    lockForWriteTimed(&m_signingKeysLock, QtS3MetricsRegistry::SigningKeysLock);
     m_signingKeys.clear();
     m_signingKeysLock.unlock();
 
-    m_bucketRegionsLock.lockForWrite();
+    lockForWriteTimed(&m_bucketRegionsLock, QtS3MetricsRegistry::BucketRegionsLock);
     m_bucketRegions.clear();
     m_bucketRegionsLock.unlock();
+    m_objectCache.clear();
+    m_existenceCache.clear();
 }
 
 QByteArray QtS3Private::accessKeyId()
@@ -835,7 +1966,7 @@ bool QtS3ReplyPrivate::boolValue()
     return false;
 }
 
-int QtS3ReplyPrivate::intValue()
+qint64 QtS3ReplyPrivate::intValue()
 {
     if (m_intAndBoolDataValid)
         return m_intAndBoolData;
@@ -844,4 +1975,10 @@ int QtS3ReplyPrivate::intValue()
 
 QByteArray QtS3ReplyPrivate::bytearrayValue() { return m_byteArrayData; }
 
+QtS3ObjectMetadata QtS3ReplyPrivate::metadataValue() { return m_metadata; }
+
+QtS3ListPage QtS3ReplyPrivate::listPageValue() { return m_listPage; }
+
+QList<bool> QtS3ReplyPrivate::boolListValue() { return m_boolListData; }
+
 QPM_END_NAMESPACE(com, github, msorvig, s3)
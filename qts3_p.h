@@ -3,6 +3,13 @@
 
 #include "qts3.h"
 #include "qts3qnam_p.h"
+#include "qts3cache_p.h"
+#include "qts3limiter_p.h"
+#include "qts3metrics_p.h"
+#include "qts3trace_p.h"
+#include "qts3recorder_p.h"
+#include "qts3transport_p.h"
+#include "qts3epoll_p.h"
 
 #include <QLoggingCategory>
 #include <QtNetwork>
@@ -26,7 +33,12 @@ public:
     std::function<QByteArray()> m_accessKeyIdProvider;
     std::function<QByteArray()> m_secretAccessKeyProvider;
     QByteArray m_service;
+    QUrl m_endpoint;              // custom S3 compatible endpoint, or empty for AWS
+    QByteArray m_endpointRegion;
     ThreadsafeBlockingNetworkAccesManager *m_networkAccessManager;
+    QAtomicPointer<QtS3Transport> m_transport; // sends requests, see setTransport()
+    QList<QtS3Transport *> m_retiredTransports; // replaced by setTransport(), deleted with this
+    QThreadPool m_threadPool; // shared by batch operations, see runConcurrently()
 
     class S3KeyStruct
     {
@@ -38,6 +50,19 @@ public:
     QReadWriteLock m_signingKeysLock;
     QHash<QByteArray, QByteArray> m_bucketRegions; // bucket name -> region
     QReadWriteLock m_bucketRegionsLock;
+    QtS3ObjectCache m_objectCache;
+    QtS3DiskCache m_diskCache;
+    QtS3ExistenceCache m_existenceCache;
+    QtS3ConcurrencyLimiter m_concurrencyLimiter;
+    QAtomicInt m_slowDownRetries;
+    QAtomicInt m_credentialsChecked; // see checkCredentials()
+    QtS3Recorder m_recorder;
+
+    // In-flight GET and HEAD requests, for coalescing identical requests.
+    class InFlightRequest;
+    QHash<QByteArray, QSharedPointer<InFlightRequest>> m_inFlightRequests; // "verb bucket/path"
+    QMutex m_inFlightRequestsMutex;
+    QWaitCondition m_inFlightRequestFinished;
 
     static QByteArray hash(const QByteArray &data);
     static QByteArray sign(const QByteArray &key, const QByteArray &data);
@@ -94,42 +119,129 @@ public:
                             const QByteArray &m_region, const QByteArray &m_service);
 
     // Error handling
+    static QByteArray operationName(const QByteArray &verb, const QByteArray &queryString);
     static QHash<QByteArray, QByteArray> getErrorComponents(const QByteArray &errorString);
     static QByteArray getStringToSign(const QByteArray &errorString);
     static QByteArray getCanonicalRequest(const QByteArray &errorString);
 
+    // Object metadata
+    static QtS3ObjectMetadata
+    parseObjectMetadata(const QList<QNetworkReply::RawHeaderPair> &headers);
+
+    // Object listing
+    class ListRange
+    {
+    public:
+        QString prefix;
+        QString startAfter; // exclusive lower bound, empty for none
+        QString last;       // inclusive upper bound, empty for none
+    };
+    static QByteArray formatListQuery(const QString &prefix, const QString &delimiter,
+                                      const QString &startAfter, const QString &continuationToken);
+    static QtS3ListPage parseListObjectsV2(const QByteArray &xml);
+    static QList<ListRange> splitListRange(const QString &prefix, int rangeCount);
+
+    // Existence checks for many keys
+    class ExistsGroup
+    {
+    public:
+        ListRange range;       // listing which covers the keys
+        QList<int> keyIndexes; // indexes of the keys
+    };
+    static QList<ExistsGroup> planExistsMany(const QStringList &keys, int minListKeys,
+                                             QList<int> *headKeyIndexes);
+
+    // Multipart upload
+    static QByteArray parseUploadId(const QByteArray &xml);
+    static QByteArray formatCompleteMultipartUpload(const QList<QByteArray> &partETags);
+
     // Top-level stateful functions. These read object state and may/will modify it in a thread-safe way.
     void init();
+    void setTransport(QtS3Transport *transport);
+    void checkCredentials();
+    void runConcurrently(int taskCount, int concurrency, std::function<void(int)> task);
     void checkGenerateS3SigningKey(const QByteArray &region);
-    QNetworkRequest *createSignedRequest(const QByteArray &verb, const QUrl &url,
-                                         const QHash<QByteArray, QByteArray> &headers,
-                                         const QByteArray &host, const QByteArray &payload,
-                                         const QByteArray &region);
+    QNetworkRequest createRequest(const QUrl &url, const QHash<QByteArray, QByteArray> &headers,
+                                  const QByteArray &host);
+    void signRequestNow(QNetworkRequest *request, const QByteArray &verb,
+                        const QByteArray &payload, const QByteArray &region,
+                        QtS3ReplyTiming *timing = 0);
     QNetworkReply *sendRequest(const QByteArray &verb, const QNetworkRequest &request,
-                               const QByteArray &payload);
+                               const QByteArray &payload, const QByteArray &region,
+                               QtS3ReplyTiming *timing = 0);
     QNetworkReply *sendS3Request(const QByteArray &bucketName, const QByteArray &verb,
                                  const QString &path, const QByteArray &queryString,
-                                 const QByteArray &content, const QStringList &headers);
+                                 const QByteArray &content, const QStringList &headers,
+                                 QtS3ReplyTiming *timing = 0);
 
     bool checkBucketName(QtS3ReplyPrivate *s3Reply, const QByteArray &bucketName);
     bool checkPath(QtS3ReplyPrivate *s3Reply, const QByteArray &path);
     bool cacheBucketLocation(QtS3ReplyPrivate *s3Reply, const QByteArray &bucketName);
+    static void addNetworkTiming(QtS3ReplyTiming *timing, QNetworkReply *networkReply);
     void processNetworkReplyState(QtS3ReplyPrivate *s3Reply, QNetworkReply *networkReply);
+    static QByteArray readAll(QNetworkReply *networkReply);
     QtS3ReplyPrivate *location_impl(const QByteArray &bucketName);
+    QtS3ReplyPrivate *coalesce(const QByteArray &verb, const QByteArray &bucketName,
+                               const QString &path, std::function<QtS3ReplyPrivate *()> request);
+    QtS3ReplyPrivate *record(QtS3RequestRecord::Operation operation, const QByteArray &bucketName,
+                             const QString &key, qint64 size,
+                             std::function<QtS3ReplyPrivate *()> request);
+    QtS3ReplyPrivate *headObject_impl(const QByteArray &bucketName, const QString &path);
+    QtS3ReplyPrivate *get_impl(const QByteArray &bucketName, const QString &path);
     QtS3ReplyPrivate *processS3Request(const QByteArray &verb, const QByteArray &bucketName,
                                        const QByteArray &path, const QByteArray &query,
                                        const QByteArray &content, const QStringList &headers);
+    QtS3ReplyPrivate *listRange(const QByteArray &bucketName, const ListRange &range,
+                                std::function<bool(const QList<QtS3ObjectInfo> &)> callback);
+    QtS3ReplyPrivate *listRanges(const QByteArray &bucketName, const QList<ListRange> &ranges,
+                                 int concurrency,
+                                 std::function<void(int, const QList<QtS3ObjectInfo> &)> callback);
+    QtS3ReplyPrivate *discoverListRanges(const QByteArray &bucketName, const QString &prefix,
+                                         int concurrency, QList<ListRange> *ranges,
+                                         QList<QtS3ObjectInfo> *objects);
 
     // Public API. The public QtS3 class calls these.
-    void preflight(const QByteArray &bucketName);
+    void setEndpoint(const QUrl &endpoint, const QByteArray &region);
+    QtS3ReplyPrivate *warmup(const QList<QByteArray> &bucketNames, int connectionsPerEndpoint);
     QtS3ReplyPrivate *location(const QByteArray &bucketName);
     QtS3ReplyPrivate *put(const QByteArray &bucketName, const QString &path,
                           const QByteArray &content, const QStringList &headers);
+    QtS3ReplyPrivate *headObject(const QByteArray &bucketName, const QString &path);
     QtS3ReplyPrivate *exists(const QByteArray &bucketName, const QString &path);
+    QtS3ReplyPrivate *existsMany(const QByteArray &bucketName, const QStringList &keys,
+                                 int concurrency);
+    QtS3ReplyPrivate *loadExistenceFilter(const QByteArray &bucketName, const QString &prefix,
+                                          double falsePositiveRate);
     QtS3ReplyPrivate *size(const QByteArray &bucketName, const QString &path);
     QtS3ReplyPrivate *get(const QByteArray &bucketName, const QString &path);
     QtS3ReplyPrivate *remove(const QByteArray &bucket, const QString &path);
+    void getMany(const QByteArray &bucketName, const QStringList &paths,
+                 std::function<void(int, QtS3ReplyPrivate *)> callback);
+    void putMany(const QByteArray &bucketName, const QList<QPair<QString, QByteArray>> &objects,
+                 const QStringList &headers, std::function<void(int, QtS3ReplyPrivate *)> callback);
+    QtS3ReplyPrivate *getRange(const QByteArray &bucketName, const QString &path, qint64 offset,
+                               qint64 length);
+    QtS3ReplyPrivate *createMultipartUpload(const QByteArray &bucketName, const QString &path,
+                                            const QStringList &headers);
+    QtS3ReplyPrivate *uploadPart(const QByteArray &bucketName, const QString &path,
+                                 const QByteArray &uploadId, int partNumber,
+                                 const QByteArray &content);
+    QtS3ReplyPrivate *completeMultipartUpload(const QByteArray &bucketName, const QString &path,
+                                              const QByteArray &uploadId,
+                                              const QList<QByteArray> &partETags);
+    QtS3ReplyPrivate *abortMultipartUpload(const QByteArray &bucketName, const QString &path,
+                                           const QByteArray &uploadId);
+    QtS3ReplyPrivate *listPage(const QByteArray &bucketName, const QString &prefix,
+                               const QString &delimiter, const QString &startAfter,
+                               const QString &continuationToken);
+    QtS3ReplyPrivate *list(const QByteArray &bucketName, const QString &prefix);
+    QtS3ReplyPrivate *listParallel(const QByteArray &bucketName, const QString &prefix,
+                                   int concurrency);
+    QtS3ReplyPrivate *listParallel(const QByteArray &bucketName, const QString &prefix,
+                                   std::function<void(const QList<QtS3ObjectInfo> &)> callback,
+                                   int concurrency);
 
+    void invalidateCachedObject(const QByteArray &bucketName, const QString &path);
     void clearCaches();
     QByteArray accessKeyId();
     QByteArray secretAccessKey();
@@ -143,9 +255,13 @@ public:
 
     QByteArray m_byteArrayData;
     bool m_intAndBoolDataValid;
-    int m_intAndBoolData;
+    qint64 m_intAndBoolData;
+    QtS3ObjectMetadata m_metadata;
+    QtS3ListPage m_listPage;
+    QList<bool> m_boolListData;
 
     QNetworkReply *m_networkReply;
+    QtS3ReplyTiming m_timing; // summed over the network requests for the reply
 
     QtS3ReplyBase::S3Error m_s3Error;
     QString m_s3ErrorString;
@@ -161,8 +277,20 @@ public:
     QByteArray headerValue(const QByteArray &headerName);
 
     bool boolValue();
-    int intValue();
+    qint64 intValue();
     QByteArray bytearrayValue();
+    QtS3ObjectMetadata metadataValue();
+    QtS3ListPage listPageValue();
+    QList<bool> boolListValue();
+};
+
+class QtS3Private::InFlightRequest
+{
+public:
+    InFlightRequest() : finished(false) {}
+
+    bool finished;
+    QtS3ReplyPrivate reply; // copied to each waiting caller
 };
 
 QPM_END_NAMESPACE(com, github, msorvig, s3)
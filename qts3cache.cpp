@@ -0,0 +1,908 @@
+#include "qts3cache_p.h"
+
+#include <algorithm>
+#include <cmath>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// QtS3ObjectCache keeps recently fetched objects in memory, keyed on
+// "bucket/path". Entries are evicted least recently used first when the
+// total content size exceeds the budget. The cache is disabled (size 0)
+// by default.
+
+QtS3ObjectCache::QtS3ObjectCache() { m_entries.setMaxCost(0); }
+
+QByteArray QtS3ObjectCache::cacheKey(const QByteArray &bucketName, const QString &path)
+{
+    return bucketName + "/" + path.toUtf8();
+}
+
+void QtS3ObjectCache::setMaxSize(qint64 bytes)
+{
+    // QCache costs are ints
+    QMutexLocker lock(&m_mutex);
+    m_entries.setMaxCost(int(qBound(qint64(0), bytes, qint64(INT_MAX))));
+}
+
+qint64 QtS3ObjectCache::maxSize()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_entries.maxCost();
+}
+
+qint64 QtS3ObjectCache::size()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_entries.totalCost();
+}
+
+bool QtS3ObjectCache::isEnabled()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_entries.maxCost() > 0;
+}
+
+void QtS3ObjectCache::setDefaultPolicy(const QtS3CachePolicy &policy)
+{
+    QMutexLocker lock(&m_mutex);
+    m_defaultPolicy = policy;
+}
+
+void QtS3ObjectCache::setPolicy(const QByteArray &bucketName, const QString &prefix,
+                                const QtS3CachePolicy &policy)
+{
+    QMutexLocker lock(&m_mutex);
+    m_policies.insert(cacheKey(bucketName, prefix), policy);
+}
+
+// Returns the policy for the longest matching bucket/prefix, or the
+// default policy if there is no match.
+QtS3CachePolicy QtS3ObjectCache::policy(const QByteArray &bucketName, const QString &path)
+{
+    const QByteArray key = cacheKey(bucketName, path);
+
+    QMutexLocker lock(&m_mutex);
+    QtS3CachePolicy policy = m_defaultPolicy;
+    int matchLength = -1;
+    for (auto it = m_policies.constBegin(); it != m_policies.constEnd(); ++it) {
+        if (it.key().length() > matchLength && key.startsWith(it.key())) {
+            policy = it.value();
+            matchLength = it.key().length();
+        }
+    }
+    return policy;
+}
+
+// Looks up an entry and marks it as most recently used.
+bool QtS3ObjectCache::lookup(const QByteArray &key, QByteArray *content, QByteArray *etag,
+                             qint64 *ageMsecs)
+{
+    QMutexLocker lock(&m_mutex);
+    Entry *entry = m_entries.object(key);
+    if (!entry)
+        return false;
+    *content = entry->content;
+    *etag = entry->etag;
+    *ageMsecs = QDateTime::currentMSecsSinceEpoch() - entry->fetched;
+    return true;
+}
+
+// Inserts or replaces an entry, which was fetched ageMsecs ago. Objects
+// larger than the budget are not cached.
+void QtS3ObjectCache::insert(const QByteArray &key, const QByteArray &content,
+                             const QByteArray &etag, qint64 ageMsecs)
+{
+    QMutexLocker lock(&m_mutex);
+    if (content.size() > m_entries.maxCost()) {
+        m_entries.remove(key);
+        return;
+    }
+    Entry *entry = new Entry;
+    entry->content = content;
+    entry->etag = etag;
+    entry->fetched = QDateTime::currentMSecsSinceEpoch() - ageMsecs;
+    m_entries.insert(key, entry, content.size());
+}
+
+// Marks an entry as fresh after a 304 Not Modified reply.
+void QtS3ObjectCache::revalidated(const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    if (Entry *entry = m_entries.object(key))
+        entry->fetched = QDateTime::currentMSecsSinceEpoch();
+}
+
+void QtS3ObjectCache::remove(const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    m_entries.remove(key);
+}
+
+void QtS3ObjectCache::clear()
+{
+    QMutexLocker lock(&m_mutex);
+    m_entries.clear();
+}
+
+// QtS3DiskCache stores objects as files named by their content hash, so
+// identical content fetched under different keys is stored once. The index
+// is a snapshot file and a journal of the changes since the snapshot.
+// Writers append records to the journal under the lock file; readers apply
+// the records appended since their last read, and do not take the lock.
+// When the journal grows larger than the snapshot, the writer compacts it:
+// it writes a snapshot with the next generation number, and an empty
+// journal for that generation.
+//
+// Object files, snapshots and new journals are written with QSaveFile, so
+// readers see either the old or the new file. Journal records are prefixed
+// with their size; an incomplete record (being appended, or cut short by a
+// crash) is not applied, and is truncated by the next writer. A journal for
+// another generation than the snapshot is stale or being replaced, and is
+// ignored.
+//
+// Cache hits do not write to the index: access times are kept in memory and
+// appended to the journal with the next write, or at most once per
+// diskCacheAccessResolution.
+
+static const quint32 diskCacheIndexMagic = 0x51533343;   // "QS3C"
+static const quint32 diskCacheJournalMagic = 0x5153334a; // "QS3J"
+static const quint32 diskCacheIndexVersion = 2;
+static const int diskCacheJournalHeaderSize = 16;
+
+// Access times are written to the journal at most this often.
+static const qint64 diskCacheAccessResolution = 60 * 1000;
+
+// The journal is compacted when it is larger than both this size and the
+// snapshot.
+static const qint64 diskCacheCompactionSize = 64 * 1024;
+
+// Eviction brings the content size down to this fraction of the maximum
+// size, so that the inserts which follow do not each evict.
+static const double diskCacheEvictionTarget = 0.9;
+
+QtS3DiskCache::QtS3DiskCache()
+    : m_maxSize(0), m_contentSize(0), m_accessWritten(0), m_generation(0), m_snapshotSize(0),
+      m_journalOffset(-1)
+{
+}
+
+QByteArray QtS3DiskCache::contentHash(const QByteArray &content)
+{
+    return QCryptographicHash::hash(content, QCryptographicHash::Sha256).toHex();
+}
+
+QByteArray QtS3DiskCache::formatIndex(const Index &index, quint64 generation)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << diskCacheIndexMagic << diskCacheIndexVersion << generation << quint32(index.count());
+    for (auto it = index.constBegin(); it != index.constEnd(); ++it) {
+        const IndexEntry &entry = it.value();
+        stream << it.key() << entry.contentHash << entry.etag << entry.size << entry.fetched
+               << entry.lastAccess;
+    }
+    return data;
+}
+
+bool QtS3DiskCache::parseIndex(const QByteArray &data, Index *index, quint64 *generation)
+{
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic, version, count;
+    quint64 indexGeneration;
+    stream >> magic >> version >> indexGeneration >> count;
+    if (stream.status() != QDataStream::Ok || magic != diskCacheIndexMagic
+        || version != diskCacheIndexVersion)
+        return false;
+
+    Index parsed;
+    for (quint32 i = 0; i < count; ++i) {
+        QByteArray key;
+        IndexEntry entry;
+        stream >> key >> entry.contentHash >> entry.etag >> entry.size >> entry.fetched
+            >> entry.lastAccess;
+        if (stream.status() != QDataStream::Ok)
+            return false;
+        parsed.insert(key, entry);
+    }
+    *index = parsed;
+    if (generation)
+        *generation = indexGeneration;
+    return true;
+}
+
+static QByteArray formatJournalHeader(quint64 generation)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << diskCacheJournalMagic << diskCacheIndexVersion << generation;
+    return data;
+}
+
+static bool parseJournalHeader(const QByteArray &data, quint64 *generation)
+{
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic, version;
+    stream >> magic >> version >> *generation;
+    return stream.status() == QDataStream::Ok && magic == diskCacheJournalMagic
+           && version == diskCacheIndexVersion;
+}
+
+// Returns a journal record: the record size, followed by the operation, the
+// key, and for PutEntry the entry.
+QByteArray QtS3DiskCache::formatJournalRecord(JournalOperation operation, const QByteArray &key,
+                                              const IndexEntry &entry)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << quint32(0) << quint8(operation) << key;
+    if (operation == PutEntry) {
+        stream << entry.contentHash << entry.etag << entry.size << entry.fetched
+               << entry.lastAccess;
+    }
+    stream.device()->seek(0);
+    stream << quint32(record.size() - 4);
+    return record;
+}
+
+// Parses the journal record at offset in data. Returns the offset of the
+// next record, or -1 if the record is incomplete or invalid.
+int QtS3DiskCache::parseJournalRecord(const QByteArray &data, int offset,
+                                      JournalOperation *operation, QByteArray *key,
+                                      IndexEntry *entry)
+{
+    if (data.size() - offset < 4)
+        return -1;
+    quint32 size;
+    QDataStream sizeStream(data.mid(offset, 4));
+    sizeStream >> size;
+    if (quint32(data.size() - offset - 4) < size)
+        return -1;
+
+    QDataStream stream(data.mid(offset + 4, int(size)));
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint8 recordOperation;
+    stream >> recordOperation >> *key;
+    if (recordOperation == PutEntry) {
+        stream >> entry->contentHash >> entry->etag >> entry->size >> entry->fetched
+            >> entry->lastAccess;
+    } else if (recordOperation != RemoveEntry) {
+        return -1;
+    }
+    if (stream.status() != QDataStream::Ok)
+        return -1;
+    *operation = JournalOperation(recordOperation);
+    return offset + 4 + int(size);
+}
+
+// Returns the disk usage of the indexed objects. Shared content is counted once.
+qint64 QtS3DiskCache::contentSize(const Index &index)
+{
+    QHash<QByteArray, qint64> contents;
+    for (const IndexEntry &entry : index)
+        contents.insert(entry.contentHash, entry.size);
+    qint64 size = 0;
+    for (qint64 contentSize : contents)
+        size += contentSize;
+    return size;
+}
+
+// Returns the keys to remove, least recently used first, to bring the
+// content size within maxSize.
+QList<QByteArray> QtS3DiskCache::evictionOrder(const Index &index, qint64 maxSize)
+{
+    QList<QPair<qint64, QByteArray>> byAccess;
+    for (auto it = index.constBegin(); it != index.constEnd(); ++it)
+        byAccess.append(qMakePair(it.value().lastAccess, it.key()));
+    std::sort(byAccess.begin(), byAccess.end());
+
+    QHash<QByteArray, int> references; // content hash -> key count
+    for (const IndexEntry &entry : index)
+        ++references[entry.contentHash];
+    qint64 size = contentSize(index);
+
+    QList<QByteArray> evicted;
+    for (const auto &access : byAccess) {
+        if (size <= maxSize)
+            break;
+        const IndexEntry entry = index.value(access.second);
+        if (--references[entry.contentHash] == 0)
+            size -= entry.size;
+        evicted.append(access.second);
+    }
+    return evicted;
+}
+
+// Sets the cache directory, which is created if needed. An empty
+// directory or zero maxSize disables the cache.
+void QtS3DiskCache::setDirectory(const QString &directory, qint64 maxSize)
+{
+    QMutexLocker lock(&m_mutex);
+    m_directory.clear();
+    m_maxSize = 0;
+    m_lockFile.reset();
+    m_index.clear();
+    m_references.clear();
+    m_contentSize = 0;
+    m_accessed.clear();
+    m_generation = 0;
+    m_snapshotSize = 0;
+    m_journalOffset = -1;
+    if (directory.isEmpty() || maxSize <= 0)
+        return;
+
+    if (!QDir().mkpath(directory + QStringLiteral("/objects"))) {
+        qWarning() << "QtS3: could not create disk cache directory" << directory;
+        return;
+    }
+    m_directory = QDir(directory).absolutePath();
+    m_maxSize = maxSize;
+    m_lockFile.reset(new QLockFile(m_directory + QStringLiteral("/lock")));
+    m_accessWritten = QDateTime::currentMSecsSinceEpoch();
+
+    // Clean up after crashes, apply the (possibly smaller) size limit, and
+    // compact the journal.
+    if (!lockDirectory())
+        return;
+    readIndex();
+    QList<QByteArray> records;
+    evict(&records);
+    compact();
+    removeUnreferencedObjects();
+    unlockDirectory();
+}
+
+QString QtS3DiskCache::directory()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_directory;
+}
+
+qint64 QtS3DiskCache::maxSize()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_maxSize;
+}
+
+qint64 QtS3DiskCache::size()
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_directory.isEmpty())
+        return 0;
+    readIndex();
+    return m_contentSize;
+}
+
+bool QtS3DiskCache::isEnabled()
+{
+    QMutexLocker lock(&m_mutex);
+    return !m_directory.isEmpty();
+}
+
+// Looks up an entry and reads the content from a memory-mapped file.
+bool QtS3DiskCache::lookup(const QByteArray &key, QByteArray *content, QByteArray *etag,
+                           qint64 *ageMsecs)
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_directory.isEmpty())
+        return false;
+    readIndex();
+    auto it = m_index.find(key);
+    if (it == m_index.end())
+        return false;
+
+    const IndexEntry entry = it.value();
+    QFile file(objectFilePath(entry.contentHash));
+    if (!file.open(QIODevice::ReadOnly) || file.size() != entry.size) {
+        // Missing or damaged object file
+        if (lockDirectory()) {
+            readIndex();
+            QList<QByteArray> records;
+            if (m_index.value(key).contentHash == entry.contentHash)
+                removeEntries(QList<QByteArray>() << key, &records);
+            write(records);
+            unlockDirectory();
+        }
+        return false;
+    }
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    *etag = entry.etag;
+    *ageMsecs = now - entry.fetched;
+    if (now - entry.lastAccess > diskCacheAccessResolution) {
+        it->lastAccess = now;
+        m_accessed.insert(key, now);
+    }
+    if (!m_accessed.isEmpty() && now - m_accessWritten > diskCacheAccessResolution
+        && lockDirectory()) {
+        readIndex();
+        write(QList<QByteArray>());
+        unlockDirectory();
+    }
+    lock.unlock();
+
+    // Object files are replaced and removed, but never modified in place,
+    // so the content can be read without the locks.
+    if (file.size() == 0) {
+        *content = QByteArray();
+        return true;
+    }
+    const uchar *data = file.map(0, file.size());
+    if (data) {
+        *content = QByteArray(reinterpret_cast<const char *>(data), int(file.size()));
+        file.unmap(const_cast<uchar *>(data));
+    } else {
+        *content = file.readAll();
+    }
+    return content->size() == file.size();
+}
+
+// Inserts or replaces an entry, which was fetched ageMsecs ago, and evicts
+// least recently used entries if the cache is over budget.
+void QtS3DiskCache::insert(const QByteArray &key, const QByteArray &content,
+                           const QByteArray &etag, qint64 ageMsecs)
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_directory.isEmpty() || content.size() > m_maxSize)
+        return;
+
+    // Write the object file before taking the lock; content-addressed files
+    // with the same name have the same content.
+    const QByteArray hash = contentHash(content);
+    const QString objectPath = objectFilePath(hash);
+    if (!QFile::exists(objectPath)) {
+        QSaveFile file(objectPath);
+        if (!file.open(QIODevice::WriteOnly) || file.write(content) != content.size()
+            || !file.commit()) {
+            qWarning() << "QtS3: could not write disk cache file" << objectPath;
+            return;
+        }
+    }
+
+    if (!lockDirectory())
+        return;
+    readIndex();
+    if (!QFile::exists(objectPath)) {
+        // Removed by another process before the lock was taken
+        unlockDirectory();
+        return;
+    }
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    IndexEntry entry;
+    entry.contentHash = hash;
+    entry.etag = etag;
+    entry.size = content.size();
+    entry.fetched = now - ageMsecs;
+    entry.lastAccess = now;
+    QList<QByteArray> records;
+    records.append(formatJournalRecord(PutEntry, key, entry));
+    m_accessed.remove(key);
+    const QByteArray unreferenced = putEntry(key, entry);
+    if (!unreferenced.isEmpty())
+        QFile::remove(objectFilePath(unreferenced));
+    evict(&records);
+    write(records);
+    unlockDirectory();
+}
+
+// Marks an entry as fresh after a 304 Not Modified reply.
+void QtS3DiskCache::revalidated(const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    if (!lockDirectory())
+        return;
+    readIndex();
+    QList<QByteArray> records;
+    if (m_index.contains(key)) {
+        IndexEntry entry = m_index.value(key);
+        entry.fetched = QDateTime::currentMSecsSinceEpoch();
+        records.append(formatJournalRecord(PutEntry, key, entry));
+        putEntry(key, entry);
+    }
+    write(records);
+    unlockDirectory();
+}
+
+void QtS3DiskCache::remove(const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    if (!lockDirectory())
+        return;
+    readIndex();
+    QList<QByteArray> records;
+    removeEntries(QList<QByteArray>() << key, &records);
+    write(records);
+    unlockDirectory();
+}
+
+void QtS3DiskCache::clear()
+{
+    QMutexLocker lock(&m_mutex);
+    if (!lockDirectory())
+        return;
+    readIndex();
+    QList<QByteArray> records;
+    removeEntries(m_index.keys(), &records);
+    write(records);
+    unlockDirectory();
+}
+
+// Takes the directory lock. Returns false if the cache is disabled or the
+// lock could not be taken. Must be called with m_mutex locked.
+bool QtS3DiskCache::lockDirectory()
+{
+    if (!m_lockFile)
+        return false;
+    if (!m_lockFile->tryLock(10000)) {
+        qWarning() << "QtS3: could not lock disk cache directory" << m_directory;
+        return false;
+    }
+    return true;
+}
+
+void QtS3DiskCache::unlockDirectory() { m_lockFile->unlock(); }
+
+// Brings m_index up to date: reads the snapshot if it was replaced, and
+// applies the journal records appended since the last read. Does not need
+// the directory lock. Must be called with m_mutex locked.
+void QtS3DiskCache::readIndex()
+{
+    QFile snapshot(m_directory + QStringLiteral("/index"));
+    quint64 generation = 0;
+    if (snapshot.open(QIODevice::ReadOnly)) {
+        QDataStream stream(&snapshot);
+        stream.setVersion(QDataStream::Qt_5_0);
+        quint32 magic, version;
+        stream >> magic >> version >> generation;
+        if (stream.status() != QDataStream::Ok)
+            generation = 0;
+    }
+
+    if (m_journalOffset < 0 || generation != m_generation) {
+        Index index;
+        QByteArray data;
+        if (snapshot.isOpen() && snapshot.seek(0)) {
+            data = snapshot.readAll();
+            if (!parseIndex(data, &index))
+                qWarning() << "QtS3: discarding invalid disk cache index" << snapshot.fileName();
+        }
+        m_index = index;
+        m_generation = generation;
+        m_snapshotSize = data.size();
+        m_journalOffset = diskCacheJournalHeaderSize;
+        m_references.clear();
+        m_contentSize = 0;
+        for (auto it = m_index.begin(); it != m_index.end(); ++it) {
+            if (m_references[it->contentHash]++ == 0)
+                m_contentSize += it->size;
+            it->lastAccess = qMax(it->lastAccess, m_accessed.value(it.key()));
+        }
+    }
+
+    QFile journal(m_directory + QStringLiteral("/journal"));
+    quint64 journalGeneration;
+    if (!journal.open(QIODevice::ReadOnly)
+        || !parseJournalHeader(journal.read(diskCacheJournalHeaderSize), &journalGeneration)
+        || journalGeneration != m_generation || !journal.seek(m_journalOffset))
+        return;
+    const QByteArray data = journal.readAll();
+    int offset = 0;
+    for (;;) {
+        JournalOperation operation;
+        QByteArray key;
+        IndexEntry entry;
+        const int next = parseJournalRecord(data, offset, &operation, &key, &entry);
+        if (next < 0)
+            break;
+        if (operation == PutEntry) {
+            entry.lastAccess = qMax(entry.lastAccess, m_accessed.value(key));
+            putEntry(key, entry);
+        } else {
+            removeEntry(key);
+        }
+        offset = next;
+    }
+    m_journalOffset += offset;
+}
+
+// Inserts or replaces an index entry. Returns the content hash which is no
+// longer referenced, if any.
+QByteArray QtS3DiskCache::putEntry(const QByteArray &key, const IndexEntry &entry)
+{
+    if (m_references[entry.contentHash]++ == 0)
+        m_contentSize += entry.size;
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        m_index.insert(key, entry);
+        return QByteArray();
+    }
+    const IndexEntry previous = it.value();
+    it.value() = entry;
+    return unreference(previous);
+}
+
+// Removes an index entry. Returns the content hash which is no longer
+// referenced, if any.
+QByteArray QtS3DiskCache::removeEntry(const QByteArray &key)
+{
+    auto it = m_index.find(key);
+    if (it == m_index.end())
+        return QByteArray();
+    const IndexEntry previous = it.value();
+    m_index.erase(it);
+    return unreference(previous);
+}
+
+QByteArray QtS3DiskCache::unreference(const IndexEntry &entry)
+{
+    auto it = m_references.find(entry.contentHash);
+    if (--it.value() > 0)
+        return QByteArray();
+    m_references.erase(it);
+    m_contentSize -= entry.size;
+    return entry.contentHash;
+}
+
+// Appends records, and the access times which are not yet written, to the
+// journal. Compacts the journal when it has grown large. Must be called with
+// the directory locked, after readIndex().
+void QtS3DiskCache::write(const QList<QByteArray> &records)
+{
+    QByteArray data;
+    for (const QByteArray &record : records)
+        data += record;
+    for (auto it = m_accessed.constBegin(); it != m_accessed.constEnd(); ++it) {
+        const auto entry = m_index.constFind(it.key());
+        if (entry != m_index.constEnd())
+            data += formatJournalRecord(PutEntry, it.key(), entry.value());
+    }
+    m_accessed.clear();
+    m_accessWritten = QDateTime::currentMSecsSinceEpoch();
+    if (data.isEmpty())
+        return;
+
+    const QString journalPath = m_directory + QStringLiteral("/journal");
+    QFile journal(journalPath);
+    quint64 generation;
+    if (!journal.open(QIODevice::ReadWrite)
+        || !parseJournalHeader(journal.read(diskCacheJournalHeaderSize), &generation)
+        || generation != m_generation) {
+        // Missing or stale journal: start a new one for the snapshot.
+        journal.close();
+        const QByteArray header = formatJournalHeader(m_generation);
+        QSaveFile newJournal(journalPath);
+        if (!newJournal.open(QIODevice::WriteOnly) || newJournal.write(header) != header.size()
+            || !newJournal.commit() || !journal.open(QIODevice::ReadWrite)) {
+            qWarning() << "QtS3: could not write disk cache journal" << journalPath;
+            return;
+        }
+        m_journalOffset = header.size();
+    }
+
+    // Drop an incomplete record left by an interrupted write.
+    if (journal.size() != m_journalOffset)
+        journal.resize(m_journalOffset);
+    if (!journal.seek(m_journalOffset) || journal.write(data) != data.size() || !journal.flush()) {
+        qWarning() << "QtS3: could not write disk cache journal" << journalPath;
+        return;
+    }
+    m_journalOffset += data.size();
+
+    if (m_journalOffset > qMax(diskCacheCompactionSize, m_snapshotSize))
+        compact();
+}
+
+// Writes m_index as the snapshot for the next generation, and starts an
+// empty journal for it. Must be called with the directory locked, after
+// readIndex().
+void QtS3DiskCache::compact()
+{
+    const QString indexPath = m_directory + QStringLiteral("/index");
+    const QByteArray data = formatIndex(m_index, m_generation + 1);
+    QSaveFile snapshot(indexPath);
+    if (!snapshot.open(QIODevice::WriteOnly) || snapshot.write(data) != data.size()
+        || !snapshot.commit()) {
+        qWarning() << "QtS3: could not write disk cache index" << indexPath;
+        return;
+    }
+    ++m_generation;
+    m_snapshotSize = data.size();
+    m_accessed.clear();
+
+    // A failure here leaves a stale journal, which is ignored and replaced
+    // by the next write.
+    const QString journalPath = m_directory + QStringLiteral("/journal");
+    const QByteArray header = formatJournalHeader(m_generation);
+    QSaveFile journal(journalPath);
+    if (!journal.open(QIODevice::WriteOnly) || journal.write(header) != header.size()
+        || !journal.commit())
+        qWarning() << "QtS3: could not write disk cache journal" << journalPath;
+    m_journalOffset = header.size();
+}
+
+QString QtS3DiskCache::objectFilePath(const QByteArray &contentHash)
+{
+    return m_directory + QStringLiteral("/objects/") + QString::fromLatin1(contentHash);
+}
+
+// Removes index entries, and object files which are no longer referenced,
+// and adds the journal records for the removals to records.
+void QtS3DiskCache::removeEntries(const QList<QByteArray> &keys, QList<QByteArray> *records)
+{
+    for (const QByteArray &key : keys) {
+        if (!m_index.contains(key))
+            continue;
+        records->append(formatJournalRecord(RemoveEntry, key));
+        const QByteArray unreferenced = removeEntry(key);
+        if (!unreferenced.isEmpty())
+            QFile::remove(objectFilePath(unreferenced));
+    }
+}
+
+// Removes least recently used entries if the cache is over budget.
+void QtS3DiskCache::evict(QList<QByteArray> *records)
+{
+    if (m_contentSize <= m_maxSize)
+        return;
+    removeEntries(evictionOrder(m_index, qint64(m_maxSize * diskCacheEvictionTarget)), records);
+}
+
+// Removes object files which are not referenced by the index, for example
+// after a crash between writing an object and the index.
+void QtS3DiskCache::removeUnreferencedObjects()
+{
+    QSet<QString> referenced;
+    for (const IndexEntry &entry : m_index)
+        referenced.insert(QString::fromLatin1(entry.contentHash));
+    QDir objects(m_directory + QStringLiteral("/objects"));
+    for (const QString &fileName : objects.entryList(QDir::Files)) {
+        if (!referenced.contains(fileName))
+            objects.remove(fileName);
+    }
+}
+
+// QtS3BloomFilter uses double hashing (Kirsch-Mitzenmacher) to derive the
+// bit positions from two key hashes. The hashes must be independent, or the
+// probes collapse onto fewer bits than the sizing assumes: they are the two
+// halves of one 128-bit digest, rather than two seeded qHash() values.
+
+QtS3BloomFilter::QtS3BloomFilter() : m_hashCount(0) {}
+
+void QtS3BloomFilter::hashKey(const QByteArray &key, quint64 *h1, quint64 *h2)
+{
+    const QByteArray digest = QCryptographicHash::hash(key, QCryptographicHash::Md5);
+    *h1 = qFromLittleEndian<quint64>(reinterpret_cast<const uchar *>(digest.constData()));
+    *h2 = qFromLittleEndian<quint64>(reinterpret_cast<const uchar *>(digest.constData() + 8))
+          | 1;
+}
+
+// Creates a filter sized for expectedCount keys and the given false
+// positive rate: m = -n ln(p) / ln(2)^2 bits and k = m/n ln(2) hashes.
+QtS3BloomFilter::QtS3BloomFilter(int expectedCount, double falsePositiveRate)
+{
+    const double n = qMax(1, expectedCount);
+    const double p = qBound(1e-9, falsePositiveRate, 0.5);
+    const double ln2 = std::log(2.0);
+    const double bits = std::ceil(-n * std::log(p) / (ln2 * ln2));
+    m_bits.resize(int(qMin(bits, double(INT_MAX - 1))));
+    m_hashCount = qBound(1, int(std::round(bits / n * ln2)), 30);
+}
+
+void QtS3BloomFilter::insert(const QByteArray &key)
+{
+    if (m_bits.isEmpty())
+        return;
+    quint64 h1, h2;
+    hashKey(key, &h1, &h2);
+    for (int i = 0; i < m_hashCount; ++i)
+        m_bits.setBit(int((h1 + i * h2) % quint64(m_bits.size())));
+}
+
+// Returns false if the key was definitely not inserted. An empty
+// (default-constructed) filter might contain any key.
+bool QtS3BloomFilter::mightContain(const QByteArray &key) const
+{
+    if (m_bits.isEmpty())
+        return true;
+    quint64 h1, h2;
+    hashKey(key, &h1, &h2);
+    for (int i = 0; i < m_hashCount; ++i) {
+        if (!m_bits.testBit(int((h1 + i * h2) % quint64(m_bits.size()))))
+            return false;
+    }
+    return true;
+}
+
+int QtS3BloomFilter::bitCount() const { return m_bits.size(); }
+
+int QtS3BloomFilter::hashCount() const { return m_hashCount; }
+
+// The negative cache is bounded by count; expired entries are pruned when
+// the limit is reached.
+static const int maxMissingEntries = 100000;
+
+QtS3ExistenceCache::QtS3ExistenceCache() : m_negativeTtl(0) {}
+
+void QtS3ExistenceCache::setNegativeTtl(int msecs)
+{
+    QMutexLocker lock(&m_mutex);
+    m_negativeTtl = qMax(0, msecs);
+    if (m_negativeTtl == 0)
+        m_missing.clear();
+}
+
+int QtS3ExistenceCache::negativeTtl()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_negativeTtl;
+}
+
+// Sets the filter for keys starting with prefixKey ("bucket/prefix"),
+// replacing any previous filter for the prefix.
+void QtS3ExistenceCache::setFilter(const QByteArray &prefixKey, const QtS3BloomFilter &filter)
+{
+    QMutexLocker lock(&m_mutex);
+    m_filters.insert(prefixKey, filter);
+}
+
+// Returns true if the key is known to not exist, from a recent negative
+// result or from a filter for a prefix of the key.
+bool QtS3ExistenceCache::isKnownMissing(const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    auto missing = m_missing.find(key);
+    if (missing != m_missing.end()) {
+        if (missing.value() > QDateTime::currentMSecsSinceEpoch())
+            return true;
+        m_missing.erase(missing);
+    }
+    for (auto it = m_filters.constBegin(); it != m_filters.constEnd(); ++it) {
+        if (key.startsWith(it.key()) && !it.value().mightContain(key))
+            return true;
+    }
+    return false;
+}
+
+void QtS3ExistenceCache::insertMissing(const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_negativeTtl == 0)
+        return;
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (m_missing.count() >= maxMissingEntries) {
+        auto it = m_missing.begin();
+        while (it != m_missing.end()) {
+            if (it.value() <= now)
+                it = m_missing.erase(it);
+            else
+                ++it;
+        }
+        if (m_missing.count() >= maxMissingEntries)
+            m_missing.clear();
+    }
+    m_missing.insert(key, now + m_negativeTtl);
+}
+
+// Updates the cache after this client wrote the key: removes the negative
+// entry and adds the key to the filters, which may now contain it.
+void QtS3ExistenceCache::invalidate(const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    m_missing.remove(key);
+    for (auto it = m_filters.begin(); it != m_filters.end(); ++it) {
+        if (key.startsWith(it.key()))
+            it.value().insert(key);
+    }
+}
+
+void QtS3ExistenceCache::clear()
+{
+    QMutexLocker lock(&m_mutex);
+    m_missing.clear();
+    m_filters.clear();
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
@@ -0,0 +1,174 @@
+#ifndef QTS3CACHE_P_H
+#define QTS3CACHE_P_H
+
+#include "qts3.h"
+
+#include <QtCore>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// In-memory LRU object cache with a byte budget. Thread-safe.
+class QtS3ObjectCache
+{
+public:
+    class Entry
+    {
+    public:
+        QByteArray content;
+        QByteArray etag;
+        qint64 fetched; // msecs since epoch when the entry was fetched or revalidated
+    };
+
+    QtS3ObjectCache();
+
+    static QByteArray cacheKey(const QByteArray &bucketName, const QString &path);
+
+    void setMaxSize(qint64 bytes);
+    qint64 maxSize();
+    qint64 size();
+    bool isEnabled();
+
+    void setDefaultPolicy(const QtS3CachePolicy &policy);
+    void setPolicy(const QByteArray &bucketName, const QString &prefix,
+                   const QtS3CachePolicy &policy);
+    QtS3CachePolicy policy(const QByteArray &bucketName, const QString &path);
+
+    bool lookup(const QByteArray &key, QByteArray *content, QByteArray *etag, qint64 *ageMsecs);
+    void insert(const QByteArray &key, const QByteArray &content, const QByteArray &etag,
+                qint64 ageMsecs = 0);
+    void revalidated(const QByteArray &key);
+    void remove(const QByteArray &key);
+    void clear();
+
+private:
+    QMutex m_mutex;
+    QCache<QByteArray, Entry> m_entries; // cache key -> entry, cost is the content size
+    QtS3CachePolicy m_defaultPolicy;
+    QMap<QByteArray, QtS3CachePolicy> m_policies; // cache key prefix -> policy
+};
+
+// Persistent content-addressed object cache in a local directory, shared
+// between processes. Thread-safe and process-safe.
+//
+// Layout:
+//     index       QDataStream snapshot: cache key -> IndexEntry
+//     journal     changes since the snapshot, appended by each writer
+//     lock        QLockFile serializing writers
+//     objects/    object content files, named by the SHA-256 of the content
+class QtS3DiskCache
+{
+public:
+    class IndexEntry
+    {
+    public:
+        IndexEntry() : size(0), fetched(0), lastAccess(0) {}
+
+        QByteArray contentHash;
+        QByteArray etag;
+        qint64 size;
+        qint64 fetched;    // msecs since epoch
+        qint64 lastAccess; // msecs since epoch
+    };
+    typedef QHash<QByteArray, IndexEntry> Index;
+
+    enum JournalOperation { PutEntry, RemoveEntry };
+
+    QtS3DiskCache();
+
+    static QByteArray contentHash(const QByteArray &content);
+    static QByteArray formatIndex(const Index &index, quint64 generation = 0);
+    static bool parseIndex(const QByteArray &data, Index *index, quint64 *generation = 0);
+    static QByteArray formatJournalRecord(JournalOperation operation, const QByteArray &key,
+                                          const IndexEntry &entry = IndexEntry());
+    static int parseJournalRecord(const QByteArray &data, int offset, JournalOperation *operation,
+                                  QByteArray *key, IndexEntry *entry);
+    static qint64 contentSize(const Index &index);
+    static QList<QByteArray> evictionOrder(const Index &index, qint64 maxSize);
+
+    void setDirectory(const QString &directory, qint64 maxSize);
+    QString directory();
+    qint64 maxSize();
+    qint64 size();
+    bool isEnabled();
+
+    bool lookup(const QByteArray &key, QByteArray *content, QByteArray *etag, qint64 *ageMsecs);
+    void insert(const QByteArray &key, const QByteArray &content, const QByteArray &etag,
+                qint64 ageMsecs = 0);
+    void revalidated(const QByteArray &key);
+    void remove(const QByteArray &key);
+    void clear();
+
+private:
+    bool lockDirectory();
+    void unlockDirectory();
+    void readIndex();
+    QByteArray putEntry(const QByteArray &key, const IndexEntry &entry);
+    QByteArray removeEntry(const QByteArray &key);
+    QByteArray unreference(const IndexEntry &entry);
+    void write(const QList<QByteArray> &records);
+    void compact();
+    QString objectFilePath(const QByteArray &contentHash);
+    void removeEntries(const QList<QByteArray> &keys, QList<QByteArray> *records);
+    void evict(QList<QByteArray> *records);
+    void removeUnreferencedObjects();
+
+    QMutex m_mutex;
+    QString m_directory;
+    qint64 m_maxSize;
+    QScopedPointer<QLockFile> m_lockFile;
+    Index m_index;
+    QHash<QByteArray, int> m_references; // content hash -> number of keys
+    qint64 m_contentSize;                // size of the referenced content
+    QHash<QByteArray, qint64> m_accessed; // key -> access time not yet in the journal
+    qint64 m_accessWritten;               // msecs since epoch when m_accessed was last written
+    quint64 m_generation;                 // generation of the snapshot m_index is based on
+    qint64 m_snapshotSize;
+    qint64 m_journalOffset; // journal bytes applied to m_index, or -1 if not loaded
+};
+
+// Bloom filter over object keys: answers "definitely not present" or
+// "maybe present".
+class QtS3BloomFilter
+{
+public:
+    QtS3BloomFilter();
+    QtS3BloomFilter(int expectedCount, double falsePositiveRate);
+
+    void insert(const QByteArray &key);
+    bool mightContain(const QByteArray &key) const;
+    int bitCount() const;
+    int hashCount() const;
+
+private:
+    static void hashKey(const QByteArray &key, quint64 *h1, quint64 *h2);
+
+    QBitArray m_bits;
+    int m_hashCount;
+};
+
+// Known-missing objects for exists(): a negative result cache with a TTL,
+// and Bloom filters built from prefix listings. Thread-safe.
+class QtS3ExistenceCache
+{
+public:
+    QtS3ExistenceCache();
+
+    void setNegativeTtl(int msecs);
+    int negativeTtl();
+    void setFilter(const QByteArray &prefixKey, const QtS3BloomFilter &filter);
+
+    bool isKnownMissing(const QByteArray &key);
+    void insertMissing(const QByteArray &key);
+    void invalidate(const QByteArray &key);
+    void clear();
+
+private:
+    QMutex m_mutex;
+    int m_negativeTtl;
+    QHash<QByteArray, qint64> m_missing; // cache key -> expiry time, msecs since epoch
+    QMap<QByteArray, QtS3BloomFilter> m_filters; // cache key prefix -> filter
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
@@ -0,0 +1,540 @@
+#include "qts3epoll_p.h"
+#include "qts3metrics_p.h"
+#include "qts3trace_p.h"
+
+#ifdef Q_OS_LINUX
+
+#include <errno.h>
+#include <limits>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// Maximum wait for connecting, and for each read or write.
+static const int ioTimeoutMsecs = 60000;
+
+// Maximum number of idle connections kept per host.
+static const int maxIdleConnections = 64;
+
+// Maximum response body size: bodies are held in a QByteArray, which is
+// limited to 2 GB, and the read buffer needs room beyond the body.
+static const qint64 maxContentSize = std::numeric_limits<int>::max() - 1024 * 1024;
+
+static QString systemErrorString(int errorNumber)
+{
+    return QString::fromLocal8Bit(strerror(errorNumber));
+}
+
+QtS3EpollConnection::QtS3EpollConnection()
+    : requestCount(0), timedOut(false), m_socket(-1), m_epoll(-1), m_events(0)
+{
+}
+
+QtS3EpollConnection::~QtS3EpollConnection()
+{
+    if (m_socket >= 0)
+        ::close(m_socket);
+    if (m_epoll >= 0)
+        ::close(m_epoll);
+}
+
+// Connects to host, trying each resolved address in turn.
+bool QtS3EpollConnection::connectToHost(const QByteArray &host, int port, QString *errorString,
+                                        QNetworkReply::NetworkError *error)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses = 0;
+    const int status = ::getaddrinfo(host.constData(), QByteArray::number(port).constData(),
+                                     &hints, &addresses);
+    if (status != 0) {
+        *error = QNetworkReply::HostNotFoundError;
+        *errorString = QStringLiteral("Host %1 not found: %2")
+                           .arg(QString::fromUtf8(host),
+                                QString::fromLocal8Bit(gai_strerror(status)));
+        return false;
+    }
+
+    m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll < 0) {
+        *error = QNetworkReply::UnknownNetworkError;
+        *errorString = systemErrorString(errno);
+        ::freeaddrinfo(addresses);
+        return false;
+    }
+
+    for (struct addrinfo *address = addresses; address && m_socket < 0;
+         address = address->ai_next) {
+        m_socket = ::socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            address->ai_protocol);
+        if (m_socket < 0)
+            continue;
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = m_events = EPOLLOUT;
+        int socketError = 0;
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_socket, &event) < 0)
+            socketError = errno;
+        else if (::connect(m_socket, address->ai_addr, address->ai_addrlen) < 0)
+            socketError = errno;
+
+        // Wait for the connection to complete
+        if (socketError == EINPROGRESS) {
+            socklen_t length = sizeof(socketError);
+            const int events = wait(EPOLLOUT);
+            if (events == 0)
+                socketError = ETIMEDOUT;
+            else if (events < 0
+                     || ::getsockopt(m_socket, SOL_SOCKET, SO_ERROR, &socketError, &length) < 0)
+                socketError = errno;
+        }
+
+        if (socketError != 0) {
+            *error = socketError == ETIMEDOUT ? QNetworkReply::TimeoutError
+                                              : QNetworkReply::ConnectionRefusedError;
+            *errorString = systemErrorString(socketError);
+            ::close(m_socket); // also removes it from m_epoll
+            m_socket = -1;
+        }
+    }
+    ::freeaddrinfo(addresses);
+    if (m_socket < 0)
+        return false;
+
+    // Send request headers immediately: requests are written in one go.
+    int one = 1;
+    ::setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+}
+
+// Waits for events on the socket. Returns the ready events, 0 on timeout,
+// or -1 on error.
+int QtS3EpollConnection::wait(quint32 events)
+{
+    if (events != m_events) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = events;
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_MOD, m_socket, &event) < 0)
+            return -1;
+        m_events = events;
+    }
+
+    struct epoll_event ready;
+    int count;
+    do {
+        count = ::epoll_wait(m_epoll, &ready, 1, ioTimeoutMsecs);
+    } while (count < 0 && errno == EINTR);
+    timedOut = count == 0;
+    return count > 0 ? int(ready.events) : count;
+}
+
+// Writes the iov buffers without copying them. Returns false on error or
+// timeout. Modifies iov.
+bool QtS3EpollConnection::write(struct iovec *iov, int count, QString *errorString)
+{
+    while (count > 0) {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t written = ::sendmsg(m_socket, &message, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                const int events = wait(EPOLLOUT);
+                if (events > 0)
+                    continue;
+                *errorString = events == 0 ? QStringLiteral("Network operation timed out")
+                                           : systemErrorString(errno);
+                return false;
+            }
+            *errorString = systemErrorString(errno);
+            return false;
+        }
+
+        // Skip the written buffers
+        while (count > 0 && size_t(written) >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// Reads available bytes into buffer, waiting for them if there are none.
+// Returns the number of bytes read, 0 if the peer closed the connection,
+// or -1 on error or timeout.
+int QtS3EpollConnection::read(QString *errorString)
+{
+    const int readSize = 64 * 1024;
+    for (;;) {
+        const int size = buffer.size();
+        buffer.resize(size + readSize);
+        const ssize_t count = ::recv(m_socket, buffer.data() + size, readSize, 0);
+        const int readError = errno;
+        buffer.resize(size + qMax(ssize_t(0), count));
+        if (count >= 0)
+            return int(count);
+        if (readError == EINTR)
+            continue;
+        if (readError == EAGAIN || readError == EWOULDBLOCK) {
+            const int events = wait(EPOLLIN);
+            if (events > 0)
+                continue;
+            *errorString = events == 0 ? QStringLiteral("Network operation timed out")
+                                       : systemErrorString(errno);
+            return -1;
+        }
+        *errorString = systemErrorString(readError);
+        return -1;
+    }
+}
+
+// Reads until buffer holds at least size bytes.
+bool QtS3EpollConnection::fill(int size, QString *errorString)
+{
+    while (buffer.size() < size) {
+        const int count = read(errorString);
+        if (count == 0)
+            *errorString = QStringLiteral("Connection closed");
+        if (count <= 0)
+            return false;
+    }
+    return true;
+}
+
+QtS3EpollTransport::QtS3EpollTransport(ThreadsafeBlockingNetworkAccesManager *networkAccessManager)
+    : m_scheduler(networkAccessManager->scheduler()), m_httpsTransport(networkAccessManager)
+{
+}
+
+QtS3EpollTransport::~QtS3EpollTransport()
+{
+    qDeleteAll(m_idleConnections);
+}
+
+QNetworkReply *QtS3EpollTransport::sendRequest(const QNetworkRequest &unsignedRequest,
+                                               const QByteArray &verb, const QByteArray &payload,
+                                               int priorityClass, const RequestSigner &sign)
+{
+    // Send https requests with QNetworkAccessManager, which handles TLS
+    const QUrl url = unsignedRequest.url();
+    if (url.scheme() != QLatin1String("http"))
+        return m_httpsTransport.sendRequest(unsignedRequest, verb, payload, priorityClass, sign);
+
+    // Wait for the scheduler to admit the request, as for QNetworkAccessManager
+    // requests.
+    QtS3MetricsRegistry::instance()->addPendingRequests(1);
+    const QByteArray schedulerHost = RequestScheduler::hostKey(url);
+    qint64 queueWaitTime = 0;
+    {
+        QtS3TraceSpan span("enqueue");
+        queueWaitTime = m_scheduler->acquire(priorityClass, schedulerHost);
+    }
+    QNetworkRequest request(unsignedRequest);
+    if (sign)
+        sign(&request);
+    QtS3TransportReply *reply = new QtS3TransportReply(request, verb);
+    m_replies.add(reply);
+
+    // Format the request line and headers. The payload is sent from its own
+    // buffer after the headers.
+    const QByteArray host = url.host(QUrl::FullyEncoded).toUtf8();
+    const int port = url.port(80);
+    const QByteArray hostPort = host + ':' + QByteArray::number(port);
+    QByteArray path =
+        url.toEncoded(QUrl::RemoveScheme | QUrl::RemoveAuthority | QUrl::RemoveFragment);
+    if (path.isEmpty() || path.startsWith('?'))
+        path.prepend('/');
+    QByteArray header = verb + ' ' + path + " HTTP/1.1\r\n";
+    for (const QByteArray &name : request.rawHeaderList())
+        header += name + ": " + request.rawHeader(name) + "\r\n";
+    if (!request.hasRawHeader("Host"))
+        header += "Host: " + (port == 80 ? host : hostPort) + "\r\n";
+    if (!payload.isEmpty() || verb == "PUT" || verb == "POST")
+        header += "Content-Length: " + QByteArray::number(payload.size()) + "\r\n";
+    header += "\r\n";
+
+    // Send the request on an idle connection if there is one. A server may
+    // close idle connections at any time: retry once on a new connection if
+    // a reused connection fails before the response starts. POST requests
+    // are not idempotent and can not be retried, and use a new connection.
+    const bool idempotent = verb != "POST";
+    QElapsedTimer timer;
+    timer.start();
+    qint64 timeToFirstByte = -1;
+    qint64 bytesReceived = 0;
+    QNetworkReply::NetworkError error = QNetworkReply::NoError;
+    QString errorString;
+    {
+        QtS3TraceSpan span("network");
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            QtS3EpollConnection *connection =
+                attempt == 0 && idempotent ? takeConnection(hostPort) : 0;
+            const bool reused = connection != 0;
+            if (!connection) {
+                connection = new QtS3EpollConnection;
+                if (!connection->connectToHost(host, port, &errorString, &error)) {
+                    delete connection;
+                    break;
+                }
+            }
+
+            bool keepAlive = false;
+            if (exchange(connection, header, payload, verb != "HEAD", reply, timer,
+                         &timeToFirstByte, &bytesReceived, &keepAlive, &error, &errorString)) {
+                error = QNetworkReply::NoError;
+                ++connection->requestCount;
+                if (keepAlive)
+                    releaseConnection(hostPort, connection);
+                else
+                    delete connection;
+                break;
+            }
+
+            delete connection;
+            if (!reused || timeToFirstByte >= 0)
+                break;
+        }
+    }
+    if (error != QNetworkReply::NoError)
+        reply->setNetworkError(error, errorString);
+    m_scheduler->release(priorityClass, schedulerHost);
+
+    // Record the request timings (in usecs) and sizes, see
+    // QtS3Private::processNetworkReplyState().
+    const qint64 requestTime = timer.nsecsElapsed() / 1000;
+    if (timeToFirstByte < 0)
+        timeToFirstByte = requestTime;
+    reply->setProperty("qts3QueueWaitTime", queueWaitTime);
+    reply->setProperty("qts3TimeToFirstByte", timeToFirstByte);
+    reply->setProperty("qts3TransferTime", requestTime - timeToFirstByte);
+    reply->setProperty("qts3BytesSent", payload.size());
+    reply->setProperty("qts3BytesReceived", bytesReceived);
+    QtS3MetricsRegistry::instance()->addPendingRequests(-1);
+    return reply;
+}
+
+// Opens connections to endpoint until the pool has that many idle ones.
+void QtS3EpollTransport::connectToHost(const QUrl &endpoint, int connections)
+{
+    if (endpoint.scheme() != QLatin1String("http")) {
+        m_httpsTransport.connectToHost(endpoint, connections);
+        return;
+    }
+
+    const QByteArray host = endpoint.host(QUrl::FullyEncoded).toUtf8();
+    const int port = endpoint.port(80);
+    const QByteArray hostPort = host + ':' + QByteArray::number(port);
+    int idleConnections;
+    {
+        QMutexLocker lock(&m_poolMutex);
+        idleConnections = m_idleConnections.count(hostPort);
+    }
+    for (int i = idleConnections; i < connections; ++i) {
+        QtS3EpollConnection *connection = new QtS3EpollConnection;
+        QString errorString;
+        QNetworkReply::NetworkError error;
+        if (!connection->connectToHost(host, port, &errorString, &error)) {
+            delete connection;
+            return;
+        }
+        releaseConnection(hostPort, connection);
+    }
+}
+
+int QtS3EpollTransport::idleConnectionCount()
+{
+    QMutexLocker lock(&m_poolMutex);
+    return m_idleConnections.count();
+}
+
+QtS3EpollConnection *QtS3EpollTransport::takeConnection(const QByteArray &hostPort)
+{
+    QMutexLocker lock(&m_poolMutex);
+    auto it = m_idleConnections.find(hostPort);
+    if (it == m_idleConnections.end())
+        return 0;
+    QtS3EpollConnection *connection = it.value();
+    m_idleConnections.erase(it);
+    return connection;
+}
+
+void QtS3EpollTransport::releaseConnection(const QByteArray &hostPort,
+                                           QtS3EpollConnection *connection)
+{
+    // Close connections with unexpected unread data, and connections over
+    // the idle limit.
+    {
+        QMutexLocker lock(&m_poolMutex);
+        if (connection->buffer.isEmpty()
+            && m_idleConnections.count(hostPort) < maxIdleConnections) {
+            m_idleConnections.insert(hostPort, connection);
+            return;
+        }
+    }
+    delete connection;
+}
+
+// Sends a request on connection and reads the response into reply. Returns
+// false if the request failed, and sets error: TimeoutError or
+// RemoteHostClosedError if the connection failed, or ProtocolFailure for an
+// invalid response. timeToFirstByte is set (in usecs since timer was
+// started) when response bytes arrive; keepAlive is set if the connection
+// can be reused.
+bool QtS3EpollTransport::exchange(QtS3EpollConnection *connection, const QByteArray &header,
+                                  const QByteArray &payload, bool hasBody,
+                                  QtS3TransportReply *reply, const QElapsedTimer &timer,
+                                  qint64 *timeToFirstByte, qint64 *bytesReceived,
+                                  bool *keepAlive, QNetworkReply::NetworkError *error,
+                                  QString *errorString)
+{
+    auto connectionFailure = [connection, error]() {
+        *error = connection->timedOut ? QNetworkReply::TimeoutError
+                                      : QNetworkReply::RemoteHostClosedError;
+        return false;
+    };
+    auto protocolFailure = [error, errorString](const QString &message) {
+        *error = QNetworkReply::ProtocolFailure;
+        *errorString = message;
+        return false;
+    };
+
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char *>(header.constData());
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = const_cast<char *>(payload.constData());
+    iov[1].iov_len = payload.size();
+    if (!connection->write(iov, payload.isEmpty() ? 1 : 2, errorString))
+        return connectionFailure();
+
+    // Read the status line and headers
+    QByteArray &buffer = connection->buffer;
+    int headerEnd;
+    while ((headerEnd = buffer.indexOf("\r\n\r\n")) < 0) {
+        if (!connection->fill(buffer.size() + 1, errorString))
+            return connectionFailure();
+        if (*timeToFirstByte < 0) {
+            *timeToFirstByte = timer.nsecsElapsed() / 1000;
+            QtS3Tracer::instance()->instant("first byte");
+        }
+    }
+    const QList<QByteArray> lines = buffer.left(headerEnd).split('\n');
+    buffer.remove(0, headerEnd + 4);
+
+    // "HTTP/1.1 200 OK"
+    const QByteArray statusLine = lines.first().trimmed();
+    const int codeStart = statusLine.indexOf(' ') + 1;
+    const int codeEnd = statusLine.indexOf(' ', codeStart);
+    bool ok = false;
+    const int statusCode =
+        statusLine.mid(codeStart, codeEnd < 0 ? -1 : codeEnd - codeStart).toInt(&ok);
+    if (!statusLine.startsWith("HTTP/1.") || codeStart == 0 || !ok)
+        return protocolFailure(QStringLiteral("Invalid HTTP response"));
+    const QByteArray reasonPhrase = codeEnd < 0 ? QByteArray() : statusLine.mid(codeEnd + 1);
+
+    *keepAlive = !statusLine.startsWith("HTTP/1.0");
+    qint64 contentLength = -1;
+    bool chunked = false;
+    QList<QNetworkReply::RawHeaderPair> headers;
+    for (int i = 1; i < lines.count(); ++i) {
+        const int colon = lines.at(i).indexOf(':');
+        if (colon <= 0)
+            continue;
+        const QByteArray name = lines.at(i).left(colon).trimmed();
+        const QByteArray value = lines.at(i).mid(colon + 1).trimmed();
+        const QByteArray lowerName = name.toLower();
+        if (lowerName == "content-length")
+            contentLength = value.toLongLong();
+        else if (lowerName == "transfer-encoding")
+            chunked = value.toLower().contains("chunked");
+        else if (lowerName == "connection")
+            *keepAlive = !value.toLower().contains("close");
+        headers.append(qMakePair(name, value));
+    }
+
+    // Read the body, which is delimited by the content length, by chunked
+    // encoding, or by the server closing the connection.
+    QByteArray content;
+    if (!hasBody || statusCode < 200 || statusCode == 204 || statusCode == 304) {
+        // no body
+    } else if (chunked) {
+        for (;;) {
+            int lineEnd;
+            while ((lineEnd = buffer.indexOf("\r\n")) < 0) {
+                if (!connection->fill(buffer.size() + 1, errorString))
+                    return connectionFailure();
+            }
+            const int chunkSize = buffer.left(lineEnd).split(';').first().trimmed().toInt(&ok, 16);
+            if (!ok || chunkSize < 0)
+                return protocolFailure(QStringLiteral("Invalid chunk size"));
+            if (chunkSize > maxContentSize - content.size())
+                return protocolFailure(QStringLiteral("Response body too large"));
+            buffer.remove(0, lineEnd + 2);
+            if (chunkSize == 0)
+                break;
+            if (!connection->fill(chunkSize + 2, errorString))
+                return connectionFailure();
+            content.append(buffer.constData(), chunkSize);
+            buffer.remove(0, chunkSize + 2);
+        }
+        // Skip trailers, up to the final empty line
+        for (;;) {
+            const int lineEnd = buffer.indexOf("\r\n");
+            if (lineEnd < 0) {
+                if (!connection->fill(buffer.size() + 1, errorString))
+                    return connectionFailure();
+                continue;
+            }
+            buffer.remove(0, lineEnd + 2);
+            if (lineEnd == 0)
+                break;
+        }
+    } else if (contentLength >= 0) {
+        if (contentLength > maxContentSize)
+            return protocolFailure(QStringLiteral("Response body too large"));
+        buffer.reserve(int(contentLength));
+        if (!connection->fill(int(contentLength), errorString))
+            return connectionFailure();
+        if (buffer.size() == contentLength) {
+            content.swap(buffer);
+        } else {
+            content = buffer.left(int(contentLength));
+            buffer.remove(0, int(contentLength));
+        }
+    } else {
+        *keepAlive = false;
+        int count;
+        while ((count = connection->read(errorString)) > 0) {
+            if (buffer.size() > maxContentSize)
+                return protocolFailure(QStringLiteral("Response body too large"));
+        }
+        if (count < 0)
+            return connectionFailure();
+        content.swap(buffer);
+    }
+
+    *bytesReceived = content.size();
+    reply->setResponse(statusCode, reasonPhrase, headers, content);
+    return true;
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef QTS3EPOLL_P_H
+#define QTS3EPOLL_P_H
+
+#include "qts3.h"
+#include "qts3transport_p.h"
+
+#include <QtCore>
+
+#ifdef Q_OS_LINUX
+
+#include <sys/uio.h>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// A non-blocking keep-alive connection with its own epoll instance. Reads and
+// writes wait in epoll_wait() on the calling thread. Not thread-safe: a
+// connection is used by one request at a time.
+class QtS3EpollConnection
+{
+public:
+    QtS3EpollConnection();
+    ~QtS3EpollConnection();
+
+    bool connectToHost(const QByteArray &host, int port, QString *errorString,
+                       QNetworkReply::NetworkError *error);
+    bool write(struct iovec *iov, int count, QString *errorString);
+    int read(QString *errorString);
+    bool fill(int size, QString *errorString);
+
+    int requestCount; // requests completed on this connection
+    bool timedOut;    // the last wait timed out
+    QByteArray buffer; // bytes read but not yet consumed
+
+private:
+    Q_DISABLE_COPY(QtS3EpollConnection)
+    int wait(quint32 events);
+
+    int m_socket;
+    int m_epoll;
+    quint32 m_events; // events currently registered with m_epoll
+};
+
+// Sends HTTP/1.1 requests on non-blocking sockets from the calling thread,
+// without QNetworkAccessManager or a network thread. Connections are kept
+// alive and reused from a per host pool, and payloads are sent directly
+// from the caller's buffer with scatter/gather writes. Requests are admitted
+// by the shared RequestScheduler; the memory budget and bandwidth limits
+// apply to QNetworkAccessManager requests only. Supports http endpoints;
+// https requests are sent with QtS3QnamTransport. Thread-safe.
+class QtS3EpollTransport : public QtS3Transport
+{
+public:
+    explicit QtS3EpollTransport(ThreadsafeBlockingNetworkAccesManager *networkAccessManager);
+    ~QtS3EpollTransport();
+
+    QNetworkReply *sendRequest(const QNetworkRequest &request, const QByteArray &verb,
+                               const QByteArray &payload, int priorityClass,
+                               const RequestSigner &sign);
+    void connectToHost(const QUrl &endpoint, int connections);
+    int idleConnectionCount();
+
+private:
+    QtS3EpollConnection *takeConnection(const QByteArray &hostPort);
+    void releaseConnection(const QByteArray &hostPort, QtS3EpollConnection *connection);
+    static bool exchange(QtS3EpollConnection *connection, const QByteArray &header,
+                         const QByteArray &payload, bool hasBody, QtS3TransportReply *reply,
+                         const QElapsedTimer &timer, qint64 *timeToFirstByte,
+                         qint64 *bytesReceived, bool *keepAlive,
+                         QNetworkReply::NetworkError *error, QString *errorString);
+
+    RequestScheduler *m_scheduler;
+    QtS3QnamTransport m_httpsTransport;
+    QMutex m_poolMutex;
+    QMultiHash<QByteArray, QtS3EpollConnection *> m_idleConnections; // "host:port" -> connection
+    QtS3TransportReplies m_replies;
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
+
+#endif
@@ -0,0 +1,146 @@
+#include "qts3limiter_p.h"
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// QtS3ConcurrencyLimiter implements AIMD with a latency gradient:
+//
+// - Each request which completes without throttling while at least half of
+//   the limit is in use adds 1/limit, which raises the limit by up to one
+//   per round of requests.
+// - A throttled request halves the limit.
+// - A smoothed latency above twice the baseline (the minimum latency seen
+//   over the last two windows of samples) reduces the limit by 10%.
+//
+// Decreases happen at most once per smoothed latency period, so that a burst
+// of concurrent throttled requests counts as one congestion signal. Latency
+// samples should only be given for small requests, where latency is not
+// dominated by transfer time.
+
+static const int latencyWindowSize = 100;
+
+QtS3ConcurrencyLimiter::QtS3ConcurrencyLimiter()
+    : m_enabled(true), m_minimum(1), m_initial(6), m_maximum(6)
+{
+    m_clock.start();
+}
+
+// Returns the limit key for path in bucketName: S3 partitions and throttles
+// request rates by key prefix, and the top-level "directory" is used as an
+// approximation.
+QByteArray QtS3ConcurrencyLimiter::limitKey(const QByteArray &bucketName, const QString &path)
+{
+    const int slash = path.indexOf(QLatin1Char('/'));
+    return bucketName + "/" + (slash == -1 ? QByteArray() : path.left(slash + 1).toUtf8());
+}
+
+void QtS3ConcurrencyLimiter::setEnabled(bool enabled)
+{
+    QMutexLocker lock(&m_mutex);
+    m_enabled = enabled;
+    m_released.wakeAll();
+}
+
+bool QtS3ConcurrencyLimiter::isEnabled()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_enabled;
+}
+
+void QtS3ConcurrencyLimiter::setLimitRange(int minimum, int initial, int maximum)
+{
+    QMutexLocker lock(&m_mutex);
+    m_minimum = qMax(1, minimum);
+    m_maximum = qMax(m_minimum, maximum);
+    m_initial = qBound(m_minimum, initial, m_maximum);
+    m_states.clear();
+    m_released.wakeAll();
+}
+
+// Waits until a request for key may start. Returns the wait time in msecs.
+// Each acquire() must be followed by a release().
+qint64 QtS3ConcurrencyLimiter::acquire(const QByteArray &key)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QMutexLocker lock(&m_mutex);
+    if (!m_enabled)
+        return 0;
+    State *keyState = &state(key);
+    while (m_enabled && keyState->inFlight >= int(keyState->limit)) {
+        m_released.wait(&m_mutex);
+        keyState = &state(key); // m_states may have been rehashed
+    }
+    ++keyState->inFlight;
+    return timer.elapsed();
+}
+
+// Ends a request for key. latencyMsecs is the request latency, or -1 to
+// not sample the latency, and throttled is true if the server asked the
+// client to slow down.
+void QtS3ConcurrencyLimiter::release(const QByteArray &key, qint64 latencyMsecs, bool throttled)
+{
+    QMutexLocker lock(&m_mutex);
+    State &keyState = state(key);
+    if (keyState.inFlight == 0) // acquired while disabled
+        return;
+    // The limit is only raised while it is being used.
+    const bool inUse = keyState.inFlight * 2 >= keyState.limit;
+    --keyState.inFlight;
+
+    if (throttled) {
+        decrease(&keyState, 0.5);
+    } else if (latencyMsecs >= 0) {
+        keyState.smoothedLatency = keyState.smoothedLatency == 0
+                                       ? latencyMsecs
+                                       : 0.9 * keyState.smoothedLatency + 0.1 * latencyMsecs;
+        if (keyState.windowMinimum == -1 || latencyMsecs < keyState.windowMinimum)
+            keyState.windowMinimum = latencyMsecs;
+        if (++keyState.windowSamples >= latencyWindowSize) {
+            keyState.previousWindowMinimum = keyState.windowMinimum;
+            keyState.windowMinimum = -1;
+            keyState.windowSamples = 0;
+        }
+
+        qint64 baseline = keyState.previousWindowMinimum;
+        if (baseline == -1 || (keyState.windowMinimum != -1 && keyState.windowMinimum < baseline))
+            baseline = keyState.windowMinimum;
+
+        if (keyState.smoothedLatency > 2 * baseline + 10)
+            decrease(&keyState, 0.9);
+        else if (inUse)
+            keyState.limit = qMin(double(m_maximum), keyState.limit + 1.0 / keyState.limit);
+    } else if (inUse) {
+        keyState.limit = qMin(double(m_maximum), keyState.limit + 1.0 / keyState.limit);
+    }
+
+    m_released.wakeAll();
+}
+
+// Returns the current limit for key.
+double QtS3ConcurrencyLimiter::limit(const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    return state(key).limit;
+}
+
+// Returns the state for key, creating it if needed. Must be called with
+// m_mutex locked.
+QtS3ConcurrencyLimiter::State &QtS3ConcurrencyLimiter::state(const QByteArray &key)
+{
+    State &keyState = m_states[key];
+    if (keyState.limit == 0)
+        keyState.limit = m_initial;
+    return keyState;
+}
+
+void QtS3ConcurrencyLimiter::decrease(State *state, double factor)
+{
+    const qint64 now = m_clock.elapsed();
+    if (state->lastDecrease != -1 && now - state->lastDecrease < qMax(10.0, state->smoothedLatency))
+        return;
+    state->limit = qMax(double(m_minimum), state->limit * factor);
+    state->lastDecrease = now;
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
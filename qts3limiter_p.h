@@ -0,0 +1,63 @@
+#ifndef QTS3LIMITER_P_H
+#define QTS3LIMITER_P_H
+
+#include "qts3.h"
+
+#include <QtCore>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// Adaptive concurrency limit per bucket and top-level prefix. The limit
+// grows additively while latency stays near the observed minimum, and
+// shrinks multiplicatively on throttling (503 SlowDown) or rising latency.
+// Thread-safe.
+class QtS3ConcurrencyLimiter
+{
+public:
+    QtS3ConcurrencyLimiter();
+
+    static QByteArray limitKey(const QByteArray &bucketName, const QString &path);
+
+    void setEnabled(bool enabled);
+    bool isEnabled();
+    void setLimitRange(int minimum, int initial, int maximum);
+
+    qint64 acquire(const QByteArray &key);
+    void release(const QByteArray &key, qint64 latencyMsecs, bool throttled);
+    double limit(const QByteArray &key);
+
+private:
+    class State
+    {
+    public:
+        State()
+            : limit(0), inFlight(0), smoothedLatency(0), windowMinimum(-1),
+              previousWindowMinimum(-1), windowSamples(0), lastDecrease(-1)
+        {
+        }
+
+        double limit;
+        int inFlight;
+        double smoothedLatency;        // msecs, exponentially weighted
+        qint64 windowMinimum;          // msecs, -1 if no samples
+        qint64 previousWindowMinimum;  // msecs, -1 if no samples
+        int windowSamples;
+        qint64 lastDecrease;           // m_clock time, -1 if never
+    };
+
+    State &state(const QByteArray &key);
+    void decrease(State *state, double factor);
+
+    QMutex m_mutex;
+    QWaitCondition m_released;
+    QElapsedTimer m_clock;
+    bool m_enabled;
+    int m_minimum;
+    int m_initial;
+    int m_maximum;
+    QHash<QByteArray, State> m_states; // limit key -> state
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
@@ -0,0 +1,261 @@
+#include "qts3metrics_p.h"
+#include "qts3trace_p.h"
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// Latency histogram bucket upper bounds in seconds (the Prometheus client
+// library defaults).
+const double QtS3MetricsRegistry::histogramBounds[QtS3MetricsRegistry::Histogram::BucketCount] =
+    { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+QtS3MetricsRegistry::Histogram::Histogram() : count(0), sum(0)
+{
+    for (int i = 0; i < BucketCount; ++i)
+        buckets[i] = 0;
+}
+
+Q_GLOBAL_STATIC(QtS3MetricsRegistry, metricsRegistry)
+
+QtS3MetricsRegistry *QtS3MetricsRegistry::instance()
+{
+    return metricsRegistry();
+}
+
+void QtS3MetricsRegistry::addRequest(const QByteArray &verb, int statusCode)
+{
+    QMutexLocker lock(&m_mutex);
+    ++m_requests[qMakePair(verb, statusCode)];
+}
+
+void QtS3MetricsRegistry::addLatency(const QByteArray &operation, const QByteArray &bucketName,
+                                     qint64 usecs)
+{
+    const double seconds = usecs / 1000000.0;
+    QMutexLocker lock(&m_mutex);
+    Histogram &histogram = m_latencies[qMakePair(operation, bucketName)];
+    for (int i = 0; i < Histogram::BucketCount; ++i) {
+        if (seconds <= histogramBounds[i]) {
+            ++histogram.buckets[i];
+            break;
+        }
+    }
+    ++histogram.count;
+    histogram.sum += seconds;
+}
+
+void QtS3MetricsRegistry::addBytes(qint64 sent, qint64 received)
+{
+    m_bytesSent.fetchAndAddRelaxed(sent);
+    m_bytesReceived.fetchAndAddRelaxed(received);
+}
+
+void QtS3MetricsRegistry::addSigningKeyRotation()
+{
+    m_signingKeyRotations.fetchAndAddRelaxed(1);
+}
+
+void QtS3MetricsRegistry::addRegionCacheLookup(bool hit)
+{
+    (hit ? m_regionCacheHits : m_regionCacheMisses).fetchAndAddRelaxed(1);
+}
+
+void QtS3MetricsRegistry::addPendingRequests(int delta)
+{
+    m_pendingRequests.fetchAndAddRelaxed(delta);
+}
+
+void QtS3MetricsRegistry::addLockWait(Lock lock, qint64 nsecs)
+{
+    m_lockWaitNsecs[lock].fetchAndAddRelaxed(nsecs);
+    m_lockContentions[lock].fetchAndAddRelaxed(1);
+}
+
+// Returns the total time spent waiting for lock, in nsecs.
+qint64 QtS3MetricsRegistry::lockWaitTime(Lock lock)
+{
+    return m_lockWaitNsecs[lock].load();
+}
+
+// Returns the number of lock acquisitions which had to wait for lock.
+qint64 QtS3MetricsRegistry::lockContentions(Lock lock)
+{
+    return m_lockContentions[lock].load();
+}
+
+static QByteArray formatLabelValue(const QByteArray &value)
+{
+    QByteArray escaped = value;
+    escaped.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return '"' + escaped + '"';
+}
+
+static void formatHeader(QByteArray *text, const char *name, const char *type, const char *help)
+{
+    *text += QByteArray("# HELP ") + name + " " + help + "\n";
+    *text += QByteArray("# TYPE ") + name + " " + type + "\n";
+}
+
+static void formatSample(QByteArray *text, const char *name, qint64 value)
+{
+    *text += QByteArray(name) + " " + QByteArray::number(value) + "\n";
+}
+
+// Returns the metrics in the Prometheus text exposition format.
+QByteArray QtS3MetricsRegistry::formatPrometheus()
+{
+    static const char *lockNames[LockCount] = { "signing_keys", "bucket_regions",
+                                                "in_flight_requests", "network" };
+    QByteArray text;
+
+    {
+        QMutexLocker lock(&m_mutex);
+
+        formatHeader(&text, "qts3_requests_total", "counter",
+                     "S3 requests sent, by HTTP verb and status code (0 if no response).");
+        for (auto it = m_requests.constBegin(); it != m_requests.constEnd(); ++it) {
+            text += "qts3_requests_total{verb=" + formatLabelValue(it.key().first)
+                    + ",status=\"" + QByteArray::number(it.key().second) + "\"} "
+                    + QByteArray::number(it.value()) + "\n";
+        }
+
+        formatHeader(&text, "qts3_request_duration_seconds", "histogram",
+                     "S3 request latency including retries, by operation and bucket.");
+        for (auto it = m_latencies.constBegin(); it != m_latencies.constEnd(); ++it) {
+            const QByteArray labels = "operation=" + formatLabelValue(it.key().first)
+                                      + ",bucket=" + formatLabelValue(it.key().second);
+            const Histogram &histogram = it.value();
+            quint64 cumulative = 0;
+            for (int i = 0; i < Histogram::BucketCount; ++i) {
+                cumulative += histogram.buckets[i];
+                text += "qts3_request_duration_seconds_bucket{" + labels + ",le=\""
+                        + QByteArray::number(histogramBounds[i]) + "\"} "
+                        + QByteArray::number(cumulative) + "\n";
+            }
+            text += "qts3_request_duration_seconds_bucket{" + labels + ",le=\"+Inf\"} "
+                    + QByteArray::number(histogram.count) + "\n";
+            text += "qts3_request_duration_seconds_sum{" + labels + "} "
+                    + QByteArray::number(histogram.sum, 'g', 10) + "\n";
+            text += "qts3_request_duration_seconds_count{" + labels + "} "
+                    + QByteArray::number(histogram.count) + "\n";
+        }
+    }
+
+    formatHeader(&text, "qts3_sent_bytes_total", "counter", "Request content bytes sent.");
+    formatSample(&text, "qts3_sent_bytes_total", m_bytesSent.load());
+    formatHeader(&text, "qts3_received_bytes_total", "counter",
+                 "Response content bytes received.");
+    formatSample(&text, "qts3_received_bytes_total", m_bytesReceived.load());
+    formatHeader(&text, "qts3_signing_key_rotations_total", "counter",
+                 "Signing keys derived, on first use and daily rotation.");
+    formatSample(&text, "qts3_signing_key_rotations_total", m_signingKeyRotations.load());
+    formatHeader(&text, "qts3_region_cache_hits_total", "counter",
+                 "Bucket region lookups answered from the cache.");
+    formatSample(&text, "qts3_region_cache_hits_total", m_regionCacheHits.load());
+    formatHeader(&text, "qts3_region_cache_misses_total", "counter",
+                 "Bucket region lookups which required a location request.");
+    formatSample(&text, "qts3_region_cache_misses_total", m_regionCacheMisses.load());
+    formatHeader(&text, "qts3_pending_requests", "gauge",
+                 "Network requests in progress or queued.");
+    formatSample(&text, "qts3_pending_requests", m_pendingRequests.load());
+
+    formatHeader(&text, "qts3_lock_wait_seconds_total", "counter",
+                 "Time spent waiting for contended internal locks.");
+    for (int i = 0; i < LockCount; ++i) {
+        text += QByteArray("qts3_lock_wait_seconds_total{lock=\"") + lockNames[i] + "\"} "
+                + QByteArray::number(m_lockWaitNsecs[i].load() / 1e9, 'g', 10) + "\n";
+    }
+    formatHeader(&text, "qts3_lock_contentions_total", "counter",
+                 "Lock acquisitions which had to wait for internal locks.");
+    for (int i = 0; i < LockCount; ++i) {
+        text += QByteArray("qts3_lock_contentions_total{lock=\"") + lockNames[i] + "\"} "
+                + QByteArray::number(m_lockContentions[i].load()) + "\n";
+    }
+
+    return text;
+}
+
+// Resets all metrics except the pending requests gauge.
+void QtS3MetricsRegistry::reset()
+{
+    QMutexLocker lock(&m_mutex);
+    m_requests.clear();
+    m_latencies.clear();
+    m_bytesSent.store(0);
+    m_bytesReceived.store(0);
+    m_signingKeyRotations.store(0);
+    m_regionCacheHits.store(0);
+    m_regionCacheMisses.store(0);
+    for (int i = 0; i < LockCount; ++i) {
+        m_lockWaitNsecs[i].store(0);
+        m_lockContentions[i].store(0);
+    }
+}
+
+// The lock functions try the lock first, and only time the wait if the lock
+// is contended: uncontended locking stays as cheap as without metrics.
+// Contended waits are also traced.
+
+static const char *lockWaitSpanNames[QtS3MetricsRegistry::LockCount] = {
+    "lock wait: signing keys", "lock wait: bucket regions", "lock wait: in-flight requests",
+    "lock wait: network"
+};
+
+void lockTimed(QMutex *mutex, QtS3MetricsRegistry::Lock lock)
+{
+    if (mutex->tryLock())
+        return;
+    QtS3TraceSpan span(lockWaitSpanNames[lock]);
+    QElapsedTimer timer;
+    timer.start();
+    mutex->lock();
+    QtS3MetricsRegistry::instance()->addLockWait(lock, timer.nsecsElapsed());
+}
+
+void lockForReadTimed(QReadWriteLock *readWriteLock, QtS3MetricsRegistry::Lock lock)
+{
+    if (readWriteLock->tryLockForRead())
+        return;
+    QtS3TraceSpan span(lockWaitSpanNames[lock]);
+    QElapsedTimer timer;
+    timer.start();
+    readWriteLock->lockForRead();
+    QtS3MetricsRegistry::instance()->addLockWait(lock, timer.nsecsElapsed());
+}
+
+void lockForWriteTimed(QReadWriteLock *readWriteLock, QtS3MetricsRegistry::Lock lock)
+{
+    if (readWriteLock->tryLockForWrite())
+        return;
+    QtS3TraceSpan span(lockWaitSpanNames[lock]);
+    QElapsedTimer timer;
+    timer.start();
+    readWriteLock->lockForWrite();
+    QtS3MetricsRegistry::instance()->addLockWait(lock, timer.nsecsElapsed());
+}
+
+QtS3TimedMutexLocker::QtS3TimedMutexLocker(QMutex *mutex, QtS3MetricsRegistry::Lock lock)
+    : m_mutex(mutex), m_lock(lock), m_locked(false)
+{
+    relock();
+}
+
+QtS3TimedMutexLocker::~QtS3TimedMutexLocker()
+{
+    unlock();
+}
+
+void QtS3TimedMutexLocker::unlock()
+{
+    if (m_locked)
+        m_mutex->unlock();
+    m_locked = false;
+}
+
+void QtS3TimedMutexLocker::relock()
+{
+    if (!m_locked)
+        lockTimed(m_mutex, m_lock);
+    m_locked = true;
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
@@ -0,0 +1,90 @@
+#ifndef QTS3METRICS_P_H
+#define QTS3METRICS_P_H
+
+#include "qts3.h"
+
+#include <QtCore>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// Process-wide metrics for all QtS3 objects: request counts, latency
+// histograms, byte counts, cache and lock statistics. Counters are atomic;
+// labeled metrics are kept under a mutex. Thread-safe.
+class QtS3MetricsRegistry
+{
+public:
+    enum Lock {
+        SigningKeysLock,
+        BucketRegionsLock,
+        InFlightRequestsLock,
+        NetworkLock,
+        LockCount
+    };
+
+    static QtS3MetricsRegistry *instance();
+
+    void addRequest(const QByteArray &verb, int statusCode);
+    void addLatency(const QByteArray &operation, const QByteArray &bucketName, qint64 usecs);
+    void addBytes(qint64 sent, qint64 received);
+    void addSigningKeyRotation();
+    void addRegionCacheLookup(bool hit);
+    void addPendingRequests(int delta);
+    void addLockWait(Lock lock, qint64 nsecs);
+    qint64 lockWaitTime(Lock lock);
+    qint64 lockContentions(Lock lock);
+
+    QByteArray formatPrometheus();
+    void reset();
+
+private:
+    class Histogram
+    {
+    public:
+        enum { BucketCount = 11 };
+        Histogram();
+
+        quint64 buckets[BucketCount]; // cumulative counts are computed when formatting
+        quint64 count;
+        double sum; // seconds
+    };
+    static const double histogramBounds[Histogram::BucketCount];
+
+    QAtomicInteger<qint64> m_bytesSent;
+    QAtomicInteger<qint64> m_bytesReceived;
+    QAtomicInteger<qint64> m_signingKeyRotations;
+    QAtomicInteger<qint64> m_regionCacheHits;
+    QAtomicInteger<qint64> m_regionCacheMisses;
+    QAtomicInteger<qint64> m_pendingRequests;
+    QAtomicInteger<qint64> m_lockWaitNsecs[LockCount];
+    QAtomicInteger<qint64> m_lockContentions[LockCount];
+
+    QMutex m_mutex;
+    QMap<QPair<QByteArray, int>, quint64> m_requests; // (verb, status code) -> count
+    QMap<QPair<QByteArray, QByteArray>, Histogram> m_latencies; // (operation, bucket) -> latency
+};
+
+// Lock functions which record the wait time when the lock is contended.
+void lockTimed(QMutex *mutex, QtS3MetricsRegistry::Lock lock);
+void lockForReadTimed(QReadWriteLock *readWriteLock, QtS3MetricsRegistry::Lock lock);
+void lockForWriteTimed(QReadWriteLock *readWriteLock, QtS3MetricsRegistry::Lock lock);
+
+// QMutexLocker with lock wait metrics.
+class QtS3TimedMutexLocker
+{
+public:
+    QtS3TimedMutexLocker(QMutex *mutex, QtS3MetricsRegistry::Lock lock);
+    ~QtS3TimedMutexLocker();
+
+    void unlock();
+    void relock();
+
+private:
+    Q_DISABLE_COPY(QtS3TimedMutexLocker)
+    QMutex *m_mutex;
+    QtS3MetricsRegistry::Lock m_lock;
+    bool m_locked;
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
@@ -1,8 +1,12 @@
 #include "qts3qnam_p.h"
+#include "qts3metrics_p.h"
+#include "qts3trace_p.h"
 
 #include <QtCore>
 #include <QtNetwork/QNetworkReply>
 
+#include <limits>
+
 QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
 
 BlockingNetworkAccessManager::BlockingNetworkAccessManager(QObject *parent)
@@ -22,65 +26,649 @@ QNetworkReply *BlockingNetworkAccessManager::syncGet(const QNetworkRequest &requ
     return reply;
 }
 
+SlottetNetworkAccessManager::SlottetNetworkAccessManager() {}
+
 QNetworkReply *SlottetNetworkAccessManager::sendCustomRequest_slot(const QNetworkRequest &request,
                                                                    const QByteArray &verb,
-                                                                   QIODevice *data)
+                                                                   QIODevice *data,
+                                                                   QObject *downloadReader,
+                                                                   MemoryBudget *memoryBudget)
+{
+    QtS3TraceSpan span("dispatch");
+
+    // Use head() for HEAD requests: QNetworkAccessManager then knows that the
+    // reply has no body even if it has a Content-Length header. A custom HEAD
+    // request waits for Content-Length body bytes which never arrive, until
+    // the server closes the (then lost) keep-alive connection.
+    QNetworkReply *reply = (verb == "HEAD") ? head(request)
+                                            : sendCustomRequest(request, verb, data);
+
+    // When the response headers arrive, record the time to first byte (in
+    // usecs) and charge the response body to the memory budget. The charged
+    // size is released by ThreadsafeBlockingNetworkAccesManager when the
+    // request completes.
+    QElapsedTimer sent;
+    sent.start();
+    connect(reply, &QNetworkReply::metaDataChanged, reply, [reply, memoryBudget, sent]() {
+        if (!reply->property("qts3TimeToFirstByte").isValid()) {
+            reply->setProperty("qts3TimeToFirstByte", sent.nsecsElapsed() / 1000);
+            QtS3Tracer::instance()->instant("first byte");
+        }
+
+        if (memoryBudget) {
+            memoryBudget->chargeReply(
+                reply, reply->header(QNetworkRequest::ContentLengthHeader).toLongLong());
+        }
+    });
+
+    connect(reply, &QNetworkReply::finished, reply,
+            []() { QtS3Tracer::instance()->instant("finished"); });
+
+    // Start reading before returning to the event loop, which may deliver
+    // reply data.
+    if (downloadReader)
+        static_cast<ShapedDownloadReader *>(downloadReader)->start(reply);
+    return reply;
+}
+
+// Opens a keep-alive connection to endpoint, which the next request to the
+// endpoint uses. Connections are opened in the background.
+void SlottetNetworkAccessManager::connectToHost_slot(const QUrl &endpoint)
 {
-    return sendCustomRequest(request, verb, data);
+#ifndef QT_NO_SSL
+    if (endpoint.scheme() == QLatin1String("https")) {
+        connectToHostEncrypted(endpoint.host(), quint16(endpoint.port(443)));
+        return;
+    }
+#endif
+    connectToHost(endpoint.host(), quint16(endpoint.port(80)));
 }
 
-// A thread-safe network access manager wrapper.
-ThreadsafeBlockingNetworkAccesManager::ThreadsafeBlockingNetworkAccesManager()
+// RequestScheduler uses weighted fair queuing in virtual time: each request
+// in a class takes 1/weight virtual time, and the waiting class whose next
+// request would finish first starts next. A class which becomes active again
+// starts at the current virtual time, so idle classes do not accumulate credit.
+// Each host has its own queues and virtual time.
+
+static const qint64 strideScale = 1 << 20;
+
+// The transfer size for shaped reads: small enough to keep the traffic
+// smooth, large enough to keep the per-read overhead low.
+static const qint64 shapedChunkSize = 16 * 1024;
+
+RequestScheduler::Host::Host() : running(0), virtualTime(0)
+{
+    for (int i = 0; i < ClassCount; ++i) {
+        classRunning[i] = 0;
+        pass[i] = 0;
+    }
+}
+
+RequestScheduler::RequestScheduler() : m_maxRequests(6)
+{
+    const int defaultWeights[ClassCount] = { 16, 4, 1 };
+    for (int i = 0; i < ClassCount; ++i) {
+        m_classLimit[i] = INT_MAX;
+        m_weight[i] = defaultWeights[i];
+    }
+}
+
+// Returns the key for the host (and port) of url, for acquire() and release().
+QByteArray RequestScheduler::hostKey(const QUrl &url)
+{
+    const int defaultPort = url.scheme() == QLatin1String("https") ? 443 : 80;
+    return url.host().toLatin1() + ':' + QByteArray::number(url.port(defaultPort));
+}
+
+// Sets the maximum number of requests in progress per host. The default
+// is 6, which is the QNetworkAccessManager connection limit per host.
+void RequestScheduler::setMaxRequests(int maxRequests)
+{
+    QMutexLocker lock(&m_mutex);
+    m_maxRequests = qMax(1, maxRequests);
+    dispatchAll();
+}
+
+void RequestScheduler::setWeight(int priorityClass, int weight)
+{
+    QMutexLocker lock(&m_mutex);
+    m_weight[priorityClass] = qMax(1, weight);
+}
+
+void RequestScheduler::setClassLimit(int priorityClass, int maxRequests)
+{
+    QMutexLocker lock(&m_mutex);
+    m_classLimit[priorityClass] = maxRequests > 0 ? maxRequests : INT_MAX;
+    dispatchAll();
+}
+
+// Returns the number of requests in priorityClass waiting, for all hosts.
+int RequestScheduler::waitingCount(int priorityClass)
+{
+    QMutexLocker lock(&m_mutex);
+    int count = 0;
+    for (const Host &hostState : m_hosts)
+        count += hostState.waiting[priorityClass].count();
+    return count;
+}
+
+// Waits until a request in priorityClass to host may start. Returns the wait
+// time in msecs. Each acquire() must be followed by a release().
+qint64 RequestScheduler::acquire(int priorityClass, const QByteArray &host)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QMutexLocker lock(&m_mutex);
+    Ticket ticket;
+    Host &hostState = m_hosts[host];
+    if (hostState.waiting[priorityClass].isEmpty() && hostState.classRunning[priorityClass] == 0)
+        hostState.pass[priorityClass] = qMax(hostState.pass[priorityClass], hostState.virtualTime);
+    hostState.waiting[priorityClass].enqueue(&ticket);
+    if (dispatch(&hostState))
+        m_granted.wakeAll();
+    while (!ticket.granted)
+        m_granted.wait(&m_mutex);
+    return timer.elapsed();
+}
+
+void RequestScheduler::release(int priorityClass, const QByteArray &host)
+{
+    QMutexLocker lock(&m_mutex);
+    auto it = m_hosts.find(host);
+    Host &hostState = it.value();
+    --hostState.running;
+    --hostState.classRunning[priorityClass];
+    if (dispatch(&hostState))
+        m_granted.wakeAll();
+
+    // Forget idle hosts
+    if (hostState.running == 0) {
+        bool waiting = false;
+        for (int i = 0; i < ClassCount; ++i)
+            waiting = waiting || !hostState.waiting[i].isEmpty();
+        if (!waiting)
+            m_hosts.erase(it);
+    }
+}
+
+qint64 RequestScheduler::stride(int priorityClass) const
+{
+    return strideScale / m_weight[priorityClass];
+}
+
+// Starts waiting requests to a host while below the limits. Returns whether
+// a request was started. Must be called with m_mutex locked.
+bool RequestScheduler::dispatch(Host *host)
+{
+    bool granted = false;
+    while (host->running < m_maxRequests) {
+        int next = -1;
+        for (int i = 0; i < ClassCount; ++i) {
+            if (host->waiting[i].isEmpty() || host->classRunning[i] >= m_classLimit[i])
+                continue;
+            if (next == -1 || host->pass[i] + stride(i) < host->pass[next] + stride(next))
+                next = i;
+        }
+        if (next == -1)
+            break;
+
+        host->waiting[next].dequeue()->granted = true;
+        ++host->running;
+        ++host->classRunning[next];
+        host->virtualTime = host->pass[next];
+        host->pass[next] += stride(next);
+        granted = true;
+    }
+    return granted;
+}
+
+// Must be called with m_mutex locked.
+void RequestScheduler::dispatchAll()
+{
+    bool granted = false;
+    for (Host &hostState : m_hosts)
+        granted = dispatch(&hostState) || granted;
+
+    // (this wakes all waiting threads and could be optimized)
+    if (granted)
+        m_granted.wakeAll();
+}
+
+MemoryBudget::MemoryBudget() : m_limit(0), m_maxWait(-1), m_usage(0), m_highWaterMark(0) {}
+
+// Sets the budget to bytes (0 for unlimited). Requests wait for up to
+// maxWaitMsecs for memory to become available, or indefinitely if -1.
+void MemoryBudget::setLimit(qint64 bytes, int maxWaitMsecs)
+{
+    QMutexLocker lock(&m_mutex);
+    m_limit = qMax(qint64(0), bytes);
+    m_maxWait = maxWaitMsecs;
+    m_released.wakeAll();
+}
+
+// Reserves bytes for a new request, waiting while the budget is used up.
+// A request larger than the budget may start when no other memory is in
+// use. Returns false if the wait timed out.
+bool MemoryBudget::acquire(qint64 bytes)
 {
-    m_networkThread = new QThread;
-    m_networkThread->start();
+    QElapsedTimer timer;
+    timer.start();
+
+    QMutexLocker lock(&m_mutex);
+    while (m_limit > 0 && m_usage > 0 && m_usage + qMax(bytes, qint64(1)) > m_limit) {
+        if (m_maxWait == -1) {
+            m_released.wait(&m_mutex);
+            continue;
+        }
+        const qint64 remaining = m_maxWait - timer.elapsed();
+        if (remaining <= 0 || !m_released.wait(&m_mutex, remaining))
+            return false;
+    }
+    add(bytes);
+    return true;
+}
+
+// Adds bytes to the usage without waiting.
+void MemoryBudget::charge(qint64 bytes)
+{
+    QMutexLocker lock(&m_mutex);
+    add(bytes);
+}
+
+// Must be called with m_mutex locked.
+void MemoryBudget::add(qint64 bytes)
+{
+    m_usage += bytes;
+    m_highWaterMark = qMax(m_highWaterMark, m_usage);
+}
+
+void MemoryBudget::release(qint64 bytes)
+{
+    QMutexLocker lock(&m_mutex);
+    m_usage -= bytes;
+    m_released.wakeAll();
+}
+
+// Charges the body of reply, of size bytes, on the network thread. The
+// charged size is kept in the "qts3ChargedBytes" reply property. Does
+// nothing once the reply has been released.
+void MemoryBudget::chargeReply(QObject *reply, qint64 size)
+{
+    QMutexLocker lock(&m_mutex);
+    if (reply->property("qts3BudgetReleased").toBool())
+        return;
+    const qint64 charged = reply->property("qts3ChargedBytes").toLongLong();
+    if (size > charged) {
+        add(size - charged);
+        reply->setProperty("qts3ChargedBytes", size);
+    }
+}
+
+// Releases bytes and the body charged for reply when its request completes.
+// The charge and the release are made under the budget mutex, so that a
+// late charge on the network thread is not leaked.
+void MemoryBudget::releaseReply(QObject *reply, qint64 bytes)
+{
+    QMutexLocker lock(&m_mutex);
+    reply->setProperty("qts3BudgetReleased", true);
+    m_usage -= bytes + reply->property("qts3ChargedBytes").toLongLong();
+    m_released.wakeAll();
+}
+
+qint64 MemoryBudget::usage()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_usage;
+}
+
+qint64 MemoryBudget::highWaterMark()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_highWaterMark;
+}
+
+TokenBucket::TokenBucket() : m_rate(0), m_burst(0), m_tokens(0), m_lastRefill(0)
+{
+    m_clock.start();
+}
+
+// Sets the rate to bytesPerSecond, and the bucket size to burstBytes. The
+// bucket starts full.
+void TokenBucket::setRate(qint64 bytesPerSecond, qint64 burstBytes)
+{
+    m_rate = qMax(qint64(0), bytesPerSecond);
+    m_burst = burstBytes > 0 ? burstBytes : m_rate;
+    m_tokens = m_burst;
+    m_lastRefill = m_clock.elapsed();
+}
+
+bool TokenBucket::isLimited() const
+{
+    return m_rate > 0;
+}
+
+// Returns the number of bytes which can be sent now.
+qint64 TokenBucket::available()
+{
+    if (!isLimited())
+        return std::numeric_limits<qint64>::max();
+
+    const qint64 now = m_clock.elapsed();
+    m_tokens = qMin(double(m_burst), m_tokens + double(now - m_lastRefill) * m_rate / 1000);
+    m_lastRefill = now;
+    return qint64(m_tokens);
+}
+
+void TokenBucket::consume(qint64 bytes)
+{
+    if (isLimited())
+        m_tokens -= bytes;
+}
+
+// Returns the time until bytes (at most the bucket size) can be sent.
+int TokenBucket::msecsUntilAvailable(qint64 bytes)
+{
+    const qint64 missing = qMin(bytes, m_burst) - available();
+    if (!isLimited() || missing <= 0)
+        return 0;
+    return int(qMin(qint64(INT_MAX), (missing * 1000 + m_rate - 1) / m_rate));
+}
+
+// Sets the limit for requests in priorityClass, or for all requests if
+// priorityClass is -1. A bytesPerSecond of 0 removes the limit, and a
+// burstBytes of 0 sets the burst size to one second of traffic.
+void BandwidthShaper::setLimit(Direction direction, int priorityClass, qint64 bytesPerSecond,
+                               qint64 burstBytes)
+{
+    QMutexLocker lock(&m_mutex);
+    TokenBucket &bucket =
+        priorityClass == -1 ? m_total[direction] : m_class[direction][priorityClass];
+    bucket.setRate(bytesPerSecond, burstBytes);
+}
+
+bool BandwidthShaper::isLimited(Direction direction, int priorityClass)
+{
+    QMutexLocker lock(&m_mutex);
+    return m_total[direction].isLimited() || m_class[direction][priorityClass].isLimited();
+}
+
+// Takes and returns up to maxBytes tokens from both the total and the class
+// buckets. Returns 0 if there are no tokens.
+qint64 BandwidthShaper::take(Direction direction, int priorityClass, qint64 maxBytes)
+{
+    QMutexLocker lock(&m_mutex);
+    TokenBucket &total = m_total[direction];
+    TokenBucket &priority = m_class[direction][priorityClass];
+    const qint64 bytes = qMax(qint64(0), qMin(maxBytes, qMin(total.available(),
+                                                             priority.available())));
+    total.consume(bytes);
+    priority.consume(bytes);
+    return bytes;
+}
+
+int BandwidthShaper::msecsUntilAvailable(Direction direction, int priorityClass, qint64 bytes)
+{
+    QMutexLocker lock(&m_mutex);
+    return qMax(m_total[direction].msecsUntilAvailable(bytes),
+                m_class[direction][priorityClass].msecsUntilAvailable(bytes));
+}
+
+ShapedUploadDevice::ShapedUploadDevice(QIODevice *source, BandwidthShaper *shaper,
+                                       int priorityClass)
+    : m_source(source), m_shaper(shaper), m_priorityClass(priorityClass),
+      m_tokenTimer(new QTimer(this))
+{
+    m_tokenTimer->setSingleShot(true);
+    connect(m_tokenTimer, SIGNAL(timeout()), this, SIGNAL(readyRead()));
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+bool ShapedUploadDevice::isSequential() const
+{
+    return m_source->isSequential();
+}
+
+qint64 ShapedUploadDevice::size() const
+{
+    return m_source->size();
+}
+
+bool ShapedUploadDevice::seek(qint64 pos)
+{
+    return m_source->seek(pos) && QIODevice::seek(pos);
+}
+
+bool ShapedUploadDevice::reset()
+{
+    return m_source->reset() && QIODevice::reset();
+}
+
+qint64 ShapedUploadDevice::readData(char *data, qint64 maxSize)
+{
+    const qint64 wanted = qMin(maxSize, m_source->bytesAvailable());
+    if (wanted <= 0)
+        return m_source->read(data, maxSize);
+
+    const qint64 granted = m_shaper->take(BandwidthShaper::Upload, m_priorityClass,
+                                          qMin(wanted, shapedChunkSize));
+    if (granted == 0) {
+        // Out of tokens: QNetworkAccessManager reads again on readyRead()
+        if (!m_tokenTimer->isActive())
+            m_tokenTimer->start(m_shaper->msecsUntilAvailable(
+                BandwidthShaper::Upload, m_priorityClass, qMin(wanted, shapedChunkSize)));
+        return 0;
+    }
+    return m_source->read(data, granted);
+}
+
+qint64 ShapedUploadDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
+
+ShapedDownloadReader::ShapedDownloadReader(BandwidthShaper *shaper, int priorityClass)
+    : m_shaper(shaper), m_priorityClass(priorityClass), m_reply(0),
+      m_tokenTimer(new QTimer(this))
+{
+    m_tokenTimer->setSingleShot(true);
+    connect(m_tokenTimer, SIGNAL(timeout()), this, SLOT(read()));
+}
+
+void ShapedDownloadReader::start(QNetworkReply *reply)
+{
+    m_reply = reply;
+    m_reply->setReadBufferSize(shapedChunkSize);
+    connect(m_reply, SIGNAL(readyRead()), this, SLOT(read()));
+    connect(m_reply, SIGNAL(finished()), this, SLOT(read()));
+}
+
+// Returns true when the reply has finished and all content has been read.
+bool ShapedDownloadReader::isFinished()
+{
+    return m_finished.loadAcquire();
+}
+
+QByteArray ShapedDownloadReader::content()
+{
+    return m_content;
+}
+
+void ShapedDownloadReader::read()
+{
+    while (m_reply->bytesAvailable() > 0) {
+        const qint64 granted = m_shaper->take(BandwidthShaper::Download, m_priorityClass,
+                                              m_reply->bytesAvailable());
+        if (granted == 0) {
+            // Out of tokens: leave the data in the reply buffer, which stops
+            // the socket reads, and read again when there are tokens.
+            if (!m_tokenTimer->isActive())
+                m_tokenTimer->start(m_shaper->msecsUntilAvailable(
+                    BandwidthShaper::Download, m_priorityClass,
+                    qMin(m_reply->bytesAvailable(), shapedChunkSize)));
+            return;
+        }
+        m_content += m_reply->read(granted);
+    }
+
+    if (m_reply->isFinished() && !m_finished.loadAcquire()) {
+        m_finished.storeRelease(1);
+        emit finished();
+    }
+}
+
+SharedNetworkThread::SharedNetworkThread()
+{
+    qRegisterMetaType<MemoryBudget *>("MemoryBudget*");
+    m_thread = new QThread;
+    m_thread->setObjectName(QStringLiteral("QtS3 network"));
+    m_thread->start();
     m_networkAccessManager = new SlottetNetworkAccessManager;
-    m_networkAccessManager->moveToThread(m_networkThread);
-    m_requestCount = 0;
-    m_cancellAll = false;
+    m_networkAccessManager->moveToThread(m_thread);
+}
+
+// Runs at process exit. The network access manager is deleted on the
+// network thread, which deletes deferred objects when it finishes.
+SharedNetworkThread::~SharedNetworkThread()
+{
+    m_networkAccessManager->deleteLater();
+    m_thread->quit();
+    m_thread->wait();
+    delete m_thread;
+}
+
+Q_GLOBAL_STATIC(SharedNetworkThread, sharedNetworkThread)
+
+SharedNetworkThread *SharedNetworkThread::instance()
+{
+    return sharedNetworkThread();
+}
+
+QThread *SharedNetworkThread::thread()
+{
+    return m_thread;
+}
+
+SlottetNetworkAccessManager *SharedNetworkThread::networkAccessManager()
+{
+    return m_networkAccessManager;
 }
 
-ThreadsafeBlockingNetworkAccesManager::~ThreadsafeBlockingNetworkAccesManager()
+RequestScheduler *SharedNetworkThread::scheduler()
 {
-    delete m_networkAccessManager;
-    m_networkThread->quit();
-    m_networkThread->wait();
-    delete m_networkThread;
+    return &m_scheduler;
 }
 
-// A synchronous, thread-safe sendCustomRequest.
+// A thread-safe network access manager wrapper. Requests are sent on the
+// shared network thread and admitted by the shared request scheduler; the
+// bandwidth limits and memory budget are per instance.
+ThreadsafeBlockingNetworkAccesManager::ThreadsafeBlockingNetworkAccesManager()
+{
+    m_requestCount = 0;
+    m_cancellAll = false;
+}
+
+// A synchronous, thread-safe sendCustomRequest. Returns 0 if the request
+// could not be started within the memory budget. The request is signed with
+// sign, if set, once admitted.
 QNetworkReply *ThreadsafeBlockingNetworkAccesManager::sendCustomRequest(
-    const QNetworkRequest &request, const QByteArray &verb, QIODevice *data)
+    const QNetworkRequest &unsignedRequest, const QByteArray &verb, QIODevice *data,
+    int priorityClass, const RequestSigner &sign)
 {
+    // Requests made on the network thread can not wait for memory or for the
+    // scheduler: the requests which would release them need this thread.
+    SharedNetworkThread *networkThread = SharedNetworkThread::instance();
+    const bool onNetworkThread = QThread::currentThread() == networkThread->thread();
+
+    // Reserve memory for the payload. Returns 0 if the memory budget is used
+    // up and the wait times out.
+    QElapsedTimer memoryWaitTimer;
+    memoryWaitTimer.start();
+    const qint64 payloadSize = data ? data->size() : 0;
+    if (onNetworkThread) {
+        m_memoryBudget.charge(payloadSize);
+    } else {
+        QtS3TraceSpan span("memory budget");
+        if (!m_memoryBudget.acquire(payloadSize))
+            return 0;
+    }
+    const qint64 memoryWaitTime = memoryWaitTimer.elapsed();
+
     // Maintain the active request count
     {
-        QMutexLocker lock(&m_mutex);
+        QtS3TimedMutexLocker lock(&m_mutex, QtS3MetricsRegistry::NetworkLock);
         ++m_requestCount;
     }
+    QtS3MetricsRegistry::instance()->addPendingRequests(1);
+
+    // Wait for the scheduler to admit the request. Requests are queued here
+    // rather than in the QNetworkAccessManager, which does not know about
+    // priorities.
+    const QByteArray host = RequestScheduler::hostKey(unsignedRequest.url());
+    qint64 queueWaitTime = memoryWaitTime;
+    if (!onNetworkThread) {
+        QtS3TraceSpan span("enqueue");
+        queueWaitTime += networkThread->scheduler()->acquire(priorityClass, host);
+    }
+    QNetworkRequest request(unsignedRequest);
+    if (sign)
+        sign(&request);
+
+    // Shape the upload and download bandwidth if limited. The shaping objects
+    // read and write on the network thread.
+    ShapedUploadDevice *uploadDevice = 0;
+    if (data && m_bandwidthShaper.isLimited(BandwidthShaper::Upload, priorityClass)) {
+        uploadDevice = new ShapedUploadDevice(data, &m_bandwidthShaper, priorityClass);
+        uploadDevice->moveToThread(networkThread->thread());
+        data = uploadDevice;
+    }
+    ShapedDownloadReader *downloadReader = 0;
+    if (m_bandwidthShaper.isLimited(BandwidthShaper::Download, priorityClass)) {
+        downloadReader = new ShapedDownloadReader(&m_bandwidthShaper, priorityClass);
+        connect(downloadReader, SIGNAL(finished()), this, SLOT(wakeWaitingThreads()),
+                Qt::DirectConnection);
+        downloadReader->moveToThread(networkThread->thread());
+    }
 
     // Call sendCustomRequest on QNetworkAccessMaanger, on the network thread. Use a
     // BlockingQueuedConnection to get the returned reply object.
+    QElapsedTimer requestTimer;
+    requestTimer.start();
     QNetworkReply *reply = 0;
-    QMetaObject::invokeMethod(m_networkAccessManager, "sendCustomRequest_slot",
-                              Qt::BlockingQueuedConnection, Q_RETURN_ARG(QNetworkReply *, reply),
-                              Q_ARG(QNetworkRequest, request), Q_ARG(QByteArray, verb),
-                              Q_ARG(QIODevice *, data));
-
-    // The reply should wake this thread when the request completes.
-    // (this currently wakes all threads and could be optimized)
-    connect(reply, SIGNAL(finished()), this, SLOT(wakeWaitingThreads()), Qt::DirectConnection);
-
-    // Special case for HEAD requests: return on first metaDataChanged(). Needed to reduce
-    // wait time - finished() is not signaled until S3 times out and clses the connection.
-    const bool isHead = (verb == "HEAD");
-    if (isHead)
-        connect(reply, SIGNAL(metaDataChanged()), this, SLOT(wakeWaitingThreads()),
+    if (onNetworkThread) {
+        // Called on the network thread, for example from a slot connected to
+        // a reply: a blocking call to this thread would deadlock. Send the
+        // request directly and run the event loop until it completes.
+        QtS3TraceSpan span("network");
+        reply = networkThread->networkAccessManager()->sendCustomRequest_slot(
+            request, verb, data, downloadReader, &m_memoryBudget);
+        QEventLoop eventLoop;
+        connect(reply, SIGNAL(finished()), &eventLoop, SLOT(quit()));
+        if (downloadReader)
+            connect(downloadReader, SIGNAL(finished()), &eventLoop, SLOT(quit()));
+        while (!(downloadReader ? downloadReader->isFinished() : reply->isFinished()))
+            eventLoop.exec();
+    } else {
+        QtS3TraceSpan span("network");
+        QMetaObject::invokeMethod(networkThread->networkAccessManager(), "sendCustomRequest_slot",
+                                  Qt::BlockingQueuedConnection,
+                                  Q_RETURN_ARG(QNetworkReply *, reply),
+                                  Q_ARG(QNetworkRequest, request), Q_ARG(QByteArray, verb),
+                                  Q_ARG(QIODevice *, data), Q_ARG(QObject *, downloadReader),
+                                  Q_ARG(MemoryBudget *, &m_memoryBudget));
+
+        // The reply should wake this thread when the request completes.
+        // (this currently wakes all threads and could be optimized)
+        connect(reply, SIGNAL(finished()), this, SLOT(wakeWaitingThreads()),
                 Qt::DirectConnection);
 
-    // Wait until the request completes, or is cancelled, or HEAD returns headers.
-    {
-        QMutexLocker lock(&m_mutex);
-        while (!(reply->isFinished() || m_cancellAll || (isHead && reply->rawHeaderList().count() > 0))) {
+        // Wait until the request completes (and shaped content has been read),
+        // or is cancelled.
+        QtS3TimedMutexLocker lock(&m_mutex, QtS3MetricsRegistry::NetworkLock);
+        while (!((downloadReader ? downloadReader->isFinished() : reply->isFinished())
+                 || m_cancellAll)) {
             m_waitCompleted.wait(&m_mutex);
         }
     }
@@ -89,10 +677,37 @@ QNetworkReply *ThreadsafeBlockingNetworkAccesManager::sendCustomRequest(
     if (m_cancellAll)
         reply->abort();
 
+    if (!onNetworkThread)
+        networkThread->scheduler()->release(priorityClass, host);
+    m_memoryBudget.releaseReply(reply, payloadSize);
+    if (uploadDevice)
+        uploadDevice->deleteLater();
+    qint64 bytesReceived = reply->bytesAvailable();
+    if (downloadReader) {
+        if (downloadReader->isFinished())
+            reply->setProperty("qts3Content", downloadReader->content());
+        bytesReceived += downloadReader->content().size();
+        downloadReader->deleteLater();
+    }
+
+    // Record the request timings (in usecs) and sizes, see
+    // QtS3Private::processNetworkReplyState().
+    const qint64 requestTime = requestTimer.nsecsElapsed() / 1000;
+    const qint64 timeToFirstByte =
+        reply->property("qts3TimeToFirstByte").isValid()
+            ? qMin(requestTime, reply->property("qts3TimeToFirstByte").toLongLong())
+            : requestTime;
+    reply->setProperty("qts3QueueWaitTime", queueWaitTime);
+    reply->setProperty("qts3TimeToFirstByte", timeToFirstByte);
+    reply->setProperty("qts3TransferTime", requestTime - timeToFirstByte);
+    reply->setProperty("qts3BytesSent", payloadSize);
+    reply->setProperty("qts3BytesReceived", bytesReceived);
+
     // Maintain the active request count. Wake any waitAll waiters (lock
     // to avoid racing the wait() in waitForAll())
+    QtS3MetricsRegistry::instance()->addPendingRequests(-1);
     {
-        QMutexLocker lock(&m_mutex);
+        QtS3TimedMutexLocker lock(&m_mutex, QtS3MetricsRegistry::NetworkLock);
          --m_requestCount;
         if (m_requestCount == 0) {
             m_cancellAll = false;
@@ -108,7 +723,7 @@ QNetworkReply *ThreadsafeBlockingNetworkAccesManager::sendCustomRequest(
 // drained.
 void ThreadsafeBlockingNetworkAccesManager::cancelAll()
 {
-    QMutexLocker lock(&m_mutex);
+    QtS3TimedMutexLocker lock(&m_mutex, QtS3MetricsRegistry::NetworkLock);
     if (m_requestCount == 0)
         return;
 
@@ -119,19 +734,57 @@ void ThreadsafeBlockingNetworkAccesManager::cancelAll()
 // Wait until all in-progress netowork operations completes.
 void ThreadsafeBlockingNetworkAccesManager::waitForAll()
 {
-    QMutexLocker lock(&m_mutex);
+    QtS3TimedMutexLocker lock(&m_mutex, QtS3MetricsRegistry::NetworkLock);
     m_waitAll.wait(&m_mutex);
 }
 
+// Returns the process-wide request scheduler.
+RequestScheduler *ThreadsafeBlockingNetworkAccesManager::scheduler()
+{
+    return SharedNetworkThread::instance()->scheduler();
+}
+
+BandwidthShaper *ThreadsafeBlockingNetworkAccesManager::bandwidthShaper()
+{
+    return &m_bandwidthShaper;
+}
+
+MemoryBudget *ThreadsafeBlockingNetworkAccesManager::memoryBudget()
+{
+    return &m_memoryBudget;
+}
+
+// Starts opening keep-alive connections to endpoint, on the
+// network thread. QNetworkAccessManager uses up to 6 connections per host.
+void ThreadsafeBlockingNetworkAccesManager::connectToHost(const QUrl &endpoint, int connections)
+{
+    SlottetNetworkAccessManager *networkAccessManager =
+        SharedNetworkThread::instance()->networkAccessManager();
+    for (int i = 0; i < connections; ++i) {
+        QMetaObject::invokeMethod(networkAccessManager, "connectToHost_slot",
+                                  Qt::QueuedConnection, Q_ARG(QUrl, endpoint));
+    }
+}
+
+// Returns the content of a reply returned by sendCustomRequest(). Use this
+// instead of QNetworkReply::readAll(): shaped downloads are read into a
+// separate buffer.
+QByteArray ThreadsafeBlockingNetworkAccesManager::readAll(QNetworkReply *reply)
+{
+    QByteArray content = reply->property("qts3Content").toByteArray();
+    reply->setProperty("qts3Content", QVariant());
+    return content + reply->readAll();
+}
+
 int ThreadsafeBlockingNetworkAccesManager::pendingRequests()
 {
-    QMutexLocker lock(&m_mutex);
+    QtS3TimedMutexLocker lock(&m_mutex, QtS3MetricsRegistry::NetworkLock);
     return m_requestCount;
 }
 
 void ThreadsafeBlockingNetworkAccesManager::wakeWaitingThreads()
 {
-    QMutexLocker lock(&m_mutex);
+    QtS3TimedMutexLocker lock(&m_mutex, QtS3MetricsRegistry::NetworkLock);
     m_waitCompleted.wakeAll();
 }
 
@@ -2,9 +2,15 @@
 #define QTS3QNAM_H
 
 #include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkReply>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QMutex>
+#include <QtCore/QQueue>
+#include <QtCore/QTimer>
 #include <QtCore/QWaitCondition>
 
+#include <functional>
+
 #include "qpm.h"
 
 QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
@@ -17,23 +23,234 @@ public:
     QNetworkReply *syncGet(const QNetworkRequest &request);
 };
 
+class MemoryBudget;
+
 class SlottetNetworkAccessManager : public QNetworkAccessManager
 {
     Q_OBJECT
 public:
+    SlottetNetworkAccessManager();
+
 public slots:
     QNetworkReply *sendCustomRequest_slot(const QNetworkRequest &request, const QByteArray &verb,
-                                          QIODevice *data = 0);
+                                          QIODevice *data = 0, QObject *downloadReader = 0,
+                                          MemoryBudget *memoryBudget = 0);
+    void connectToHost_slot(const QUrl &endpoint);
+};
+
+// Budget for the memory used by requests in progress: request payloads, and
+// response bodies, which are charged when the response headers arrive. New
+// requests wait while the budget is used up. Thread-safe.
+class MemoryBudget
+{
+public:
+    MemoryBudget();
+
+    void setLimit(qint64 bytes, int maxWaitMsecs);
+    bool acquire(qint64 bytes);
+    void charge(qint64 bytes);
+    void release(qint64 bytes);
+    void chargeReply(QObject *reply, qint64 size);
+    void releaseReply(QObject *reply, qint64 bytes);
+    qint64 usage();
+    qint64 highWaterMark();
+
+private:
+    void add(qint64 bytes);
+
+    QMutex m_mutex;
+    QWaitCondition m_released;
+    qint64 m_limit;    // 0 for unlimited
+    int m_maxWait;     // msecs, -1 to wait indefinitely
+    qint64 m_usage;
+    qint64 m_highWaterMark;
 };
 
+// Weighted-fair admission of requests to the network, per host. At most
+// maxRequests requests to one host are in progress, which by default is the
+// QNetworkAccessManager connection limit per host. Requests are in priority
+// classes (0 is the highest priority); each class has a weight, and an
+// optional cap on its concurrent requests to a host.
+class RequestScheduler
+{
+public:
+    enum { ClassCount = 3 };
+
+    RequestScheduler();
+
+    static QByteArray hostKey(const QUrl &url);
+
+    void setMaxRequests(int maxRequests);
+    void setWeight(int priorityClass, int weight);
+    void setClassLimit(int priorityClass, int maxRequests);
+    int waitingCount(int priorityClass);
+
+    qint64 acquire(int priorityClass, const QByteArray &host = QByteArray());
+    void release(int priorityClass, const QByteArray &host = QByteArray());
+
+private:
+    class Ticket
+    {
+    public:
+        Ticket() : granted(false) {}
+        bool granted;
+    };
+
+    class Host
+    {
+    public:
+        Host();
+
+        int running;
+        qint64 virtualTime;
+        QQueue<Ticket *> waiting[ClassCount];
+        int classRunning[ClassCount];
+        qint64 pass[ClassCount]; // virtual start time of the next request in the class
+    };
+
+    qint64 stride(int priorityClass) const;
+    bool dispatch(Host *host);
+    void dispatchAll();
+
+    QMutex m_mutex;
+    QWaitCondition m_granted;
+    int m_maxRequests; // per host
+    int m_classLimit[ClassCount];
+    int m_weight[ClassCount];
+    QHash<QByteArray, Host> m_hosts; // host key -> state, for hosts with requests
+};
+
+// The network thread, QNetworkAccessManager and request scheduler shared by
+// all QtS3 objects in the process, which then share one connection pool and
+// its per-host request limit. Started on first use.
+class SharedNetworkThread
+{
+public:
+    SharedNetworkThread();
+    ~SharedNetworkThread();
+    static SharedNetworkThread *instance();
+
+    QThread *thread();
+    SlottetNetworkAccessManager *networkAccessManager();
+    RequestScheduler *scheduler();
+
+private:
+    QThread *m_thread;
+    SlottetNetworkAccessManager *m_networkAccessManager;
+    RequestScheduler m_scheduler;
+};
+
+// Token bucket: tokens (bytes) accrue at rate per second, up to the burst
+// size. A rate of 0 is unlimited. Not thread-safe.
+class TokenBucket
+{
+public:
+    TokenBucket();
+
+    void setRate(qint64 bytesPerSecond, qint64 burstBytes);
+    bool isLimited() const;
+    qint64 available();
+    void consume(qint64 bytes);
+    int msecsUntilAvailable(qint64 bytes);
+
+private:
+    QElapsedTimer m_clock;
+    qint64 m_rate;
+    qint64 m_burst;
+    double m_tokens;
+    qint64 m_lastRefill; // m_clock time
+};
+
+// Upload and download bandwidth limits for all requests, and optionally
+// per priority class. Thread-safe.
+class BandwidthShaper
+{
+public:
+    enum Direction { Upload, Download };
+
+    void setLimit(Direction direction, int priorityClass, qint64 bytesPerSecond,
+                  qint64 burstBytes);
+    bool isLimited(Direction direction, int priorityClass);
+    qint64 take(Direction direction, int priorityClass, qint64 maxBytes);
+    int msecsUntilAvailable(Direction direction, int priorityClass, qint64 bytes);
+
+private:
+    QMutex m_mutex;
+    TokenBucket m_total[2];
+    TokenBucket m_class[2][RequestScheduler::ClassCount];
+};
+
+// Upload device which reads from a source device at the rate allowed by a
+// BandwidthShaper. Reads return 0 bytes while out of tokens, and readyRead()
+// is emitted when tokens are available again. Lives on the network thread.
+class ShapedUploadDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    ShapedUploadDevice(QIODevice *source, BandwidthShaper *shaper, int priorityClass);
+
+    bool isSequential() const;
+    qint64 size() const;
+    bool seek(qint64 pos);
+    bool reset();
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    QIODevice *m_source;
+    BandwidthShaper *m_shaper;
+    int m_priorityClass;
+    QTimer *m_tokenTimer;
+};
+
+// Reads a reply body at the rate allowed by a BandwidthShaper. The reply read
+// buffer is limited, so that QNetworkAccessManager stops reading from the
+// socket while the reader waits for tokens. Lives on the network thread.
+class ShapedDownloadReader : public QObject
+{
+    Q_OBJECT
+public:
+    ShapedDownloadReader(BandwidthShaper *shaper, int priorityClass);
+
+    void start(QNetworkReply *reply);
+    bool isFinished();
+    QByteArray content();
+
+signals:
+    void finished();
+
+private slots:
+    void read();
+
+private:
+    BandwidthShaper *m_shaper;
+    int m_priorityClass;
+    QNetworkReply *m_reply;
+    QByteArray m_content;
+    QAtomicInt m_finished;
+    QTimer *m_tokenTimer;
+};
+
+// Signs a request. Called once the request has been admitted to the network,
+// so that time spent waiting for memory or for the scheduler does not age the
+// signature.
+typedef std::function<void(QNetworkRequest *)> RequestSigner;
+
 class ThreadsafeBlockingNetworkAccesManager : public QObject
 {
     Q_OBJECT
 public:
     ThreadsafeBlockingNetworkAccesManager();
-    ~ThreadsafeBlockingNetworkAccesManager();
     QNetworkReply *sendCustomRequest(const QNetworkRequest &request, const QByteArray &verb,
-                                     QIODevice *data = 0);
+                                     QIODevice *data = 0, int priorityClass = 1,
+                                     const RequestSigner &sign = RequestSigner());
+    RequestScheduler *scheduler();
+    BandwidthShaper *bandwidthShaper();
+    MemoryBudget *memoryBudget();
+    void connectToHost(const QUrl &endpoint, int connections);
+    static QByteArray readAll(QNetworkReply *reply);
     void cancelAll();
     void waitForAll();
     int pendingRequests();
@@ -42,8 +259,8 @@ public slots:
     void wakeWaitingThreads();
 
 private:
-    QNetworkAccessManager *m_networkAccessManager;
-    QThread *m_networkThread;
+    BandwidthShaper m_bandwidthShaper;
+    MemoryBudget m_memoryBudget;
     QMutex m_mutex;
     QWaitCondition m_waitCompleted;
     QWaitCondition m_waitAll;
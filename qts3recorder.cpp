@@ -0,0 +1,207 @@
+#include "qts3recorder_p.h"
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+static const char recordMagic[] = "QTS3REC";
+static const char recordVersion = 1;
+
+const char *QtS3RequestRecord::operationName(Operation operation)
+{
+    static const char *names[OperationCount] = { "get",    "put",    "head",     "exists",
+                                                 "size",   "remove", "listPage", "list" };
+    return operation < OperationCount ? names[operation] : "unknown";
+}
+
+static void appendVarint(QByteArray *data, quint64 value)
+{
+    while (value >= 0x80) {
+        data->append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    data->append(char(value));
+}
+
+// Zigzag encoding maps small negative values to small unsigned values.
+static quint64 zigzagEncode(qint64 value)
+{
+    return (quint64(value) << 1) ^ quint64(value >> 63);
+}
+
+static qint64 zigzagDecode(quint64 value)
+{
+    return qint64(value >> 1) ^ -qint64(value & 1);
+}
+
+QtS3RecordWriter::QtS3RecordWriter(QIODevice *device) : m_device(device), m_previousStartTime(0)
+{
+    m_device->write(recordMagic, sizeof(recordMagic) - 1);
+    m_device->write(&recordVersion, 1);
+}
+
+void QtS3RecordWriter::write(const QtS3RequestRecord &record)
+{
+    QByteArray data;
+    data.append(char(record.operation));
+
+    // Records are written as operations complete, which may be out of start
+    // time order: the delta can be negative.
+    appendVarint(&data, zigzagEncode(record.startTime - m_previousStartTime));
+    m_previousStartTime = record.startTime;
+
+    auto bucket = m_buckets.constFind(record.bucket);
+    if (bucket != m_buckets.constEnd()) {
+        appendVarint(&data, bucket.value());
+    } else {
+        const int index = m_buckets.count();
+        m_buckets.insert(record.bucket, index);
+        appendVarint(&data, index);
+        appendVarint(&data, record.bucket.size());
+        data.append(record.bucket);
+    }
+
+    int shared = 0;
+    const int maxShared = qMin(record.key.size(), m_previousKey.size());
+    while (shared < maxShared && record.key.at(shared) == m_previousKey.at(shared))
+        ++shared;
+    appendVarint(&data, shared);
+    appendVarint(&data, record.key.size() - shared);
+    data.append(record.key.constData() + shared, record.key.size() - shared);
+    m_previousKey = record.key;
+
+    appendVarint(&data, quint64(qMax(qint64(0), record.size)));
+    appendVarint(&data, quint64(qMax(qint64(0), record.latency)));
+    appendVarint(&data, quint64(qMax(0, record.s3Error)));
+
+    m_device->write(data);
+}
+
+QtS3RecordReader::QtS3RecordReader(QIODevice *device)
+    : m_device(device), m_valid(false), m_previousStartTime(0)
+{
+    const QByteArray header = m_device->read(sizeof(recordMagic));
+    m_valid = header.size() == int(sizeof(recordMagic))
+              && header.startsWith(QByteArray(recordMagic)) && header.at(7) == recordVersion;
+}
+
+// Returns whether the device contains a record file of a supported version.
+bool QtS3RecordReader::isValid() const
+{
+    return m_valid;
+}
+
+// Reads the next record. Returns false at the end of the file, or if the
+// file is truncated or invalid.
+bool QtS3RecordReader::read(QtS3RequestRecord *record)
+{
+    char operation;
+    if (!m_valid || !m_device->getChar(&operation))
+        return false;
+    if (operation < 0 || operation >= QtS3RequestRecord::OperationCount)
+        return false;
+    record->operation = QtS3RequestRecord::Operation(operation);
+
+    quint64 value;
+    if (!readVarint(&value))
+        return false;
+    record->startTime = m_previousStartTime + zigzagDecode(value);
+    m_previousStartTime = record->startTime;
+
+    if (!readVarint(&value) || value > quint64(m_buckets.count()))
+        return false;
+    if (value == quint64(m_buckets.count())) {
+        quint64 length;
+        QByteArray bucket;
+        if (!readVarint(&length) || !readBytes(length, &bucket))
+            return false;
+        m_buckets.append(bucket);
+    }
+    record->bucket = m_buckets.at(int(value));
+
+    quint64 shared;
+    quint64 suffixLength;
+    QByteArray suffix;
+    if (!readVarint(&shared) || shared > quint64(m_previousKey.size())
+        || !readVarint(&suffixLength) || !readBytes(suffixLength, &suffix))
+        return false;
+    record->key = m_previousKey.left(int(shared)) + suffix;
+    m_previousKey = record->key;
+
+    quint64 size;
+    quint64 latency;
+    quint64 s3Error;
+    if (!readVarint(&size) || !readVarint(&latency) || !readVarint(&s3Error))
+        return false;
+    record->size = qint64(size);
+    record->latency = qint64(latency);
+    record->s3Error = int(s3Error);
+    return true;
+}
+
+bool QtS3RecordReader::readVarint(quint64 *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        char byte;
+        if (!m_device->getChar(&byte))
+            return false;
+        *value |= quint64(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool QtS3RecordReader::readBytes(qint64 count, QByteArray *bytes)
+{
+    if (count > m_device->bytesAvailable() && !m_device->isSequential())
+        return false;
+    *bytes = m_device->read(count);
+    return bytes->size() == count;
+}
+
+QtS3Recorder::QtS3Recorder() : m_recording(0) {}
+
+QtS3Recorder::~QtS3Recorder()
+{
+    stop();
+}
+
+// Starts recording to fileName, replacing any current recording. Returns
+// false if the file could not be opened.
+bool QtS3Recorder::start(const QString &fileName)
+{
+    stop();
+
+    QMutexLocker lock(&m_mutex);
+    m_file.setFileName(fileName);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    m_writer.reset(new QtS3RecordWriter(&m_file));
+    m_clock.start();
+    m_recording.store(1);
+    return true;
+}
+
+void QtS3Recorder::stop()
+{
+    QMutexLocker lock(&m_mutex);
+    m_recording.store(0);
+    m_writer.reset();
+    if (m_file.isOpen())
+        m_file.close();
+}
+
+// Returns the time since recording started, in usecs.
+qint64 QtS3Recorder::elapsed() const
+{
+    return m_clock.nsecsElapsed() / 1000;
+}
+
+void QtS3Recorder::add(const QtS3RequestRecord &record)
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_writer)
+        m_writer->write(record);
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
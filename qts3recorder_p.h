@@ -0,0 +1,92 @@
+#ifndef QTS3RECORDER_P_H
+#define QTS3RECORDER_P_H
+
+#include "qts3.h"
+
+#include <QtCore>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// One recorded QtS3 operation.
+class QtS3RequestRecord
+{
+public:
+    enum Operation { Get, Put, Head, Exists, Size, Remove, ListPage, List, OperationCount };
+
+    QtS3RequestRecord() : operation(Get), startTime(0), size(0), latency(0), s3Error(0) {}
+
+    static const char *operationName(Operation operation);
+
+    Operation operation;
+    QByteArray bucket;
+    QByteArray key;   // object key, or prefix for listings
+    qint64 startTime; // usecs since the recording started
+    qint64 size;      // content bytes sent or received
+    qint64 latency;   // usecs
+    int s3Error;      // QtS3ReplyBase::S3Error
+};
+
+// Writes records in the compact binary record format: a "QTS3REC" magic
+// and version byte, followed by one record after the other. Integers are
+// varints, start times are deltas to the previous record, bucket names are
+// sent once and then referred to by index, and keys share their prefix
+// with the previous key. Not thread-safe.
+class QtS3RecordWriter
+{
+public:
+    explicit QtS3RecordWriter(QIODevice *device);
+
+    void write(const QtS3RequestRecord &record);
+
+private:
+    QIODevice *m_device;
+    QHash<QByteArray, int> m_buckets; // name -> index
+    QByteArray m_previousKey;
+    qint64 m_previousStartTime;
+};
+
+// Reads records written by QtS3RecordWriter.
+class QtS3RecordReader
+{
+public:
+    explicit QtS3RecordReader(QIODevice *device);
+
+    bool isValid() const;
+    bool read(QtS3RequestRecord *record);
+
+private:
+    bool readVarint(quint64 *value);
+    bool readBytes(qint64 count, QByteArray *bytes);
+
+    QIODevice *m_device;
+    bool m_valid;
+    QList<QByteArray> m_buckets;
+    QByteArray m_previousKey;
+    qint64 m_previousStartTime;
+};
+
+// Records operations to a file while recording is active. Thread-safe.
+class QtS3Recorder
+{
+public:
+    QtS3Recorder();
+    ~QtS3Recorder();
+
+    bool start(const QString &fileName);
+    void stop();
+    bool isRecording() const { return m_recording.load(); }
+    qint64 elapsed() const;
+
+    void add(const QtS3RequestRecord &record);
+
+private:
+    QAtomicInt m_recording;
+    QElapsedTimer m_clock;
+    QMutex m_mutex;
+    QFile m_file;
+    QScopedPointer<QtS3RecordWriter> m_writer;
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
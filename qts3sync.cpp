@@ -0,0 +1,467 @@
+#include "qts3sync_p.h"
+
+#include <QtCore>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// QtS3Sync mirrors a local directory tree to a bucket prefix, or the
+// reverse. The source and destination are compared per file and only
+// changed files are transferred, on a bounded pool of worker threads.
+//
+// Change detection, cheapest test first:
+//   - size: different size means changed
+//   - time: a destination which is newer than the source was written after
+//     the source was last modified (downloads set the local modification time
+//     to the object LastModified time)
+//   - content: the file MD5 (or multipart ETag) is compared to the object ETag
+
+static const qint64 maxPartCount = 10000; // S3 limit
+
+static bool setModificationTime(const QString &fileName, const QDateTime &time)
+{
+    QFile file(fileName);
+    return file.open(QIODevice::ReadWrite)
+           && file.setFileTime(time, QFileDevice::FileModificationTime);
+}
+
+QtS3SyncPrivate::QtS3SyncPrivate(const QSharedPointer<QtS3Private> &s3)
+    : m_s3(s3), m_workerCount(8), m_multipartThreshold(64 * 1024 * 1024),
+      m_partSize(8 * 1024 * 1024), m_deleteExtraneous(false), m_dryRun(false)
+{
+}
+
+// Returns the key prefix for a "directory" prefix, with a trailing '/'.
+QString QtS3SyncPrivate::keyPrefix(const QString &prefix)
+{
+    if (prefix.isEmpty() || prefix.endsWith(QLatin1Char('/')))
+        return prefix;
+    return prefix + QLatin1Char('/');
+}
+
+// Returns the local file name for relativePath below localDir, or an empty
+// string if relativePath is not a plain relative path. Relative paths of
+// downloaded files come from object keys, which may be absolute or contain
+// "..", "." or empty segments, and must not escape localDir.
+QString QtS3SyncPrivate::localFileName(const QDir &localDir, const QString &relativePath)
+{
+    if (relativePath.isEmpty() || QDir::isAbsolutePath(relativePath))
+        return QString();
+#ifdef Q_OS_WIN
+    if (relativePath.contains(QLatin1Char('\\')) || relativePath.contains(QLatin1Char(':')))
+        return QString();
+#endif
+    foreach (const QString &segment, relativePath.split(QLatin1Char('/'))) {
+        if (segment.isEmpty() || segment == QLatin1String(".") || segment == QLatin1String(".."))
+            return QString();
+    }
+
+    QString root = localDir.exists() ? localDir.canonicalPath()
+                                     : QDir::cleanPath(localDir.absolutePath());
+    if (!root.endsWith(QLatin1Char('/')))
+        root += QLatin1Char('/');
+    const QString fileName = QDir::cleanPath(root + relativePath);
+    if (!fileName.startsWith(root))
+        return QString();
+    return fileName;
+}
+
+// Returns the multipart part size for a file, which is the minimum part size
+// unless the file is too large to fit in the maximum number of parts.
+qint64 QtS3SyncPrivate::partSize(qint64 fileSize, qint64 minimumPartSize)
+{
+    return qMax(minimumPartSize, (fileSize + maxPartCount - 1) / maxPartCount);
+}
+
+// Computes the S3 ETag for the content of \a fileName. This is the content
+// MD5 for single part uploads. Multipart uploads (\a remoteETag ends with
+// "-N") have the MD5 of the part MD5s followed by the part count.
+QByteArray QtS3SyncPrivate::fileETag(const QString &fileName, const QByteArray &remoteETag,
+                                     qint64 partSize)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    if (!remoteETag.contains('-')) {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        if (!hash.addData(&file))
+            return QByteArray();
+        return hash.result().toHex();
+    }
+
+    QCryptographicHash partHashes(QCryptographicHash::Md5);
+    int partCount = 0;
+    while (!file.atEnd()) {
+        QCryptographicHash partHash(QCryptographicHash::Md5);
+        qint64 remaining = partSize;
+        while (remaining > 0 && !file.atEnd()) {
+            const QByteArray chunk = file.read(qMin(remaining, qint64(1024 * 1024)));
+            if (chunk.isEmpty())
+                return QByteArray(); // read error
+            partHash.addData(chunk);
+            remaining -= chunk.size();
+        }
+        partHashes.addData(partHash.result());
+        ++partCount;
+    }
+    return partHashes.result().toHex() + "-" + QByteArray::number(partCount);
+}
+
+// Compares the local file with the remote object. \a upload selects the
+// local file as the source, otherwise the remote object is the source.
+QtS3SyncPrivate::Comparison QtS3SyncPrivate::compare(const QFileInfo &local,
+                                                     const QtS3ObjectInfo &remote, bool upload,
+                                                     qint64 minimumPartSize)
+{
+    if (local.size() != remote.size)
+        return Changed;
+
+    // LastModified has second resolution.
+    const QDateTime localTime = QDateTime::fromMSecsSinceEpoch(
+        local.lastModified().toMSecsSinceEpoch() / 1000 * 1000, Qt::UTC);
+    if (remote.lastModified.isValid()) {
+        if (upload ? remote.lastModified >= localTime : localTime >= remote.lastModified)
+            return UnchangedByTime;
+    }
+
+    const QByteArray etag =
+        fileETag(local.filePath(), remote.etag, partSize(local.size(), minimumPartSize));
+    if (!etag.isEmpty() && etag == remote.etag)
+        return UnchangedByContent;
+    return Changed;
+}
+
+QtS3ReplyPrivate *QtS3SyncPrivate::uploadFile(const QByteArray &bucket, const QString &key,
+                                              const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return new QtS3ReplyPrivate(QtS3ReplyBase::FileError,
+                                    fileName + QStringLiteral(": ") + file.errorString());
+
+    if (file.size() < m_multipartThreshold)
+        return m_s3->put(bucket, key, file.readAll(), QStringList());
+
+    QtS3ReplyPrivate *createReply = m_s3->createMultipartUpload(bucket, key, QStringList());
+    if (!createReply->isSuccess())
+        return createReply;
+    const QByteArray uploadId = createReply->m_byteArrayData;
+    delete createReply;
+
+    // Upload the parts in sequence: files (not parts) are distributed
+    // over the workers, which bounds the number of parts in memory.
+    const qint64 filePartSize = partSize(file.size(), m_partSize);
+    QList<QByteArray> partETags;
+    for (int partNumber = 1; !file.atEnd(); ++partNumber) {
+        const QByteArray part = file.read(filePartSize);
+        QtS3ReplyPrivate *partReply =
+            part.isEmpty() ? new QtS3ReplyPrivate(QtS3ReplyBase::FileError,
+                                                  fileName + QStringLiteral(": ")
+                                                      + file.errorString())
+                           : m_s3->uploadPart(bucket, key, uploadId, partNumber, part);
+        if (!partReply->isSuccess()) {
+            delete m_s3->abortMultipartUpload(bucket, key, uploadId);
+            return partReply;
+        }
+        partETags.append(partReply->m_byteArrayData);
+        delete partReply;
+    }
+
+    QtS3ReplyPrivate *completeReply =
+        m_s3->completeMultipartUpload(bucket, key, uploadId, partETags);
+    if (!completeReply->isSuccess())
+        delete m_s3->abortMultipartUpload(bucket, key, uploadId);
+    return completeReply;
+}
+
+QtS3ReplyPrivate *QtS3SyncPrivate::downloadFile(const QByteArray &bucket,
+                                                const QtS3ObjectInfo &object,
+                                                const QString &fileName)
+{
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+
+    // QSaveFile writes to a temporary file which replaces the target on
+    // commit(), so an interrupted download never leaves a partial file.
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return new QtS3ReplyPrivate(QtS3ReplyBase::FileError,
+                                    fileName + QStringLiteral(": ") + file.errorString());
+
+    QtS3ReplyPrivate *s3Reply = 0;
+    if (object.size < m_multipartThreshold) {
+        s3Reply = m_s3->get(bucket, object.key);
+        if (!s3Reply->isSuccess())
+            return s3Reply;
+        if (file.write(s3Reply->m_byteArrayData) != s3Reply->m_byteArrayData.size()) {
+            delete s3Reply;
+            return new QtS3ReplyPrivate(QtS3ReplyBase::FileError,
+                                        fileName + QStringLiteral(": ") + file.errorString());
+        }
+    } else {
+        const qint64 rangeSize = partSize(object.size, m_partSize);
+        for (qint64 offset = 0; offset < object.size; offset += rangeSize) {
+            const qint64 length = qMin(rangeSize, object.size - offset);
+            delete s3Reply;
+            s3Reply = m_s3->getRange(bucket, object.key, offset, length);
+            if (!s3Reply->isSuccess())
+                return s3Reply;
+            if (s3Reply->m_byteArrayData.size() != length
+                || file.write(s3Reply->m_byteArrayData) != length) {
+                delete s3Reply;
+                return new QtS3ReplyPrivate(QtS3ReplyBase::FileError,
+                                            fileName + QStringLiteral(": short read or write"));
+            }
+        }
+    }
+    delete s3Reply;
+
+    if (!file.commit())
+        return new QtS3ReplyPrivate(QtS3ReplyBase::FileError,
+                                    fileName + QStringLiteral(": ") + file.errorString());
+    setModificationTime(fileName, object.lastModified);
+    return new QtS3ReplyPrivate(QtS3ReplyBase::NoError, QString());
+}
+
+// Brings one destination file or object up to date. Returns 0 if there
+// was nothing to do.
+QtS3ReplyPrivate *QtS3SyncPrivate::syncEntry(bool upload, const QByteArray &bucket,
+                                             const QString &key, const QString &fileName,
+                                             const Entry &entry)
+{
+    const bool hasSource = upload ? entry.hasLocal : entry.hasRemote;
+    const bool hasDestination = upload ? entry.hasRemote : entry.hasLocal;
+
+    // Destination only: delete if mirroring.
+    if (!hasSource) {
+        if (!m_deleteExtraneous)
+            return 0;
+        log(QStringLiteral("delete ") + (upload ? key : fileName));
+        {
+            QMutexLocker lock(&m_mutex);
+            ++m_stats.filesDeleted;
+        }
+        if (m_dryRun)
+            return 0;
+        if (upload)
+            return m_s3->remove(bucket, key);
+        if (!QFile::remove(fileName))
+            return new QtS3ReplyPrivate(QtS3ReplyBase::FileError,
+                                        fileName + QStringLiteral(": could not delete"));
+        return 0;
+    }
+
+    {
+        QMutexLocker lock(&m_mutex);
+        ++m_stats.filesChecked;
+    }
+
+    if (hasDestination) {
+        const Comparison comparison = compare(entry.local, entry.remote, upload, m_partSize);
+        if (comparison != Changed) {
+            // Record the object time on the local file so that the next sync
+            // can skip it without hashing.
+            if (!upload && comparison == UnchangedByContent && !m_dryRun)
+                setModificationTime(fileName, entry.remote.lastModified);
+            QMutexLocker lock(&m_mutex);
+            ++m_stats.filesSkipped;
+            return 0;
+        }
+    }
+
+    log((upload ? QStringLiteral("upload ") : QStringLiteral("download ")) + entry.relativePath);
+    const qint64 size = upload ? entry.local.size() : entry.remote.size;
+    QtS3ReplyPrivate *s3Reply = 0;
+    if (!m_dryRun) {
+        s3Reply = upload ? uploadFile(bucket, key, fileName)
+                         : downloadFile(bucket, entry.remote, fileName);
+        if (!s3Reply->isSuccess())
+            return s3Reply;
+    }
+
+    QMutexLocker lock(&m_mutex);
+    ++m_stats.filesTransferred;
+    m_stats.bytesTransferred += size;
+    return s3Reply;
+}
+
+QtS3ReplyPrivate *QtS3SyncPrivate::sync(bool upload, const QString &localDirectory,
+                                        const QByteArray &bucket, const QString &prefix)
+{
+    {
+        QMutexLocker lock(&m_mutex);
+        m_stats = QtS3Sync::Stats();
+    }
+
+    const QString objectPrefix = keyPrefix(prefix);
+    const QDir localDir(localDirectory);
+    if (upload && !localDir.exists())
+        return new QtS3ReplyPrivate(QtS3ReplyBase::FileError,
+                                    localDirectory + QStringLiteral(": directory not found"));
+
+    // Collect the remote and local state, keyed on the relative path.
+    QtS3ReplyPrivate *listReply = m_s3->listParallel(bucket, objectPrefix, m_workerCount);
+    if (!listReply->isSuccess())
+        return listReply;
+    QtS3ReplyPrivate *errorReply = 0;
+    QMap<QString, Entry> entries;
+    foreach (const QtS3ObjectInfo &object, listReply->m_listPage.objects) {
+        if (object.key.endsWith(QLatin1Char('/'))) // "directory" placeholder objects
+            continue;
+        const QString relativePath = object.key.mid(objectPrefix.length());
+        if (!upload && localFileName(localDir, relativePath).isEmpty()) {
+            const QString error = object.key + QStringLiteral(": not a valid local path");
+            log(QStringLiteral("error ") + error);
+            QMutexLocker lock(&m_mutex);
+            ++m_stats.filesFailed;
+            if (!errorReply)
+                errorReply = new QtS3ReplyPrivate(QtS3ReplyBase::FileError, error);
+            continue;
+        }
+        Entry &entry = entries[relativePath];
+        entry.relativePath = relativePath;
+        entry.hasRemote = true;
+        entry.remote = object;
+    }
+    delete listReply;
+
+    if (localDir.exists()) {
+        QDirIterator it(localDir.absolutePath(), QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot,
+                        QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            it.next();
+            const QString relativePath = localDir.relativeFilePath(it.filePath());
+            Entry &entry = entries[relativePath];
+            entry.relativePath = relativePath;
+            entry.hasLocal = true;
+            entry.local = it.fileInfo();
+        }
+    }
+
+    // Sync each entry on the worker pool. All entries are processed, the
+    // first error is returned.
+    const QList<Entry> work = entries.values();
+    m_s3->runConcurrently(work.count(), m_workerCount, [&](int index) {
+        const Entry &entry = work.at(index);
+        const QString key = objectPrefix + entry.relativePath;
+        const QString fileName = localFileName(localDir, entry.relativePath);
+
+        QtS3ReplyPrivate *s3Reply = syncEntry(upload, bucket, key, fileName, entry);
+        if (!s3Reply)
+            return;
+        if (s3Reply->isSuccess()) {
+            delete s3Reply;
+            return;
+        }
+
+        log(QStringLiteral("error ") + entry.relativePath + QStringLiteral(": ")
+            + s3Reply->anyErrorString());
+        QMutexLocker lock(&m_mutex);
+        ++m_stats.filesFailed;
+        if (!errorReply)
+            errorReply = s3Reply;
+        else
+            delete s3Reply;
+    });
+
+    if (errorReply)
+        return errorReply;
+    return new QtS3ReplyPrivate(QtS3ReplyBase::NoError, QString());
+}
+
+void QtS3SyncPrivate::log(const QString &message)
+{
+    QMutexLocker lock(&m_mutex);
+    if (m_logCallback)
+        m_logCallback(message);
+}
+
+/*
+    \class QtS3Sync
+    \brief The QtS3Sync class synchronizes a local directory tree with a bucket prefix.
+
+    upload() makes the bucket prefix a copy of the local directory, and
+    download() makes the local directory a copy of the bucket prefix.
+    Unchanged files are detected by size, modification time and content
+    MD5/ETag, and are not transferred.
+
+    Files are transferred on a pool of worker threads. Files larger than the
+    multipart threshold are uploaded with multipart upload and downloaded
+    with ranged requests, one part in memory per worker.
+*/
+
+/*!
+    Constructs a QtS3Sync object which transfers files using \a s3.
+*/
+QtS3Sync::QtS3Sync(const QtS3 &s3) : d(new QtS3SyncPrivate(s3.d)) {}
+
+QtS3Sync::~QtS3Sync() { delete d; }
+
+/*!
+    Sets the number of worker threads to \a count. The default is 8.
+*/
+void QtS3Sync::setWorkerCount(int count) { d->m_workerCount = qMax(1, count); }
+
+/*!
+    Sets the file size at which multipart upload and ranged download is used
+    to \a bytes. The default is 64MB.
+*/
+void QtS3Sync::setMultipartThreshold(qint64 bytes) { d->m_multipartThreshold = bytes; }
+
+/*!
+    Sets the multipart upload part size and ranged download size to \a bytes.
+    The default is 8MB and the minimum is 5MB. The part size is increased for files
+    which would otherwise need more than 10000 parts.
+*/
+void QtS3Sync::setPartSize(qint64 bytes) { d->m_partSize = qMax(qint64(5 * 1024 * 1024), bytes); }
+
+/*!
+    Sets whether files or objects which are not present in the source are
+    deleted from the destination to \a enable. The default is false.
+*/
+void QtS3Sync::setDeleteExtraneous(bool enable) { d->m_deleteExtraneous = enable; }
+
+/*!
+    Sets dry-run mode to \a enable. In dry-run mode changes are detected and
+    logged but not transferred.
+*/
+void QtS3Sync::setDryRun(bool enable) { d->m_dryRun = enable; }
+
+/*!
+    Sets a \a callback which is called with a message for each transferred,
+    deleted or failed file. The callback is called from the worker threads,
+    one call at a time.
+*/
+void QtS3Sync::setLogCallback(std::function<void(const QString &)> callback)
+{
+    QMutexLocker lock(&d->m_mutex);
+    d->m_logCallback = callback;
+}
+
+/*!
+    Uploads changed files in \a localDirectory to \a prefix in \a bucket.
+*/
+QtS3Reply<void> QtS3Sync::upload(const QString &localDirectory, const QByteArray &bucket,
+                                 const QString &prefix)
+{
+    return QtS3Reply<void>(d->sync(true, localDirectory, bucket, prefix));
+}
+
+/*!
+    Downloads changed objects in \a prefix in \a bucket to \a localDirectory.
+*/
+QtS3Reply<void> QtS3Sync::download(const QByteArray &bucket, const QString &prefix,
+                                   const QString &localDirectory)
+{
+    return QtS3Reply<void>(d->sync(false, localDirectory, bucket, prefix));
+}
+
+/*!
+    Returns statistics for the last upload() or download().
+*/
+QtS3Sync::Stats QtS3Sync::stats()
+{
+    QMutexLocker lock(&d->m_mutex);
+    return d->m_stats;
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
@@ -0,0 +1,64 @@
+#ifndef QTS3SYNC_P_H
+#define QTS3SYNC_P_H
+
+#include "qts3.h"
+#include "qts3_p.h"
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+class QtS3SyncPrivate
+{
+public:
+    QtS3SyncPrivate(const QSharedPointer<QtS3Private> &s3);
+
+    class Entry
+    {
+    public:
+        Entry() : hasLocal(false), hasRemote(false) {}
+
+        QString relativePath;
+        bool hasLocal;
+        QFileInfo local;
+        bool hasRemote;
+        QtS3ObjectInfo remote;
+    };
+
+    enum Comparison {
+        Changed,
+        UnchangedByTime,
+        UnchangedByContent,
+    };
+
+    static QString keyPrefix(const QString &prefix);
+    static QString localFileName(const QDir &localDir, const QString &relativePath);
+    static qint64 partSize(qint64 fileSize, qint64 minimumPartSize);
+    static QByteArray fileETag(const QString &fileName, const QByteArray &remoteETag,
+                               qint64 partSize);
+    static Comparison compare(const QFileInfo &local, const QtS3ObjectInfo &remote, bool upload,
+                              qint64 minimumPartSize);
+
+    QtS3ReplyPrivate *uploadFile(const QByteArray &bucket, const QString &key,
+                                 const QString &fileName);
+    QtS3ReplyPrivate *downloadFile(const QByteArray &bucket, const QtS3ObjectInfo &object,
+                                   const QString &fileName);
+    QtS3ReplyPrivate *syncEntry(bool upload, const QByteArray &bucket, const QString &key,
+                                const QString &fileName, const Entry &entry);
+    QtS3ReplyPrivate *sync(bool upload, const QString &localDirectory, const QByteArray &bucket,
+                           const QString &prefix);
+    void log(const QString &message);
+
+    QSharedPointer<QtS3Private> m_s3;
+    int m_workerCount;
+    qint64 m_multipartThreshold;
+    qint64 m_partSize;
+    bool m_deleteExtraneous;
+    bool m_dryRun;
+    std::function<void(const QString &)> m_logCallback;
+
+    QMutex m_mutex;
+    QtS3Sync::Stats m_stats;
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
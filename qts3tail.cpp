@@ -0,0 +1,262 @@
+#include "qts3tail_p.h"
+
+#include <QtCore>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// QtS3Tail follows prefixes where new keys are appended in key order,
+// typically time-stamped keys. Each prefix has a checkpoint which is the
+// last seen key, and a poll lists only the keys after it (StartAfter).
+
+class QtS3TailThread : public QThread
+{
+public:
+    QtS3TailThread(QtS3TailPrivate *tail) : m_tail(tail) {}
+    void run() { m_tail->run(); }
+
+    QtS3TailPrivate *m_tail;
+};
+
+QtS3TailPrivate::QtS3TailPrivate(const QSharedPointer<QtS3Private> &s3, const QByteArray &bucket)
+    : m_s3(s3), m_bucket(bucket), m_minimumInterval(1000), m_maximumInterval(60000),
+      m_interval(1000), m_stopping(false), m_thread(0)
+{
+}
+
+// Returns the next poll interval: poll again soon while new keys keep
+// arriving, and back off exponentially while the prefixes are idle.
+int QtS3TailPrivate::nextPollInterval(int current, int minimum, int maximum, bool foundNewKeys)
+{
+    if (foundNewKeys)
+        return minimum;
+    return qBound(minimum, current * 2, maximum);
+}
+
+// Lists new keys for all prefixes. The checkpoints are advanced page by
+// page, so that a failed poll resumes after the last delivered key.
+QtS3ReplyPrivate *QtS3TailPrivate::poll()
+{
+    QMap<QString, QString> checkpoints;
+    {
+        QMutexLocker lock(&m_mutex);
+        checkpoints = m_checkpoints;
+    }
+
+    QList<QtS3ObjectInfo> newObjects;
+    for (auto it = checkpoints.constBegin(); it != checkpoints.constEnd(); ++it) {
+        const QString prefix = it.key();
+        QtS3Private::ListRange range;
+        range.prefix = prefix;
+        range.startAfter = it.value();
+
+        QtS3ReplyPrivate *s3Reply = m_s3->listRange(
+            m_bucket, range, [this, &prefix, &newObjects](const QList<QtS3ObjectInfo> &objects) {
+                {
+                    QMutexLocker lock(&m_mutex);
+                    m_checkpoints[prefix] = objects.last().key;
+                }
+                if (m_callback)
+                    m_callback(prefix, objects);
+                newObjects.append(objects);
+                return true;
+            });
+        if (!s3Reply->isSuccess())
+            return s3Reply;
+        delete s3Reply;
+    }
+
+    QtS3ReplyPrivate *s3Reply = new QtS3ReplyPrivate(QtS3ReplyBase::NoError, QString());
+    s3Reply->m_listPage.objects = newObjects;
+    return s3Reply;
+}
+
+// Poll loop for the background thread.
+void QtS3TailPrivate::run()
+{
+    QMutexLocker lock(&m_mutex);
+    while (!m_stopping) {
+        lock.unlock();
+        QtS3ReplyPrivate *s3Reply = poll();
+        const bool foundNewKeys = s3Reply->isSuccess() && !s3Reply->m_listPage.objects.isEmpty();
+        if (!s3Reply->isSuccess())
+            qWarning() << "QtS3Tail poll failed:" << s3Reply->anyErrorString();
+        delete s3Reply;
+        lock.relock();
+
+        m_interval =
+            nextPollInterval(m_interval, m_minimumInterval, m_maximumInterval, foundNewKeys);
+        if (!m_stopping)
+            m_wakeCondition.wait(&m_mutex, m_interval);
+    }
+}
+
+/*
+    \class QtS3Tail
+    \brief The QtS3Tail class follows append-only key prefixes in a bucket.
+
+    QtS3Tail keeps a checkpoint (the last seen key) for each prefix and polls
+    for keys after it, which avoids re-listing the entire prefix. This requires
+    that new keys sort after existing keys, for example keys that start with
+    a time stamp.
+
+    New keys are delivered to the callback. The poll interval adapts to the
+    rate of new keys: it is reset to the minimum interval when new keys are
+    found, and doubles up to the maximum interval while the prefixes are idle.
+*/
+
+/*!
+    Constructs a QtS3Tail object which polls prefixes in \a bucket using \a s3.
+*/
+QtS3Tail::QtS3Tail(const QtS3 &s3, const QByteArray &bucket)
+    : d(new QtS3TailPrivate(s3.d, bucket))
+{
+}
+
+/*!
+    Destroys the QtS3Tail object, stopping polling if started.
+*/
+QtS3Tail::~QtS3Tail()
+{
+    stop();
+    delete d;
+}
+
+/*!
+    Adds \a prefix to the set of followed prefixes. The first poll lists
+    all existing keys for the prefix, unless a checkpoint for it has been
+    restored.
+*/
+void QtS3Tail::addPrefix(const QString &prefix)
+{
+    QMutexLocker lock(&d->m_mutex);
+    if (!d->m_checkpoints.contains(prefix))
+        d->m_checkpoints.insert(prefix, QString());
+}
+
+/*!
+    Returns the followed prefixes.
+*/
+QStringList QtS3Tail::prefixes()
+{
+    QMutexLocker lock(&d->m_mutex);
+    return d->m_checkpoints.keys();
+}
+
+/*!
+    Sets the \a callback which is called with new objects for a prefix. The
+    callback is called from the thread calling poll(), or from the polling
+    thread after start(). Set the callback before starting.
+*/
+void QtS3Tail::setCallback(
+    std::function<void(const QString &prefix, const QList<QtS3ObjectInfo> &objects)> callback)
+{
+    QMutexLocker lock(&d->m_mutex);
+    d->m_callback = callback;
+}
+
+/*!
+    Sets the poll interval range to [\a minimumMsecs, \a maximumMsecs].
+    The default is 1 to 60 seconds.
+*/
+void QtS3Tail::setPollInterval(int minimumMsecs, int maximumMsecs)
+{
+    QMutexLocker lock(&d->m_mutex);
+    d->m_minimumInterval = qMax(1, minimumMsecs);
+    d->m_maximumInterval = qMax(d->m_minimumInterval, maximumMsecs);
+    d->m_interval = d->m_minimumInterval;
+}
+
+/*!
+    Returns the current poll interval.
+*/
+int QtS3Tail::pollInterval()
+{
+    QMutexLocker lock(&d->m_mutex);
+    return d->m_interval;
+}
+
+/*!
+    Polls all prefixes once and returns the new objects. The callback is
+    called for each new page of objects.
+*/
+QtS3Reply<QList<QtS3ObjectInfo>> QtS3Tail::poll()
+{
+    return QtS3Reply<QList<QtS3ObjectInfo>>(d->poll());
+}
+
+/*!
+    Starts polling on a background thread.
+*/
+void QtS3Tail::start()
+{
+    QMutexLocker lock(&d->m_mutex);
+    if (d->m_thread)
+        return;
+    d->m_stopping = false;
+    d->m_interval = d->m_minimumInterval;
+    d->m_thread = new QtS3TailThread(d);
+    d->m_thread->start();
+}
+
+/*!
+    Stops polling and waits for an in-progress poll to complete.
+*/
+void QtS3Tail::stop()
+{
+    QThread *thread;
+    {
+        QMutexLocker lock(&d->m_mutex);
+        thread = d->m_thread;
+        d->m_thread = 0;
+        d->m_stopping = true;
+        d->m_wakeCondition.wakeAll();
+    }
+
+    if (thread) {
+        thread->wait();
+        delete thread;
+    }
+}
+
+/*!
+    Returns the current checkpoints. Store the checkpoint and pass it to
+    restoreCheckpoint() to resume after a restart without re-listing.
+*/
+QByteArray QtS3Tail::saveCheckpoint()
+{
+    QMutexLocker lock(&d->m_mutex);
+
+    QJsonObject prefixes;
+    for (auto it = d->m_checkpoints.constBegin(); it != d->m_checkpoints.constEnd(); ++it)
+        prefixes.insert(it.key(), it.value());
+
+    QJsonObject checkpoint;
+    checkpoint.insert(QStringLiteral("bucket"), QString::fromLatin1(d->m_bucket));
+    checkpoint.insert(QStringLiteral("prefixes"), prefixes);
+    return QJsonDocument(checkpoint).toJson(QJsonDocument::Compact);
+}
+
+/*!
+    Restores \a checkpoint as created by saveCheckpoint(). The prefixes in
+    the checkpoint are added to the followed prefixes. Returns false if the
+    checkpoint is invalid or for a different bucket.
+*/
+bool QtS3Tail::restoreCheckpoint(const QByteArray &checkpoint)
+{
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(checkpoint, &error);
+    if (error.error != QJsonParseError::NoError || !document.isObject())
+        return false;
+
+    const QJsonObject object = document.object();
+    if (object.value(QStringLiteral("bucket")).toString().toLatin1() != d->m_bucket)
+        return false;
+
+    QMutexLocker lock(&d->m_mutex);
+    const QJsonObject prefixes = object.value(QStringLiteral("prefixes")).toObject();
+    for (auto it = prefixes.constBegin(); it != prefixes.constEnd(); ++it)
+        d->m_checkpoints.insert(it.key(), it.value().toString());
+    return true;
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
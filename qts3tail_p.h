@@ -0,0 +1,35 @@
+#ifndef QTS3TAIL_P_H
+#define QTS3TAIL_P_H
+
+#include "qts3.h"
+#include "qts3_p.h"
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+class QtS3TailPrivate
+{
+public:
+    QtS3TailPrivate(const QSharedPointer<QtS3Private> &s3, const QByteArray &bucket);
+
+    static int nextPollInterval(int current, int minimum, int maximum, bool foundNewKeys);
+
+    QtS3ReplyPrivate *poll();
+    void run();
+
+    QSharedPointer<QtS3Private> m_s3;
+    QByteArray m_bucket;
+    std::function<void(const QString &, const QList<QtS3ObjectInfo> &)> m_callback;
+    QMap<QString, QString> m_checkpoints; // prefix -> last seen key
+    int m_minimumInterval;
+    int m_maximumInterval;
+    int m_interval;
+
+    QMutex m_mutex;
+    QWaitCondition m_wakeCondition;
+    bool m_stopping;
+    QThread *m_thread;
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
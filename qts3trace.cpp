@@ -0,0 +1,202 @@
+#include "qts3trace_p.h"
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+QtS3TraceRing::QtS3TraceRing(int threadId, const QByteArray &threadName)
+    : m_threadId(threadId), m_threadName(threadName), m_writeIndex(0), m_startIndex(0)
+{
+}
+
+int QtS3TraceRing::threadId() const
+{
+    return m_threadId;
+}
+
+QByteArray QtS3TraceRing::threadName() const
+{
+    return m_threadName;
+}
+
+// Adds an event. Must be called on the owning thread.
+void QtS3TraceRing::add(const char *name, char phase, qint64 timestamp)
+{
+    const quint64 index = m_writeIndex.load();
+    Event &event = m_events[index % Capacity];
+    event.name = name;
+    event.timestamp = timestamp;
+    event.phase = phase;
+    m_writeIndex.storeRelease(index + 1);
+}
+
+// Returns the events in the ring, oldest first. Events which the writer may
+// have overwritten while they were copied are dropped.
+QVector<QtS3TraceRing::Event> QtS3TraceRing::events() const
+{
+    const quint64 end = m_writeIndex.loadAcquire();
+    const quint64 start = m_startIndex.loadAcquire();
+    quint64 begin = qMax(start, end > Capacity ? end - Capacity : 0);
+
+    QVector<Event> copy;
+    copy.reserve(int(end - qMin(begin, end)));
+    for (quint64 index = begin; index < end; ++index)
+        copy.append(m_events[index % Capacity]);
+
+    // The writer may be writing the slot for endAfterCopy, which holds the
+    // event at endAfterCopy - Capacity.
+    const quint64 endAfterCopy = m_writeIndex.loadAcquire();
+    const quint64 overwritten = endAfterCopy + 1 > Capacity ? endAfterCopy + 1 - Capacity : 0;
+    if (overwritten > begin)
+        copy.remove(0, int(qMin(overwritten, end) - begin));
+    return copy;
+}
+
+// Drops the events recorded so far. May be called from any thread.
+void QtS3TraceRing::clear()
+{
+    m_startIndex.storeRelease(m_writeIndex.loadAcquire());
+}
+
+QtS3Tracer::QtS3Tracer() : m_enabled(0), m_nextThreadId(1)
+{
+    m_clock.start();
+}
+
+Q_GLOBAL_STATIC(QtS3Tracer, tracer)
+
+QtS3Tracer *QtS3Tracer::instance()
+{
+    return tracer();
+}
+
+// Holds the ring for the current thread, created on first use by an enabled
+// tracer, and releases it when the thread exits.
+class QtS3ThreadRingHolder
+{
+public:
+    QtS3ThreadRingHolder() : ring(0) {}
+    ~QtS3ThreadRingHolder()
+    {
+        if (ring && !tracer.isDestroyed())
+            tracer()->releaseRing(ring);
+    }
+
+    QtS3TraceRing *ring;
+};
+
+static thread_local QtS3ThreadRingHolder currentThreadRing;
+
+void QtS3Tracer::setEnabled(bool enabled)
+{
+    m_enabled.store(enabled ? 1 : 0);
+}
+
+void QtS3Tracer::begin(const char *name)
+{
+    threadRing()->add(name, 'B', m_clock.nsecsElapsed());
+}
+
+void QtS3Tracer::end(const char *name)
+{
+    threadRing()->add(name, 'E', m_clock.nsecsElapsed());
+}
+
+void QtS3Tracer::instant(const char *name)
+{
+    if (isEnabled())
+        threadRing()->add(name, 'i', m_clock.nsecsElapsed());
+}
+
+QtS3TraceRing *QtS3Tracer::threadRing()
+{
+    if (currentThreadRing.ring)
+        return currentThreadRing.ring;
+
+    QMutexLocker lock(&m_ringsMutex);
+    const int threadId = m_nextThreadId++;
+    QByteArray threadName = QThread::currentThread()->objectName().toUtf8();
+    if (threadName.isEmpty())
+        threadName = "Thread " + QByteArray::number(threadId);
+    m_rings.append(QSharedPointer<QtS3TraceRing>(new QtS3TraceRing(threadId, threadName)));
+    currentThreadRing.ring = m_rings.last().data();
+    return currentThreadRing.ring;
+}
+
+// Unregisters the ring of an exiting thread. The ring, and its events, are
+// deleted once formatChromeTrace() no longer uses it.
+void QtS3Tracer::releaseRing(QtS3TraceRing *ring)
+{
+    QMutexLocker lock(&m_ringsMutex);
+    for (int i = 0; i < m_rings.count(); ++i) {
+        if (m_rings.at(i).data() == ring) {
+            m_rings.removeAt(i);
+            return;
+        }
+    }
+}
+
+static QByteArray formatJsonString(const QByteArray &string)
+{
+    QByteArray escaped = string;
+    escaped.replace('\\', "\\\\").replace('"', "\\\"");
+    return '"' + escaped + '"';
+}
+
+// Returns the recorded events as Chrome trace-event JSON, which can be
+// loaded in chrome://tracing or Perfetto. Spans cut off by the ring
+// capacity are dropped.
+QByteArray QtS3Tracer::formatChromeTrace()
+{
+    QList<QSharedPointer<QtS3TraceRing>> rings;
+    {
+        QMutexLocker lock(&m_ringsMutex);
+        rings = m_rings;
+    }
+
+    const QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+    QByteArray json = "{\"traceEvents\":[";
+    bool first = true;
+    auto appendEvent = [&json, &first](const QByteArray &event) {
+        if (!first)
+            json += ",\n";
+        json += event;
+        first = false;
+    };
+
+    for (const QSharedPointer<QtS3TraceRing> &ring : rings) {
+        const QByteArray tid = QByteArray::number(ring->threadId());
+        appendEvent("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + pid + ",\"tid\":" + tid
+                    + ",\"args\":{\"name\":" + formatJsonString(ring->threadName()) + "}}");
+
+        int depth = 0;
+        for (const QtS3TraceRing::Event &event : ring->events()) {
+            // Skip ends of spans whose begin was overwritten
+            if (event.phase == 'E') {
+                if (depth == 0)
+                    continue;
+                --depth;
+            } else if (event.phase == 'B') {
+                ++depth;
+            }
+            const QByteArray timestamp = QByteArray::number(event.timestamp / 1000.0, 'f', 3);
+            QByteArray formatted = "{\"name\":\"" + QByteArray(event.name)
+                                   + "\",\"cat\":\"qts3\",\"ph\":\"" + event.phase
+                                   + "\",\"ts\":" + timestamp + ",\"pid\":" + pid
+                                   + ",\"tid\":" + tid;
+            if (event.phase == 'i')
+                formatted += ",\"s\":\"t\"";
+            appendEvent(formatted + "}");
+        }
+    }
+
+    json += "],\"displayTimeUnit\":\"ms\"}\n";
+    return json;
+}
+
+void QtS3Tracer::clear()
+{
+    QMutexLocker lock(&m_ringsMutex);
+    for (const QSharedPointer<QtS3TraceRing> &ring : m_rings)
+        ring->clear();
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
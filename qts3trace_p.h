@@ -0,0 +1,102 @@
+#ifndef QTS3TRACE_P_H
+#define QTS3TRACE_P_H
+
+#include "qts3.h"
+
+#include <QtCore>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// Fixed-size ring of trace events for one thread. Only the owning thread
+// writes, without locking; other threads may take snapshots at any time.
+// When the ring is full the oldest events are overwritten.
+class QtS3TraceRing
+{
+public:
+    enum { Capacity = 4096 };
+
+    class Event
+    {
+    public:
+        const char *name; // static string
+        qint64 timestamp; // nsecs since the tracer was created
+        char phase;       // 'B'egin, 'E'nd or 'i'nstant
+    };
+
+    QtS3TraceRing(int threadId, const QByteArray &threadName);
+
+    int threadId() const;
+    QByteArray threadName() const;
+
+    void add(const char *name, char phase, qint64 timestamp);
+    QVector<Event> events() const;
+    void clear();
+
+private:
+    Q_DISABLE_COPY(QtS3TraceRing)
+    const int m_threadId;
+    const QByteArray m_threadName;
+    QAtomicInteger<quint64> m_writeIndex; // total events written
+    QAtomicInteger<quint64> m_startIndex; // first event after clear()
+    Event m_events[Capacity];
+};
+
+// Process-wide tracer. Records begin/end spans and instant events into
+// per-thread rings, and formats them as Chrome trace-event JSON. Tracing is
+// disabled by default, and then costs one atomic load per span.
+class QtS3Tracer
+{
+public:
+    QtS3Tracer();
+    static QtS3Tracer *instance();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() const { return m_enabled.load(); }
+
+    void begin(const char *name);
+    void end(const char *name);
+    void instant(const char *name);
+
+    QByteArray formatChromeTrace();
+    void clear();
+    void releaseRing(QtS3TraceRing *ring);
+
+private:
+    QtS3TraceRing *threadRing();
+
+    QAtomicInt m_enabled;
+    QElapsedTimer m_clock;
+    QMutex m_ringsMutex;
+    QList<QSharedPointer<QtS3TraceRing>> m_rings; // rings of running threads
+    int m_nextThreadId;
+};
+
+// Records a span for the lifetime of the object:
+//     QtS3TraceSpan span("sign");
+class QtS3TraceSpan
+{
+public:
+    explicit QtS3TraceSpan(const char *name) : m_name(0)
+    {
+        QtS3Tracer *tracer = QtS3Tracer::instance();
+        if (tracer->isEnabled()) {
+            m_name = name;
+            tracer->begin(name);
+        }
+    }
+
+    ~QtS3TraceSpan()
+    {
+        // End spans which began, also if tracing was disabled meanwhile.
+        if (m_name)
+            QtS3Tracer::instance()->end(m_name);
+    }
+
+private:
+    Q_DISABLE_COPY(QtS3TraceSpan)
+    const char *m_name;
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
@@ -0,0 +1,418 @@
+#include "qts3transport_p.h"
+#include "qts3metrics_p.h"
+#include "qts3trace_p.h"
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+QtS3TransportReply::QtS3TransportReply(const QNetworkRequest &request, const QByteArray &verb)
+    : m_offset(0)
+{
+    setRequest(request);
+    setUrl(request.url());
+    setOperation(QNetworkAccessManager::CustomOperation);
+    setAttribute(QNetworkRequest::CustomVerbAttribute, verb);
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+void QtS3TransportReply::setResponse(int statusCode, const QByteArray &reasonPhrase,
+                                     const QList<RawHeaderPair> &headers,
+                                     const QByteArray &content)
+{
+    setAttribute(QNetworkRequest::HttpStatusCodeAttribute, statusCode);
+    setAttribute(QNetworkRequest::HttpReasonPhraseAttribute, reasonPhrase);
+    for (const RawHeaderPair &header : headers)
+        setRawHeader(header.first, header.second);
+    m_content = content;
+    m_offset = 0;
+
+    // Map error status codes like QNetworkAccessManager does.
+    if (statusCode >= 400) {
+        NetworkError error = UnknownContentError;
+        if (statusCode == 401)
+            error = AuthenticationRequiredError;
+        else if (statusCode == 403)
+            error = ContentAccessDenied;
+        else if (statusCode == 404)
+            error = ContentNotFoundError;
+        else if (statusCode == 409)
+            error = ContentConflictError;
+        else if (statusCode >= 500)
+            error = statusCode == 503 ? ServiceUnavailableError : InternalServerError;
+        setError(error, QString::fromLatin1(reasonPhrase));
+    }
+    setFinished(true);
+}
+
+void QtS3TransportReply::setNetworkError(NetworkError error, const QString &errorString)
+{
+    setError(error, errorString);
+    setFinished(true);
+}
+
+void QtS3TransportReply::abort()
+{
+}
+
+bool QtS3TransportReply::isSequential() const
+{
+    return true;
+}
+
+qint64 QtS3TransportReply::bytesAvailable() const
+{
+    return m_content.size() - m_offset + QNetworkReply::bytesAvailable();
+}
+
+qint64 QtS3TransportReply::readData(char *data, qint64 maxSize)
+{
+    const qint64 count = qMin(maxSize, m_content.size() - m_offset);
+    if (count <= 0)
+        return m_offset == m_content.size() ? -1 : 0;
+    memcpy(data, m_content.constData() + m_offset, count);
+    m_offset += count;
+    if (m_offset == m_content.size()) {
+        m_content.clear();
+        m_offset = 0;
+    }
+    return count;
+}
+
+QtS3TransportReplies::QtS3TransportReplies(Deletion deletion)
+    : m_deletion(deletion)
+{
+}
+
+QtS3TransportReplies::~QtS3TransportReplies()
+{
+    QHash<QObject *, QMetaObject::Connection> replies;
+    {
+        QMutexLocker lock(&m_mutex);
+        replies.swap(m_replies);
+    }
+    for (auto it = replies.constBegin(); it != replies.constEnd(); ++it) {
+        QObject::disconnect(it.value());
+        if (m_deletion == DeleteLater)
+            it.key()->deleteLater();
+        else
+            delete it.key();
+    }
+}
+
+void QtS3TransportReplies::add(QNetworkReply *reply)
+{
+    QMutexLocker lock(&m_mutex);
+    m_replies.insert(reply, QObject::connect(reply, &QObject::destroyed,
+                                             [this](QObject *object) { remove(object); }));
+}
+
+void QtS3TransportReplies::remove(QObject *reply)
+{
+    QMutexLocker lock(&m_mutex);
+    m_replies.remove(reply);
+}
+
+QtS3QnamTransport::QtS3QnamTransport(ThreadsafeBlockingNetworkAccesManager *networkAccessManager)
+    : m_networkAccessManager(networkAccessManager), m_replies(QtS3TransportReplies::DeleteLater)
+{
+}
+
+QNetworkReply *QtS3QnamTransport::sendRequest(const QNetworkRequest &request,
+                                              const QByteArray &verb, const QByteArray &payload,
+                                              int priorityClass, const RequestSigner &sign)
+{
+    QBuffer payloadBuffer(const_cast<QByteArray *>(&payload));
+    if (!payload.isEmpty())
+        payloadBuffer.open(QIODevice::ReadOnly);
+
+    QNetworkReply *reply = m_networkAccessManager->sendCustomRequest(
+        request, verb, payload.isEmpty() ? nullptr : &payloadBuffer, priorityClass, sign);
+    if (reply)
+        m_replies.add(reply);
+    return reply;
+}
+
+void QtS3QnamTransport::connectToHost(const QUrl &endpoint, int connections)
+{
+    m_networkAccessManager->connectToHost(endpoint, connections);
+}
+
+QtS3ThreadLocalTransport::QtS3ThreadLocalTransport(
+    ThreadsafeBlockingNetworkAccesManager *networkAccessManager)
+    : m_sharedNetworkAccessManager(networkAccessManager),
+      m_networkAccessManagers(new NetworkAccessManagers)
+{
+}
+
+// Deletes the network access managers of threads which are still running,
+// on their threads: when they next process events, or at the latest when
+// they exit.
+QtS3ThreadLocalTransport::~QtS3ThreadLocalTransport()
+{
+    QMutexLocker lock(&m_networkAccessManagers->mutex);
+    for (SlottetNetworkAccessManager *networkAccessManager : m_networkAccessManagers->managers)
+        networkAccessManager->deleteLater();
+    m_networkAccessManagers->managers.clear();
+}
+
+QNetworkReply *QtS3ThreadLocalTransport::sendRequest(const QNetworkRequest &unsignedRequest,
+                                                     const QByteArray &verb,
+                                                     const QByteArray &payload, int priorityClass,
+                                                     const RequestSigner &sign)
+{
+    MemoryBudget *memoryBudget = m_sharedNetworkAccessManager->memoryBudget();
+    RequestScheduler *scheduler = m_sharedNetworkAccessManager->scheduler();
+    BandwidthShaper *bandwidthShaper = m_sharedNetworkAccessManager->bandwidthShaper();
+
+    // Reserve memory for the payload, and wait for the scheduler to admit
+    // the request, as ThreadsafeBlockingNetworkAccesManager does.
+    const QByteArray host = RequestScheduler::hostKey(unsignedRequest.url());
+    QElapsedTimer memoryWaitTimer;
+    memoryWaitTimer.start();
+    {
+        QtS3TraceSpan span("memory budget");
+        if (!memoryBudget->acquire(payload.size()))
+            return 0;
+    }
+    qint64 queueWaitTime = memoryWaitTimer.elapsed();
+    QtS3MetricsRegistry::instance()->addPendingRequests(1);
+    {
+        QtS3TraceSpan span("enqueue");
+        queueWaitTime += scheduler->acquire(priorityClass, host);
+    }
+    QNetworkRequest request(unsignedRequest);
+    if (sign)
+        sign(&request);
+
+    // Send the request on this thread, and run an event loop until it
+    // completes and shaped content has been read.
+    QBuffer payloadBuffer(const_cast<QByteArray *>(&payload));
+    QIODevice *data = 0;
+    if (!payload.isEmpty()) {
+        payloadBuffer.open(QIODevice::ReadOnly);
+        data = &payloadBuffer;
+    }
+    QScopedPointer<ShapedUploadDevice> uploadDevice;
+    if (data && bandwidthShaper->isLimited(BandwidthShaper::Upload, priorityClass)) {
+        uploadDevice.reset(new ShapedUploadDevice(data, bandwidthShaper, priorityClass));
+        data = uploadDevice.data();
+    }
+    QScopedPointer<ShapedDownloadReader> downloadReader;
+    if (bandwidthShaper->isLimited(BandwidthShaper::Download, priorityClass))
+        downloadReader.reset(new ShapedDownloadReader(bandwidthShaper, priorityClass));
+
+    QElapsedTimer requestTimer;
+    requestTimer.start();
+    QNetworkReply *networkReply = 0;
+    {
+        QtS3TraceSpan span("network");
+        QEventLoop eventLoop;
+        networkReply = localNetworkAccessManager()->sendCustomRequest_slot(
+            request, verb, data, downloadReader.data(), memoryBudget);
+        QObject::connect(networkReply, &QNetworkReply::finished, &eventLoop, &QEventLoop::quit);
+        if (downloadReader) {
+            QObject::connect(downloadReader.data(), &ShapedDownloadReader::finished, &eventLoop,
+                             &QEventLoop::quit);
+        }
+        while (!(downloadReader ? downloadReader->isFinished() : networkReply->isFinished()))
+            eventLoop.exec(QEventLoop::ExcludeUserInputEvents);
+    }
+    scheduler->release(priorityClass, host);
+    memoryBudget->releaseReply(networkReply, payload.size());
+
+    // Copy the response to a reply owned by the transport: the network access
+    // manager deletes its replies when this thread exits.
+    QByteArray content = downloadReader ? downloadReader->content() : QByteArray();
+    content += networkReply->readAll();
+    QtS3TransportReply *reply = new QtS3TransportReply(request, verb);
+    reply->setResponse(networkReply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt(),
+                       networkReply->attribute(QNetworkRequest::HttpReasonPhraseAttribute)
+                           .toByteArray(),
+                       networkReply->rawHeaderPairs(), content);
+    if (networkReply->error() != QNetworkReply::NoError)
+        reply->setNetworkError(networkReply->error(), networkReply->errorString());
+    m_replies.add(reply);
+
+    // Record the request timings (in usecs) and sizes, see
+    // QtS3Private::processNetworkReplyState().
+    const qint64 requestTime = requestTimer.nsecsElapsed() / 1000;
+    const qint64 timeToFirstByte =
+        networkReply->property("qts3TimeToFirstByte").isValid()
+            ? qMin(requestTime, networkReply->property("qts3TimeToFirstByte").toLongLong())
+            : requestTime;
+    reply->setProperty("qts3QueueWaitTime", queueWaitTime);
+    reply->setProperty("qts3TimeToFirstByte", timeToFirstByte);
+    reply->setProperty("qts3TransferTime", requestTime - timeToFirstByte);
+    reply->setProperty("qts3BytesSent", payload.size());
+    reply->setProperty("qts3BytesReceived", content.size());
+    delete networkReply;
+    QtS3MetricsRegistry::instance()->addPendingRequests(-1);
+    return reply;
+}
+
+// Opens connections for the calling thread, which has its own pool. The
+// connections are opened while the thread runs its event loop, at the
+// latest on the next request.
+void QtS3ThreadLocalTransport::connectToHost(const QUrl &endpoint, int connections)
+{
+    SlottetNetworkAccessManager *networkAccessManager = localNetworkAccessManager();
+    for (int i = 0; i < connections; ++i)
+        networkAccessManager->connectToHost_slot(endpoint);
+}
+
+SlottetNetworkAccessManager *QtS3ThreadLocalTransport::localNetworkAccessManager()
+{
+    QThread *thread = QThread::currentThread();
+    QMutexLocker lock(&m_networkAccessManagers->mutex);
+    SlottetNetworkAccessManager *networkAccessManager =
+        m_networkAccessManagers->managers.value(thread);
+    if (networkAccessManager)
+        return networkAccessManager;
+
+    // Delete the network access manager when the thread exits. Finished
+    // threads process deferred deletes after emitting finished().
+    networkAccessManager = new SlottetNetworkAccessManager;
+    m_networkAccessManagers->managers.insert(thread, networkAccessManager);
+    QSharedPointer<NetworkAccessManagers> networkAccessManagers = m_networkAccessManagers;
+    QObject::connect(thread, &QThread::finished, networkAccessManager,
+                     [networkAccessManagers, thread]() {
+                         QMutexLocker lock(&networkAccessManagers->mutex);
+                         SlottetNetworkAccessManager *networkAccessManager =
+                             networkAccessManagers->managers.take(thread);
+                         if (networkAccessManager)
+                             networkAccessManager->deleteLater();
+                     },
+                     Qt::DirectConnection);
+    return networkAccessManager;
+}
+
+QNetworkReply *QtS3LoopbackTransport::sendRequest(const QNetworkRequest &unsignedRequest,
+                                                  const QByteArray &verb,
+                                                  const QByteArray &payload, int priorityClass,
+                                                  const RequestSigner &sign)
+{
+    Q_UNUSED(priorityClass);
+
+    // Sign the request anyway: this transport measures the signing cost.
+    QNetworkRequest request(unsignedRequest);
+    if (sign)
+        sign(&request);
+    QtS3MetricsRegistry::instance()->addPendingRequests(1);
+    QElapsedTimer timer;
+    timer.start();
+
+    // Path-style (endpoint/bucket/key) or virtual-hosted (bucket.s3.amazonaws.com/key)
+    const QUrl url = request.url();
+    const QUrlQuery query(url);
+    const QByteArray awsHostSuffix = ".s3.amazonaws.com";
+    QByteArray path = url.path(QUrl::FullyDecoded).toUtf8();
+    const QByteArray host = url.host().toUtf8();
+    if (host.endsWith(awsHostSuffix))
+        path = "/" + host.left(host.size() - awsHostSuffix.size()) + path;
+
+    int status = 200;
+    QByteArray reasonPhrase = "OK";
+    QList<QNetworkReply::RawHeaderPair> headers;
+    QByteArray content;
+    auto etag = [](const QByteArray &object) {
+        return "\"" + QCryptographicHash::hash(object, QCryptographicHash::Md5).toHex() + "\"";
+    };
+
+    if (query.hasQueryItem("location")) {
+        content = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                  "<LocationConstraint>us-east-1</LocationConstraint>";
+    } else if (query.hasQueryItem("list-type")) {
+        content = listObjects(path.endsWith('/') ? path : path + "/", query);
+    } else if (verb == "PUT") {
+        QWriteLocker lock(&m_objectsLock);
+        m_objects.insert(path, payload);
+        headers.append(qMakePair(QByteArray("ETag"), etag(payload)));
+    } else if (verb == "DELETE") {
+        QWriteLocker lock(&m_objectsLock);
+        m_objects.remove(path);
+        status = 204;
+        reasonPhrase = "No Content";
+    } else {
+        QReadLocker lock(&m_objectsLock);
+        auto object = m_objects.constFind(path);
+        if (object == m_objects.constEnd()) {
+            status = 404;
+            reasonPhrase = "Not Found";
+            if (verb == "GET") {
+                content = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                          "<Error><Code>NoSuchKey</Code>"
+                          "<Message>The specified key does not exist.</Message></Error>";
+            }
+        } else {
+            headers.append(qMakePair(QByteArray("ETag"), etag(object.value())));
+            headers.append(qMakePair(QByteArray("Content-Length"),
+                                     QByteArray::number(object.value().size())));
+            headers.append(qMakePair(QByteArray("Last-Modified"),
+                                     QByteArray("Sun, 01 Jan 2006 12:00:00 GMT")));
+            if (verb == "GET")
+                content = object.value();
+        }
+    }
+
+    QtS3TransportReply *reply = new QtS3TransportReply(request, verb);
+    reply->setResponse(status, reasonPhrase, headers, content);
+    const qint64 requestTime = timer.nsecsElapsed() / 1000;
+    reply->setProperty("qts3QueueWaitTime", 0);
+    reply->setProperty("qts3TimeToFirstByte", requestTime);
+    reply->setProperty("qts3TransferTime", 0);
+    reply->setProperty("qts3BytesSent", payload.size());
+    reply->setProperty("qts3BytesReceived", content.size());
+    m_replies.add(reply);
+    QtS3MetricsRegistry::instance()->addPendingRequests(-1);
+    return reply;
+}
+
+// Returns a ListObjectsV2 result for bucketPath ("/bucket/"). Supports the
+// prefix, start-after, continuation-token and max-keys parameters.
+QByteArray QtS3LoopbackTransport::listObjects(const QByteArray &bucketPath,
+                                              const QUrlQuery &query)
+{
+    const QByteArray prefix = query.queryItemValue("prefix", QUrl::FullyDecoded).toUtf8();
+    const QByteArray startAfter =
+        qMax(query.queryItemValue("start-after", QUrl::FullyDecoded).toUtf8(),
+             query.queryItemValue("continuation-token", QUrl::FullyDecoded).toUtf8());
+    const int maxKeys = query.hasQueryItem("max-keys") ? query.queryItemValue("max-keys").toInt()
+                                                       : 1000;
+
+    QByteArray contents;
+    QByteArray lastKey;
+    int count = 0;
+    bool truncated = false;
+    {
+        QReadLocker lock(&m_objectsLock);
+        const QMap<QByteArray, QByteArray> &objects = m_objects;
+        for (auto it = objects.lowerBound(bucketPath + qMax(prefix, startAfter));
+             it != objects.constEnd() && it.key().startsWith(bucketPath + prefix); ++it) {
+            const QByteArray key = it.key().mid(bucketPath.size());
+            if (key <= startAfter)
+                continue;
+            if (count == maxKeys) {
+                truncated = true;
+                break;
+            }
+            ++count;
+            lastKey = key;
+            contents += "<Contents><Key>" + QString::fromUtf8(key).toHtmlEscaped().toUtf8()
+                        + "</Key><LastModified>2006-01-01T12:00:00.000Z</LastModified>"
+                        + "<ETag>&quot;"
+                        + QCryptographicHash::hash(it.value(), QCryptographicHash::Md5).toHex()
+                        + "&quot;</ETag><Size>" + QByteArray::number(it.value().size())
+                        + "</Size></Contents>";
+        }
+    }
+
+    QByteArray content = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<ListBucketResult>";
+    content += "<KeyCount>" + QByteArray::number(count) + "</KeyCount>";
+    content += truncated ? "<IsTruncated>true</IsTruncated>" : "<IsTruncated>false</IsTruncated>";
+    if (truncated) {
+        content += "<NextContinuationToken>" + QString::fromUtf8(lastKey).toHtmlEscaped().toUtf8()
+                   + "</NextContinuationToken>";
+    }
+    return content + contents + "</ListBucketResult>";
+}
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
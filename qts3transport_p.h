@@ -0,0 +1,159 @@
+#ifndef QTS3TRANSPORT_P_H
+#define QTS3TRANSPORT_P_H
+
+#include "qts3.h"
+#include "qts3qnam_p.h"
+
+#include <QtCore>
+#include <QtNetwork/QNetworkReply>
+
+QPM_BEGIN_NAMESPACE(com, github, msorvig, s3)
+
+// Sends HTTP requests for QtS3Private. sendRequest() signs the request with
+// sign once it has been admitted to the network, blocks until the reply has
+// finished, and returns 0 if the request could not be started.
+// Replies carry the timing and size properties described at
+// QtS3Private::processNetworkReplyState() and are owned by the transport.
+// Implementations are thread-safe.
+class QtS3Transport
+{
+public:
+    virtual ~QtS3Transport() {}
+
+    virtual QNetworkReply *sendRequest(const QNetworkRequest &request, const QByteArray &verb,
+                                       const QByteArray &payload, int priorityClass,
+                                       const RequestSigner &sign) = 0;
+
+    // Opens keep-alive connections to endpoint ahead of requests. Does
+    // nothing by default.
+    virtual void connectToHost(const QUrl &endpoint, int connections)
+    {
+        Q_UNUSED(endpoint);
+        Q_UNUSED(connections);
+    }
+};
+
+// A finished reply with content held in memory, for transports which do not
+// use QNetworkAccessManager.
+class QtS3TransportReply : public QNetworkReply
+{
+    Q_OBJECT
+public:
+    QtS3TransportReply(const QNetworkRequest &request, const QByteArray &verb);
+
+    void setResponse(int statusCode, const QByteArray &reasonPhrase,
+                     const QList<RawHeaderPair> &headers, const QByteArray &content);
+    void setNetworkError(NetworkError error, const QString &errorString);
+
+    void abort();
+    bool isSequential() const;
+    qint64 bytesAvailable() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+
+private:
+    QByteArray m_content;
+    qint64 m_offset;
+};
+
+// Keeps transport replies alive until the transport is destroyed, like
+// QNetworkAccessManager does for its replies. Replies deleted earlier, for
+// example with deleteLater(), are removed.
+class QtS3TransportReplies
+{
+public:
+    // How the replies are deleted: directly, or with deleteLater() on their
+    // thread, for replies which live on the network thread.
+    enum Deletion { Delete, DeleteLater };
+
+    explicit QtS3TransportReplies(Deletion deletion = Delete);
+    ~QtS3TransportReplies();
+    void add(QNetworkReply *reply);
+
+private:
+    void remove(QObject *reply);
+
+    Deletion m_deletion;
+    QMutex m_mutex;
+    QHash<QObject *, QMetaObject::Connection> m_replies; // reply -> destroyed connection
+};
+
+// Sends requests with ThreadsafeBlockingNetworkAccesManager: one
+// QNetworkAccessManager on a network thread, with priority scheduling,
+// bandwidth shaping and the memory budget. The network access manager is
+// shared and never deleted, so the transport deletes its replies.
+class QtS3QnamTransport : public QtS3Transport
+{
+public:
+    explicit QtS3QnamTransport(ThreadsafeBlockingNetworkAccesManager *networkAccessManager);
+
+    QNetworkReply *sendRequest(const QNetworkRequest &request, const QByteArray &verb,
+                               const QByteArray &payload, int priorityClass,
+                               const RequestSigner &sign);
+    void connectToHost(const QUrl &endpoint, int connections);
+
+private:
+    ThreadsafeBlockingNetworkAccesManager *m_networkAccessManager;
+    QtS3TransportReplies m_replies;
+};
+
+// Sends requests with a QNetworkAccessManager per calling thread, and runs a
+// local event loop until the reply finishes. This avoids the hop to the
+// shared network thread and its mutex, at the cost of one connection pool
+// per thread. Requests share the process-wide request scheduler, and the
+// bandwidth limits and memory budget of the
+// ThreadsafeBlockingNetworkAccesManager.
+class QtS3ThreadLocalTransport : public QtS3Transport
+{
+public:
+    explicit QtS3ThreadLocalTransport(
+        ThreadsafeBlockingNetworkAccesManager *networkAccessManager);
+    ~QtS3ThreadLocalTransport();
+
+    QNetworkReply *sendRequest(const QNetworkRequest &request, const QByteArray &verb,
+                               const QByteArray &payload, int priorityClass,
+                               const RequestSigner &sign);
+    void connectToHost(const QUrl &endpoint, int connections);
+
+private:
+    // The network access managers for the calling threads. Each is deleted
+    // on its own thread, when the thread exits or the transport is deleted.
+    // Shared with the thread exit handlers, which may run after the transport
+    // has been deleted.
+    class NetworkAccessManagers
+    {
+    public:
+        QMutex mutex;
+        QHash<QThread *, SlottetNetworkAccessManager *> managers;
+    };
+
+    SlottetNetworkAccessManager *localNetworkAccessManager();
+
+    ThreadsafeBlockingNetworkAccesManager *m_sharedNetworkAccessManager;
+    QSharedPointer<NetworkAccessManagers> m_networkAccessManagers;
+    QtS3TransportReplies m_replies;
+};
+
+// Answers requests from an in-memory object store without any network or
+// thread hops, for benchmarking the signing and processing layers on their
+// own. Supports GET, PUT, HEAD and DELETE for objects, and ListObjectsV2
+// prefix listings. Requests are not authenticated.
+class QtS3LoopbackTransport : public QtS3Transport
+{
+public:
+    QNetworkReply *sendRequest(const QNetworkRequest &request, const QByteArray &verb,
+                               const QByteArray &payload, int priorityClass,
+                               const RequestSigner &sign);
+
+private:
+    QByteArray listObjects(const QByteArray &bucketPath, const QUrlQuery &query);
+
+    QReadWriteLock m_objectsLock;
+    QMap<QByteArray, QByteArray> m_objects; // "/bucket/key" -> content, in key order
+    QtS3TransportReplies m_replies;
+};
+
+QPM_END_NAMESPACE(com, github, msorvig, s3)
+
+#endif
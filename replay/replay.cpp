@@ -0,0 +1,237 @@
+#include <QtCore>
+
+#include <qts3.h>
+#include <qts3recorder_p.h>
+
+#ifdef USE_QPM_NS
+using namespace com::github::msorvig::s3;
+#endif
+
+// Replay results for one operation type.
+class OperationStats
+{
+public:
+    OperationStats() : count(0), errors(0), mismatches(0) {}
+
+    int count;
+    int errors;
+    int mismatches; // result differs from the recorded result
+    QVector<qint64> latencies; // usecs
+    QVector<qint64> recordedLatencies; // usecs
+};
+
+class ReplayStats
+{
+public:
+    ReplayStats() : maxStartDelay(0) {}
+
+    QMutex mutex;
+    OperationStats operations[QtS3RequestRecord::OperationCount];
+    qint64 maxStartDelay; // usecs behind schedule, worst case
+};
+
+template <typename Reply> static int result(Reply reply)
+{
+    return reply.s3Error();
+}
+
+// Runs one recorded operation with the public QtS3 API.
+static int replay(QtS3 *s3, const QtS3RequestRecord &record, const QByteArray &bucket)
+{
+    const QString key = QString::fromUtf8(record.key);
+    switch (record.operation) {
+    case QtS3RequestRecord::Get:
+        return result(s3->get(bucket, key));
+    case QtS3RequestRecord::Put:
+        return result(s3->put(bucket, key, QByteArray(int(record.size), 'x')));
+    case QtS3RequestRecord::Head:
+        return result(s3->headObject(bucket, key));
+    case QtS3RequestRecord::Exists:
+        return result(s3->exists(bucket, key));
+    case QtS3RequestRecord::Size:
+        return result(s3->size(bucket, key));
+    case QtS3RequestRecord::Remove:
+        return result(s3->remove(bucket, key));
+    case QtS3RequestRecord::ListPage:
+        return result(s3->listPage(bucket, key));
+    case QtS3RequestRecord::List:
+        return result(s3->list(bucket, key));
+    default:
+        return QtS3ReplyBase::GenereicS3Error;
+    }
+}
+
+class ReplayTask : public QRunnable
+{
+public:
+    ReplayTask(QtS3 *s3, const QtS3RequestRecord &record, const QByteArray &bucket,
+               const QElapsedTimer &clock, qint64 scheduledTime, ReplayStats *stats)
+        : m_s3(s3), m_record(record), m_bucket(bucket), m_clock(clock),
+          m_scheduledTime(scheduledTime), m_stats(stats)
+    {
+    }
+
+    void run()
+    {
+        const qint64 startTime = m_clock.nsecsElapsed() / 1000;
+        const int s3Error = replay(m_s3, m_record, m_bucket);
+        const qint64 latency = m_clock.nsecsElapsed() / 1000 - startTime;
+
+        QMutexLocker lock(&m_stats->mutex);
+        m_stats->maxStartDelay = qMax(m_stats->maxStartDelay, startTime - m_scheduledTime);
+        OperationStats &stats = m_stats->operations[m_record.operation];
+        ++stats.count;
+        if (s3Error != QtS3ReplyBase::NoError)
+            ++stats.errors;
+        if (s3Error != m_record.s3Error)
+            ++stats.mismatches;
+        stats.latencies.append(latency);
+        stats.recordedLatencies.append(m_record.latency);
+    }
+
+private:
+    QtS3 *m_s3;
+    QtS3RequestRecord m_record;
+    QByteArray m_bucket;
+    const QElapsedTimer &m_clock;
+    qint64 m_scheduledTime;
+    ReplayStats *m_stats;
+};
+
+static qint64 percentile(QVector<qint64> values, double fraction)
+{
+    if (values.isEmpty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    return values.at(qMin(values.count() - 1, int(values.count() * fraction)));
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Replays a request recording made with QtS3::startRecording() against an S3\n"
+        "compatible endpoint, with the recorded timing or time-compressed. Credentials\n"
+        "are read from the AWS_S3_ACCESS_KEY_ID and AWS_S3_SECRET_ACCESS_KEY environment\n"
+        "variables.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("recording", "Recording file");
+    parser.addPositionalArgument("endpoint", "Endpoint url, for example http://localhost:9000");
+    QCommandLineOption speedOption(
+        "speed", "Time compression factor. 0 replays as fast as possible.", "factor", "1");
+    QCommandLineOption threadsOption("threads", "Number of replay threads.", "count", "32");
+    QCommandLineOption bucketOption("bucket", "Replay all requests to this bucket.", "name");
+    QCommandLineOption prepareOption(
+        "prepare", "Upload the objects which the recording reads before replaying.");
+    QCommandLineOption cacheSizeOption("cache-size", "Object cache size in MB.", "MB", "0");
+    QCommandLineOption networkRequestsOption(
+        "network-requests", "Maximum concurrent network requests.", "count", "6");
+    parser.addOption(speedOption);
+    parser.addOption(threadsOption);
+    parser.addOption(bucketOption);
+    parser.addOption(prepareOption);
+    parser.addOption(cacheSizeOption);
+    parser.addOption(networkRequestsOption);
+    parser.process(app);
+
+    const QStringList arguments = parser.positionalArguments();
+    if (arguments.count() != 2)
+        parser.showHelp(1);
+
+    // Read the recording, in start time order.
+    QFile file(arguments.at(0));
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Could not open" << file.fileName();
+        return 1;
+    }
+    QtS3RecordReader reader(&file);
+    if (!reader.isValid()) {
+        qWarning() << file.fileName() << "is not a QtS3 recording";
+        return 1;
+    }
+    QList<QtS3RequestRecord> records;
+    QtS3RequestRecord record;
+    while (reader.read(&record))
+        records.append(record);
+    std::stable_sort(records.begin(), records.end(),
+                     [](const QtS3RequestRecord &a, const QtS3RequestRecord &b) {
+                         return a.startTime < b.startTime;
+                     });
+
+    QByteArray accessKeyId = qgetenv("AWS_S3_ACCESS_KEY_ID");
+    QByteArray secretAccessKey = qgetenv("AWS_S3_SECRET_ACCESS_KEY");
+    QtS3 s3(accessKeyId, secretAccessKey);
+    s3.setEndpoint(QUrl(arguments.at(1)));
+    s3.setCacheSize(parser.value(cacheSizeOption).toLongLong() * 1024 * 1024);
+    s3.setMaxNetworkRequests(parser.value(networkRequestsOption).toInt());
+    const QByteArray bucketOverride = parser.value(bucketOption).toUtf8();
+
+    // Create the objects which were read successfully, with the recorded size.
+    if (parser.isSet(prepareOption)) {
+        QMap<QByteArray, QMap<QString, qint64>> objects; // bucket -> key -> size
+        for (const QtS3RequestRecord &record : records) {
+            const bool read = record.operation == QtS3RequestRecord::Get
+                              || record.operation == QtS3RequestRecord::Head
+                              || record.operation == QtS3RequestRecord::Size;
+            if (read && record.s3Error == QtS3ReplyBase::NoError) {
+                const QByteArray bucket = bucketOverride.isEmpty() ? record.bucket : bucketOverride;
+                qint64 &size = objects[bucket][QString::fromUtf8(record.key)];
+                size = qMax(size, record.size);
+            }
+        }
+        for (auto bucket = objects.constBegin(); bucket != objects.constEnd(); ++bucket) {
+            QList<QPair<QString, QByteArray>> contents;
+            for (auto object = bucket->constBegin(); object != bucket->constEnd(); ++object)
+                contents.append(qMakePair(object.key(), QByteArray(int(object.value()), 'x')));
+            for (QtS3Reply<void> reply : s3.putMany(bucket.key(), contents)) {
+                if (!reply.isSuccess())
+                    qWarning() << "Prepare error:" << reply.anyErrorString();
+            }
+        }
+        qDebug() << "Prepared" << objects.count() << "buckets";
+    }
+
+    // Start each operation at its recorded time, scaled by the speed factor.
+    const double speed = parser.value(speedOption).toDouble();
+    QThreadPool pool;
+    pool.setMaxThreadCount(parser.value(threadsOption).toInt());
+    ReplayStats stats;
+    QElapsedTimer clock;
+    clock.start();
+    const qint64 firstStartTime = records.isEmpty() ? 0 : records.first().startTime;
+    for (const QtS3RequestRecord &record : records) {
+        qint64 scheduledTime = 0;
+        if (speed > 0) {
+            scheduledTime = qint64((record.startTime - firstStartTime) / speed);
+            const qint64 wait = scheduledTime - clock.nsecsElapsed() / 1000;
+            if (wait > 0)
+                QThread::usleep(wait);
+        }
+        const QByteArray bucket = bucketOverride.isEmpty() ? record.bucket : bucketOverride;
+        pool.start(new ReplayTask(&s3, record, bucket, clock, scheduledTime, &stats));
+    }
+    pool.waitForDone();
+    const qint64 replayTime = clock.elapsed();
+
+    QTextStream out(stdout);
+    out << "Replayed " << records.count() << " operations in " << replayTime << " ms"
+        << " (worst start delay " << stats.maxStartDelay / 1000 << " ms)\n";
+    out << qSetFieldWidth(10) << "operation" << "count" << "errors" << "mismatch"
+        << "p50 ms" << "p99 ms" << "rec p50" << "rec p99" << qSetFieldWidth(0) << "\n";
+    for (int i = 0; i < QtS3RequestRecord::OperationCount; ++i) {
+        const OperationStats &operation = stats.operations[i];
+        if (operation.count == 0)
+            continue;
+        out << qSetFieldWidth(10)
+            << QtS3RequestRecord::operationName(QtS3RequestRecord::Operation(i))
+            << operation.count << operation.errors << operation.mismatches
+            << percentile(operation.latencies, 0.5) / 1000.0
+            << percentile(operation.latencies, 0.99) / 1000.0
+            << percentile(operation.recordedLatencies, 0.5) / 1000.0
+            << percentile(operation.recordedLatencies, 0.99) / 1000.0 << qSetFieldWidth(0)
+            << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <QtCore>
+
+#include <qts3.h>
+
+#ifdef USE_QPM_NS
+using namespace com::github::msorvig::s3;
+#endif
+
+// Parses "s3://bucket/prefix". Returns false if \a url is not an s3 url.
+static bool parseS3Url(const QString &url, QByteArray *bucket, QString *prefix)
+{
+    const QString scheme = QStringLiteral("s3://");
+    if (!url.startsWith(scheme))
+        return false;
+    const QString path = url.mid(scheme.length());
+    const int slash = path.indexOf(QLatin1Char('/'));
+    *bucket = path.left(slash).toLatin1();
+    *prefix = slash == -1 ? QString() : path.mid(slash + 1);
+    return !bucket->isEmpty();
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Synchronizes a local directory with an S3 bucket prefix. Credentials are read\n"
+        "from the AWS_S3_ACCESS_KEY_ID and AWS_S3_SECRET_ACCESS_KEY environment variables.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("source", "Local directory or s3://bucket/prefix");
+    parser.addPositionalArgument("destination", "Local directory or s3://bucket/prefix");
+    QCommandLineOption workersOption("workers", "Number of parallel transfers.", "count", "8");
+    QCommandLineOption thresholdOption(
+        "multipart-threshold", "File size in MB for multipart/ranged transfers.", "MB", "64");
+    QCommandLineOption partSizeOption("part-size", "Part size in MB.", "MB", "8");
+    QCommandLineOption deleteOption("delete", "Delete destination files not in the source.");
+    QCommandLineOption dryRunOption("dry-run", "Show what would be transferred.");
+    parser.addOption(workersOption);
+    parser.addOption(thresholdOption);
+    parser.addOption(partSizeOption);
+    parser.addOption(deleteOption);
+    parser.addOption(dryRunOption);
+    parser.process(app);
+
+    const QStringList arguments = parser.positionalArguments();
+    if (arguments.count() != 2)
+        parser.showHelp(1);
+
+    QByteArray bucket;
+    QString prefix;
+    const bool upload = parseS3Url(arguments.at(1), &bucket, &prefix);
+    if (!upload && !parseS3Url(arguments.at(0), &bucket, &prefix)) {
+        qWarning() << "One of source and destination must be an s3://bucket/prefix url";
+        return 1;
+    }
+    const QString localDirectory = upload ? arguments.at(0) : arguments.at(1);
+
+    QByteArray accessKeyId = qgetenv("AWS_S3_ACCESS_KEY_ID");
+    QByteArray secretAccessKey = qgetenv("AWS_S3_SECRET_ACCESS_KEY");
+    QtS3 s3(accessKeyId, secretAccessKey);
+
+    const qint64 megabyte = 1024 * 1024;
+    QtS3Sync sync(s3);
+    sync.setWorkerCount(parser.value(workersOption).toInt());
+    sync.setMultipartThreshold(parser.value(thresholdOption).toLongLong() * megabyte);
+    sync.setPartSize(parser.value(partSizeOption).toLongLong() * megabyte);
+    sync.setDeleteExtraneous(parser.isSet(deleteOption));
+    sync.setDryRun(parser.isSet(dryRunOption));
+    sync.setLogCallback([](const QString &message) { qDebug().noquote() << message; });
+
+    QtS3Reply<void> reply = upload ? sync.upload(localDirectory, bucket, prefix)
+                                   : sync.download(bucket, prefix, localDirectory);
+
+    QtS3Sync::Stats stats = sync.stats();
+    qDebug() << "Checked" << stats.filesChecked << "files: transferred" << stats.filesTransferred
+             << "(" << stats.bytesTransferred << "bytes ), skipped" << stats.filesSkipped
+             << ", deleted" << stats.filesDeleted << ", failed" << stats.filesFailed;
+
+    if (!reply.isSuccess()) {
+        qWarning() << "Sync error:" << reply.anyErrorString();
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,10 @@
+    # select namespaced vs non-namespaced version
+include ($$PWD/../com_github_msorvig_s3.pri)
+#include (../qts3.pri)
+
+TARGET = qts3sync
+OBJECTS_DIR = .ob
+MOC_DIR = .moc
+CONFIG -= app_bundle
+
+SOURCES += sync.cpp
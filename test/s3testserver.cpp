@@ -0,0 +1,271 @@
+#include "s3testserver.h"
+
+S3TestServer::S3TestServer() : m_server(0), m_port(0)
+{
+    m_thread.start();
+    moveToThread(&m_thread);
+    QMetaObject::invokeMethod(this, "listen", Qt::BlockingQueuedConnection);
+}
+
+S3TestServer::~S3TestServer()
+{
+    QMetaObject::invokeMethod(this, "close", Qt::BlockingQueuedConnection);
+    m_thread.quit();
+    m_thread.wait();
+}
+
+QUrl S3TestServer::url()
+{
+    return QUrl(QStringLiteral("http://127.0.0.1:%1").arg(m_port));
+}
+
+void S3TestServer::putObject(const QByteArray &bucket, const QByteArray &key,
+                             const QByteArray &content)
+{
+    QMutexLocker lock(&m_mutex);
+    m_objects.insert("/" + bucket + "/" + key, content);
+}
+
+QByteArray S3TestServer::object(const QByteArray &bucket, const QByteArray &key)
+{
+    QMutexLocker lock(&m_mutex);
+    return m_objects.value("/" + bucket + "/" + key);
+}
+
+// Delays all responses by msecs, to keep requests in flight.
+void S3TestServer::setResponseDelay(int msecs) { m_responseDelay.store(msecs); }
+
+// Responds to the next count requests with 503 SlowDown.
+void S3TestServer::throttleRequests(int count) { m_throttleCount.store(count); }
+
+int S3TestServer::connectionCount() { return m_connectionCount.load(); }
+
+int S3TestServer::requestCount() { return m_requestCount.load(); }
+
+int S3TestServer::notModifiedCount() { return m_notModifiedCount.load(); }
+
+void S3TestServer::listen()
+{
+    m_server = new QTcpServer(this);
+    connect(m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+    m_server->listen(QHostAddress::LocalHost);
+    m_port = m_server->serverPort();
+}
+
+void S3TestServer::close()
+{
+    delete m_server; // deletes the client sockets
+    m_server = 0;
+    m_buffers.clear();
+}
+
+void S3TestServer::newConnection()
+{
+    while (QTcpSocket *socket = m_server->nextPendingConnection()) {
+        m_connectionCount.ref();
+        connect(socket, SIGNAL(readyRead()), this, SLOT(readClient()));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(clientDisconnected()));
+    }
+}
+
+// Reads and handles all complete requests from the client.
+void S3TestServer::readClient()
+{
+    QTcpSocket *socket = static_cast<QTcpSocket *>(sender());
+    QByteArray &buffer = m_buffers[socket];
+    buffer += socket->readAll();
+
+    forever {
+        const int headerEnd = buffer.indexOf("\r\n\r\n");
+        if (headerEnd == -1)
+            return;
+
+        const QList<QByteArray> lines = buffer.left(headerEnd).split('\n');
+        const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+        if (requestLine.count() < 2) {
+            socket->disconnectFromHost();
+            return;
+        }
+        QHash<QByteArray, QByteArray> headers; // lower-case name -> value
+        foreach (const QByteArray &line, lines.mid(1)) {
+            const int colon = line.indexOf(':');
+            if (colon != -1)
+                headers.insert(line.left(colon).trimmed().toLower(), line.mid(colon + 1).trimmed());
+        }
+        const int contentLength = headers.value("content-length").toInt();
+        if (buffer.size() < headerEnd + 4 + contentLength)
+            return;
+
+        const QByteArray body = buffer.mid(headerEnd + 4, contentLength);
+        buffer.remove(0, headerEnd + 4 + contentLength);
+
+        QByteArray path = requestLine.at(1);
+        QByteArray query;
+        const int queryStart = path.indexOf('?');
+        if (queryStart != -1) {
+            query = path.mid(queryStart + 1);
+            path.truncate(queryStart);
+        }
+        path = QByteArray::fromPercentEncoding(path);
+
+        m_requestCount.ref();
+        int throttleCount = m_throttleCount.load();
+        while (throttleCount > 0
+               && !m_throttleCount.testAndSetOrdered(throttleCount, throttleCount - 1))
+            throttleCount = m_throttleCount.load();
+
+        QByteArray response;
+        if (throttleCount > 0)
+            response = slowDownResponse();
+        else if (query.contains("list-type=2"))
+            response = handleListRequest(path, QUrlQuery(QString::fromLatin1(query)));
+        else
+            response = handleRequest(requestLine.at(0), path, headers, body);
+        const int delay = m_responseDelay.load();
+        if (delay > 0)
+            QTimer::singleShot(delay, socket, [socket, response]() { socket->write(response); });
+        else
+            socket->write(response);
+    }
+}
+
+void S3TestServer::clientDisconnected()
+{
+    QTcpSocket *socket = static_cast<QTcpSocket *>(sender());
+    m_buffers.remove(socket);
+    socket->deleteLater();
+}
+
+// Returns the complete HTTP response for a request.
+QByteArray S3TestServer::handleRequest(const QByteArray &verb, const QByteArray &path,
+                                       const QHash<QByteArray, QByteArray> &requestHeaders,
+                                       const QByteArray &body)
+{
+    QByteArray status = "200 OK";
+    QByteArray headers;
+    QByteArray content;
+
+    QMutexLocker lock(&m_mutex);
+    const bool exists = m_objects.contains(path);
+    const QByteArray object = m_objects.value(path);
+    const QByteArray etag =
+        "\"" + QCryptographicHash::hash(object, QCryptographicHash::Md5).toHex() + "\"";
+
+    if (verb == "PUT") {
+        m_objects.insert(path, body);
+        headers += "ETag: \"" + QCryptographicHash::hash(body, QCryptographicHash::Md5).toHex()
+                   + "\"\r\n";
+    } else if (verb == "DELETE") {
+        m_objects.remove(path);
+        status = "204 No Content";
+    } else if (!exists) {
+        status = "404 Not Found";
+        if (verb == "GET") {
+            content = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                      "<Error><Code>NoSuchKey</Code>"
+                      "<Message>The specified key does not exist.</Message></Error>";
+            headers += "Content-Type: application/xml\r\n";
+        }
+    } else if (verb == "GET" && requestHeaders.value("if-none-match") == etag) {
+        status = "304 Not Modified";
+        headers += "ETag: " + etag + "\r\n";
+        m_notModifiedCount.ref();
+    } else {
+        headers += "ETag: " + etag + "\r\n";
+        headers += "Last-Modified: Sun, 01 Jan 2006 12:00:00 GMT\r\n";
+        headers += "Content-Type: application/octet-stream\r\n";
+        if (verb == "GET")
+            content = object;
+    }
+
+    // HEAD replies have the Content-Length of the object, but no body.
+    const int contentLength = (verb == "HEAD" && exists) ? object.size() : content.size();
+    return "HTTP/1.1 " + status + "\r\n" + "x-amz-request-id: 0123456789ABCDEF\r\n" + headers
+           + "Content-Length: " + QByteArray::number(contentLength) + "\r\n\r\n" + content;
+}
+
+QByteArray S3TestServer::slowDownResponse()
+{
+    const QByteArray content = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                               "<Error><Code>SlowDown</Code>"
+                               "<Message>Please reduce your request rate.</Message></Error>";
+    return "HTTP/1.1 503 Slow Down\r\nContent-Type: application/xml\r\n"
+           "Content-Length: " + QByteArray::number(content.size()) + "\r\n\r\n" + content;
+}
+
+// Returns a ListObjectsV2 response for "/bucket/", with support for prefix,
+// delimiter, start-after, continuation-token and max-keys.
+QByteArray S3TestServer::handleListRequest(const QByteArray &path, const QUrlQuery &query)
+{
+    const QByteArray bucketPath = path.endsWith('/') ? path : path + "/";
+    const QByteArray prefix = query.queryItemValue("prefix", QUrl::FullyDecoded).toUtf8();
+    const QByteArray delimiter = query.queryItemValue("delimiter", QUrl::FullyDecoded).toUtf8();
+    const QByteArray startAfter =
+        qMax(query.queryItemValue("start-after", QUrl::FullyDecoded).toUtf8(),
+             query.queryItemValue("continuation-token", QUrl::FullyDecoded).toUtf8());
+    const int maxKeys = query.hasQueryItem("max-keys") ? query.queryItemValue("max-keys").toInt()
+                                                       : 1000;
+
+    QMap<QByteArray, QByteArray> objects; // key -> content, in key order
+    {
+        QMutexLocker lock(&m_mutex);
+        for (auto it = m_objects.constBegin(); it != m_objects.constEnd(); ++it) {
+            if (it.key().startsWith(bucketPath))
+                objects.insert(it.key().mid(bucketPath.length()), it.value());
+        }
+    }
+
+    QByteArray contents;
+    QByteArray commonPrefixes;
+    QByteArray lastKey;
+    QByteArray lastCommonPrefix;
+    int count = 0;
+    bool truncated = false;
+    for (auto it = objects.upperBound(startAfter); it != objects.constEnd(); ++it) {
+        const QByteArray key = it.key();
+        if (!key.startsWith(prefix))
+            continue;
+        const int delimiterIndex =
+            delimiter.isEmpty() ? -1 : key.indexOf(delimiter, prefix.length());
+        const QByteArray commonPrefix =
+            delimiterIndex == -1 ? QByteArray() : key.left(delimiterIndex + delimiter.length());
+        if (!commonPrefix.isEmpty() && commonPrefix == lastCommonPrefix) {
+            lastKey = key;
+            continue;
+        }
+        if (count == maxKeys) {
+            truncated = true;
+            break;
+        }
+        ++count;
+        lastKey = key;
+        const QByteArray escapedKey = QString::fromUtf8(key).toHtmlEscaped().toUtf8();
+        if (!commonPrefix.isEmpty()) {
+            lastCommonPrefix = commonPrefix;
+            commonPrefixes += "<CommonPrefixes><Prefix>"
+                              + QString::fromUtf8(commonPrefix).toHtmlEscaped().toUtf8()
+                              + "</Prefix></CommonPrefixes>";
+        } else {
+            contents += "<Contents><Key>" + escapedKey + "</Key>"
+                        + "<LastModified>2006-01-01T12:00:00.000Z</LastModified>"
+                        + "<ETag>&quot;"
+                        + QCryptographicHash::hash(it.value(), QCryptographicHash::Md5).toHex()
+                        + "&quot;</ETag><Size>" + QByteArray::number(it.value().size())
+                        + "</Size></Contents>";
+        }
+    }
+
+    QByteArray content = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<ListBucketResult>";
+    content += "<KeyCount>" + QByteArray::number(count) + "</KeyCount>";
+    content += truncated ? "<IsTruncated>true</IsTruncated>" : "<IsTruncated>false</IsTruncated>";
+    if (truncated) {
+        content += "<NextContinuationToken>"
+                   + QString::fromUtf8(lastKey).toHtmlEscaped().toUtf8()
+                   + "</NextContinuationToken>";
+    }
+    content += contents + commonPrefixes + "</ListBucketResult>";
+
+    return "HTTP/1.1 200 OK\r\nx-amz-request-id: 0123456789ABCDEF\r\n"
+           "Content-Type: application/xml\r\nContent-Length: "
+           + QByteArray::number(content.size()) + "\r\n\r\n" + content;
+}
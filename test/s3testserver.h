@@ -0,0 +1,58 @@
+#ifndef S3TESTSERVER_H
+#define S3TESTSERVER_H
+
+#include <QtCore/QtCore>
+#include <QtNetwork/QtNetwork>
+
+// A minimal in-memory S3 compatible server for tests. Serves path-style
+// GET, PUT, HEAD and DELETE requests for /bucket/key and ListObjectsV2
+// requests for /bucket/ on 127.0.0.1 with HTTP/1.1 keep-alive, from its own
+// thread. GET supports If-None-Match, and requests can be throttled with
+// 503 SlowDown responses. Requests are not authenticated.
+class S3TestServer : public QObject
+{
+    Q_OBJECT
+public:
+    S3TestServer();
+    ~S3TestServer();
+
+    QUrl url();
+    void putObject(const QByteArray &bucket, const QByteArray &key, const QByteArray &content);
+    QByteArray object(const QByteArray &bucket, const QByteArray &key);
+
+    void setResponseDelay(int msecs);
+    void throttleRequests(int count);
+
+    int connectionCount();
+    int requestCount();
+    int notModifiedCount();
+
+private slots:
+    void listen();
+    void close();
+    void newConnection();
+    void readClient();
+    void clientDisconnected();
+
+private:
+    QByteArray handleRequest(const QByteArray &verb, const QByteArray &path,
+                             const QHash<QByteArray, QByteArray> &requestHeaders,
+                             const QByteArray &body);
+    QByteArray handleListRequest(const QByteArray &path, const QUrlQuery &query);
+    QByteArray slowDownResponse();
+
+    QThread m_thread;
+    QTcpServer *m_server;
+    quint16 m_port;
+    QHash<QTcpSocket *, QByteArray> m_buffers;
+    QAtomicInt m_responseDelay;
+    QAtomicInt m_throttleCount;
+
+    QMutex m_mutex;
+    QHash<QByteArray, QByteArray> m_objects; // "/bucket/key" -> content
+    QAtomicInt m_connectionCount;
+    QAtomicInt m_requestCount;
+    QAtomicInt m_notModifiedCount;
+};
+
+#endif
@@ -8,4 +8,5 @@ OBJECTS_DIR = .ob
 MOC_DIR = .moc
 QT += testlib
 
-SOURCES += tst_qts3.cpp
+HEADERS += s3testserver.h
+SOURCES += tst_qts3.cpp s3testserver.cpp
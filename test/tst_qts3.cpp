@@ -1,8 +1,17 @@
 #include <QtTest/QtTest>
 #include <QtCore/QtCore>
 
+#include <thread>
+
 #include "tst_qts3.h"
 #include <qts3_p.h>
+#include <qts3tail_p.h>
+#include <qts3sync_p.h>
+#include <qts3cache_p.h>
+#include <qts3metrics_p.h>
+#include <qts3trace_p.h>
+#include <qts3recorder_p.h>
+#include "s3testserver.h"
 
 class TestQtS3 : public QObject
 {
@@ -31,17 +40,78 @@ private slots:
     void awsTestSuite_data();
     void awsTestSuite();
 
+    // Object metadata
+    void parseObjectMetadata();
+
+    // Object listing
+    void parseListObjectsV2();
+    void splitListRange();
+
+    // Prefix tailing
+    void tailPollInterval();
+    void tailCheckpoint();
+
+    // Directory sync
+    void syncFileETag();
+    void syncCompare();
+    void syncLocalFileName();
+
+    // Object cache
+    void objectCache();
+    void diskCache();
+    void bloomFilter();
+    void existenceCache();
+    void planExistsMany();
+
+    // Request scheduling
+    void requestScheduler();
+    void concurrencyLimiter();
+    void tokenBucket();
+    void memoryBudget();
+    void metrics();
+    void traceRing();
+    void recordFile();
+    void loopbackTransport();
+
+    // Tests against a local S3 test server
+    void local_putGetRemove();
+    void local_headConnectionReuse();
+    void local_listParallel();
+    void local_sync();
+    void local_cachedGet();
+    void local_diskCachedGet();
+    void local_existsKnownMissing();
+    void local_existsMany();
+    void local_getManyPutMany();
+    void local_priorityQueueWait();
+    void local_slowDownRetry();
+    void local_bandwidthLimit();
+    void local_memoryBudget();
+    void local_replyTiming();
+    void local_metrics();
+    void local_trace();
+    void local_recording();
+    void local_epollTransport();
+    void local_threadLocalTransport();
+    void local_asyncReply();
+    void local_warmup();
+    void local_sharedNetworkThread();
+    void local_sharedNetworkReplies();
+
     // Integration tests that require netowork access
     // and access to a test bucket on S3.
     void location();
     void put();
     void exists();
     void size();
+    void headObject();
     void get();
     void remove();
+    void list();
 
     // Threaded integration tests
     void thread_putget();
+    void thread_local_coalescing();
 };
 
 // test date and time formatting
@@ -296,6 +366,218 @@ void TestQtS3::awsTestSuite()
     QCOMPARE(authorizationHeader, readFile(authorizationHeaderFile));
 }
 
+void TestQtS3::parseObjectMetadata()
+{
+    QList<QNetworkReply::RawHeaderPair> headers;
+    headers << qMakePair(QByteArray("x-amz-id-2"), QByteArray("ef8yU9AS1ed4OpIszj7UDNEHGran"))
+            << qMakePair(QByteArray("x-amz-request-id"), QByteArray("318BC8BC143432E5"))
+            << qMakePair(QByteArray("Date"), QByteArray("Wed, 28 Oct 2009 22:32:00 GMT"))
+            << qMakePair(QByteArray("Last-Modified"), QByteArray("Sun, 01 Jan 2006 12:00:00 GMT"))
+            << qMakePair(QByteArray("ETag"), QByteArray("\"fba9dede5f27731c9771645a39863328\""))
+            << qMakePair(QByteArray("Content-Length"), QByteArray("5000000000"))
+            << qMakePair(QByteArray("Content-Type"), QByteArray("text/plain"))
+            << qMakePair(QByteArray("x-amz-meta-Mtime"), QByteArray("1136116800"));
+
+    QtS3ObjectMetadata metadata = QtS3Private::parseObjectMetadata(headers);
+    QVERIFY(metadata.exists);
+    QCOMPARE(metadata.size, Q_INT64_C(5000000000));
+    QCOMPARE(metadata.etag, QByteArray("fba9dede5f27731c9771645a39863328"));
+    QCOMPARE(metadata.lastModified, QDateTime(QDate(2006, 1, 1), QTime(12, 0), Qt::UTC));
+    QCOMPARE(metadata.contentType, QByteArray("text/plain"));
+    QCOMPARE(metadata.userMetadata.value("mtime"), QByteArray("1136116800"));
+}
+
+void TestQtS3::parseListObjectsV2()
+{
+    QByteArray xml =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+        "<Name>bucket</Name>"
+        "<Prefix>photos/</Prefix>"
+        "<KeyCount>2</KeyCount>"
+        "<MaxKeys>2</MaxKeys>"
+        "<Delimiter>/</Delimiter>"
+        "<IsTruncated>true</IsTruncated>"
+        "<NextContinuationToken>1ueGcxLPRx1Tr/XYExHnhbYLgveDs2J/wm36Hy4vbOwM=</NextContinuationToken>"
+        "<Contents>"
+        "<Key>photos/a.jpg</Key>"
+        "<LastModified>2009-10-12T17:50:30.000Z</LastModified>"
+        "<ETag>&quot;fba9dede5f27731c9771645a39863328&quot;</ETag>"
+        "<Size>434234</Size>"
+        "<StorageClass>STANDARD</StorageClass>"
+        "</Contents>"
+        "<Contents>"
+        "<Key>photos/b.jpg</Key>"
+        "<Size>5000000000</Size>"
+        "</Contents>"
+        "<CommonPrefixes><Prefix>photos/2006/</Prefix></CommonPrefixes>"
+        "<CommonPrefixes><Prefix>photos/2007/</Prefix></CommonPrefixes>"
+        "</ListBucketResult>";
+
+    QtS3ListPage page = QtS3Private::parseListObjectsV2(xml);
+    QVERIFY(page.isTruncated);
+    QCOMPARE(page.nextContinuationToken,
+             QString("1ueGcxLPRx1Tr/XYExHnhbYLgveDs2J/wm36Hy4vbOwM="));
+    QCOMPARE(page.objects.count(), 2);
+    QCOMPARE(page.objects.at(0).key, QString("photos/a.jpg"));
+    QCOMPARE(page.objects.at(0).size, qint64(434234));
+    QCOMPARE(page.objects.at(0).etag, QByteArray("fba9dede5f27731c9771645a39863328"));
+    QCOMPARE(page.objects.at(0).lastModified.date(), QDate(2009, 10, 12));
+    QCOMPARE(page.objects.at(1).key, QString("photos/b.jpg"));
+    QCOMPARE(page.objects.at(1).size, Q_INT64_C(5000000000));
+    QCOMPARE(page.commonPrefixes, QStringList() << "photos/2006/" << "photos/2007/");
+
+    // The top-level <Prefix> is not a common prefix
+    QtS3ListPage emptyPage = QtS3Private::parseListObjectsV2(
+        "<ListBucketResult><Prefix>x</Prefix><IsTruncated>false</IsTruncated></ListBucketResult>");
+    QVERIFY(!emptyPage.isTruncated);
+    QVERIFY(emptyPage.objects.isEmpty());
+    QVERIFY(emptyPage.commonPrefixes.isEmpty());
+}
+
+// test that split ranges are adjacent and cover the key space below the prefix
+void TestQtS3::splitListRange()
+{
+    QList<QtS3Private::ListRange> single = QtS3Private::splitListRange("logs/", 1);
+    QCOMPARE(single.count(), 1);
+    QCOMPARE(single.at(0).prefix, QString("logs/"));
+    QVERIFY(single.at(0).startAfter.isEmpty());
+    QVERIFY(single.at(0).last.isEmpty());
+
+    for (int count : {2, 7, 32, 66, 1000}) {
+        QList<QtS3Private::ListRange> ranges = QtS3Private::splitListRange("logs/", count);
+        QCOMPARE(ranges.count(), qMin(count, 66));
+        QVERIFY(ranges.first().startAfter.isEmpty());
+        QVERIFY(ranges.last().last.isEmpty());
+        for (int i = 1; i < ranges.count(); ++i) {
+            QCOMPARE(ranges.at(i).startAfter, ranges.at(i - 1).last);
+            QVERIFY(ranges.at(i - 1).last.startsWith("logs/"));
+            if (i > 1)
+                QVERIFY(ranges.at(i - 1).last.toUtf8() > ranges.at(i - 2).last.toUtf8());
+        }
+    }
+}
+
+// test the adaptive poll interval: reset on activity, exponential backoff when idle
+void TestQtS3::tailPollInterval()
+{
+    QCOMPARE(QtS3TailPrivate::nextPollInterval(1000, 1000, 60000, false), 2000);
+    QCOMPARE(QtS3TailPrivate::nextPollInterval(2000, 1000, 60000, false), 4000);
+    QCOMPARE(QtS3TailPrivate::nextPollInterval(40000, 1000, 60000, false), 60000);
+    QCOMPARE(QtS3TailPrivate::nextPollInterval(60000, 1000, 60000, false), 60000);
+    QCOMPARE(QtS3TailPrivate::nextPollInterval(60000, 1000, 60000, true), 1000);
+}
+
+// test saving and restoring tail checkpoints
+void TestQtS3::tailCheckpoint()
+{
+    QtS3 s3(AwsTestData::accessKeyId, AwsTestData::secretAccessKey);
+
+    QByteArray checkpoint;
+    {
+        QtS3Tail tail(s3, "bucket");
+        tail.addPrefix("logs/a/");
+        tail.addPrefix("logs/b/");
+        QVERIFY(tail.restoreCheckpoint(
+            "{\"bucket\":\"bucket\",\"prefixes\":{\"logs/a/\":\"logs/a/2016-01-01\"}}"));
+        checkpoint = tail.saveCheckpoint();
+    }
+
+    QtS3Tail tail(s3, "bucket");
+    QVERIFY(tail.restoreCheckpoint(checkpoint));
+    QCOMPARE(tail.prefixes(), QStringList() << "logs/a/" << "logs/b/");
+    QCOMPARE(tail.saveCheckpoint(), checkpoint);
+
+    QtS3Tail otherBucketTail(s3, "other-bucket");
+    QVERIFY(!otherBucketTail.restoreCheckpoint(checkpoint));
+    QVERIFY(!otherBucketTail.restoreCheckpoint("not json"));
+}
+
+// test computing single part and multipart ETags for local files
+void TestQtS3::syncFileETag()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString fileName = dir.path() + "/file";
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write("abc");
+    file.close();
+
+    // single part: content MD5
+    QCOMPARE(QtS3SyncPrivate::fileETag(fileName, "d41d8cd98f00b204e9800998ecf8427e", 2),
+             QByteArray("900150983cd24fb0d6963f7d28e17f72"));
+
+    // multipart: MD5 of the part MD5s, and the part count
+    QCryptographicHash partHashes(QCryptographicHash::Md5);
+    partHashes.addData(QCryptographicHash::hash("ab", QCryptographicHash::Md5));
+    partHashes.addData(QCryptographicHash::hash("c", QCryptographicHash::Md5));
+    QCOMPARE(QtS3SyncPrivate::fileETag(fileName, "d41d8cd98f00b204e9800998ecf8427e-2", 2),
+             partHashes.result().toHex() + "-2");
+
+    QVERIFY(QtS3SyncPrivate::fileETag(dir.path() + "/not-a-file", "", 2).isEmpty());
+
+    QCOMPARE(QtS3SyncPrivate::partSize(1000, 5), qint64(5));
+    QCOMPARE(QtS3SyncPrivate::partSize(Q_INT64_C(100000000), 5), qint64(10000));
+}
+
+// test change detection by size, modification time and content
+void TestQtS3::syncCompare()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString fileName = dir.path() + "/file";
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write("abc");
+    file.close();
+    QFileInfo local(fileName);
+    const QDateTime localTime = local.lastModified().toUTC();
+
+    QtS3ObjectInfo remote;
+    remote.key = "file";
+    remote.size = 3;
+    remote.etag = "900150983cd24fb0d6963f7d28e17f72";
+
+    // different size
+    remote.size = 4;
+    QCOMPARE(QtS3SyncPrivate::compare(local, remote, true, 5), QtS3SyncPrivate::Changed);
+    remote.size = 3;
+
+    // remote is newer than local: the upload is up to date
+    remote.lastModified = localTime.addSecs(60);
+    QCOMPARE(QtS3SyncPrivate::compare(local, remote, true, 5),
+             QtS3SyncPrivate::UnchangedByTime);
+
+    // remote is older than local: compare the content
+    remote.lastModified = localTime.addSecs(-60);
+    QCOMPARE(QtS3SyncPrivate::compare(local, remote, true, 5),
+             QtS3SyncPrivate::UnchangedByContent);
+    QCOMPARE(QtS3SyncPrivate::compare(local, remote, false, 5),
+             QtS3SyncPrivate::UnchangedByTime);
+    remote.etag = "00000000000000000000000000000000";
+    QCOMPARE(QtS3SyncPrivate::compare(local, remote, true, 5), QtS3SyncPrivate::Changed);
+}
+
+// object keys which would escape the local directory are rejected
+void TestQtS3::syncLocalFileName()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QDir localDir(dir.path());
+    const QString root = localDir.canonicalPath();
+
+    QCOMPARE(QtS3SyncPrivate::localFileName(localDir, "file"), root + "/file");
+    QCOMPARE(QtS3SyncPrivate::localFileName(localDir, "a/b/.file"), root + "/a/b/.file");
+    QVERIFY(QtS3SyncPrivate::localFileName(localDir, "").isEmpty());
+    QVERIFY(QtS3SyncPrivate::localFileName(localDir, "../file").isEmpty());
+    QVERIFY(QtS3SyncPrivate::localFileName(localDir, "a/../../file").isEmpty());
+    QVERIFY(QtS3SyncPrivate::localFileName(localDir, "a/./file").isEmpty());
+    QVERIFY(QtS3SyncPrivate::localFileName(localDir, "a//file").isEmpty());
+    QVERIFY(QtS3SyncPrivate::localFileName(localDir, "/etc/passwd").isEmpty());
+    QVERIFY(QtS3SyncPrivate::localFileName(QDir(dir.path() + "/missing"), "..").isEmpty());
+}
+
 void TestQtS3::location()
 {
     // Get key id and secret key from environment
@@ -440,19 +722,58 @@ void TestQtS3::size()
 
     // exisiting files
     {
-        QtS3Reply<int> sizeReply = s3.size(testBucketUs, "foo-object");
+        QtS3Reply<qint64> sizeReply = s3.size(testBucketUs, "foo-object");
         QVERIFY(sizeReply.isSuccess());
-        QCOMPARE(sizeReply.value(), 14);
+        QCOMPARE(sizeReply.value(), qint64(14));
     }
 
     // Error case: object does not exist
     {
-        QtS3Reply<int> sizeReply = s3.size(testBucketUs, "foo-object-notcreated");
+        QtS3Reply<qint64> sizeReply = s3.size(testBucketUs, "foo-object-notcreated");
         QVERIFY(!sizeReply.isSuccess());
         // value is undefined
     }
 }
 
+void TestQtS3::headObject()
+{
+    QByteArray awsKeyId = qgetenv("QTS3_TEST_ACCESS_KEY_ID");
+    QByteArray awsSecretKey = qgetenv("QTS3_TEST_SECRET_ACCESS_KEY");
+    QByteArray testBucketUs = qgetenv("QTS3_TEST_BUCKET_US");
+    QByteArray testBucketEu = qgetenv("QTS3_TEST_BUCKET_EU");
+
+    if (awsKeyId.isEmpty())
+        QSKIP("QTS3_TEST_ACCESS_KEY_ID not set. This tests requires S3 access.");
+    if (awsSecretKey.isEmpty())
+        QSKIP("QTS3_TEST_SECRET_ACCESS_KEY not set. This tests requires S3 access.");
+    if (testBucketUs.isEmpty() || testBucketEu.isEmpty())
+        QSKIP("QTS3_TEST_BUCKET_US or QTS3_TEST_BUCKET_EU not set. Should be set to a"
+              "us-east-1 and eu-west-1 bucket with write access");
+
+    QtS3 s3(awsKeyId, awsSecretKey);
+
+    // exisiting files
+    {
+        QtS3Reply<QtS3ObjectMetadata> reply = s3.headObject(testBucketUs, "foo-object");
+        QVERIFY(reply.isSuccess());
+        QtS3ObjectMetadata metadata = reply.value();
+        QVERIFY(metadata.exists);
+        QCOMPARE(metadata.size, qint64(14));
+        QCOMPARE(metadata.etag, QCryptographicHash::hash("foo-content-us",
+                                                         QCryptographicHash::Md5).toHex());
+        QVERIFY(metadata.lastModified.isValid());
+    }
+
+    // Error case: object does not exist
+    {
+        QtS3Reply<QtS3ObjectMetadata> reply =
+            s3.headObject(testBucketUs, "foo-object-notcreated");
+        QVERIFY(!reply.isSuccess());
+        QCOMPARE(reply.s3Error(), QtS3ReplyBase::ObjectNotFoundError);
+        QVERIFY(!reply.value().exists);
+    }
+}
+
 void TestQtS3::get()
 {
     QByteArray awsKeyId = qgetenv("QTS3_TEST_ACCESS_KEY_ID");
@@ -570,6 +891,1380 @@ void TestQtS3::remove()
     }
 }
 
+void TestQtS3::list()
+{
+    QByteArray awsKeyId = qgetenv("QTS3_TEST_ACCESS_KEY_ID");
+    QByteArray awsSecretKey = qgetenv("QTS3_TEST_SECRET_ACCESS_KEY");
+    QByteArray testBucketEu = qgetenv("QTS3_TEST_BUCKET_EU");
+
+    if (awsKeyId.isEmpty())
+        QSKIP("QTS3_TEST_ACCESS_KEY_ID not set. This tests requires S3 access.");
+    if (awsSecretKey.isEmpty())
+        QSKIP("QTS3_TEST_SECRET_ACCESS_KEY not set. This tests requires S3 access.");
+    if (testBucketEu.isEmpty())
+        QSKIP("QTS3_TEST_BUCKET_EU not set. Should be set to a"
+              "us-east-1 and eu-west-1 bucket with write access");
+
+    QtS3 s3(awsKeyId, awsSecretKey);
+
+    // Create objects in a few "directories"
+    QStringList keys;
+    keys << "foo-list/a" << "foo-list/b/1" << "foo-list/b/2" << "foo-list/c/1" << "foo-list/d";
+    foreach (const QString &key, keys) {
+        QtS3Reply<void> reply = s3.put(testBucketEu, key, "foo-list-content", QStringList());
+        QVERIFY(reply.isSuccess());
+    }
+
+    // Delimited single page
+    {
+        QtS3Reply<QtS3ListPage> reply = s3.listPage(testBucketEu, "foo-list/", "/");
+        QVERIFY(reply.isSuccess());
+        QCOMPARE(reply.value().objects.count(), 2);
+        QCOMPARE(reply.value().commonPrefixes,
+                 QStringList() << "foo-list/b/" << "foo-list/c/");
+    }
+
+    // Serial listing
+    {
+        QtS3Reply<QList<QtS3ObjectInfo>> reply = s3.list(testBucketEu, "foo-list/");
+        QVERIFY(reply.isSuccess());
+        QStringList listedKeys;
+        foreach (const QtS3ObjectInfo &object, reply.value())
+            listedKeys.append(object.key);
+        QCOMPARE(listedKeys, keys);
+    }
+
+    // Parallel listing, ordered
+    {
+        QtS3Reply<QList<QtS3ObjectInfo>> reply = s3.listParallel(testBucketEu, "foo-list/", 4);
+        QVERIFY(reply.isSuccess());
+        QStringList listedKeys;
+        foreach (const QtS3ObjectInfo &object, reply.value())
+            listedKeys.append(object.key);
+        QCOMPARE(listedKeys, keys);
+    }
+
+    // Parallel listing, unordered
+    {
+        QStringList listedKeys;
+        QtS3Reply<void> reply = s3.listParallel(
+            testBucketEu, "foo-list/",
+            [&listedKeys](const QList<QtS3ObjectInfo> &objects) {
+                foreach (const QtS3ObjectInfo &object, objects)
+                    listedKeys.append(object.key);
+            },
+            4);
+        QVERIFY(reply.isSuccess());
+        listedKeys.sort();
+        QCOMPARE(listedKeys, keys);
+    }
+}
+
+void TestQtS3::objectCache()
+{
+    QtS3ObjectCache cache;
+    QVERIFY(!cache.isEnabled());
+    cache.setMaxSize(10);
+    QVERIFY(cache.isEnabled());
+
+    // least recently used entries are evicted when over budget
+    cache.insert("bucket/a", "aaaa", "etag-a");
+    cache.insert("bucket/b", "bbbb", "etag-b");
+    QByteArray content, etag;
+    qint64 age;
+    QVERIFY(cache.lookup("bucket/a", &content, &etag, &age));
+    QCOMPARE(content, QByteArray("aaaa"));
+    QCOMPARE(etag, QByteArray("etag-a"));
+    cache.insert("bucket/c", "cccc", "etag-c");
+    QCOMPARE(cache.size(), qint64(8));
+    QVERIFY(cache.lookup("bucket/a", &content, &etag, &age));
+    QVERIFY(!cache.lookup("bucket/b", &content, &etag, &age));
+
+    // objects larger than the budget are not cached
+    cache.insert("bucket/d", "ddddddddddd", "etag-d");
+    QVERIFY(!cache.lookup("bucket/d", &content, &etag, &age));
+
+    cache.remove("bucket/a");
+    QVERIFY(!cache.lookup("bucket/a", &content, &etag, &age));
+
+    // the longest matching bucket/prefix policy applies
+    QtS3CachePolicy noCache;
+    noCache.enabled = false;
+    QtS3CachePolicy shortAge;
+    shortAge.maxAge = 10;
+    cache.setPolicy("bucket", "", noCache);
+    cache.setPolicy("bucket", "config/", shortAge);
+    QVERIFY(!cache.policy("bucket", "data/1").enabled);
+    QVERIFY(cache.policy("bucket", "config/1").enabled);
+    QCOMPARE(cache.policy("bucket", "config/1").maxAge, 10);
+    QVERIFY(cache.policy("other-bucket", "config/1").enabled);
+    QCOMPARE(cache.policy("other-bucket", "config/1").maxAge, QtS3CachePolicy().maxAge);
+}
+
+void TestQtS3::diskCache()
+{
+    QTemporaryDir directory;
+    QVERIFY(directory.isValid());
+
+    QtS3DiskCache cache;
+    QVERIFY(!cache.isEnabled());
+    cache.setDirectory(directory.path(), 10);
+    QVERIFY(cache.isEnabled());
+
+    // identical content is stored once
+    cache.insert("bucket/a", "aaaa", "etag-a");
+    cache.insert("bucket/a2", "aaaa", "etag-a");
+    QCOMPARE(cache.size(), qint64(4));
+    QCOMPARE(QDir(directory.path() + "/objects").entryList(QDir::Files).count(), 1);
+
+    // entries are visible to other instances, such as in other processes
+    {
+        QtS3DiskCache other;
+        other.setDirectory(directory.path(), 10);
+        QByteArray content, etag;
+        qint64 age;
+        QVERIFY(other.lookup("bucket/a", &content, &etag, &age));
+        QCOMPARE(content, QByteArray("aaaa"));
+        QCOMPARE(etag, QByteArray("etag-a"));
+        other.insert("bucket/b", "bbbb", "etag-b");
+    }
+    QByteArray content, etag;
+    qint64 age;
+    QVERIFY(cache.lookup("bucket/b", &content, &etag, &age));
+    QCOMPARE(content, QByteArray("bbbb"));
+
+    // objects larger than the budget are not cached, and the least
+    // recently used entries are evicted
+    cache.insert("bucket/c", "ccccccccccc", "etag-c");
+    QVERIFY(!cache.lookup("bucket/c", &content, &etag, &age));
+    cache.insert("bucket/c", "cccc", "etag-c");
+    QVERIFY(cache.size() <= 10);
+    QVERIFY(cache.lookup("bucket/c", &content, &etag, &age));
+
+    cache.remove("bucket/c");
+    QVERIFY(!cache.lookup("bucket/c", &content, &etag, &age));
+
+    // cache hits do not write, and a journal record cut short by a crash
+    // is ignored
+    cache.insert("bucket/d", "dddd", "etag-d");
+    const QString journalPath = directory.path() + "/journal";
+    const qint64 journalSize = QFileInfo(journalPath).size();
+    QVERIFY(cache.lookup("bucket/d", &content, &etag, &age));
+    QCOMPARE(QFileInfo(journalPath).size(), journalSize);
+    {
+        QFile journal(journalPath);
+        QVERIFY(journal.open(QIODevice::Append));
+        journal.write(
+            QtS3DiskCache::formatJournalRecord(QtS3DiskCache::RemoveEntry, "bucket/d").left(6));
+    }
+    {
+        QtS3DiskCache other;
+        other.setDirectory(directory.path(), 10);
+        QVERIFY(other.lookup("bucket/d", &content, &etag, &age));
+        QCOMPARE(content, QByteArray("dddd"));
+    }
+    QVERIFY(cache.lookup("bucket/d", &content, &etag, &age));
+
+    // unreferenced object files are removed
+    cache.clear();
+    QCOMPARE(cache.size(), qint64(0));
+    QCOMPARE(QDir(directory.path() + "/objects").entryList(QDir::Files).count(), 0);
+
+    // index parsing
+    QtS3DiskCache::Index index;
+    QtS3DiskCache::IndexEntry entry;
+    entry.contentHash = QtS3DiskCache::contentHash("aaaa");
+    entry.etag = "etag-a";
+    entry.size = 4;
+    entry.fetched = 1000;
+    entry.lastAccess = 2000;
+    index.insert("bucket/a", entry);
+    QtS3DiskCache::Index parsed;
+    QVERIFY(QtS3DiskCache::parseIndex(QtS3DiskCache::formatIndex(index), &parsed));
+    QCOMPARE(parsed.value("bucket/a").contentHash, entry.contentHash);
+    QCOMPARE(parsed.value("bucket/a").lastAccess, qint64(2000));
+    QVERIFY(!QtS3DiskCache::parseIndex("garbage", &parsed));
+
+    // journal record parsing
+    const QByteArray records =
+        QtS3DiskCache::formatJournalRecord(QtS3DiskCache::PutEntry, "bucket/a", entry)
+        + QtS3DiskCache::formatJournalRecord(QtS3DiskCache::RemoveEntry, "bucket/a");
+    QtS3DiskCache::JournalOperation operation;
+    QByteArray key;
+    QtS3DiskCache::IndexEntry parsedEntry;
+    int offset = QtS3DiskCache::parseJournalRecord(records, 0, &operation, &key, &parsedEntry);
+    QVERIFY(offset > 0);
+    QCOMPARE(operation, QtS3DiskCache::PutEntry);
+    QCOMPARE(key, QByteArray("bucket/a"));
+    QCOMPARE(parsedEntry.etag, QByteArray("etag-a"));
+    offset = QtS3DiskCache::parseJournalRecord(records, offset, &operation, &key, &parsedEntry);
+    QCOMPARE(offset, records.size());
+    QCOMPARE(operation, QtS3DiskCache::RemoveEntry);
+    QCOMPARE(QtS3DiskCache::parseJournalRecord(records.left(records.size() - 1), 0, &operation,
+                                               &key, &parsedEntry),
+             int(QtS3DiskCache::formatJournalRecord(QtS3DiskCache::PutEntry, "bucket/a", entry)
+                     .size()));
+    QCOMPARE(QtS3DiskCache::parseJournalRecord(records.left(10), 0, &operation, &key,
+                                               &parsedEntry),
+             -1);
+}
+
+void TestQtS3::bloomFilter()
+{
+    const int keyCount = 10000;
+    QtS3BloomFilter filter(keyCount, 0.01);
+    QVERIFY(filter.bitCount() >= keyCount * 9);
+    QCOMPARE(filter.hashCount(), 7);
+
+    for (int i = 0; i < keyCount; ++i)
+        filter.insert("bucket/key-" + QByteArray::number(i));
+
+    // no false negatives
+    for (int i = 0; i < keyCount; ++i)
+        QVERIFY(filter.mightContain("bucket/key-" + QByteArray::number(i)));
+
+    // about 1% false positives
+    int falsePositives = 0;
+    for (int i = 0; i < keyCount; ++i)
+        falsePositives += filter.mightContain("bucket/other-" + QByteArray::number(i));
+    QVERIFY(falsePositives < keyCount * 15 / 1000);
+
+    QVERIFY(QtS3BloomFilter().mightContain("bucket/key"));
+}
+
+void TestQtS3::existenceCache()
+{
+    QtS3ExistenceCache cache;
+
+    // negative results are cached only when a TTL is set
+    cache.insertMissing("bucket/a");
+    QVERIFY(!cache.isKnownMissing("bucket/a"));
+    cache.setNegativeTtl(60000);
+    cache.insertMissing("bucket/a");
+    QVERIFY(cache.isKnownMissing("bucket/a"));
+    cache.invalidate("bucket/a");
+    QVERIFY(!cache.isKnownMissing("bucket/a"));
+
+    // filters answer for keys below their prefix
+    QtS3BloomFilter filter(100, 0.001);
+    filter.insert("bucket/prefix/a");
+    cache.setFilter("bucket/prefix/", filter);
+    QVERIFY(!cache.isKnownMissing("bucket/prefix/a"));
+    QVERIFY(cache.isKnownMissing("bucket/prefix/b"));
+    QVERIFY(!cache.isKnownMissing("bucket/other/b"));
+    cache.invalidate("bucket/prefix/b");
+    QVERIFY(!cache.isKnownMissing("bucket/prefix/b"));
+
+    cache.clear();
+    QVERIFY(!cache.isKnownMissing("bucket/prefix/c"));
+}
+
+void TestQtS3::planExistsMany()
+{
+    QStringList keys;
+    keys << "logs/2016-01-02" << "a/x" << "logs/2016-01-01" << "logs/2016-02-01" << "b/y"
+         << "logs/2016-01-15";
+    QList<int> headKeyIndexes;
+    QList<QtS3Private::ExistsGroup> groups = QtS3Private::planExistsMany(keys, 4, &headKeyIndexes);
+
+    QCOMPARE(groups.count(), 1);
+    QCOMPARE(groups.at(0).range.prefix, QString("logs/2016-0"));
+    QCOMPARE(groups.at(0).range.startAfter, QString());
+    QCOMPARE(groups.at(0).range.last, QString("logs/2016-02-01"));
+    QCOMPARE(groups.at(0).keyIndexes, QList<int>() << 0 << 2 << 3 << 5);
+    std::sort(headKeyIndexes.begin(), headKeyIndexes.end());
+    QCOMPARE(headKeyIndexes, QList<int>() << 1 << 4);
+
+    // below minListKeys all keys are checked with HEAD
+    headKeyIndexes.clear();
+    groups = QtS3Private::planExistsMany(keys, 5, &headKeyIndexes);
+    QCOMPARE(groups.count(), 0);
+    QCOMPARE(headKeyIndexes.count(), keys.count());
+}
+
+void TestQtS3::requestScheduler()
+{
+    RequestScheduler scheduler;
+    scheduler.setMaxRequests(1);
+
+    // Queue low and then high priority requests behind a running request
+    scheduler.acquire(1);
+    QMutex mutex;
+    QList<int> started;
+    std::vector<std::thread> threads;
+    int queued[RequestScheduler::ClassCount] = { 0, 0, 0 };
+    const int priorityClasses[] = { 2, 2, 2, 0, 0, 0 };
+    for (int priorityClass : priorityClasses) {
+        threads.emplace_back([&scheduler, &mutex, &started, priorityClass]() {
+            scheduler.acquire(priorityClass);
+            {
+                QMutexLocker lock(&mutex);
+                started.append(priorityClass);
+            }
+            scheduler.release(priorityClass);
+        });
+        ++queued[priorityClass];
+        while (scheduler.waitingCount(priorityClass) < queued[priorityClass])
+            QThread::yieldCurrentThread();
+    }
+
+    // High priority requests overtake the queued low priority requests
+    scheduler.release(1);
+    for (std::thread &thread : threads)
+        thread.join();
+    QCOMPARE(started, QList<int>() << 0 << 0 << 0 << 2 << 2 << 2);
+
+    // A class limit holds back its class only
+    scheduler.setMaxRequests(4);
+    scheduler.setClassLimit(2, 1);
+    scheduler.acquire(2);
+    std::thread low([&scheduler]() {
+        scheduler.acquire(2);
+        scheduler.release(2);
+    });
+    while (scheduler.waitingCount(2) == 0)
+        QThread::yieldCurrentThread();
+    scheduler.acquire(0);
+    scheduler.release(0);
+    QCOMPARE(scheduler.waitingCount(2), 1);
+    scheduler.release(2);
+    low.join();
+    QCOMPARE(scheduler.waitingCount(2), 0);
+
+    // The limit is per host
+    scheduler.setMaxRequests(1);
+    scheduler.acquire(1, "a:80");
+    scheduler.acquire(1, "b:80");
+    scheduler.release(1, "b:80");
+    scheduler.release(1, "a:80");
+    QCOMPARE(RequestScheduler::hostKey(QUrl("https://bucket.s3.amazonaws.com/key")),
+             QByteArray("bucket.s3.amazonaws.com:443"));
+}
+
+void TestQtS3::concurrencyLimiter()
+{
+    QCOMPARE(QtS3ConcurrencyLimiter::limitKey("bucket", "logs/2016/a"), QByteArray("bucket/logs/"));
+    QCOMPARE(QtS3ConcurrencyLimiter::limitKey("bucket", "a"), QByteArray("bucket/"));
+
+    QtS3ConcurrencyLimiter limiter;
+    limiter.setLimitRange(1, 4, 16);
+    const QByteArray key = "bucket/";
+    QCOMPARE(limiter.limit(key), 4.0);
+
+    // flat latency while the limit is in use raises the limit
+    for (int round = 0; round < 10; ++round) {
+        const int count = int(limiter.limit(key));
+        for (int i = 0; i < count; ++i)
+            limiter.acquire(key);
+        for (int i = 0; i < count; ++i)
+            limiter.release(key, 20, false);
+    }
+    const double raisedLimit = limiter.limit(key);
+    QVERIFY(raisedLimit > 8);
+    QVERIFY(raisedLimit <= 16);
+
+    // throttling halves the limit, once for a burst of throttled requests
+    limiter.acquire(key);
+    limiter.acquire(key);
+    limiter.release(key, -1, true);
+    limiter.release(key, -1, true);
+    QCOMPARE(limiter.limit(key), raisedLimit / 2);
+
+    // limits are per key
+    QCOMPARE(limiter.limit("bucket/logs/"), 4.0);
+}
+
+void TestQtS3::tokenBucket()
+{
+    TokenBucket bucket;
+    QVERIFY(!bucket.isLimited());
+    QCOMPARE(bucket.msecsUntilAvailable(1000000), 0);
+
+    // a full bucket allows a burst, then refills at the rate
+    bucket.setRate(1000, 500);
+    QVERIFY(bucket.isLimited());
+    QCOMPARE(bucket.available(), qint64(500));
+    bucket.consume(500);
+    QVERIFY(bucket.available() < 100);
+    const int wait = bucket.msecsUntilAvailable(200);
+    QVERIFY(wait > 100 && wait <= 200);
+    QTest::qWait(wait + 50);
+    QVERIFY(bucket.available() >= 200);
+
+    // requests larger than the bucket wait for a full bucket
+    QVERIFY(bucket.msecsUntilAvailable(1000000) <= 500);
+}
+
+void TestQtS3::memoryBudget()
+{
+    MemoryBudget budget;
+    budget.setLimit(100, 0);
+
+    // fail fast when the budget is used up
+    QVERIFY(budget.acquire(60));
+    QVERIFY(!budget.acquire(60));
+    budget.charge(50);
+    QCOMPARE(budget.usage(), qint64(110));
+    QCOMPARE(budget.highWaterMark(), qint64(110));
+    budget.release(110);
+    QCOMPARE(budget.usage(), qint64(0));
+
+    // a request larger than the budget starts when no memory is in use
+    QVERIFY(budget.acquire(500));
+    budget.release(500);
+
+    // reply bodies charged after the reply is released are not counted
+    QObject reply;
+    budget.chargeReply(&reply, 40);
+    budget.chargeReply(&reply, 30);
+    QCOMPARE(budget.usage(), qint64(40));
+    budget.releaseReply(&reply, 0);
+    budget.chargeReply(&reply, 80);
+    QCOMPARE(budget.usage(), qint64(0));
+
+    // wait for memory to be released
+    budget.setLimit(100, 5000);
+    QVERIFY(budget.acquire(100));
+    std::thread releaser([&budget]() {
+        QThread::msleep(50);
+        budget.release(100);
+    });
+    QVERIFY(budget.acquire(100));
+    releaser.join();
+    budget.release(100);
+    QCOMPARE(budget.usage(), qint64(0));
+    QCOMPARE(budget.highWaterMark(), qint64(500));
+}
+
+void TestQtS3::metrics()
+{
+    QCOMPARE(QtS3Private::operationName("GET", "list-type=2&prefix=a"),
+             QByteArray("ListObjectsV2"));
+    QCOMPARE(QtS3Private::operationName("PUT", "partNumber=1&uploadId=x"),
+             QByteArray("UploadPart"));
+    QCOMPARE(QtS3Private::operationName("POST", "uploads"), QByteArray("CreateMultipartUpload"));
+    QCOMPARE(QtS3Private::operationName("DELETE", "uploadId=x"),
+             QByteArray("AbortMultipartUpload"));
+    QCOMPARE(QtS3Private::operationName("GET", ""), QByteArray("GetObject"));
+    QCOMPARE(QtS3Private::operationName("HEAD", ""), QByteArray("HeadObject"));
+
+    QtS3MetricsRegistry *registry = QtS3MetricsRegistry::instance();
+    registry->reset();
+    registry->addRequest("GET", 200);
+    registry->addRequest("GET", 200);
+    registry->addRequest("PUT", 503);
+    registry->addLatency("GetObject", "test-bucket", 20000);  // 20 ms
+    registry->addLatency("GetObject", "test-bucket", 300000); // 300 ms
+    registry->addBytes(10, 20);
+    registry->addRegionCacheLookup(true);
+    registry->addLockWait(QtS3MetricsRegistry::SigningKeysLock, 500000000);
+
+    const QByteArray text = registry->formatPrometheus();
+    QVERIFY(text.contains("# TYPE qts3_requests_total counter\n"));
+    QVERIFY(text.contains("qts3_requests_total{verb=\"GET\",status=\"200\"} 2\n"));
+    QVERIFY(text.contains("qts3_requests_total{verb=\"PUT\",status=\"503\"} 1\n"));
+    const QByteArray labels = "operation=\"GetObject\",bucket=\"test-bucket\"";
+    QVERIFY(text.contains("qts3_request_duration_seconds_bucket{" + labels + ",le=\"0.01\"} 0\n"));
+    QVERIFY(text.contains("qts3_request_duration_seconds_bucket{" + labels + ",le=\"0.025\"} 1\n"));
+    QVERIFY(text.contains("qts3_request_duration_seconds_bucket{" + labels + ",le=\"0.5\"} 2\n"));
+    QVERIFY(text.contains("qts3_request_duration_seconds_bucket{" + labels + ",le=\"+Inf\"} 2\n"));
+    QVERIFY(text.contains("qts3_request_duration_seconds_sum{" + labels + "} 0.32\n"));
+    QVERIFY(text.contains("qts3_request_duration_seconds_count{" + labels + "} 2\n"));
+    QVERIFY(text.contains("qts3_sent_bytes_total 10\n"));
+    QVERIFY(text.contains("qts3_received_bytes_total 20\n"));
+    QVERIFY(text.contains("qts3_region_cache_hits_total 1\n"));
+    QVERIFY(text.contains("qts3_lock_wait_seconds_total{lock=\"signing_keys\"} 0.5\n"));
+    QVERIFY(text.contains("qts3_lock_contentions_total{lock=\"signing_keys\"} 1\n"));
+
+    registry->reset();
+    QVERIFY(!registry->formatPrometheus().contains("qts3_requests_total{"));
+}
+
+void TestQtS3::traceRing()
+{
+    QtS3TraceRing ring(1, "test");
+    ring.add("a", 'B', 1);
+    ring.add("a", 'E', 2);
+    QVector<QtS3TraceRing::Event> events = ring.events();
+    QCOMPARE(events.count(), 2);
+    QCOMPARE(events.at(0).phase, 'B');
+    QCOMPARE(events.at(1).timestamp, qint64(2));
+
+    // the oldest events are overwritten when the ring is full. The oldest
+    // slot is the next to be written, and is not returned.
+    for (int i = 0; i < QtS3TraceRing::Capacity + 10; ++i)
+        ring.add("b", 'i', 100 + i);
+    events = ring.events();
+    QCOMPARE(events.count(), int(QtS3TraceRing::Capacity) - 1);
+    QCOMPARE(events.first().timestamp, qint64(111));
+    QCOMPARE(events.last().timestamp, qint64(100 + QtS3TraceRing::Capacity + 9));
+
+    ring.clear();
+    QVERIFY(ring.events().isEmpty());
+    ring.add("c", 'i', 1);
+    QCOMPARE(ring.events().count(), 1);
+}
+
+void TestQtS3::recordFile()
+{
+    QList<QtS3RequestRecord> records;
+    for (int i = 0; i < 100; ++i) {
+        QtS3RequestRecord record;
+        record.operation = QtS3RequestRecord::Operation(i % QtS3RequestRecord::OperationCount);
+        record.bucket = i % 3 ? "bucket-a" : "bucket-b";
+        record.key = "logs/2016/05/object-" + QByteArray::number(i);
+        record.startTime = 1000 * i + (i % 2 ? -300 : 0); // completion order
+        record.size = i * 1000;
+        record.latency = 5000 + i;
+        record.s3Error = i % 7 ? QtS3ReplyBase::NoError : QtS3ReplyBase::ObjectNotFoundError;
+        records.append(record);
+    }
+
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    QtS3RecordWriter writer(&buffer);
+    for (const QtS3RequestRecord &record : records)
+        writer.write(record);
+    buffer.close();
+    // bucket names and shared key prefixes are not repeated
+    QVERIFY(buffer.size() < 100 * 16);
+
+    buffer.open(QIODevice::ReadOnly);
+    QtS3RecordReader reader(&buffer);
+    QVERIFY(reader.isValid());
+    QtS3RequestRecord record;
+    for (const QtS3RequestRecord &expected : records) {
+        QVERIFY(reader.read(&record));
+        QCOMPARE(record.operation, expected.operation);
+        QCOMPARE(record.bucket, expected.bucket);
+        QCOMPARE(record.key, expected.key);
+        QCOMPARE(record.startTime, expected.startTime);
+        QCOMPARE(record.size, expected.size);
+        QCOMPARE(record.latency, expected.latency);
+        QCOMPARE(record.s3Error, expected.s3Error);
+    }
+    QVERIFY(!reader.read(&record));
+
+    // truncated files end the recording
+    QByteArray truncated = buffer.data().left(buffer.size() - 3);
+    QBuffer truncatedBuffer(&truncated);
+    truncatedBuffer.open(QIODevice::ReadOnly);
+    QtS3RecordReader truncatedReader(&truncatedBuffer);
+    int count = 0;
+    while (truncatedReader.read(&record))
+        ++count;
+    QCOMPARE(count, records.count() - 1);
+
+    QByteArray invalid("not a recording");
+    QBuffer invalidBuffer(&invalid);
+    invalidBuffer.open(QIODevice::ReadOnly);
+    QVERIFY(!QtS3RecordReader(&invalidBuffer).isValid());
+}
+
+// The loopback transport serves requests from memory, without a server.
+void TestQtS3::loopbackTransport()
+{
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(QUrl("http://loopback.invalid"));
+    s3.setTransport(QtS3::LoopbackTransport);
+
+    QVERIFY(s3.put("test-bucket", "foo/a", "content-a").isSuccess());
+    QVERIFY(s3.put("test-bucket", "foo/b", "content-bb").isSuccess());
+    QVERIFY(s3.put("test-bucket", "bar/c", "content-c").isSuccess());
+
+    QtS3Reply<QByteArray> contents = s3.get("test-bucket", "foo/a");
+    QVERIFY(contents.isSuccess());
+    QCOMPARE(contents.value(), QByteArray("content-a"));
+    QCOMPARE(s3.size("test-bucket", "foo/b").value(), qint64(10));
+    QCOMPARE(s3.get("test-bucket", "foo/x").s3Error(), QtS3ReplyBase::ObjectNotFoundError);
+
+    QtS3Reply<QList<QtS3ObjectInfo>> list = s3.list("test-bucket", "foo/");
+    QVERIFY(list.isSuccess());
+    QCOMPARE(list.value().count(), 2);
+    QCOMPARE(list.value().at(0).key, QString("foo/a"));
+    QCOMPARE(list.value().at(1).size, qint64(10));
+
+    QVERIFY(s3.remove("test-bucket", "foo/a").isSuccess());
+    QtS3Reply<bool> exists = s3.exists("test-bucket", "foo/a");
+    QVERIFY(exists.isSuccess());
+    QVERIFY(!exists.value());
+}
+
+void TestQtS3::local_putGetRemove()
+{
+    S3TestServer server;
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    QVERIFY(s3.put("test-bucket", "foo-object", "foo-content", QStringList()).isSuccess());
+    QCOMPARE(server.object("test-bucket", "foo-object"), QByteArray("foo-content"));
+
+    QtS3Reply<QByteArray> contents = s3.get("test-bucket", "foo-object");
+    QVERIFY(contents.isSuccess());
+    QCOMPARE(contents.value(), QByteArray("foo-content"));
+
+    QtS3Reply<qint64> size = s3.size("test-bucket", "foo-object");
+    QVERIFY(size.isSuccess());
+    QCOMPARE(size.value(), qint64(11));
+
+    QVERIFY(s3.remove("test-bucket", "foo-object").isSuccess());
+    QtS3Reply<bool> exists = s3.exists("test-bucket", "foo-object");
+    QVERIFY(exists.isSuccess());
+    QVERIFY(!exists.value());
+}
+
+// HEAD replies must complete without waiting for a body, and leave the
+// connection open for reuse by the next request.
+void TestQtS3::local_headConnectionReuse()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    const int requestCount = 10000;
+    for (int i = 0; i < requestCount; ++i) {
+        QtS3Reply<bool> exists = s3.exists("test-bucket", "foo-object");
+        QVERIFY(exists.isSuccess());
+        QVERIFY(exists.value());
+    }
+
+    QtS3Reply<bool> exists = s3.exists("test-bucket", "foo-object-notcreated");
+    QVERIFY(exists.isSuccess());
+    QVERIFY(!exists.value());
+
+    QCOMPARE(server.requestCount(), requestCount + 1);
+    QCOMPARE(server.connectionCount(), 1); // sequential requests reuse one connection
+}
+
+// Parallel listings are complete, sorted and free of duplicates, for flat
+// prefixes split at StartAfter points and for "directory" prefixes, with
+// truncated pages in several ranges.
+void TestQtS3::local_listParallel()
+{
+    S3TestServer server;
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    // flat: clusters of more than 1000 keys in different split ranges
+    QStringList flatKeys;
+    const QString clusters = QStringLiteral("0Aax");
+    for (int i = 0; i < 4800; ++i) {
+        const QChar cluster = clusters.at(i % clusters.count());
+        flatKeys.append(QStringLiteral("flat/%1%2").arg(cluster).arg(i, 5, 10, QChar('0')));
+    }
+    for (const char *key : { "flat/-first", "flat/.dot", "flat/_under", "flat/zlast" })
+        flatKeys.append(QString::fromLatin1(key));
+
+    // directories, with objects at the prefix level between them
+    QStringList treeKeys;
+    for (int dir = 0; dir < 4; ++dir) {
+        const int fileCount = dir % 2 ? 1500 : 10;
+        for (int i = 0; i < fileCount; ++i)
+            treeKeys.append(QStringLiteral("tree/dir%1/file%2").arg(dir).arg(i, 5, 10, QChar('0')));
+        treeKeys.append(QStringLiteral("tree/dir%1.object").arg(dir));
+    }
+
+    for (const QString &key : flatKeys + treeKeys)
+        server.putObject("test-bucket", key.toUtf8(), key.toUtf8());
+    flatKeys.sort();
+    treeKeys.sort();
+
+    for (const QStringList &keys : { flatKeys, treeKeys }) {
+        const QString prefix = keys.first().section('/', 0, 0) + "/";
+
+        QtS3Reply<QList<QtS3ObjectInfo>> reply = s3.listParallel("test-bucket", prefix, 4);
+        QVERIFY(reply.isSuccess());
+        QStringList listedKeys;
+        for (const QtS3ObjectInfo &object : reply.value())
+            listedKeys.append(object.key);
+        QCOMPARE(listedKeys.count(), keys.count());
+        QCOMPARE(listedKeys, keys);
+
+        QStringList callbackKeys;
+        QMutex mutex;
+        QVERIFY(s3.listParallel("test-bucket", prefix,
+                                [&callbackKeys, &mutex](const QList<QtS3ObjectInfo> &objects) {
+                                    QMutexLocker lock(&mutex);
+                                    for (const QtS3ObjectInfo &object : objects)
+                                        callbackKeys.append(object.key);
+                                },
+                                4)
+                    .isSuccess());
+        callbackKeys.sort();
+        QCOMPARE(callbackKeys, keys);
+    }
+}
+
+// Sync uploads and downloads files whose names contain URL delimiters,
+// percent signs and non-Latin-1 characters under the same keys.
+void TestQtS3::local_sync()
+{
+    S3TestServer server;
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    const QStringList names = QStringList() << "plain.txt" << "a#b" << "a?b" << "100%.txt"
+                                            << "space name.txt" << "dir/plus+and&=;"
+                                            << "star*(paren)'" << QString::fromUtf8("dïr/日本.txt");
+    QTemporaryDir sourceDir;
+    for (const QString &name : names) {
+        const QString fileName = sourceDir.filePath(name);
+        QVERIFY(QDir().mkpath(QFileInfo(fileName).path()));
+        QFile file(fileName);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write(name.toUtf8());
+    }
+
+    QtS3Sync upload(s3);
+    QVERIFY(upload.upload(sourceDir.path(), "test-bucket", "sync/").isSuccess());
+    QCOMPARE(upload.stats().filesTransferred, names.count());
+    for (const QString &name : names)
+        QCOMPARE(server.object("test-bucket", "sync/" + name.toUtf8()), name.toUtf8());
+
+    // unchanged files are not uploaded again
+    QtS3Sync reupload(s3);
+    QVERIFY(reupload.upload(sourceDir.path(), "test-bucket", "sync/").isSuccess());
+    QCOMPARE(reupload.stats().filesTransferred, 0);
+    QCOMPARE(reupload.stats().filesFailed, 0);
+
+    QTemporaryDir targetDir;
+    QtS3Sync download(s3);
+    QVERIFY(download.download("test-bucket", "sync/", targetDir.path()).isSuccess());
+    QCOMPARE(download.stats().filesTransferred, names.count());
+    for (const QString &name : names) {
+        QFile file(targetDir.filePath(name));
+        QVERIFY2(file.open(QIODevice::ReadOnly), qPrintable(name));
+        QCOMPARE(file.readAll(), name.toUtf8());
+    }
+}
+
+void TestQtS3::local_cachedGet()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    s3.setCacheSize(1024 * 1024);
+
+    // fresh objects are served from memory
+    QCOMPARE(s3.get("test-bucket", "foo-object").value(), QByteArray("foo-content"));
+    QCOMPARE(s3.get("test-bucket", "foo-object").value(), QByteArray("foo-content"));
+    QCOMPARE(server.requestCount(), 1);
+
+    // stale objects are revalidated
+    QtS3CachePolicy alwaysRevalidate;
+    alwaysRevalidate.maxAge = 0;
+    s3.setCachePolicy("test-bucket", "foo", alwaysRevalidate);
+    QCOMPARE(s3.get("test-bucket", "foo-object").value(), QByteArray("foo-content"));
+    QCOMPARE(server.requestCount(), 2);
+    QCOMPARE(server.notModifiedCount(), 1);
+
+    server.putObject("test-bucket", "foo-object", "foo-content-2");
+    QCOMPARE(s3.get("test-bucket", "foo-object").value(), QByteArray("foo-content-2"));
+    QCOMPARE(server.notModifiedCount(), 1);
+
+    // writes invalidate the cache
+    s3.setCachePolicy(QtS3CachePolicy());
+    s3.setCachePolicy("test-bucket", "foo", QtS3CachePolicy());
+    QVERIFY(s3.put("test-bucket", "foo-object", "foo-content-3").isSuccess());
+    QCOMPARE(s3.get("test-bucket", "foo-object").value(), QByteArray("foo-content-3"));
+    QVERIFY(s3.remove("test-bucket", "foo-object").isSuccess());
+    QtS3Reply<QByteArray> removed = s3.get("test-bucket", "foo-object");
+    QCOMPARE(removed.s3Error(), QtS3ReplyBase::ObjectNotFoundError);
+}
+
+void TestQtS3::local_diskCachedGet()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QTemporaryDir directory;
+    QVERIFY(directory.isValid());
+
+    {
+        QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+        s3.setEndpoint(server.url());
+        s3.setDiskCache(directory.path(), 1024 * 1024);
+        QCOMPARE(s3.get("test-bucket", "foo-object").value(), QByteArray("foo-content"));
+        QCOMPARE(server.requestCount(), 1);
+    }
+
+    // A new QtS3 object (or process) reads from the disk cache
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    s3.setDiskCache(directory.path(), 1024 * 1024);
+    QCOMPARE(s3.get("test-bucket", "foo-object").value(), QByteArray("foo-content"));
+    QCOMPARE(server.requestCount(), 1);
+
+    QtS3CachePolicy alwaysRevalidate;
+    alwaysRevalidate.maxAge = 0;
+    s3.setCachePolicy(alwaysRevalidate);
+    QCOMPARE(s3.get("test-bucket", "foo-object").value(), QByteArray("foo-content"));
+    QCOMPARE(server.notModifiedCount(), 1);
+}
+
+void TestQtS3::local_existsKnownMissing()
+{
+    S3TestServer server;
+    for (int i = 0; i < 100; ++i)
+        server.putObject("test-bucket", "data/object-" + QByteArray::number(i), "content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    // negative cache
+    s3.setNegativeCacheTtl(60000);
+    QVERIFY(!s3.exists("test-bucket", "optional-object").value());
+    QVERIFY(!s3.exists("test-bucket", "optional-object").value());
+    QCOMPARE(server.requestCount(), 1);
+    QVERIFY(s3.put("test-bucket", "optional-object", "content").isSuccess());
+    QVERIFY(s3.exists("test-bucket", "optional-object").value());
+    s3.setNegativeCacheTtl(0);
+
+    // existence filter
+    QVERIFY(s3.loadExistenceFilter("test-bucket", "data/").isSuccess());
+    const int requestCount = server.requestCount();
+    int missingCount = 0;
+    for (int i = 0; i < 100; ++i)
+        missingCount += !s3.exists("test-bucket", "data/missing-" + QString::number(i)).value();
+    QCOMPARE(missingCount, 100);
+    QVERIFY(server.requestCount() - requestCount < 10);
+    QVERIFY(s3.exists("test-bucket", "data/object-1").value());
+
+    QVERIFY(s3.put("test-bucket", "data/missing-1", "content").isSuccess());
+    QVERIFY(s3.exists("test-bucket", "data/missing-1").value());
+}
+
+void TestQtS3::local_existsMany()
+{
+    S3TestServer server;
+    for (int i = 0; i < 100; i += 2)
+        server.putObject("test-bucket", "data/object-" + QByteArray::number(i), "content");
+    server.putObject("test-bucket", "config/a", "content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    // 100 dense keys are listed, 2 sparse keys use HEAD
+    QStringList keys;
+    for (int i = 0; i < 100; ++i)
+        keys.append("data/object-" + QString::number(i));
+    keys << "config/a" << "config/b" << "data/object-0";
+    QtS3Reply<QList<bool>> exists = s3.existsMany("test-bucket", keys);
+    QVERIFY(exists.isSuccess());
+    const QList<bool> found = exists.value();
+    QCOMPARE(found.count(), keys.count());
+    for (int i = 0; i < 100; ++i)
+        QCOMPARE(found.at(i), i % 2 == 0);
+    QVERIFY(found.at(100));
+    QVERIFY(!found.at(101));
+    QVERIFY(found.at(102));
+    QCOMPARE(server.requestCount(), 3);
+}
+
+void TestQtS3::local_getManyPutMany()
+{
+    S3TestServer server;
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    QCOMPARE(s3.maxConcurrency(), 16);
+
+    QList<QPair<QString, QByteArray>> objects;
+    QStringList paths;
+    for (int i = 0; i < 50; ++i) {
+        paths.append("object-" + QString::number(i));
+        objects.append(qMakePair(paths.last(), "content-" + QByteArray::number(i)));
+    }
+
+    QList<QtS3Reply<void>> putReplies = s3.putMany("test-bucket", objects);
+    QCOMPARE(putReplies.count(), objects.count());
+    for (QtS3Reply<void> reply : putReplies)
+        QVERIFY(reply.isSuccess());
+
+    // results in order
+    QList<QtS3Reply<QByteArray>> getReplies = s3.getMany("test-bucket", paths);
+    QCOMPARE(getReplies.count(), paths.count());
+    for (int i = 0; i < getReplies.count(); ++i)
+        QCOMPARE(getReplies[i].value(), objects.at(i).second);
+
+    // results as they complete
+    QSet<int> completed;
+    s3.getMany("test-bucket", paths, [&](int index, QtS3Reply<QByteArray> reply) {
+        QCOMPARE(reply.value(), objects.at(index).second);
+        completed.insert(index);
+    });
+    QCOMPARE(completed.count(), paths.count());
+
+    // nested batches complete when the shared scheduler is saturated
+    s3.setMaxConcurrency(1);
+    int nestedCount = 0;
+    s3.getMany("test-bucket", paths.mid(0, 4), [&](int, QtS3Reply<QByteArray>) {
+        for (QtS3Reply<QByteArray> reply : s3.getMany("test-bucket", paths.mid(4, 4)))
+            nestedCount += reply.isSuccess();
+    });
+    QCOMPARE(nestedCount, 16);
+}
+
+void TestQtS3::local_slowDownRetry()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    QCOMPARE(s3.concurrencyLimit("test-bucket"), 6);
+
+    // throttled requests are retried, and lower the concurrency limit
+    server.throttleRequests(2);
+    QtS3Reply<QByteArray> contents = s3.get("test-bucket", "foo-object");
+    QVERIFY(contents.isSuccess());
+    QCOMPARE(contents.value(), QByteArray("foo-content"));
+    QCOMPARE(server.requestCount(), 3);
+    QVERIFY(s3.concurrencyLimit("test-bucket") < 6);
+
+    // the error is reported when retries are exhausted
+    s3.setSlowDownRetries(1);
+    server.throttleRequests(2);
+    contents = s3.get("test-bucket", "foo-object");
+    QVERIFY(!contents.isSuccess());
+    QCOMPARE(contents.s3Error(), QtS3ReplyBase::SlowDownError);
+    QCOMPARE(server.requestCount(), 5);
+}
+
+void TestQtS3::local_bandwidthLimit()
+{
+    S3TestServer server;
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    s3.setBandwidthLimit(100000, 100000, 20000);
+
+    // 100 KB at 100 KB/s with a 20 KB burst takes at least 0.8 seconds
+    QByteArray content(100000, 'x');
+    QElapsedTimer timer;
+    timer.start();
+    QVERIFY(s3.put("test-bucket", "big-object", content).isSuccess());
+    QVERIFY(timer.elapsed() >= 700);
+    QCOMPARE(server.object("test-bucket", "big-object"), content);
+
+    timer.restart();
+    QtS3Reply<QByteArray> reply = s3.get("test-bucket", "big-object");
+    QVERIFY(reply.isSuccess());
+    QCOMPARE(reply.value(), content);
+    QVERIFY(timer.elapsed() >= 700);
+
+    // small requests fit in the burst
+    QTest::qWait(300);
+    timer.restart();
+    QVERIFY(s3.exists("test-bucket", "big-object").value());
+    QVERIFY(timer.elapsed() < 500);
+}
+
+void TestQtS3::local_memoryBudget()
+{
+    S3TestServer server;
+    server.setResponseDelay(300);
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    s3.setMemoryBudget(1000, 0);
+
+    // a second upload fails fast while the first uses the budget
+    bool backgroundSuccess = false;
+    std::thread background([&s3, &backgroundSuccess]() {
+        backgroundSuccess = s3.put("test-bucket", "object-1", QByteArray(800, 'x')).isSuccess();
+    });
+    QTRY_COMPARE(s3.memoryUsage(), qint64(800));
+    QtS3Reply<void> reply = s3.put("test-bucket", "object-2", QByteArray(800, 'x'));
+    QCOMPARE(reply.s3Error(), QtS3ReplyBase::MemoryBudgetExceededError);
+    background.join();
+    QVERIFY(backgroundSuccess);
+
+    // reply content is charged while the request is in progress
+    QtS3Reply<QByteArray> contents = s3.get("test-bucket", "object-1");
+    QCOMPARE(contents.value(), QByteArray(800, 'x'));
+    QCOMPARE(s3.memoryUsage(), qint64(0));
+    QCOMPARE(s3.memoryHighWaterMark(), qint64(800));
+}
+
+void TestQtS3::local_replyTiming()
+{
+    S3TestServer server;
+    server.setResponseDelay(100);
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    QtS3Reply<void> putReply = s3.put("test-bucket", "foo-object", QByteArray(1000, 'x'));
+    QVERIFY(putReply.isSuccess());
+    QtS3ReplyTiming timing = putReply.timing();
+    QVERIFY(timing.signingTime > 0);
+    QVERIFY(timing.timeToFirstByte >= 90000);
+    QCOMPARE(timing.bytesSent, qint64(1000));
+    QCOMPARE(timing.retryCount, 0);
+
+    server.throttleRequests(1);
+    QtS3Reply<QByteArray> getReply = s3.get("test-bucket", "foo-object");
+    QVERIFY(getReply.isSuccess());
+    timing = getReply.timing();
+    QCOMPARE(timing.bytesSent, qint64(0));
+    QCOMPARE(timing.retryCount, 1);
+
+    // the throttled attempt is included: its error response, and the
+    // response delay for both attempts
+    QVERIFY(timing.bytesReceived > 1000);
+    QVERIFY(timing.timeToFirstByte >= 180000);
+}
+
+void TestQtS3::local_metrics()
+{
+    S3TestServer server;
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    QtS3Metrics::reset();
+
+    QVERIFY(s3.put("test-bucket", "foo-object", QByteArray(1000, 'x')).isSuccess());
+    QVERIFY(s3.get("test-bucket", "foo-object").isSuccess());
+    QVERIFY(!s3.get("test-bucket", "bar-object").isSuccess());
+
+    const QByteArray text = QtS3Metrics::prometheusText();
+    QVERIFY(text.contains("qts3_requests_total{verb=\"PUT\",status=\"200\"} 1\n"));
+    QVERIFY(text.contains("qts3_requests_total{verb=\"GET\",status=\"200\"} 1\n"));
+    QVERIFY(text.contains("qts3_requests_total{verb=\"GET\",status=\"404\"} 1\n"));
+    QVERIFY(text.contains(
+        "qts3_request_duration_seconds_count{operation=\"GetObject\",bucket=\"test-bucket\"} 2\n"));
+    QVERIFY(text.contains("qts3_sent_bytes_total 1000\n"));
+    QVERIFY(text.contains("qts3_signing_key_rotations_total 1\n"));
+    QVERIFY(text.contains("qts3_pending_requests 0\n"));
+}
+
+void TestQtS3::local_trace()
+{
+    S3TestServer server;
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    // nothing is recorded while tracing is disabled
+    QtS3Trace::clear();
+    QVERIFY(s3.put("test-bucket", "foo-object", "foo-content").isSuccess());
+    QVERIFY(!QtS3Trace::chromeTraceJson().contains("\"name\":\"sign\""));
+
+    QtS3Trace::setEnabled(true);
+    QVERIFY(s3.get("test-bucket", "foo-object").isSuccess());
+    QtS3Trace::setEnabled(false);
+
+    const QByteArray json = QtS3Trace::chromeTraceJson();
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(json, &error);
+    QCOMPARE(error.error, QJsonParseError::NoError);
+
+    QSet<QString> spans;
+    QSet<QString> threadNames;
+    for (const QJsonValue &value : document.object().value("traceEvents").toArray()) {
+        const QJsonObject event = value.toObject();
+        if (event.value("ph").toString() == "M")
+            threadNames.insert(event.value("args").toObject().value("name").toString());
+        else
+            spans.insert(event.value("name").toString());
+    }
+    for (const char *span : { "request", "sign", "enqueue", "network", "dispatch", "parse" })
+        QVERIFY2(spans.contains(span), span);
+    QVERIFY(threadNames.contains("QtS3 network"));
+
+    // the ring of a thread is released when the thread exits
+    QtS3Trace::setEnabled(true);
+    std::thread([]() { QtS3TraceSpan span("exited"); }).join();
+    QtS3Trace::setEnabled(false);
+    QVERIFY(!QtS3Trace::chromeTraceJson().contains("\"name\":\"exited\""));
+}
+
+void TestQtS3::local_recording()
+{
+    S3TestServer server;
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    QTemporaryDir directory;
+    const QString fileName = directory.filePath("recording.qts3rec");
+
+    QVERIFY(s3.startRecording(fileName));
+    QVERIFY(s3.put("test-bucket", "foo-object", QByteArray(1000, 'x')).isSuccess());
+    QVERIFY(s3.get("test-bucket", "foo-object").isSuccess());
+    QVERIFY(s3.exists("test-bucket", "bar-object").isSuccess());
+    s3.getMany("test-bucket", QStringList() << "foo-object" << "bar-object");
+    s3.stopRecording();
+    QVERIFY(s3.get("test-bucket", "foo-object").isSuccess()); // not recorded
+
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QtS3RecordReader reader(&file);
+    QVERIFY(reader.isValid());
+    QList<QtS3RequestRecord> records;
+    QtS3RequestRecord record;
+    while (reader.read(&record))
+        records.append(record);
+    QCOMPARE(records.count(), 5);
+
+    QCOMPARE(records.at(0).operation, QtS3RequestRecord::Put);
+    QCOMPARE(records.at(0).bucket, QByteArray("test-bucket"));
+    QCOMPARE(records.at(0).key, QByteArray("foo-object"));
+    QCOMPARE(records.at(0).size, qint64(1000));
+    QCOMPARE(records.at(1).operation, QtS3RequestRecord::Get);
+    QCOMPARE(records.at(1).size, qint64(1000));
+    QVERIFY(records.at(1).startTime >= records.at(0).startTime + records.at(0).latency);
+    QCOMPARE(records.at(2).operation, QtS3RequestRecord::Exists);
+    QCOMPARE(records.at(2).s3Error, int(QtS3ReplyBase::NoError));
+
+    // batch operations record each object
+    int missing = 0;
+    for (int i = 3; i < 5; ++i) {
+        QCOMPARE(records.at(i).operation, QtS3RequestRecord::Get);
+        if (records.at(i).s3Error == QtS3ReplyBase::ObjectNotFoundError)
+            ++missing;
+    }
+    QCOMPARE(missing, 1);
+}
+
+// The epoll transport sends requests on keep-alive connections from the
+// calling threads.
+void TestQtS3::local_epollTransport()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("The epoll transport is Linux only");
+#endif
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    s3.setTransport(QtS3::EpollTransport);
+
+    const QByteArray content(1024 * 1024, 'x');
+    QVERIFY(s3.put("test-bucket", "bar-object", content).isSuccess());
+    QCOMPARE(server.object("test-bucket", "bar-object"), content);
+    QtS3Reply<QByteArray> contents = s3.get("test-bucket", "bar-object");
+    QVERIFY(contents.isSuccess());
+    QCOMPARE(contents.value(), content);
+    QVERIFY(contents.timing().bytesReceived >= content.size());
+
+    // HEAD replies and errors without a body keep the connection
+    for (int i = 0; i < 100; ++i) {
+        QtS3Reply<bool> exists = s3.exists("test-bucket", "foo-object");
+        QVERIFY(exists.isSuccess());
+        QVERIFY(exists.value());
+    }
+    QCOMPARE(s3.get("test-bucket", "missing").s3Error(), QtS3ReplyBase::ObjectNotFoundError);
+    QVERIFY(s3.remove("test-bucket", "bar-object").isSuccess());
+    QCOMPARE(s3.list("test-bucket", "").value().count(), 1);
+
+    // concurrent requests use a connection each
+    std::vector<std::thread> threads;
+    QAtomicInt errors;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&s3, &errors]() {
+            for (int j = 0; j < 50; ++j) {
+                if (s3.get("test-bucket", "foo-object").value() != "foo-content")
+                    errors.ref();
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    QCOMPARE(errors.load(), 0);
+    QVERIFY(server.connectionCount() <= 4);
+
+    // throttled replies are deleted before the transport, and replies stay
+    // valid after switching transports
+    server.throttleRequests(1);
+    QtS3Reply<QByteArray> retried = s3.get("test-bucket", "foo-object");
+    QCoreApplication::sendPostedEvents(0, QEvent::DeferredDelete);
+    s3.setTransport(QtS3::LoopbackTransport);
+    QVERIFY(retried.isSuccess());
+    QCOMPARE(retried.networkError(), QNetworkReply::NoError);
+}
+
+// The thread-local transport runs requests on the calling threads, and
+// replies outlive the threads.
+void TestQtS3::local_threadLocalTransport()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    s3.setTransport(QtS3::ThreadLocalTransport);
+
+    QVERIFY(s3.put("test-bucket", "bar-object", "bar-content").isSuccess());
+    QCOMPARE(server.object("test-bucket", "bar-object"), QByteArray("bar-content"));
+    QCOMPARE(s3.get("test-bucket", "missing").s3Error(), QtS3ReplyBase::ObjectNotFoundError);
+
+    std::vector<std::thread> threads;
+    QList<QtS3Reply<QByteArray>> replies;
+    QMutex mutex;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&s3, &replies, &mutex]() {
+            for (int j = 0; j < 50; ++j) {
+                QtS3Reply<QByteArray> reply = s3.get("test-bucket", "foo-object");
+                QMutexLocker lock(&mutex);
+                replies.append(reply);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    QCOMPARE(replies.count(), 200);
+    for (QtS3Reply<QByteArray> reply : replies) {
+        QVERIFY(reply.isSuccess());
+        QCOMPARE(reply.value(), QByteArray("foo-content"));
+    }
+}
+
+// Async replies deliver their signals to the calling thread's event loop.
+void TestQtS3::local_asyncReply()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    QScopedPointer<QtS3AsyncReply<QtS3Reply<QByteArray>>> get(
+        s3.getAsync("test-bucket", "foo-object"));
+    QSignalSpy getFinished(get.data(), &QtS3AsyncReplyBase::finished);
+    QVERIFY(getFinished.wait());
+    QVERIFY(get->isFinished());
+    QCOMPARE(get->result().value(), QByteArray("foo-content"));
+
+    QList<QPair<QString, QByteArray>> objects;
+    QStringList paths;
+    for (int i = 0; i < 20; ++i) {
+        objects.append(qMakePair(QString("object-%1").arg(i), QByteArray::number(i)));
+        paths.append(objects.last().first);
+    }
+    QScopedPointer<QtS3AsyncReply<QList<QtS3Reply<void>>>> put(
+        s3.putManyAsync("test-bucket", objects));
+    QSignalSpy putProgress(put.data(), &QtS3AsyncReplyBase::progress);
+    QSignalSpy putFinished(put.data(), &QtS3AsyncReplyBase::finished);
+    QVERIFY(putFinished.wait());
+    QCOMPARE(put->result().count(), 20);
+    QCOMPARE(putProgress.count(), 20);
+    QCOMPARE(putProgress.last().at(0).toInt(), 20);
+    QCOMPARE(putProgress.last().at(1).toInt(), 20);
+
+    // the result waits for the operation if it has not finished
+    QScopedPointer<QtS3AsyncReply<QList<QtS3Reply<QByteArray>>>> getMany(
+        s3.getManyAsync("test-bucket", paths));
+    QList<QtS3Reply<QByteArray>> replies = getMany->result();
+    QCOMPARE(replies.count(), 20);
+    for (int i = 0; i < 20; ++i)
+        QCOMPARE(replies[i].value(), QByteArray::number(i));
+}
+
+// warmup() opens connections ahead of the first requests, which then reuse them.
+void TestQtS3::local_warmup()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    QVERIFY(!s3.warmup(QList<QByteArray>() << "").isSuccess());
+
+    QtS3Reply<void> reply = s3.warmup(QList<QByteArray>() << "test-bucket");
+    QVERIFY(reply.isSuccess());
+    QTRY_VERIFY(server.connectionCount() >= 1);
+
+#ifdef Q_OS_LINUX
+    S3TestServer epollServer;
+    epollServer.putObject("test-bucket", "foo-object", "foo-content");
+    QtS3 epollS3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    epollS3.setEndpoint(epollServer.url());
+    epollS3.setTransport(QtS3::EpollTransport);
+
+    QVERIFY(epollS3.warmup(QList<QByteArray>() << "test-bucket", 3).isSuccess());
+    QTRY_COMPARE(epollServer.connectionCount(), 3);
+    for (int i = 0; i < 10; ++i)
+        QCOMPARE(epollS3.get("test-bucket", "foo-object").value(), QByteArray("foo-content"));
+    QCOMPARE(epollServer.connectionCount(), 3);
+#endif
+}
+
+// QtS3 objects do not access credentials before the first request, and share
+// the network thread and connection pool.
+void TestQtS3::local_sharedNetworkThread()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+
+    QAtomicInt providerCalls;
+    for (int i = 0; i < 10; ++i) {
+        const QByteArray keyId = "AKIDEXAMPLE" + QByteArray::number(i);
+        QtS3 s3([&providerCalls, keyId]() { providerCalls.ref(); return keyId; },
+                [&providerCalls]() {
+                    providerCalls.ref();
+                    return QByteArray("wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+                });
+        s3.setEndpoint(server.url());
+        QCOMPARE(providerCalls.load(), 0);
+
+        QtS3Reply<QByteArray> contents = s3.get("test-bucket", "foo-object");
+        QVERIFY(contents.isSuccess());
+        QCOMPARE(contents.value(), QByteArray("foo-content"));
+        QVERIFY(providerCalls.load() > 0);
+        providerCalls.store(0);
+    }
+
+    // Sequential requests from all objects use one keep-alive connection
+    QCOMPARE(server.connectionCount(), 1);
+}
+
+// Replies are deleted with the QtS3 object which sent them, and do not
+// accumulate in the shared network access manager.
+void TestQtS3::local_sharedNetworkReplies()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    QObject *networkAccessManager = SharedNetworkThread::instance()->networkAccessManager();
+
+    for (int i = 0; i < 50; ++i) {
+        QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+        s3.setEndpoint(server.url());
+        QVERIFY(s3.get("test-bucket", "foo-object").isSuccess());
+        QVERIFY(s3.put("test-bucket", "bar-object", "bar-content").isSuccess());
+    }
+
+    // The replies are deleted on the network thread. The network access
+    // manager's own children remain.
+    QTRY_VERIFY(networkAccessManager->children().count() < 10);
+}
+
+void TestQtS3::local_priorityQueueWait()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    server.setResponseDelay(50);
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+    s3.setMaxNetworkRequests(1);
+
+    QList<QPair<QString, QByteArray>> objects;
+    for (int i = 0; i < 40; ++i)
+        objects.append(qMakePair("object-" + QString::number(i), QByteArray("content")));
+
+    // Background upload which keeps the network busy for about two seconds
+    qint64 backgroundWaitTime = 0;
+    std::thread background([&s3, &objects, &backgroundWaitTime]() {
+        QtS3PriorityScope priority(QtS3::LowPriority);
+        for (QtS3Reply<void> reply : s3.putMany("test-bucket", objects))
+            backgroundWaitTime = qMax(backgroundWaitTime, reply.queueWaitTime());
+    });
+    QThread::msleep(200);
+
+    // An interactive request waits for the request in progress only
+    {
+        QtS3PriorityScope priority(QtS3::HighPriority);
+        QtS3Reply<QByteArray> reply = s3.get("test-bucket", "foo-object");
+        QVERIFY(reply.isSuccess());
+        QVERIFY(reply.queueWaitTime() < 500);
+    }
+
+    background.join();
+    QVERIFY(backgroundWaitTime >= 500);
+
+    // The limit is process-wide; restore the default for later tests
+    s3.setMaxNetworkRequests(6);
+}
+
 template <typename F> class Runnable : public QRunnable
 {
 public:
@@ -638,6 +2333,35 @@ void TestQtS3::thread_putget()
     });
 }
 
+void TestQtS3::thread_local_coalescing()
+{
+    S3TestServer server;
+    server.putObject("test-bucket", "foo-object", "foo-content");
+    server.setResponseDelay(200);
+    QtS3 s3("AKIDEXAMPLE", "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+    s3.setEndpoint(server.url());
+
+    // Concurrent identical requests share one network request
+    const int threadCount = 16;
+    runOnThreads(threadCount, [&s3]() {
+        QtS3Reply<QByteArray> contents = s3.get("test-bucket", "foo-object");
+        QVERIFY(contents.isSuccess());
+        QCOMPARE(contents.value(), QByteArray("foo-content"));
+    });
+    QVERIFY(server.requestCount() < threadCount);
+
+    const int getRequestCount = server.requestCount();
+    runOnThreads(threadCount, [&s3]() {
+        QtS3Reply<qint64> size = s3.size("test-bucket", "foo-object");
+        QVERIFY(size.isSuccess());
+        QCOMPARE(size.value(), qint64(11));
+        QtS3Reply<bool> exists = s3.exists("test-bucket", "foo-object");
+        QVERIFY(exists.isSuccess());
+        QVERIFY(exists.value());
+    });
+    QVERIFY(server.requestCount() - getRequestCount < threadCount * 2);
+}
+
 QTEST_MAIN(TestQtS3)
 
 #include "tst_qts3.moc"